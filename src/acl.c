@@ -0,0 +1,699 @@
+/*
+	acl.c
+
+	Address filtering (access control list) for dpmaster
+
+	Copyright (C) 2011  Mathieu Olivier
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include "common.h"
+#include "system.h"
+#include "acl.h"
+
+
+// ---------- Private constants ---------- //
+
+// Index used to mark the absence of a node
+#define NO_NODE ((unsigned int)-1)
+
+// Actions associated to the prefixes
+#define ACL_ACTION_NONE		0
+#define ACL_ACTION_ALLOW	1
+#define ACL_ACTION_DENY		2
+
+// Indexes of the IPv4 and IPv6 tries
+#define ACL_TRIE_IPV4	0
+#define ACL_TRIE_IPV6	1
+
+// The first bits of an address are looked up in a direct table
+#define ACL_STRIDE_BITS	16
+#define ACL_STRIDE_SIZE	(1 << ACL_STRIDE_BITS)
+
+
+// ---------- Private types ---------- //
+
+// A 128-bit key. IPv4 addresses use the 32 most significant bits
+typedef struct
+{
+	qu64 hi;
+	qu64 lo;
+} acl_key_t;
+
+// A node of a path-compressed binary trie (32 bytes). Each node represents a
+// prefix; nodes with only one child are never created, unless they carry
+// an action, so the depth of the trie is bounded by the number of prefixes
+// which really differ, not by the number of bits in the addresses
+typedef struct
+{
+	acl_key_t prefix;
+	unsigned int children [2];
+	qbyte length;					// length of the prefix, in bits
+	qbyte action;					// ACL_ACTION_*
+} acl_node_t;
+
+// An entry of the first-level table: the action of the longest prefix
+// shorter than ACL_STRIDE_BITS, and where to continue the lookup in the trie
+typedef struct
+{
+	unsigned int start;
+	unsigned int action;
+} acl_stride_t;
+
+// A complete access control list
+typedef struct
+{
+	acl_node_t* nodes;
+	unsigned int nb_nodes;
+	unsigned int max_nb_nodes;
+	unsigned int roots [2];			// one trie per address family
+	acl_stride_t* strides [2];		// first-level table of each trie
+	unsigned int nb_denied;			// number of "deny" entries
+	unsigned int nb_allowed;		// number of "allow" entries
+} acl_table_t;
+
+
+// ---------- Private variables ---------- //
+
+static acl_table_t acl = { NULL, 0, 0, { NO_NODE, NO_NODE }, { NULL, NULL }, 0, 0 };
+
+static char acl_filepath [MAX_PATH] = "";
+
+// Masks for each prefix length, to speed up the lookups
+static acl_key_t acl_masks [129];
+
+// Should we reload the ACL file?
+static volatile sig_atomic_t must_reload = false;
+
+
+// ---------- Private functions ---------- //
+
+/*
+====================
+Acl_MaskKey
+
+Keep only the first "length" bits of a key
+====================
+*/
+static acl_key_t Acl_MaskKey (acl_key_t key, unsigned int length)
+{
+	if (length == 0)
+		key.hi = 0;
+	else if (length < 64)
+		key.hi &= ~(qu64)0 << (64 - length);
+
+	if (length <= 64)
+		key.lo = 0;
+	else if (length < 128)
+		key.lo &= ~(qu64)0 << (128 - length);
+
+	return key;
+}
+
+
+/*
+====================
+Acl_GetBit
+
+Return the value of a bit of a key (bit 0 is the most significant one)
+====================
+*/
+static unsigned int Acl_GetBit (const acl_key_t* key, unsigned int bit)
+{
+	if (bit < 64)
+		return (unsigned int)(key->hi >> (63 - bit)) & 1;
+	return (unsigned int)(key->lo >> (127 - bit)) & 1;
+}
+
+
+/*
+====================
+Acl_GetCommonLength
+
+Return the length of the prefix shared by 2 keys, up to "max_length"
+====================
+*/
+static unsigned int Acl_GetCommonLength (const acl_key_t* key1, const acl_key_t* key2, unsigned int max_length)
+{
+	unsigned int length = 0;
+
+	while (length < max_length && Acl_GetBit (key1, length) == Acl_GetBit (key2, length))
+		length++;
+
+	return length;
+}
+
+
+/*
+====================
+Acl_NewNode
+
+Allocate a new node in a table, and return its index (or NO_NODE)
+====================
+*/
+static unsigned int Acl_NewNode (acl_table_t* table, const acl_key_t* key, unsigned int length, unsigned int action)
+{
+	acl_node_t* node;
+
+	if (table->nb_nodes == table->max_nb_nodes)
+	{
+		unsigned int new_max = (table->max_nb_nodes == 0 ? 1024 : table->max_nb_nodes * 2);
+		acl_node_t* new_nodes = realloc (table->nodes, new_max * sizeof (new_nodes[0]));
+
+		if (new_nodes == NULL)
+			return NO_NODE;
+		table->nodes = new_nodes;
+		table->max_nb_nodes = new_max;
+	}
+
+	node = &table->nodes[table->nb_nodes];
+	node->prefix = Acl_MaskKey (*key, length);
+	node->length = (qbyte)length;
+	node->action = (qbyte)action;
+	node->children[0] = NO_NODE;
+	node->children[1] = NO_NODE;
+
+	return table->nb_nodes++;
+}
+
+
+/*
+====================
+Acl_Insert
+
+Insert a prefix in a trie. Returns "false" if we're out of memory
+====================
+*/
+static qboolean Acl_Insert (acl_table_t* table, unsigned int trie, const acl_key_t* key, unsigned int length, unsigned int action)
+{
+	// We can't keep a pointer to the link we follow, since
+	// the node array may be reallocated when adding a node
+	unsigned int parent_ind = NO_NODE;
+	unsigned int parent_bit = 0;
+	unsigned int new_ind;
+
+	for (;;)
+	{
+		unsigned int node_ind, common;
+		acl_node_t* node;
+
+		node_ind = (parent_ind == NO_NODE ? table->roots[trie] : table->nodes[parent_ind].children[parent_bit]);
+
+		// Empty spot: add a leaf
+		if (node_ind == NO_NODE)
+		{
+			new_ind = Acl_NewNode (table, key, length, action);
+			if (new_ind == NO_NODE)
+				return false;
+			break;
+		}
+
+		node = &table->nodes[node_ind];
+		common = Acl_GetCommonLength (key, &node->prefix,
+									  length < node->length ? length : node->length);
+
+		// The node prefix isn't a prefix of the new one: we need to split the path
+		if (common < node->length)
+		{
+			unsigned int node_bit = Acl_GetBit (&node->prefix, common);
+
+			// The new prefix is a prefix of the node one: it becomes its parent
+			if (common == length)
+			{
+				new_ind = Acl_NewNode (table, key, length, action);
+				if (new_ind == NO_NODE)
+					return false;
+				table->nodes[new_ind].children[node_bit] = node_ind;
+			}
+
+			// Otherwise, we need a branching node, with the new prefix as its other child
+			else
+			{
+				unsigned int leaf_ind;
+
+				new_ind = Acl_NewNode (table, key, common, ACL_ACTION_NONE);
+				if (new_ind == NO_NODE)
+					return false;
+				leaf_ind = Acl_NewNode (table, key, length, action);
+				if (leaf_ind == NO_NODE)
+					return false;
+				table->nodes[new_ind].children[node_bit] = node_ind;
+				table->nodes[new_ind].children[1 - node_bit] = leaf_ind;
+			}
+
+			break;
+		}
+
+		// Same prefix: the last entry wins
+		if (length == node->length)
+		{
+			node->action = (qbyte)action;
+			return true;
+		}
+
+		parent_ind = node_ind;
+		parent_bit = Acl_GetBit (key, node->length);
+	}
+
+	// Link the new node to its parent
+	if (parent_ind == NO_NODE)
+		table->roots[trie] = new_ind;
+	else
+		table->nodes[parent_ind].children[parent_bit] = new_ind;
+	return true;
+}
+
+
+/*
+====================
+Acl_Lookup
+
+Return the action associated to the longest prefix matching a key
+====================
+*/
+static unsigned int Acl_Lookup (const acl_table_t* table, unsigned int trie, const acl_key_t* key, unsigned int max_length)
+{
+	const acl_stride_t* stride = &table->strides[trie][key->hi >> (64 - ACL_STRIDE_BITS)];
+	unsigned int node_ind = stride->start;
+	unsigned int action = stride->action;
+
+	while (node_ind != NO_NODE)
+	{
+		const acl_node_t* node = &table->nodes[node_ind];
+		const acl_key_t* mask = &acl_masks[node->length];
+
+		if ((((key->hi ^ node->prefix.hi) & mask->hi) | ((key->lo ^ node->prefix.lo) & mask->lo)) != 0)
+			break;
+
+		if (node->action != ACL_ACTION_NONE)
+			action = node->action;
+		if (node->length >= max_length)
+			break;
+
+		node_ind = node->children[Acl_GetBit (key, node->length)];
+	}
+
+	return action;
+}
+
+
+/*
+====================
+Acl_BuildStrides
+
+Build the first-level table of a trie. For each value of the first
+ACL_STRIDE_BITS bits, we walk the trie in advance down to the first node
+whose prefix is at least that long, so the lookups only have to walk the
+(usually tiny) part of the trie below it
+====================
+*/
+static qboolean Acl_BuildStrides (acl_table_t* table, unsigned int trie)
+{
+	acl_stride_t* strides;
+	unsigned int value;
+
+	strides = malloc (ACL_STRIDE_SIZE * sizeof (strides[0]));
+	if (strides == NULL)
+		return false;
+
+	for (value = 0; value < ACL_STRIDE_SIZE; value++)
+	{
+		acl_key_t key;
+		unsigned int node_ind = table->roots[trie];
+		unsigned int action = ACL_ACTION_NONE;
+
+		key.hi = (qu64)value << (64 - ACL_STRIDE_BITS);
+		key.lo = 0;
+
+		while (node_ind != NO_NODE)
+		{
+			const acl_node_t* node = &table->nodes[node_ind];
+			unsigned int length = (node->length < ACL_STRIDE_BITS ? node->length : ACL_STRIDE_BITS);
+			acl_key_t masked_prefix = Acl_MaskKey (node->prefix, length);
+			acl_key_t masked_key = Acl_MaskKey (key, length);
+
+			if (masked_key.hi != masked_prefix.hi)
+			{
+				node_ind = NO_NODE;
+				break;
+			}
+
+			// The lookups will start from here
+			if (node->length >= ACL_STRIDE_BITS)
+				break;
+
+			if (node->action != ACL_ACTION_NONE)
+				action = node->action;
+			node_ind = node->children[Acl_GetBit (&key, node->length)];
+		}
+
+		strides[value].start = node_ind;
+		strides[value].action = action;
+	}
+
+	table->strides[trie] = strides;
+	return true;
+}
+
+
+/*
+====================
+Acl_FreeTable
+
+Free the memory used by an access control list
+====================
+*/
+static void Acl_FreeTable (acl_table_t* table)
+{
+	free (table->nodes);
+	table->nodes = NULL;
+	free (table->strides[ACL_TRIE_IPV4]);
+	table->strides[ACL_TRIE_IPV4] = NULL;
+	free (table->strides[ACL_TRIE_IPV6]);
+	table->strides[ACL_TRIE_IPV6] = NULL;
+	table->nb_nodes = 0;
+	table->max_nb_nodes = 0;
+	table->roots[ACL_TRIE_IPV4] = NO_NODE;
+	table->roots[ACL_TRIE_IPV6] = NO_NODE;
+	table->nb_denied = 0;
+	table->nb_allowed = 0;
+}
+
+
+/*
+====================
+Acl_ParseLine
+
+Parse a line of the ACL file and add its entry to a table
+====================
+*/
+static qboolean Acl_ParseLine (acl_table_t* table, char* line, unsigned int line_num)
+{
+	char* action_str;
+	char* prefix_str;
+	char* length_str;
+	unsigned int action, trie, length, max_length;
+	acl_key_t key;
+	qbyte addr_buff [16];
+	unsigned int ind;
+
+	// Remove the comments
+	prefix_str = strchr (line, '#');
+	if (prefix_str != NULL)
+		*prefix_str = '\0';
+
+	action_str = strtok (line, " \t\r\n");
+	if (action_str == NULL)
+		return true;  // empty line
+	prefix_str = strtok (NULL, " \t\r\n");
+	if (prefix_str == NULL || strtok (NULL, " \t\r\n") != NULL)
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: invalid syntax at line %u of the ACL file\n", line_num);
+		return false;
+	}
+
+	if (strcmp (action_str, "deny") == 0)
+		action = ACL_ACTION_DENY;
+	else if (strcmp (action_str, "allow") == 0)
+		action = ACL_ACTION_ALLOW;
+	else
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: invalid action \"%s\" at line %u of the ACL file\n",
+					action_str, line_num);
+		return false;
+	}
+
+	length_str = strchr (prefix_str, '/');
+	if (length_str != NULL)
+		*length_str++ = '\0';
+
+	memset (&key, 0, sizeof (key));
+	if (inet_pton (AF_INET, prefix_str, addr_buff) == 1)
+	{
+		trie = ACL_TRIE_IPV4;
+		max_length = 32;
+		for (ind = 0; ind < 4; ind++)
+			key.hi |= (qu64)addr_buff[ind] << (56 - ind * 8);
+	}
+	else if (inet_pton (AF_INET6, prefix_str, addr_buff) == 1)
+	{
+		trie = ACL_TRIE_IPV6;
+		max_length = 128;
+		for (ind = 0; ind < 8; ind++)
+		{
+			key.hi = (key.hi << 8) | addr_buff[ind];
+			key.lo = (key.lo << 8) | addr_buff[ind + 8];
+		}
+	}
+	else
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: invalid address \"%s\" at line %u of the ACL file\n",
+					prefix_str, line_num);
+		return false;
+	}
+
+	if (length_str != NULL)
+	{
+		char* end_ptr;
+
+		length = (unsigned int)strtol (length_str, &end_ptr, 10);
+		if (end_ptr == length_str || *end_ptr != '\0' || length > max_length)
+		{
+			Com_Printf (MSG_ERROR, "> ERROR: invalid prefix length at line %u of the ACL file\n",
+						line_num);
+			return false;
+		}
+	}
+	else
+		length = max_length;
+
+	if (! Acl_Insert (table, trie, &key, length, action))
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: can't allocate memory for the ACL\n");
+		return false;
+	}
+
+	if (action == ACL_ACTION_DENY)
+		table->nb_denied++;
+	else
+		table->nb_allowed++;
+	return true;
+}
+
+
+/*
+====================
+Acl_Load
+
+Load the ACL file into a table
+====================
+*/
+static qboolean Acl_Load (acl_table_t* table)
+{
+	FILE* file;
+	char line [MAX_ACL_LINE_LENGTH];
+	unsigned int line_num = 0;
+	qboolean result = true;
+
+	file = fopen (acl_filepath, "r");
+	if (file == NULL)
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: can't open the ACL file \"%s\" (%s)\n",
+					acl_filepath, strerror (errno));
+		return false;
+	}
+
+	while (fgets (line, sizeof (line), file) != NULL)
+	{
+		line_num++;
+		if (! Acl_ParseLine (table, line, line_num))
+		{
+			result = false;
+			break;
+		}
+	}
+
+	fclose (file);
+
+	if (result &&
+		(! Acl_BuildStrides (table, ACL_TRIE_IPV4) || ! Acl_BuildStrides (table, ACL_TRIE_IPV6)))
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: can't allocate memory for the ACL\n");
+		result = false;
+	}
+
+	if (! result)
+		Acl_FreeTable (table);
+	return result;
+}
+
+
+// ---------- Public functions ---------- //
+
+/*
+====================
+Acl_SetFilePath
+
+Set the path of the ACL file
+====================
+*/
+qboolean Acl_SetFilePath (const char* filepath)
+{
+	if (filepath == NULL || filepath[0] == '\0')
+		return false;
+
+	strncpy (acl_filepath, filepath, sizeof (acl_filepath) - 1);
+	acl_filepath[sizeof (acl_filepath) - 1] = '\0';
+
+	return true;
+}
+
+
+/*
+====================
+Acl_Init
+
+Load the ACL file, if any (must be called before chroot)
+====================
+*/
+qboolean Acl_Init (void)
+{
+	unsigned int length;
+
+	if (acl_filepath[0] == '\0')
+		return true;
+
+	for (length = 0; length <= 128; length++)
+	{
+		acl_key_t all_ones;
+
+		all_ones.hi = ~(qu64)0;
+		all_ones.lo = ~(qu64)0;
+		acl_masks[length] = Acl_MaskKey (all_ones, length);
+	}
+
+	return Acl_Reload ();
+}
+
+
+/*
+====================
+Acl_RequestReload
+
+Ask for a reload of the ACL file (can be called from a signal handler)
+====================
+*/
+void Acl_RequestReload (void)
+{
+	must_reload = true;
+}
+
+
+/*
+====================
+Acl_Update
+
+Reload the ACL file if a reload has been requested
+====================
+*/
+void Acl_Update (void)
+{
+	if (must_reload)
+	{
+		must_reload = false;
+		if (acl_filepath[0] != '\0')
+			Acl_Reload ();
+	}
+}
+
+
+/*
+====================
+Acl_Reload
+
+Reload the ACL file now. The current list is kept if the new one is invalid
+====================
+*/
+qboolean Acl_Reload (void)
+{
+	acl_table_t new_acl = { NULL, 0, 0, { NO_NODE, NO_NODE }, { NULL, NULL }, 0, 0 };
+
+	if (acl_filepath[0] == '\0')
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: no ACL file has been specified\n");
+		return false;
+	}
+
+	if (! Acl_Load (&new_acl))
+	{
+		if (acl.nodes != NULL)
+			Com_Printf (MSG_WARNING,
+						"> WARNING: keeping the previous ACL (%u deny and %u allow entries)\n",
+						acl.nb_denied, acl.nb_allowed);
+		return false;
+	}
+
+	Acl_FreeTable (&acl);
+	acl = new_acl;
+
+	Com_Printf (MSG_NORMAL, "> ACL loaded from \"%s\": %u deny and %u allow entries (%u nodes)\n",
+				acl_filepath, acl.nb_denied, acl.nb_allowed, acl.nb_nodes);
+	return true;
+}
+
+
+/*
+====================
+Acl_IsDenied
+
+Return "true" if the packets from this address must be dropped
+====================
+*/
+qboolean Acl_IsDenied (const struct sockaddr_storage* address)
+{
+	acl_key_t key;
+	unsigned int action;
+
+	if (acl.nodes == NULL)
+		return false;
+
+	if (address->ss_family == AF_INET6)
+	{
+		const struct sockaddr_in6* addr6 = (const struct sockaddr_in6*)address;
+		const qbyte* addr_buff = (const qbyte*)&addr6->sin6_addr.s6_addr;
+		unsigned int ind;
+
+		key.hi = 0;
+		key.lo = 0;
+		for (ind = 0; ind < 8; ind++)
+		{
+			key.hi = (key.hi << 8) | addr_buff[ind];
+			key.lo = (key.lo << 8) | addr_buff[ind + 8];
+		}
+		action = Acl_Lookup (&acl, ACL_TRIE_IPV6, &key, 128);
+	}
+	else
+	{
+		const struct sockaddr_in* addr4 = (const struct sockaddr_in*)address;
+
+		key.hi = (qu64)ntohl (addr4->sin_addr.s_addr) << 32;
+		key.lo = 0;
+		action = Acl_Lookup (&acl, ACL_TRIE_IPV4, &key, 32);
+	}
+
+	return (action == ACL_ACTION_DENY);
+}
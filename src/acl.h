@@ -0,0 +1,55 @@
+/*
+	acl.h
+
+	Address filtering (access control list) for dpmaster
+
+	Copyright (C) 2011  Mathieu Olivier
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef _ACL_H_
+#define _ACL_H_
+
+
+// ---------- Constants ---------- //
+
+// Maximum length of a line in the ACL file
+#define MAX_ACL_LINE_LENGTH 256
+
+
+// ---------- Public functions ---------- //
+
+// Set the path of the ACL file
+qboolean Acl_SetFilePath (const char* filepath);
+
+// Load the ACL file, if any (must be called before chroot)
+qboolean Acl_Init (void);
+
+// Ask for a reload of the ACL file (can be called from a signal handler)
+void Acl_RequestReload (void);
+
+// Reload the ACL file if a reload has been requested
+void Acl_Update (void);
+
+// Reload the ACL file now. The current list is kept if the new one is invalid
+qboolean Acl_Reload (void);
+
+// Return "true" if the packets from this address must be dropped
+qboolean Acl_IsDenied (const struct sockaddr_storage* address);
+
+
+#endif  // #ifndef _ACL_H_
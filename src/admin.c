@@ -0,0 +1,865 @@
+/*
+	admin.c
+
+	Administration socket for dpmaster
+
+	Copyright (C) 2011  Mathieu Olivier
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include "common.h"
+#include "system.h"
+#include "acl.h"
+#include "admin.h"
+#include "clients.h"
+#include "games.h"
+#include "geoip.h"
+#include "hitters.h"
+#include "servers.h"
+#include "stats.h"
+
+#ifndef WIN32
+#	include <sys/stat.h>
+#	include <sys/un.h>
+#endif
+
+
+// ---------- Private constants ---------- //
+
+// Maximum number of parameters in an admin command, including the command name
+#define MAX_ADMIN_COMMAND_TOKENS 64
+
+
+// ---------- Private types ---------- //
+
+// Admin connection
+typedef struct
+{
+	socket_t socket;						// INVALID_SOCKET if the slot is unused
+	char input [MAX_ADMIN_COMMAND_LENGTH];	// incomplete command line
+	size_t input_size;
+	char* output;							// data waiting to be sent
+	size_t output_size;
+	size_t output_capacity;
+	qboolean output_overflow;
+	qboolean closing;						// close it once the output has been sent
+} admin_conn_t;
+
+// Admin command
+typedef struct
+{
+	const char* name;
+	const char* help;
+	qboolean (*handler) (const char** params, unsigned int nb_params);
+} admin_cmd_t;
+
+
+// ---------- Private variables ---------- //
+
+static char socket_path [MAX_PATH] = "";
+static socket_t listen_socket = INVALID_SOCKET;
+static admin_conn_t connections [MAX_ADMIN_CONNECTIONS];
+
+// The connection whose command is being executed
+static admin_conn_t* crt_conn = NULL;
+
+
+// The admin socket is only available on UNIX systems
+#ifndef WIN32
+
+// ---------- Private functions (output) ---------- //
+
+/*
+====================
+Adm_Output
+
+Append a text to the output of the current connection.
+Called by Com_Printf while the output is redirected
+====================
+*/
+static void Adm_Output (const char* text)
+{
+	size_t length = strlen (text);
+	admin_conn_t* conn = crt_conn;
+
+	assert (conn != NULL);
+	if (conn->output_overflow)
+		return;
+
+	if (conn->output_size + length > conn->output_capacity)
+	{
+		size_t new_capacity;
+		char* new_output;
+
+		if (conn->output_size + length > MAX_ADMIN_OUTPUT_SIZE)
+		{
+			conn->output_overflow = true;
+			return;
+		}
+
+		new_capacity = (conn->output_capacity == 0 ? 4096 : conn->output_capacity * 2);
+		while (new_capacity < conn->output_size + length)
+			new_capacity *= 2;
+
+		new_output = realloc (conn->output, new_capacity);
+		if (new_output == NULL)
+		{
+			conn->output_overflow = true;
+			return;
+		}
+		conn->output = new_output;
+		conn->output_capacity = new_capacity;
+	}
+
+	memcpy (conn->output + conn->output_size, text, length);
+	conn->output_size += length;
+}
+
+
+// ---------- Private functions (commands) ---------- //
+
+/*
+====================
+Adm_ParseUnsigned
+
+Parse an unsigned integer parameter
+====================
+*/
+static qboolean Adm_ParseUnsigned (const char* param, unsigned int* value)
+{
+	char* end_ptr;
+	unsigned long result;
+
+	// No sign nor space: strtoul would silently negate a negative number
+	if (! isdigit ((unsigned char)param[0]))
+		return false;
+
+	errno = 0;
+	result = strtoul (param, &end_ptr, 0);
+	if (end_ptr == param || *end_ptr != '\0' || errno == ERANGE || result > UINT_MAX)
+		return false;
+
+	*value = (unsigned int)result;
+	return true;
+}
+
+
+/*
+====================
+Adm_Cmd_AclReload
+
+Reload the ACL file
+====================
+*/
+static qboolean Adm_Cmd_AclReload (const char** params, unsigned int nb_params)
+{
+	if (nb_params != 0)
+		return false;
+
+	return Acl_Reload ();
+}
+
+
+/*
+====================
+Adm_Cmd_FloodProtection
+
+Show, enable or disable the flood protection
+====================
+*/
+static qboolean Adm_Cmd_FloodProtection (const char** params, unsigned int nb_params)
+{
+	if (nb_params > 1)
+		return false;
+
+	if (nb_params == 1)
+	{
+		if (strcmp (params[0], "on") == 0)
+		{
+			// Allocate the client list if it hasn't been done at startup
+			flood_protection = true;
+			if (! Cl_Init ())
+			{
+				flood_protection = false;
+				return false;
+			}
+		}
+		else if (strcmp (params[0], "off") == 0)
+			flood_protection = false;
+		else
+			return false;
+	}
+
+	Com_Printf (MSG_OUTPUT, "flood-protection %s\n", flood_protection ? "on" : "off");
+	return true;
+}
+
+
+/*
+====================
+Adm_Cmd_FPDecayTime
+
+Change the decay time of the flood protection
+====================
+*/
+static qboolean Adm_Cmd_FPDecayTime (const char** params, unsigned int nb_params)
+{
+	unsigned int decay_time;
+
+	if (nb_params != 1 || ! Adm_ParseUnsigned (params[0], &decay_time))
+		return false;
+
+	return Cl_SetFPDecayTime (FP_CLASS_GETSERVERS, decay_time);
+}
+
+
+/*
+====================
+Adm_Cmd_FPLimits
+
+Show or change the flood protection limits of a message class
+====================
+*/
+static qboolean Adm_Cmd_FPLimits (const char** params, unsigned int nb_params)
+{
+	fp_class_t msg_class;
+	unsigned int throttle, decay_time;
+
+	if (nb_params == 0)
+	{
+		Cl_PrintStats (MSG_OUTPUT);
+		return true;
+	}
+
+	if (nb_params != 3)
+		return false;
+
+	msg_class = Cl_GetFPClassByName (params[0]);
+	if (msg_class == NB_FP_CLASSES ||
+		! Adm_ParseUnsigned (params[1], &throttle) ||
+		! Adm_ParseUnsigned (params[2], &decay_time))
+		return false;
+
+	// Check both values before changing anything
+	if (throttle <= 1 || decay_time == 0)
+		return false;
+
+	return (Cl_SetFPThrottle (msg_class, throttle) &&
+			Cl_SetFPDecayTime (msg_class, decay_time));
+}
+
+
+/*
+====================
+Adm_Cmd_FPThrottle
+
+Change the throttle limit of the flood protection
+====================
+*/
+static qboolean Adm_Cmd_FPThrottle (const char** params, unsigned int nb_params)
+{
+	unsigned int throttle;
+
+	if (nb_params != 1 || ! Adm_ParseUnsigned (params[0], &throttle))
+		return false;
+
+	return Cl_SetFPThrottle (FP_CLASS_GETSERVERS, throttle);
+}
+
+
+/*
+====================
+Adm_Cmd_GamePolicy
+
+Show or update the game policy
+====================
+*/
+static qboolean Adm_Cmd_GamePolicy (const char** params, unsigned int nb_params)
+{
+	if (nb_params == 1)
+		return false;
+
+	if (nb_params > 1)
+	{
+		if (strcmp (params[0], "remove") == 0)
+		{
+			unsigned int ind;
+			qboolean result = true;
+
+			for (ind = 1; ind < nb_params; ind++)
+				if (! Game_RemoveFromPolicy (params[ind]))
+				{
+					Com_Printf (MSG_OUTPUT, "Game \"%s\" isn't in the policy list\n",
+								params[ind]);
+					result = false;
+				}
+			if (! result)
+				return false;
+		}
+		else if (Game_DeclarePolicy (params[0], &params[1], nb_params - 1) != CMDLINE_STATUS_OK)
+			return false;
+	}
+
+	Game_PrintPolicy (MSG_OUTPUT);
+	return true;
+}
+
+
+/*
+====================
+Adm_Cmd_GeoipReload
+
+Reload the GeoIP file
+====================
+*/
+static qboolean Adm_Cmd_GeoipReload (const char** params, unsigned int nb_params)
+{
+	if (nb_params != 0)
+		return false;
+
+	return Geo_Reload ();
+}
+
+
+/*
+====================
+Adm_Cmd_Servers
+
+Print the list of servers, in a machine-readable form
+====================
+*/
+static qboolean Adm_Cmd_Servers (const char** params, unsigned int nb_params)
+{
+	if (nb_params != 0)
+		return false;
+
+	Sv_DumpServerList (MSG_OUTPUT);
+	return true;
+}
+
+
+/*
+====================
+Adm_Cmd_Stats
+
+Print the statistics
+====================
+*/
+static qboolean Adm_Cmd_Stats (const char** params, unsigned int nb_params)
+{
+	if (nb_params != 0)
+		return false;
+
+	Stats_Print (MSG_OUTPUT);
+	return true;
+}
+
+
+/*
+====================
+Adm_Cmd_Verbose
+
+Show or change the verbose level
+====================
+*/
+static qboolean Adm_Cmd_Verbose (const char** params, unsigned int nb_params)
+{
+	if (nb_params > 1)
+		return false;
+
+	if (nb_params == 1)
+	{
+		unsigned int vlevel;
+
+		if (! Adm_ParseUnsigned (params[0], &vlevel) || vlevel > MSG_DEBUG)
+			return false;
+		max_msg_level = vlevel;
+	}
+
+	Com_Printf (MSG_OUTPUT, "verbose %d\n", max_msg_level);
+	return true;
+}
+
+
+/*
+====================
+Adm_Cmd_Hitters
+
+Print the heaviest sources and the banned ones
+====================
+*/
+static qboolean Adm_Cmd_Hitters (const char** params, unsigned int nb_params)
+{
+	unsigned int nb_sources = HIT_NB_PRINTED_SOURCES;
+
+	if (nb_params > 1 ||
+		(nb_params == 1 && ! Adm_ParseUnsigned (params[0], &nb_sources)))
+		return false;
+
+	Hit_Print (MSG_OUTPUT, nb_sources);
+	return true;
+}
+
+
+/*
+====================
+Adm_Cmd_Quit
+
+Close the admin connection
+====================
+*/
+static qboolean Adm_Cmd_Quit (const char** params, unsigned int nb_params)
+{
+	crt_conn->closing = true;
+	return true;
+}
+
+
+static qboolean Adm_Cmd_Help (const char** params, unsigned int nb_params);
+
+// List of the admin commands
+static const admin_cmd_t admin_commands [] =
+{
+	{ "acl-reload",			"",			Adm_Cmd_AclReload		},
+	{ "flood-protection",	"[on|off]",	Adm_Cmd_FloodProtection	},
+	{ "fp-decay-time",		"<decay_time>",	Adm_Cmd_FPDecayTime	},
+	{ "fp-limits",			"[<class> <throttle_limit> <decay_time>]",	Adm_Cmd_FPLimits	},
+	{ "fp-throttle",		"<throttle_limit>",	Adm_Cmd_FPThrottle	},
+	{ "game-policy",		"[<accept|reject|remove> <game_name> ...]",	Adm_Cmd_GamePolicy	},
+	{ "geoip-reload",		"",			Adm_Cmd_GeoipReload		},
+	{ "help",				"",			Adm_Cmd_Help			},
+	{ "hitters",			"[nb_sources]",	Adm_Cmd_Hitters		},
+	{ "quit",				"",			Adm_Cmd_Quit			},
+	{ "servers",			"",			Adm_Cmd_Servers			},
+	{ "stats",				"",			Adm_Cmd_Stats			},
+	{ "verbose",			"[verbose_lvl]",	Adm_Cmd_Verbose	},
+
+	{ NULL, NULL, NULL }	// Marks the end of the list
+};
+
+
+/*
+====================
+Adm_Cmd_Help
+
+Print the list of admin commands
+====================
+*/
+static qboolean Adm_Cmd_Help (const char** params, unsigned int nb_params)
+{
+	const admin_cmd_t* cmd;
+
+	for (cmd = admin_commands; cmd->name != NULL; cmd++)
+		Com_Printf (MSG_OUTPUT, "%s%s%s\n", cmd->name,
+					cmd->help[0] != '\0' ? " " : "", cmd->help);
+	return true;
+}
+
+
+/*
+====================
+Adm_ExecuteCommand
+
+Parse and execute an admin command line
+====================
+*/
+static void Adm_ExecuteCommand (admin_conn_t* conn, char* line)
+{
+	const char* tokens [MAX_ADMIN_COMMAND_TOKENS];
+	unsigned int nb_tokens = 0;
+	char* crt_char = line;
+	const admin_cmd_t* cmd;
+	qboolean result;
+
+	// Split the line in tokens
+	for (;;)
+	{
+		while (*crt_char != '\0' && isspace ((unsigned char)*crt_char))
+			crt_char++;
+		if (*crt_char == '\0')
+			break;
+
+		if (nb_tokens >= MAX_ADMIN_COMMAND_TOKENS)
+		{
+			crt_conn = conn;
+			Adm_Output ("ERROR: too many parameters\n");
+			crt_conn = NULL;
+			return;
+		}
+		tokens[nb_tokens++] = crt_char;
+
+		while (*crt_char != '\0' && ! isspace ((unsigned char)*crt_char))
+			crt_char++;
+		if (*crt_char != '\0')
+			*crt_char++ = '\0';
+	}
+
+	// Ignore empty lines
+	if (nb_tokens == 0)
+		return;
+
+	for (cmd = admin_commands; cmd->name != NULL; cmd++)
+		if (strcmp (cmd->name, tokens[0]) == 0)
+			break;
+
+	crt_conn = conn;
+	if (cmd->name == NULL)
+		Adm_Output ("ERROR: unknown command (try \"help\")\n");
+	else
+	{
+		Com_BeginRedirect (Adm_Output);
+		result = cmd->handler (&tokens[1], nb_tokens - 1);
+		Com_EndRedirect ();
+
+		if (conn->output_overflow)
+		{
+			// Make room for the error message
+			conn->output_overflow = false;
+			conn->output_size = 0;
+			Adm_Output ("ERROR: output too large\n");
+		}
+		else if (result)
+			Adm_Output ("OK\n");
+		else
+		{
+			char error [MAX_ADMIN_COMMAND_LENGTH];
+
+			snprintf (error, sizeof (error), "ERROR: invalid parameters (syntax: %s %s)\n",
+					  cmd->name, cmd->help);
+			error[sizeof (error) - 1] = '\0';
+			Adm_Output (error);
+		}
+	}
+	crt_conn = NULL;
+
+	Com_Printf (MSG_NORMAL, "> Admin command \"%s\" executed\n", tokens[0]);
+}
+
+
+// ---------- Private functions (connections) ---------- //
+
+/*
+====================
+Adm_CloseConnection
+
+Close an admin connection and free its slot
+====================
+*/
+static void Adm_CloseConnection (admin_conn_t* conn)
+{
+	close (conn->socket);
+	free (conn->output);
+	memset (conn, 0, sizeof (*conn));
+	conn->socket = INVALID_SOCKET;
+}
+
+
+/*
+====================
+Adm_AcceptConnection
+
+Accept a new admin connection
+====================
+*/
+static void Adm_AcceptConnection (void)
+{
+	socket_t new_socket;
+	unsigned int ind;
+
+	new_socket = accept (listen_socket, NULL, NULL);
+	if (new_socket == INVALID_SOCKET)
+		return;
+
+	for (ind = 0; ind < MAX_ADMIN_CONNECTIONS; ind++)
+		if (connections[ind].socket == INVALID_SOCKET)
+			break;
+	if (ind >= MAX_ADMIN_CONNECTIONS)
+	{
+		Com_Printf (MSG_WARNING,
+					"> WARNING: too many admin connections, closing the new one\n");
+		close (new_socket);
+		return;
+	}
+
+	fcntl (new_socket, F_SETFL, fcntl (new_socket, F_GETFL) | O_NONBLOCK);
+	connections[ind].socket = new_socket;
+	Com_Printf (MSG_NORMAL, "> New admin connection\n");
+}
+
+
+/*
+====================
+Adm_ReadConnection
+
+Read and execute the commands sent on an admin connection
+====================
+*/
+static void Adm_ReadConnection (admin_conn_t* conn)
+{
+	for (;;)
+	{
+		ssize_t nb_bytes;
+		char* end_of_line;
+
+		nb_bytes = read (conn->socket, conn->input + conn->input_size,
+						 sizeof (conn->input) - conn->input_size - 1);
+		if (nb_bytes < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				conn->closing = true;
+			break;
+		}
+
+		// Connection closed by the peer
+		if (nb_bytes == 0)
+		{
+			conn->closing = true;
+			break;
+		}
+
+		conn->input_size += nb_bytes;
+		conn->input[conn->input_size] = '\0';
+
+		// Execute all the complete command lines
+		while (! conn->closing &&
+			   (end_of_line = strchr (conn->input, '\n')) != NULL)
+		{
+			size_t line_size = end_of_line - conn->input + 1;
+
+			*end_of_line = '\0';
+			if (end_of_line > conn->input && end_of_line[-1] == '\r')
+				end_of_line[-1] = '\0';
+			Adm_ExecuteCommand (conn, conn->input);
+
+			conn->input_size -= line_size;
+			memmove (conn->input, conn->input + line_size, conn->input_size + 1);
+		}
+
+		if (conn->input_size >= sizeof (conn->input) - 1)
+		{
+			crt_conn = conn;
+			Adm_Output ("ERROR: command too long\n");
+			crt_conn = NULL;
+			conn->closing = true;
+		}
+
+		if (conn->closing)
+			break;
+	}
+}
+
+
+/*
+====================
+Adm_WriteConnection
+
+Send the pending output of an admin connection
+====================
+*/
+static void Adm_WriteConnection (admin_conn_t* conn)
+{
+	while (conn->output_size > 0)
+	{
+		ssize_t nb_bytes;
+
+		nb_bytes = write (conn->socket, conn->output, conn->output_size);
+		if (nb_bytes <= 0)
+		{
+			if (nb_bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			{
+				// Nobody to send it to anymore
+				conn->output_size = 0;
+				conn->closing = true;
+			}
+			return;
+		}
+
+		conn->output_size -= nb_bytes;
+		memmove (conn->output, conn->output + nb_bytes, conn->output_size);
+	}
+}
+
+#endif  // #ifndef WIN32
+
+
+// ---------- Public functions ---------- //
+
+/*
+====================
+Adm_SetSocketPath
+
+Set the path of the admin socket (UNIX only)
+====================
+*/
+qboolean Adm_SetSocketPath (const char* path)
+{
+#ifndef WIN32
+	struct sockaddr_un addr;
+
+	if (path == NULL || path[0] == '\0' || strlen (path) >= sizeof (addr.sun_path))
+		return false;
+
+	strncpy (socket_path, path, sizeof (socket_path) - 1);
+	socket_path[sizeof (socket_path) - 1] = '\0';
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+/*
+====================
+Adm_Init
+
+Create the admin socket, if any (must be called before chroot)
+====================
+*/
+qboolean Adm_Init (void)
+{
+#ifndef WIN32
+	struct sockaddr_un addr;
+	struct stat file_stat;
+	unsigned int ind;
+
+	for (ind = 0; ind < MAX_ADMIN_CONNECTIONS; ind++)
+		connections[ind].socket = INVALID_SOCKET;
+
+	if (socket_path[0] == '\0')
+		return true;
+
+	// Remove the socket file of a previous instance, but nothing else
+	if (lstat (socket_path, &file_stat) == 0)
+	{
+		if (! S_ISSOCK (file_stat.st_mode))
+		{
+			Com_Printf (MSG_ERROR,
+						"> ERROR: \"%s\" already exists and isn't a socket\n",
+						socket_path);
+			return false;
+		}
+		unlink (socket_path);
+	}
+
+	listen_socket = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (listen_socket == INVALID_SOCKET)
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: admin socket creation failed (%s)\n",
+					strerror (errno));
+		return false;
+	}
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	// Adm_SetSocketPath has checked that the path fits
+	memcpy (addr.sun_path, socket_path, strlen (socket_path) + 1);
+
+	if (bind (listen_socket, (struct sockaddr*)&addr, sizeof (addr)) != 0 ||
+		chmod (socket_path, S_IRUSR | S_IWUSR) != 0 ||
+		listen (listen_socket, MAX_ADMIN_CONNECTIONS) != 0)
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: can't listen on admin socket \"%s\" (%s)\n",
+					socket_path, strerror (errno));
+		close (listen_socket);
+		listen_socket = INVALID_SOCKET;
+		return false;
+	}
+
+	fcntl (listen_socket, F_SETFL, fcntl (listen_socket, F_GETFL) | O_NONBLOCK);
+
+	Com_Printf (MSG_NORMAL, "> Listening for admin commands on \"%s\"\n", socket_path);
+#endif
+
+	return true;
+}
+
+
+/*
+====================
+Adm_SetSelectSockets
+
+Add the admin sockets to the sets of sockets to watch
+====================
+*/
+void Adm_SetSelectSockets (fd_set* read_set, fd_set* write_set, socket_t* max_sock)
+{
+#ifndef WIN32
+	unsigned int ind;
+
+	if (listen_socket == INVALID_SOCKET)
+		return;
+
+	FD_SET (listen_socket, read_set);
+	if (*max_sock == INVALID_SOCKET || *max_sock < listen_socket)
+		*max_sock = listen_socket;
+
+	for (ind = 0; ind < MAX_ADMIN_CONNECTIONS; ind++)
+	{
+		const admin_conn_t* conn = &connections[ind];
+
+		if (conn->socket == INVALID_SOCKET)
+			continue;
+
+		// Don't read any new command until the previous output has been sent
+		if (conn->output_size > 0)
+			FD_SET (conn->socket, write_set);
+		else
+			FD_SET (conn->socket, read_set);
+		if (*max_sock < conn->socket)
+			*max_sock = conn->socket;
+	}
+#endif
+}
+
+
+/*
+====================
+Adm_HandleSelectSockets
+
+Serve the admin sockets which are ready
+====================
+*/
+void Adm_HandleSelectSockets (const fd_set* read_set, const fd_set* write_set)
+{
+#ifndef WIN32
+	unsigned int ind;
+
+	if (listen_socket == INVALID_SOCKET)
+		return;
+
+	for (ind = 0; ind < MAX_ADMIN_CONNECTIONS; ind++)
+	{
+		admin_conn_t* conn = &connections[ind];
+
+		if (conn->socket == INVALID_SOCKET)
+			continue;
+
+		if (FD_ISSET (conn->socket, read_set))
+			Adm_ReadConnection (conn);
+
+		// Try to send the answers right away
+		if (conn->output_size > 0 || FD_ISSET (conn->socket, write_set))
+			Adm_WriteConnection (conn);
+
+		if (conn->closing && conn->output_size == 0)
+			Adm_CloseConnection (conn);
+	}
+
+	if (FD_ISSET (listen_socket, read_set))
+		Adm_AcceptConnection ();
+#endif
+}
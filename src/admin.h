@@ -0,0 +1,55 @@
+/*
+	admin.h
+
+	Administration socket for dpmaster
+
+	Copyright (C) 2011  Mathieu Olivier
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef _ADMIN_H_
+#define _ADMIN_H_
+
+
+// ---------- Constants ---------- //
+
+// Maximum number of simultaneous admin connections
+#define MAX_ADMIN_CONNECTIONS 4
+
+// Maximum length of an admin command, including the end of line
+#define MAX_ADMIN_COMMAND_LENGTH 1024
+
+// Maximum amount of pending output data per admin connection
+#define MAX_ADMIN_OUTPUT_SIZE (4 * 1024 * 1024)
+
+
+// ---------- Public functions ---------- //
+
+// Set the path of the admin socket (UNIX only)
+qboolean Adm_SetSocketPath (const char* path);
+
+// Create the admin socket, if any (must be called before chroot)
+qboolean Adm_Init (void);
+
+// Add the admin sockets to the sets of sockets to watch
+void Adm_SetSelectSockets (fd_set* read_set, fd_set* write_set, socket_t* max_sock);
+
+// Serve the admin sockets which are ready
+void Adm_HandleSelectSockets (const fd_set* read_set, const fd_set* write_set);
+
+
+#endif  // #ifndef _ADMIN_H_
@@ -25,32 +25,75 @@
 #include "common.h"
 #include "system.h"
 #include "clients.h"
+#include "probes.h"
+
+
+// ---------- Private constants ---------- //
+
+// Index used to terminate the hash chains and the LRU list
+#define NO_CLIENT ((unsigned int)-1)
 
 
 // ---------- Private types ---------- //
 
-typedef struct client_s
+// Limits of a message class
+typedef struct
+{
+	const char* name;
+	unsigned int throttle;
+	qu64 decay_time;			// in microseconds
+} fp_limits_t;
+
+// A client record (72 bytes). Clients are identified by their public
+// address: the IPv4 address, or the first 64 bits of the IPv6 address
+typedef struct
 {
-	user_t user;		// WARNING: MUST be the 1st member, for compatibility with the user hash tables
-	int count;
-	time_t last_time;
+	qu64 key;					// public address
+	qu64 tat [NB_FP_CLASSES];	// "theoretical arrival time" of the next message of each class, in microseconds
+	unsigned int hash_next;		// next client in the hash chain
+	unsigned int lru_prev;		// previous (more recently used) client
+	unsigned int lru_next;		// next (less recently used) client
+	qbyte family;				// AF_INET or AF_INET6
 } client_t;
 
 
 // ---------- Private variables ---------- //
 
 static client_t* clients = NULL;
-
+static unsigned int nb_clients = 0;
 static unsigned int max_nb_clients = DEFAULT_MAX_NB_CLIENTS;
-static user_hash_table_t hash_clients;
-static size_t cl_hash_size = DEFAULT_CL_HASH_SIZE;
 
-// rolling window for allocation
-static int last_used_slot = -1;
+// Hash table (heads of the hash chains). If no hash size has been specified,
+// we choose one which gives about 1 client per hash chain when the list is full
+static unsigned int* hash_clients = NULL;
+static unsigned int cl_hash_size = 0;
+static qboolean cl_hash_size_set = false;
+
+// LRU list: the head is the most recently used client, the tail the least recently used one
+static unsigned int lru_head = NO_CLIENT;
+static unsigned int lru_tail = NO_CLIENT;
+
+// Token buckets: for each message class, a client can send up to "throttle - 1"
+// messages in a row, then its bucket is refilled at a rate of 1 message every
+// "decay time" seconds. A bucket is stored as the time at which the next message
+// is expected if the client respects the rate (its "theoretical arrival time",
+// or TAT), so it only needs a single timestamp, with a microsecond resolution.
+// Servers may legitimately send a lot of heartbeats and infoResponses from the
+// same address, since there can be up to "max_per_address" servers behind it
+static fp_limits_t fp_limits [NB_FP_CLASSES] =
+{
+	{ "getservers",		DEFAULT_FP_THROTTLE,	DEFAULT_FP_DECAY_TIME * 1000000 },
+	{ "heartbeat",		65,		1000000 },
+	{ "inforesponse",	65,		1000000 },
+	{ "getmyaddr",		5,		1000000 },
+	{ "relaysend",		10,		1000000 },
+	{ "other",			5,		1000000 },
+};
 
-// Allow "throttle - 1" queries in a row, then force a throttle to one every "decay time" seconds
-static time_t fp_decay_time = DEFAULT_FP_DECAY_TIME;
-static int fp_throttle = DEFAULT_FP_THROTTLE;
+// Flood protection counters
+static qu64 nb_accepted [NB_FP_CLASSES];
+static qu64 nb_throttled [NB_FP_CLASSES];
+static qu64 nb_recycled_clients = 0;
 
 
 // ---------- Public variables ---------- //
@@ -63,91 +106,125 @@ qboolean flood_protection = false;
 
 /*
 ====================
-Cl_QueryThrottleDecay
+Cl_HashKey
+
+Compute the hash value of a client key, using a multiplicative hash (the
+high bits of the product are the best mixed ones, so we keep those)
+====================
+*/
+static unsigned int Cl_HashKey (qu64 key, int family)
+{
+	if (cl_hash_size == 0)
+		return 0;
+	return (unsigned int)(((key + family) * 0x9E3779B97F4A7C15ULL) >> (64 - cl_hash_size));
+}
+
+
+/*
+====================
+Cl_LRU_Unlink
 
-Compute the current throttle value of a client
+Remove a client from the LRU list
 ====================
 */
-static int Cl_QueryThrottleDecay( client_t *client )
+static void Cl_LRU_Unlink (unsigned int client_ind)
 {
-	int count = client->count - (int)((crt_time - client->last_time) / fp_decay_time);
-	if ( count < 0 )
-		count = 0;
+	client_t* client = &clients[client_ind];
+
+	if (client->lru_prev != NO_CLIENT)
+		clients[client->lru_prev].lru_next = client->lru_next;
+	else
+		lru_head = client->lru_next;
 
-	return count;
+	if (client->lru_next != NO_CLIENT)
+		clients[client->lru_next].lru_prev = client->lru_prev;
+	else
+		lru_tail = client->lru_prev;
 }
 
 
 /*
 ====================
-Cl_AddClient
+Cl_LRU_PushFront
 
-Add a client to an hash table
+Put a client at the head of the LRU list
 ====================
 */
-static qboolean Cl_AddClient( const struct sockaddr_storage *address, socklen_t addrlen )
+static void Cl_LRU_PushFront (unsigned int client_ind)
 {
-	int first_slot = ( last_used_slot + 1 ) % max_nb_clients;
-	int free_slot = first_slot;
-	client_t* free_client = NULL;
+	client_t* client = &clients[client_ind];
 
-	// look for the next free slot
-	do
-	{
-		int count;
-		client_t* client = &clients[ free_slot ];
+	client->lru_prev = NO_CLIENT;
+	client->lru_next = lru_head;
+	if (lru_head != NO_CLIENT)
+		clients[lru_head].lru_prev = client_ind;
+	else
+		lru_tail = client_ind;
+	lru_head = client_ind;
+}
 
-		if ( client->user.prev_ptr == NULL )
-		{
-			// this slot is not in use
-			free_client = client;
-			break;
-		}
 
-		// the rolling window lets us retire inactive queries
-		assert( client->count != 0 );
-		count = Cl_QueryThrottleDecay( client );
-		if ( count == 0 )
-		{
-			// this entry is expired, remove from the hash
-			Com_UserHashTable_Remove( &client->user );
-			free_client = client;
-			Com_Printf( MSG_DEBUG, "> Reusing expired client entry %d\n", (int)(client - clients) );
-			break;
-		}
+/*
+====================
+Cl_HashRemove
 
-		free_slot = ( free_slot + 1 ) % max_nb_clients;
-	}
-	while ( free_slot != first_slot );
+Remove a client from its hash chain
+====================
+*/
+static void Cl_HashRemove (unsigned int client_ind, unsigned int hash)
+{
+	unsigned int* link = &hash_clients[hash];
 
-	if ( free_client != NULL )
+	while (*link != client_ind)
 	{
-		int hash;
+		assert (*link != NO_CLIENT);
+		link = &clients[*link].hash_next;
+	}
+	*link = clients[client_ind].hash_next;
+}
 
-		last_used_slot = free_slot;
 
-		memcpy( &free_client->user.address, address, sizeof( free_client->user.address ) );
-		free_client->user.addrlen = addrlen;
-		free_client->count = 1;
-		free_client->last_time = crt_time;
+/*
+====================
+Cl_AddClient
 
-		hash = Com_AddressHash( address, cl_hash_size );
-		Com_UserHashTable_Add( &hash_clients, &free_client->user, hash );
+Add a client to the list, evicting the least recently used one if the list is full
+====================
+*/
+static unsigned int Cl_AddClient (int family, qu64 key, unsigned int hash)
+{
+	unsigned int client_ind;
+	client_t* client;
 
-		Com_Printf( MSG_DEBUG,
-					"> New client added: %s\n"
-					"  - index: %u\n"
-					"  - hash: 0x%04X\n",
-					peer_address, free_slot, hash );
-		return true;
-	}
+	if (nb_clients < max_nb_clients)
+		client_ind = nb_clients++;
 	else
 	{
-		Com_Printf (MSG_WARNING,
-					"> WARNING: can't add client %s (client list is full)\n",
-					peer_address);
-		return false;
+		// Recycle the least recently used client
+		client_ind = lru_tail;
+		client = &clients[client_ind];
+		Cl_LRU_Unlink (client_ind);
+		Cl_HashRemove (client_ind, Cl_HashKey (client->key, client->family));
+
+		Com_Printf (MSG_DEBUG, "> Reusing client entry %u\n", client_ind);
+		nb_recycled_clients++;
 	}
+
+	client = &clients[client_ind];
+	client->key = key;
+	client->family = (qbyte)family;
+	memset (client->tat, 0, sizeof (client->tat));
+
+	client->hash_next = hash_clients[hash];
+	hash_clients[hash] = client_ind;
+	Cl_LRU_PushFront (client_ind);
+
+	Com_Printf (MSG_DEBUG,
+				"> New client added: %s\n"
+				"  - index: %u\n"
+				"  - hash: 0x%04X\n",
+				peer_address, client_ind, hash);
+	return client_ind;
 }
 
 
@@ -163,10 +240,11 @@ Set a new hash size value
 qboolean Cl_SetHashSize (unsigned int size)
 {
 	// Too late? Or too big?
-	if (clients != NULL || size > MAX_HASH_SIZE)
+	if (clients != NULL || size > MAX_CL_HASH_SIZE)
 		return false;
 
 	cl_hash_size = size;
+	cl_hash_size_set = true;
 	return true;
 }
 
@@ -180,8 +258,8 @@ Set a new maximum number of clients
 */
 qboolean Cl_SetMaxNbClients (unsigned int nb)
 {
-	// Too late? Or too small?
-	if (clients != NULL || nb <= 0)
+	// Too late? Or too small? Or too big?
+	if (clients != NULL || nb <= 0 || nb > MAX_NB_CLIENTS)
 		return false;
 
 	max_nb_clients = nb;
@@ -193,16 +271,16 @@ qboolean Cl_SetMaxNbClients (unsigned int nb)
 ====================
 Cl_SetFPDecayTime
 
-Set a new decay time for the flood protection
+Set a new decay time for a message class of the flood protection
 ====================
 */
-qboolean Cl_SetFPDecayTime (time_t decay)
+qboolean Cl_SetFPDecayTime (fp_class_t msg_class, time_t decay)
 {
-	// Too small?
-	if (decay <= 0)
+	// Invalid class? Or too small?
+	if (msg_class >= NB_FP_CLASSES || decay <= 0)
 		return false;
 
-	fp_decay_time = decay;
+	fp_limits[msg_class].decay_time = (qu64)decay * 1000000;
 	return true;
 }
 
@@ -211,20 +289,53 @@ qboolean Cl_SetFPDecayTime (time_t decay)
 ====================
 Cl_SetFPThrottle
 
-Set a new throttle limit for the flood protection
+Set a new throttle limit for a message class of the flood protection
 ====================
 */
-qboolean Cl_SetFPThrottle (unsigned int throttle)
+qboolean Cl_SetFPThrottle (fp_class_t msg_class, unsigned int throttle)
 {
-	// Too small?
-	if (throttle <= 1)
+	// Invalid class? Or too small?
+	if (msg_class >= NB_FP_CLASSES || throttle <= 1)
 		return false;
 
-	fp_throttle = throttle;
+	fp_limits[msg_class].throttle = throttle;
 	return true;
 }
 
 
+/*
+====================
+Cl_GetFPClassByName
+
+Return the message class with this name, or NB_FP_CLASSES if there's none
+====================
+*/
+fp_class_t Cl_GetFPClassByName (const char* name)
+{
+	unsigned int ind;
+
+	for (ind = 0; ind < NB_FP_CLASSES; ind++)
+		if (strcmp (fp_limits[ind].name, name) == 0)
+			break;
+
+	return (fp_class_t)ind;
+}
+
+
+/*
+====================
+Cl_GetFPClassName
+
+Return the name of a message class
+====================
+*/
+const char* Cl_GetFPClassName (fp_class_t msg_class)
+{
+	assert (msg_class < NB_FP_CLASSES);
+	return fp_limits[msg_class].name;
+}
+
+
 /*
 ====================
 Cl_Init
@@ -232,33 +343,47 @@ Cl_Init
 Initialize the client list and hash tables
 ====================
 */
-qboolean Cl_Init( void )
+qboolean Cl_Init (void)
 {
-	// If the flood protection is enabled
-	if ( flood_protection )
-	{
-		size_t array_size;
+	unsigned int hash_table_size, ind;
 
-		last_used_slot = -1;
+	// If the flood protection is disabled, or if it's already initialized
+	if (! flood_protection || clients != NULL)
+		return true;
 
-		// data
-		array_size = max_nb_clients * sizeof( clients[0] );
-		clients = malloc( array_size );
-		if (!clients)
-		{
-			Com_Printf (MSG_ERROR,
-						"> ERROR: can't allocate the clients array (%s)\n",
-						  strerror (errno));
-			return false;
-		}
-		memset( clients, 0, array_size );
+	clients = malloc (max_nb_clients * sizeof (clients[0]));
+	if (clients == NULL)
+	{
+		Com_Printf (MSG_ERROR,
+					"> ERROR: can't allocate the clients array (%s)\n",
+					strerror (errno));
+		return false;
+	}
+	nb_clients = 0;
+	lru_head = NO_CLIENT;
+	lru_tail = NO_CLIENT;
 
-		Com_Printf( MSG_NORMAL, "> %u client records allocated\n", max_nb_clients );
+	if (! cl_hash_size_set)
+	{
+		cl_hash_size = 0;
+		while (cl_hash_size < MAX_CL_HASH_SIZE && (1U << cl_hash_size) < max_nb_clients)
+			cl_hash_size++;
+	}
 
-		if (! Com_UserHashTable_Init (&hash_clients, cl_hash_size, "client"))
-			return false;
+	hash_table_size = 1U << cl_hash_size;
+	hash_clients = malloc (hash_table_size * sizeof (hash_clients[0]));
+	if (hash_clients == NULL)
+	{
+		Com_Printf (MSG_ERROR,
+					"> ERROR: can't allocate the client hash table (%s)\n",
+					strerror (errno));
+		return false;
 	}
-	
+	for (ind = 0; ind < hash_table_size; ind++)
+		hash_clients[ind] = NO_CLIENT;
+
+	Com_Printf (MSG_NORMAL, "> %u client records allocated (hash size: %u bits)\n",
+				max_nb_clients, cl_hash_size);
 	return true;
 }
 
@@ -267,68 +392,101 @@ qboolean Cl_Init( void )
 ====================
 Cl_BlockedByThrottle
 
-Return "true" if a client should be temporary ignored because he has sent too many requests recently
+Return "true" if a message should be ignored because its sender has sent too many messages of this class recently
 ====================
 */
-qboolean Cl_BlockedByThrottle( const struct sockaddr_storage* addr, socklen_t addrlen )
+qboolean Cl_BlockedByThrottle (const struct sockaddr_storage* addr, fp_class_t msg_class)
 {
-	unsigned int hash;
-	client_t *client;
-	qboolean (*IsSameAddress) (const struct sockaddr_storage* addr1, const struct sockaddr_storage* addr2, qboolean* same_public_address);
+	const fp_limits_t* limits;
+	qu64 key, now, burst, new_tat;
+	unsigned int hash, client_ind, nb_left;
+	client_t* client;
+	qboolean is_blocked;
 
 	// If the flood protection is disabled
-	if ( !flood_protection )
+	if (! flood_protection || clients == NULL)
 		return false;
 
-	if ( addr->ss_family == AF_INET6 )
-		IsSameAddress = &Com_SameIPv6Addr;
-	else
+	assert (msg_class < NB_FP_CLASSES);
+	limits = &fp_limits[msg_class];
+	now = Sys_GetMonotonicTime ();
+
+	// Look for activity information about this client
+	key = Com_AddressKey (addr);
+	hash = Cl_HashKey (key, addr->ss_family);
+	for (client_ind = hash_clients[hash]; client_ind != NO_CLIENT; client_ind = clients[client_ind].hash_next)
 	{
-		assert (addr->ss_family == AF_INET);
-		IsSameAddress = &Com_SameIPv4Addr;
+		client = &clients[client_ind];
+		if (client->key == key && client->family == addr->ss_family)
+			break;
 	}
 
-	// look for activity information about this client
-	hash = Com_AddressHash( addr, cl_hash_size );
-	client = (client_t*)hash_clients.entries[ hash ];
-	while ( client != NULL )
+	if (client_ind != NO_CLIENT)
 	{
-		if ( addr->ss_family == client->user.address.ss_family )
+		// Move the client at the head of the LRU list
+		if (client_ind != lru_head)
 		{
-			qboolean same_public_address = false;
-
-			IsSameAddress( addr, &client->user.address, &same_public_address );
-
-			// found entry
-			if ( same_public_address )
-			{
-				msg_level_t msg_level;
-				const char* msg_result;
-
-				int new_count = Cl_QueryThrottleDecay( client ) + 1;
-				qboolean is_blocked = ( new_count >= fp_throttle );
-				if ( ! is_blocked )
-				{
-					client->count = new_count;
-					client->last_time = crt_time;
-					msg_level = MSG_DEBUG;
-					msg_result = "not throttled";
-
-				}
-				else
-				{
-					msg_level = MSG_NORMAL;
-					msg_result = "throttled";
-				}
-
-				Com_Printf( msg_level, "> Client %s: %s (new count == %d)\n", peer_address, msg_result, new_count );
-				return is_blocked;
-			}
+			Cl_LRU_Unlink (client_ind);
+			Cl_LRU_PushFront (client_ind);
 		}
+	}
+	else
+		client_ind = Cl_AddClient (addr->ss_family, key, hash);
+	client = &clients[client_ind];
+
+	// The message is accepted if it doesn't make the client
+	// go further ahead of schedule than its burst allowance
+	burst = (limits->throttle - 1) * limits->decay_time;
+	new_tat = (client->tat[msg_class] > now ? client->tat[msg_class] : now) + limits->decay_time;
+	is_blocked = (new_tat - now > burst);
+	if (! is_blocked)
+	{
+		client->tat[msg_class] = new_tat;
+		nb_left = (unsigned int)((burst - (new_tat - now)) / limits->decay_time);
+		nb_accepted[msg_class]++;
+
+		Com_Printf (MSG_DEBUG, "> Client %s: %s not throttled (%u messages left)\n",
+					peer_address, limits->name, nb_left);
+	}
+	else
+	{
+		nb_left = 0;
+		nb_throttled[msg_class]++;
 
-		client = (client_t*)client->user.next;
+		Com_Printf (MSG_NORMAL, "> Client %s: %s throttled (next message allowed in %.3f seconds)\n",
+					peer_address, limits->name,
+					(double)(client->tat[msg_class] + limits->decay_time - burst - now) / 1000000.0);
+	}
+
+	PROBE4 (client__throttle, addr, limits->name, nb_left, is_blocked);
+	return is_blocked;
+}
+
+
+/*
+====================
+Cl_PrintStats
+
+Print the flood protection limits and counters
+====================
+*/
+void Cl_PrintStats (msg_level_t msg_level)
+{
+	unsigned int ind;
+
+	if (clients == NULL)
+	{
+		Com_Printf (msg_level, "\n> Flood protection: disabled\n");
+		return;
 	}
 
-	assert( client == NULL );
-	return ( ! Cl_AddClient( addr, addrlen ) );
+	Com_Printf (msg_level, "\n> Flood protection (%s):\n",
+				flood_protection ? "enabled" : "disabled");
+	for (ind = 0; ind < NB_FP_CLASSES; ind++)
+		Com_Printf (msg_level,
+					" * %s: %llu accepted, %llu throttled (throttle limit: %u, decay time: %llu s)\n",
+					fp_limits[ind].name, nb_accepted[ind], nb_throttled[ind],
+					fp_limits[ind].throttle, fp_limits[ind].decay_time / 1000000);
+	Com_Printf (msg_level, " * client records: %u used out of %u, %llu recycled\n",
+					nb_clients, max_nb_clients, nb_recycled_clients);
 }
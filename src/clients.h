@@ -29,16 +29,39 @@
 // ---------- Constants ---------- //
 
 // Maximum number of clients in all lists by default
-#define DEFAULT_MAX_NB_CLIENTS 512
+#define DEFAULT_MAX_NB_CLIENTS 16384
 
-// Address hash size in bits for clients (between 0 and MAX_HASH_SIZE)
-#define DEFAULT_CL_HASH_SIZE 7
+// Maximum number of clients in all lists (a client record takes 72 bytes)
+#define MAX_NB_CLIENTS (1 << 24)
 
-// Allow "throttle - 1" queries in a row, then force a throttle to one every "decay time" seconds
+// Maximum address hash size in bits for clients. By default, the hash
+// size is computed from the maximum number of clients
+#define MAX_CL_HASH_SIZE 24
+
+// Allow "throttle - 1" getservers queries in a row, then force a throttle
+// to one every "decay time" seconds. The other message classes have
+// their own default limits (see clients.c)
 #define DEFAULT_FP_DECAY_TIME	3
 #define DEFAULT_FP_THROTTLE		5
 
 
+// ---------- Types ---------- //
+
+// Message classes of the flood protection. Each class has its own
+// limits, and each client has a separate budget for each class
+typedef enum
+{
+	FP_CLASS_GETSERVERS,	// getservers, getserversExt and getserversWithInfo
+	FP_CLASS_HEARTBEAT,
+	FP_CLASS_INFORESPONSE,
+	FP_CLASS_GETMYADDR,
+	FP_CLASS_RELAYSEND,
+	FP_CLASS_OTHER,			// unknown messages
+
+	NB_FP_CLASSES
+} fp_class_t;
+
+
 // ---------- Public variables ---------- //
 
 // Enable/disabled the flood protection mechanism against abusive client requests
@@ -50,14 +73,25 @@ extern qboolean flood_protection;
 // Will simply return "false" if called after Sv_Init
 qboolean Cl_SetHashSize (unsigned int size);
 qboolean Cl_SetMaxNbClients (unsigned int nb);
-qboolean Cl_SetFPDecayTime (time_t decay);
-qboolean Cl_SetFPThrottle (unsigned int throttle);
 
-// Initialize the client list and hash tables
-qboolean Cl_Init( void );
+// Those can be called at any time
+qboolean Cl_SetFPDecayTime (fp_class_t msg_class, time_t decay);
+qboolean Cl_SetFPThrottle (fp_class_t msg_class, unsigned int throttle);
+
+// Return the message class with this name, or NB_FP_CLASSES if there's none
+fp_class_t Cl_GetFPClassByName (const char* name);
+
+// Return the name of a message class
+const char* Cl_GetFPClassName (fp_class_t msg_class);
+
+// Initialize the client list and hash tables (does nothing if the flood protection is disabled)
+qboolean Cl_Init (void);
+
+// Return "true" if a message should be ignored because its sender has sent too many messages of this class recently
+qboolean Cl_BlockedByThrottle (const struct sockaddr_storage* addr, fp_class_t msg_class);
 
-// Return "true" if a client should be temporary ignored because he has sent too many requests recently
-qboolean Cl_BlockedByThrottle( const struct sockaddr_storage* addr, socklen_t addrlen );
+// Print the flood protection limits and counters
+void Cl_PrintStats (msg_level_t msg_level);
 
 
 #endif  // #ifndef _CLIENTS_H_
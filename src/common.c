@@ -24,7 +24,11 @@
 
 #include "common.h"
 #include "system.h"
+#include "acl.h"
+#include "geoip.h"
+#include "recorder.h"
 #include "servers.h"
+#include "stats.h"
 
 
 // ---------- Private variables ---------- //
@@ -41,6 +45,9 @@ static volatile sig_atomic_t must_open_log = false;
 // Should we close the log file?
 static volatile sig_atomic_t must_close_log = false;
 
+// If not NULL, all printings are sent to this function instead
+static void (*redirect_func) (const char* text) = NULL;
+
 
 // ---------- Public variables ---------- //
 
@@ -199,8 +206,12 @@ qboolean Com_UpdateLogStatus (qboolean init)
 		fprintf (log_file, "> Opening log file (time: %s)\n", datestring);
 
 		// if we're opening the log after the initialization, print the list of servers
+		// and the statistics
 		if (! init)
+		{
 			Sv_PrintServerList (MSG_WARNING);
+			Stats_Print (MSG_WARNING);
+		}
 
 	}
 
@@ -300,8 +311,25 @@ Print a message to screen, depending on its verbose level
 */
 void Com_Printf (msg_level_t msg_level, const char* format, ...)
 {
-	// If the message level is above the maximum level, or if we output
-	// neither to the console nor to a log file, there nothing to do
+	// If the output is redirected, it gets the outputs of the admin commands,
+	// and a copy of the errors and warnings. The other messages (the side
+	// effects of the commands) only go to the console and the log file
+	if (redirect_func != NULL && (msg_level <= MSG_WARNING || msg_level == MSG_OUTPUT))
+	{
+		char text [MAX_REDIRECT_TEXT_SIZE];
+		va_list args;
+
+		va_start (args, format);
+		vsnprintf (text, sizeof (text), format, args);
+		va_end (args);
+		text[sizeof (text) - 1] = '\0';
+
+		redirect_func (text);
+	}
+
+	// If the message level is above the maximum level (always true for the
+	// outputs of the admin commands), or if we output neither to the console
+	// nor to a log file, there nothing to do
 	if (msg_level > max_msg_level ||
 		(log_file == NULL && daemon_state == DAEMON_STATE_EFFECTIVE))
 		return;
@@ -338,6 +366,33 @@ void Com_Printf (msg_level_t msg_level, const char* format, ...)
 }
 
 
+/*
+====================
+Com_BeginRedirect
+
+Send the admin command outputs, and a copy of the errors and warnings, to a function
+====================
+*/
+void Com_BeginRedirect (void (*func) (const char* text))
+{
+	assert (redirect_func == NULL);
+	redirect_func = func;
+}
+
+
+/*
+====================
+Com_EndRedirect
+
+Restore the normal output
+====================
+*/
+void Com_EndRedirect (void)
+{
+	redirect_func = NULL;
+}
+
+
 /*
 ====================
 Com_SignalHandler
@@ -359,6 +414,25 @@ void Com_SignalHandler (int Signal)
 			must_close_log = true;
 			break;
 #endif
+#ifdef SIGHUP
+		case SIGHUP:
+			Acl_RequestReload ();
+			Geo_RequestReload ();
+			break;
+#endif
+#ifdef SIGQUIT
+		case SIGQUIT:
+			Rec_RequestDump ();
+			break;
+#endif
+		case SIGABRT:
+			// We're crashing (most likely an assertion failure): dump what we
+			// know right now, then let the default handler terminate us
+			Rec_Dump ("abort");
+			signal (SIGABRT, SIG_DFL);
+			raise (SIGABRT);
+			break;
+
 		default:
 			// We aren't suppose to be here...
 			assert(false);
@@ -386,10 +460,10 @@ unsigned int Com_AddressHash (const struct sockaddr_storage* address, size_t has
 		addr6 = (const struct sockaddr_in6*)address;
 		ipv6_ptr = (const unsigned int*)&addr6->sin6_addr.s6_addr;
 		
-		// Since an IPv6 device can have multiple addresses, we only hash
-		// the non-configurable part of its public address (meaning the first
-		// 64 bits, or subnet part)
-		hash = ipv6_ptr[0] ^ ipv6_ptr[1];
+		// The servers are counted per subnet separately (see Sv_CountSameAddress),
+		// so the whole address is hashed: the servers sharing a subnet are spread
+		// over the hash table rather than all piled up in the same chain
+		hash = ipv6_ptr[0] ^ ipv6_ptr[1] ^ ipv6_ptr[2] ^ ipv6_ptr[3];
 		
 		if (hash_ports)
 			hash ^= addr6->sin6_port;
@@ -418,6 +492,103 @@ unsigned int Com_AddressHash (const struct sockaddr_storage* address, size_t has
 }
 
 
+/*
+====================
+Com_AddressKey
+
+Return the public part of an address as a 64-bit integer: the IPv4
+address, or the first 64 bits (the subnet part) of the IPv6 address
+====================
+*/
+qu64 Com_AddressKey (const struct sockaddr_storage* address)
+{
+	qu64 key;
+
+	if (address->ss_family == AF_INET6)
+	{
+		const struct sockaddr_in6* addr6 = (const struct sockaddr_in6*)address;
+		const qbyte* addr_buff = (const qbyte*)&addr6->sin6_addr.s6_addr;
+		unsigned int ind;
+
+		key = 0;
+		for (ind = 0; ind < 8; ind++)
+			key = (key << 8) | addr_buff[ind];
+	}
+	else
+	{
+		const struct sockaddr_in* addr4 = (const struct sockaddr_in*)address;
+
+		assert (address->ss_family == AF_INET);
+		key = ntohl (addr4->sin_addr.s_addr);
+	}
+
+	return key;
+}
+
+
+/*
+====================
+Com_SipHash
+
+Compute the SipHash-2-4 of a buffer, using a 128-bit key. SipHash is a
+keyed hash function, meant to be fast on short inputs, and secure enough
+to be used as a MAC when its key is kept secret
+====================
+*/
+#define SIPROUND(v0, v1, v2, v3) \
+	do \
+	{ \
+		v0 += v1; v1 = (v1 << 13) | (v1 >> 51); v1 ^= v0; v0 = (v0 << 32) | (v0 >> 32); \
+		v2 += v3; v3 = (v3 << 16) | (v3 >> 48); v3 ^= v2; \
+		v0 += v3; v3 = (v3 << 21) | (v3 >> 43); v3 ^= v0; \
+		v2 += v1; v1 = (v1 << 17) | (v1 >> 47); v1 ^= v2; v2 = (v2 << 32) | (v2 >> 32); \
+	} while (0)
+
+qu64 Com_SipHash (const qu64 key [2], const void* data, size_t length)
+{
+	const qbyte* bytes = (const qbyte*)data;
+	qu64 v0 = key[0] ^ 0x736F6D6570736575ULL;
+	qu64 v1 = key[1] ^ 0x646F72616E646F6DULL;
+	qu64 v2 = key[0] ^ 0x6C7967656E657261ULL;
+	qu64 v3 = key[1] ^ 0x7465646279746573ULL;
+	qu64 last = (qu64)length << 56;
+	size_t nb_words = length / 8;
+	size_t ind;
+
+	for (ind = 0; ind < nb_words; ind++, bytes += 8)
+	{
+		qu64 m = (qu64)bytes[0]         | ((qu64)bytes[1] << 8)  |
+				 ((qu64)bytes[2] << 16) | ((qu64)bytes[3] << 24) |
+				 ((qu64)bytes[4] << 32) | ((qu64)bytes[5] << 40) |
+				 ((qu64)bytes[6] << 48) | ((qu64)bytes[7] << 56);
+
+		v3 ^= m;
+		SIPROUND (v0, v1, v2, v3);
+		SIPROUND (v0, v1, v2, v3);
+		v0 ^= m;
+	}
+
+	// The remaining bytes, and the length, make the last word
+	for (ind = 0; ind < (length & 7); ind++)
+		last |= (qu64)bytes[ind] << (8 * ind);
+
+	v3 ^= last;
+	SIPROUND (v0, v1, v2, v3);
+	SIPROUND (v0, v1, v2, v3);
+	v0 ^= last;
+
+	v2 ^= 0xFF;
+	SIPROUND (v0, v1, v2, v3);
+	SIPROUND (v0, v1, v2, v3);
+	SIPROUND (v0, v1, v2, v3);
+	SIPROUND (v0, v1, v2, v3);
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#undef SIPROUND
+
+
 /*
 ====================
 Com_SameIPv4Addr
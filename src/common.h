@@ -61,12 +61,16 @@
 // Maximum address hash size in bits
 #define MAX_HASH_SIZE 16
 
+// Maximum size of a text printed while the output is redirected
+#define MAX_REDIRECT_TEXT_SIZE 1024
+
 
 // ---------- Types ---------- //
 
 // A few basic types
 typedef enum {false, true} qboolean;
 typedef unsigned char qbyte;
+typedef unsigned long long qu64;
 
 // The various messages levels
 typedef enum
@@ -75,7 +79,9 @@ typedef enum
 	MSG_ERROR,		// errors
 	MSG_WARNING,	// warnings
 	MSG_NORMAL,		// standard messages
-	MSG_DEBUG		// for debugging purpose
+	MSG_DEBUG,		// for debugging purpose
+
+	MSG_OUTPUT		// output of an admin command (only printed while redirected)
 } msg_level_t;
 
 // Command line option
@@ -176,12 +182,24 @@ qboolean Com_UpdateLogStatus (qboolean init);
 // Print a text to the screen and/or to the log file
 void Com_Printf (msg_level_t msg_level, const char* format, ...);
 
+// Send the admin command outputs, and a copy of the errors and warnings, to a function
+void Com_BeginRedirect (void (*func) (const char* text));
+
+// Restore the normal output
+void Com_EndRedirect (void);
+
 // Handling of the signals sent to this process
 void Com_SignalHandler (int Signal);
 
 // Compute the hash of a server address
 unsigned int Com_AddressHash (const struct sockaddr_storage* address, size_t hash_size);
 
+// Return the public part of an address (IPv4 address, or IPv6 subnet) as a 64-bit integer
+qu64 Com_AddressKey (const struct sockaddr_storage* address);
+
+// Compute the SipHash-2-4 of a buffer, using a 128-bit key
+qu64 Com_SipHash (const qu64 key [2], const void* data, size_t length);
+
 // Compare 2 IPv4 addresses and return "true" if they're equal
 qboolean Com_SameIPv4Addr (const struct sockaddr_storage* addr1, const struct sockaddr_storage* addr2, qboolean* same_public_address);
 
@@ -0,0 +1,385 @@
+/*
+	hitters.h
+
+	Stateless challenges (cookies) for dpmaster
+
+	Copyright (C) 2011  Mathieu Olivier
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+
+#include "common.h"
+#include "system.h"
+#include "cookies.h"
+
+
+// ---------- Private constants ---------- //
+
+// Number of epoch keys kept: the current one and the 2 previous ones
+#define NB_EPOCH_KEYS 3
+
+// Number of bits of a challenge used by each field. A challenge is made of
+// 6-bit characters: the game index, the time it has been built at (in
+// milliseconds, modulo 4096), and a truncated MAC of all the rest
+#define COOKIE_GAME_BITS	12
+#define COOKIE_TIME_BITS	12
+#define COOKIE_MAC_BITS		42
+
+#define COOKIE_TIME_MASK	((1 << COOKIE_TIME_BITS) - 1)
+#define COOKIE_MAC_MASK		((1ULL << COOKIE_MAC_BITS) - 1)
+
+// Data authenticated by the getservers tokens. The challenges never use
+// it since their data is only COOKIE_GAME_BITS + COOKIE_TIME_BITS long
+#define COOKIE_TOKEN_DATA	0xFFFFFFFF
+
+#if COOKIE_EPOCH_DURATION * 2 * 1000 >= (1 << COOKIE_TIME_BITS)
+#	error "COOKIE_TIME_BITS is too small for the challenges lifetime"
+#endif
+#if COOKIE_TOKEN_LENGTH != COOKIE_MAC_BITS / 6
+#	error "COOKIE_TOKEN_LENGTH doesn't match COOKIE_MAC_BITS"
+#endif
+
+// Epoch value marking an unused epoch key
+#define NO_EPOCH ((qu64)-1)
+
+
+// ---------- Private types ---------- //
+
+// The key used by the MACs during an epoch
+typedef struct
+{
+	qu64 epoch;
+	qu64 key [2];
+} epoch_key_t;
+
+
+// ---------- Private variables ---------- //
+
+// The secret from which the epoch keys are derived
+static qu64 master_key [2];
+
+// The epoch keys, indexed by their epoch modulo NB_EPOCH_KEYS
+static epoch_key_t epoch_keys [NB_EPOCH_KEYS];
+
+// The characters used in the challenges, and their values (-1 if invalid).
+// None of them has a special meaning in the messages or in the infostrings
+static const char cookie_chars [64 + 1] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+-";
+static signed char cookie_values [256];
+
+
+// ---------- Private functions ---------- //
+
+/*
+====================
+Cookie_GetEpochKey
+
+Return the key of an epoch, deriving it from the master key if necessary.
+Each epoch thus has its own secret, and the keys of the past epochs can't
+be used to forge challenges for the current one
+====================
+*/
+static const qu64* Cookie_GetEpochKey (qu64 epoch)
+{
+	epoch_key_t* epoch_key = &epoch_keys[epoch % NB_EPOCH_KEYS];
+
+	if (epoch_key->epoch != epoch)
+	{
+		qbyte buffer [9];
+		unsigned int ind;
+
+		for (ind = 0; ind < 8; ind++)
+			buffer[ind] = (qbyte)(epoch >> (8 * ind));
+
+		for (ind = 0; ind < 2; ind++)
+		{
+			buffer[8] = (qbyte)ind;
+			epoch_key->key[ind] = Com_SipHash (master_key, buffer, sizeof (buffer));
+		}
+		epoch_key->epoch = epoch;
+	}
+
+	return epoch_key->key;
+}
+
+
+/*
+====================
+Cookie_ComputeMAC
+
+Compute the MAC of some data sent to an address during an epoch
+====================
+*/
+static qu64 Cookie_ComputeMAC (qu64 epoch, const struct sockaddr_storage* address, unsigned int data)
+{
+	qbyte buffer [4 + 2 + 1 + 16];
+	size_t length;
+	const qbyte* addr_buff;
+	size_t addr_length;
+	unsigned short port;
+
+	if (address->ss_family == AF_INET6)
+	{
+		const struct sockaddr_in6* addr6 = (const struct sockaddr_in6*)address;
+
+		addr_buff = (const qbyte*)&addr6->sin6_addr.s6_addr;
+		addr_length = sizeof (addr6->sin6_addr.s6_addr);
+		port = addr6->sin6_port;
+	}
+	else
+	{
+		const struct sockaddr_in* addr4 = (const struct sockaddr_in*)address;
+
+		assert (address->ss_family == AF_INET);
+		addr_buff = (const qbyte*)&addr4->sin_addr.s_addr;
+		addr_length = sizeof (addr4->sin_addr.s_addr);
+		port = addr4->sin_port;
+	}
+
+	buffer[0] = (qbyte)data;
+	buffer[1] = (qbyte)(data >> 8);
+	buffer[2] = (qbyte)(data >> 16);
+	buffer[3] = (qbyte)(data >> 24);
+	memcpy (&buffer[4], &port, 2);
+	buffer[6] = (qbyte)address->ss_family;
+	memcpy (&buffer[7], addr_buff, addr_length);
+	length = 7 + addr_length;
+
+	return Com_SipHash (Cookie_GetEpochKey (epoch), buffer, length) & COOKIE_MAC_MASK;
+}
+
+
+/*
+====================
+Cookie_EncodeMAC
+
+Write the characters of a MAC (COOKIE_MAC_BITS / 6 of them, no '\0')
+====================
+*/
+static void Cookie_EncodeMAC (char* dest, qu64 mac)
+{
+	unsigned int ind;
+
+	for (ind = 0; ind < COOKIE_MAC_BITS / 6; ind++)
+		dest[ind] = cookie_chars[(mac >> (6 * ind)) & 63];
+}
+
+
+/*
+====================
+Cookie_DecodeMAC
+
+Read the characters of a MAC. Returns "false" if one of them is invalid
+====================
+*/
+static qboolean Cookie_DecodeMAC (const char* src, qu64* mac)
+{
+	unsigned int ind;
+
+	*mac = 0;
+	for (ind = 0; ind < COOKIE_MAC_BITS / 6; ind++)
+	{
+		int value = cookie_values[(qbyte)src[ind]];
+
+		if (value < 0)
+			return false;
+		*mac |= (qu64)value << (6 * ind);
+	}
+
+	return true;
+}
+
+
+/*
+====================
+Cookie_GetMACAge
+
+Return how many epochs ago a MAC has been computed for this address and
+data, or NB_EPOCH_KEYS if it doesn't match any of the known epochs
+====================
+*/
+static unsigned int Cookie_GetMACAge (qu64 epoch, const struct sockaddr_storage* address, unsigned int data, qu64 mac)
+{
+	unsigned int age;
+
+	// The current epoch first, since it's where most answers come from
+	for (age = 0; age < NB_EPOCH_KEYS && age <= epoch; age++)
+		if (Cookie_ComputeMAC (epoch - age, address, data) == mac)
+			return age;
+
+	return NB_EPOCH_KEYS;
+}
+
+
+// ---------- Public functions ---------- //
+
+/*
+====================
+Cookie_Init
+
+Generate the secret key (must be called before chroot)
+====================
+*/
+qboolean Cookie_Init (void)
+{
+	unsigned int ind;
+
+	if (! Sys_GetRandomBytes (master_key, sizeof (master_key)))
+	{
+		qu64 seed [3];
+		const qu64 seed_key [2] = { 0, 0 };
+
+		// Fall back to a key which is much harder to guess than rand()
+		// output, but not impossible. It's still better than nothing
+		Com_Printf (MSG_WARNING,
+					"> WARNING: can't get random bytes from the system, the challenges will be easier to forge\n");
+		seed[0] = Sys_GetCycles ();
+		seed[1] = Sys_GetMonotonicTime ();
+		seed[2] = (qu64)time (NULL) ^ (qu64)(size_t)&seed;
+		master_key[0] = Com_SipHash (seed_key, seed, sizeof (seed));
+		seed[0] = Sys_GetCycles ();
+		master_key[1] = Com_SipHash (seed_key, seed, sizeof (seed));
+	}
+
+	for (ind = 0; ind < NB_EPOCH_KEYS; ind++)
+		epoch_keys[ind].epoch = NO_EPOCH;
+
+	memset (cookie_values, -1, sizeof (cookie_values));
+	for (ind = 0; ind < 64; ind++)
+		cookie_values[(qbyte)cookie_chars[ind]] = (signed char)ind;
+
+	return true;
+}
+
+
+/*
+====================
+Cookie_BuildChallenge
+
+Build the challenge of a getinfo message for this address
+====================
+*/
+const char* Cookie_BuildChallenge (const struct sockaddr_storage* address, unsigned int game_index)
+{
+	static char challenge [COOKIE_CHALLENGE_LENGTH + 1];
+	qu64 now = Sys_GetMonotonicTime ();
+	qu64 epoch = now / (COOKIE_EPOCH_DURATION * 1000000);
+	unsigned int timestamp = (unsigned int)(now / 1000) & COOKIE_TIME_MASK;
+	unsigned int data;
+	qu64 mac;
+
+	assert (game_index <= COOKIE_MAX_GAME_INDEX);
+
+	data = (game_index << COOKIE_TIME_BITS) | timestamp;
+	mac = Cookie_ComputeMAC (epoch, address, data);
+
+	challenge[0] = cookie_chars[(game_index >> 6) & 63];
+	challenge[1] = cookie_chars[game_index & 63];
+	challenge[2] = cookie_chars[(timestamp >> 6) & 63];
+	challenge[3] = cookie_chars[timestamp & 63];
+	Cookie_EncodeMAC (&challenge[4], mac);
+	challenge[COOKIE_CHALLENGE_LENGTH] = '\0';
+
+	return challenge;
+}
+
+
+/*
+====================
+Cookie_CheckChallenge
+
+Check a challenge echoed by this address
+====================
+*/
+cookie_status_t Cookie_CheckChallenge (const char* challenge, const struct sockaddr_storage* address,
+									   unsigned int* game_index, qu64* elapsed_time)
+{
+	int values [4];
+	qu64 now, epoch, mac;
+	unsigned int ind, timestamp, data, age;
+
+	for (ind = 0; ind < 4; ind++)
+	{
+		values[ind] = cookie_values[(qbyte)challenge[ind]];
+		if (values[ind] < 0)
+			return COOKIE_INVALID;
+	}
+	if (! Cookie_DecodeMAC (&challenge[4], &mac) ||
+		challenge[COOKIE_CHALLENGE_LENGTH] != '\0')
+		return COOKIE_INVALID;
+
+	*game_index = (values[0] << 6) | values[1];
+	timestamp = (values[2] << 6) | values[3];
+	data = (*game_index << COOKIE_TIME_BITS) | timestamp;
+
+	now = Sys_GetMonotonicTime ();
+	epoch = now / (COOKIE_EPOCH_DURATION * 1000000);
+
+	age = Cookie_GetMACAge (epoch, address, data, mac);
+	if (age >= NB_EPOCH_KEYS)
+		return COOKIE_INVALID;
+	if (age >= NB_EPOCH_KEYS - 1)
+		return COOKIE_EXPIRED;
+
+	// A challenge lives less than 4096 ms, so the modulo is harmless
+	*elapsed_time = (qu64)(((unsigned int)(now / 1000) - timestamp) & COOKIE_TIME_MASK) * 1000;
+	return COOKIE_VALID;
+}
+
+
+/*
+====================
+Cookie_BuildToken
+
+Build the token a client must echo to get a large getservers response
+====================
+*/
+const char* Cookie_BuildToken (const struct sockaddr_storage* address)
+{
+	static char token [COOKIE_TOKEN_LENGTH + 1];
+	qu64 epoch = Sys_GetMonotonicTime () / (COOKIE_EPOCH_DURATION * 1000000);
+
+	Cookie_EncodeMAC (token, Cookie_ComputeMAC (epoch, address, COOKIE_TOKEN_DATA));
+	token[COOKIE_TOKEN_LENGTH] = '\0';
+
+	return token;
+}
+
+
+/*
+====================
+Cookie_CheckToken
+
+Check a getservers token echoed by this address
+====================
+*/
+cookie_status_t Cookie_CheckToken (const char* token, const struct sockaddr_storage* address)
+{
+	qu64 epoch, mac;
+	unsigned int age;
+
+	if (! Cookie_DecodeMAC (token, &mac) || token[COOKIE_TOKEN_LENGTH] != '\0')
+		return COOKIE_INVALID;
+
+	epoch = Sys_GetMonotonicTime () / (COOKIE_EPOCH_DURATION * 1000000);
+	age = Cookie_GetMACAge (epoch, address, COOKIE_TOKEN_DATA, mac);
+	if (age >= NB_EPOCH_KEYS)
+		return COOKIE_INVALID;
+	if (age >= NB_EPOCH_KEYS - 1)
+		return COOKIE_EXPIRED;
+	return COOKIE_VALID;
+}
@@ -0,0 +1,78 @@
+/*
+	cookies.h
+
+	Stateless challenges (cookies) for dpmaster
+
+	Copyright (C) 2011  Mathieu Olivier
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+
+#ifndef _COOKIES_H_
+#define _COOKIES_H_
+
+
+// ---------- Constants ---------- //
+
+// Duration of an epoch, in seconds. A challenge is valid during the epoch
+// it has been built in and the following one, and is considered
+// obsolete (rather than invalid) during the epoch after that
+#define COOKIE_EPOCH_DURATION 2
+
+// Number of characters in a challenge, not including the '\0'
+#define COOKIE_CHALLENGE_LENGTH 11
+
+// Number of characters in a getservers token, not including the '\0'
+#define COOKIE_TOKEN_LENGTH 7
+
+// Maximum game index a challenge can carry
+#define COOKIE_MAX_GAME_INDEX 4095
+
+
+// ---------- Types ---------- //
+
+typedef enum
+{
+	COOKIE_VALID,
+	COOKIE_EXPIRED,
+	COOKIE_INVALID,
+} cookie_status_t;
+
+
+// ---------- Public functions ---------- //
+
+// Generate the secret key (must be called before chroot)
+qboolean Cookie_Init (void);
+
+// Build the challenge of a getinfo message for this address. The game index
+// is carried by the challenge. Returns a pointer to a static buffer
+const char* Cookie_BuildChallenge (const struct sockaddr_storage* address, unsigned int game_index);
+
+// Check a challenge echoed by this address. If it's valid, get back its game
+// index, and the time elapsed since it has been built (in microseconds)
+cookie_status_t Cookie_CheckChallenge (const char* challenge, const struct sockaddr_storage* address,
+									   unsigned int* game_index, qu64* elapsed_time);
+
+// Build the token a client must echo to get a large getservers response.
+// It has the same lifetime as a challenge. Returns a pointer to a static buffer
+const char* Cookie_BuildToken (const struct sockaddr_storage* address);
+
+// Check a getservers token echoed by this address
+cookie_status_t Cookie_CheckToken (const char* token, const struct sockaddr_storage* address);
+
+
+#endif  // #ifndef _COOKIES_H_
@@ -25,9 +25,19 @@
 #include "common.h"
 #include "system.h"
 
+#include "acl.h"
+#include "admin.h"
 #include "clients.h"
+#include "cookies.h"
+#include "egress.h"
 #include "games.h"
+#include "geoip.h"
+#include "hitters.h"
 #include "messages.h"
+#include "overload.h"
+#include "probes.h"
+#include "recorder.h"
+#include "revalidation.h"
 #include "servers.h"
 
 
@@ -37,11 +47,42 @@
 #define VERSION "2.2"
 
 
+// ---------- Private types ---------- //
+
+// A packet waiting to be handled
+typedef struct
+{
+	struct sockaddr_storage address;
+	socklen_t addrlen;
+	socket_t socket;
+	size_t length;
+	char peer_address [sizeof (peer_address)];
+	char data [MAX_PACKET_SIZE_IN + 1];  // "+ 1" because we append a '\0'
+} received_packet_t;
+
+
 // ---------- Private variables ---------- //
 
+// The packets received since the last select()
+static received_packet_t batch [MAX_BATCH_SIZE];
+static unsigned int nb_batch_packets = 0;
+
+// Number of lookups of the GeoIP benchmark (0 means no benchmark)
+static unsigned int geoip_benchmark_lookups = 0;
+
 // Cross-platform command line options
 static const cmdlineopt_t cmdline_options [] =
 {
+	{
+		"acl-file",
+		"<file_path>",
+		"Load a list of allowed and denied address prefixes from a file.\n"
+		"   The file is reloaded when dpmaster receives the HUP signal",
+		{ 0, 0 },
+		'\0',
+		1,
+		1
+	},
 	{
 		"allow-loopback",
 		NULL,
@@ -52,11 +93,55 @@ static const cmdlineopt_t cmdline_options [] =
 		0,
 		0
 	},
+	{
+		"auto-ban",
+		"<max_packets> <ban_duration> [<max_prefix_packets>]",
+		"Automatically ban the addresses sending more than <max_packets>\n"
+		"   recently, and the prefixes sending more than <max_prefix_packets>\n"
+		"   (default: 4 times <max_packets>), for <ban_duration> seconds",
+		{ 0, 0 },
+		'\0',
+		2,
+		3
+	},
+	{
+		"challenge-mode",
+		"<cookie|table>",
+		"How the servers challenges are checked (default: cookie). \"table\"\n"
+		"   stores them in a table of pending registrations",
+		{ 0, 0 },
+		'\0',
+		1,
+		1
+	},
 	{
 		"cl-hash-size",
 		"<hash_size>",
-		"Hash size used for clients, in bits, up to %d (default: %d)",
-		{ MAX_HASH_SIZE, DEFAULT_CL_HASH_SIZE },
+		"Hash size used for clients, in bits, up to %d\n"
+		"   (default: computed from the maximum number of clients)",
+		{ MAX_CL_HASH_SIZE, 0 },
+		'\0',
+		1,
+		1
+	},
+	{
+		"egress-limit",
+		"<bytes_per_sec> [<dest_bytes_per_sec>]",
+		"Limit the outgoing traffic, globally and per destination (default for\n"
+		"   the latter: 1/8 of the global limit). The lists are paced, and the\n"
+		"   getinfo and other small replies get sent first. 0 means no limit",
+		{ 0, 0 },
+		'\0',
+		1,
+		2
+	},
+	{
+		"eviction-policy",
+		"<none|quota>",
+		"What happens to a new server when the list is full (default: none).\n"
+		"   \"none\" refuses it, \"quota\" lets it replace the oldest server of\n"
+		"   a game over its quota if its own game is under its quota",
+		{ 0, 0 },
 		'\0',
 		1,
 		1
@@ -73,16 +158,28 @@ static const cmdlineopt_t cmdline_options [] =
 	{
 		"fp-decay-time",
 		"<decay_time>",
-		"Set the decay time of the flood protection, in seconds (default: %d)",
+		"Set the decay time of the flood protection for getservers requests,\n"
+		"   in seconds (default: %d)",
 		{ DEFAULT_FP_DECAY_TIME, 0 },
 		'\0',
 		1,
 		1
 	},
+	{
+		"fp-limits",
+		"<class> <throttle_limit> <decay_time>",
+		"Set the flood protection limits of a message class: getservers,\n"
+		"   heartbeat, inforesponse, getmyaddr, relaysend or other",
+		{ 0, 0 },
+		'\0',
+		3,
+		3
+	},
 	{
 		"fp-throttle",
 		"<throttle_limit>",
-		"Set the throttle limit of the flood protection (default: %d)",
+		"Set the throttle limit of the flood protection for getservers requests\n"
+		"   (default: %d)",
 		{ DEFAULT_FP_THROTTLE, 0 },
 		'\0',
 		1,
@@ -109,6 +206,27 @@ static const cmdlineopt_t cmdline_options [] =
 		2,
 		UINT_MAX
 	},
+	{
+		"geoip-benchmark",
+		"[<nb_lookups>]",
+		"Measure the speed of the GeoIP lookups, then exit. The GeoIP file\n"
+		"   must be given too (default number of lookups: %d)",
+		{ DEFAULT_GEOIP_BENCHMARK_LOOKUPS, 0 },
+		'\0',
+		0,
+		1
+	},
+	{
+		"geoip-file",
+		"<file_path>",
+		"Load the country of each address range from a file, to add it to\n"
+		"   the server infostrings. The file is reloaded when dpmaster receives\n"
+		"   the HUP signal",
+		{ 0, 0 },
+		'\0',
+		1,
+		1
+	},
 	{
 		"help",
 		NULL,
@@ -122,7 +240,6 @@ static const cmdlineopt_t cmdline_options [] =
 		"hash-ports",
 		NULL,
 		"Use both an host's address and port number when computing its hash value.\n"
-		"   The check for a maximum number of servers per address won't work correctly.\n"
 		"   FOR DEBUGGING PURPOSES ONLY!",
 		{ 0, 0 },
 		'\0',
@@ -138,6 +255,16 @@ static const cmdlineopt_t cmdline_options [] =
 		1,
 		1
 	},
+	{
+		"heavy-hitters",
+		"<nb_sources>",
+		"Number of addresses and prefixes tracked by the heavy-hitter detection,\n"
+		"   up to %d, 0 to disable it (default: %d)",
+		{ MAX_HIT_NB_SOURCES, DEFAULT_HIT_NB_SOURCES },
+		'\0',
+		1,
+		1
+	},
 	{
 		"listen",
 		"<address>",
@@ -179,8 +306,18 @@ static const cmdlineopt_t cmdline_options [] =
 	{
 		"max-clients",
 		"<max_clients>",
-		"Maximum number of clients recorded (default: %d)",
-		{ DEFAULT_MAX_NB_CLIENTS, 0 },
+		"Maximum number of clients recorded, up to %d (default: %d)",
+		{ MAX_NB_CLIENTS, DEFAULT_MAX_NB_CLIENTS },
+		'\0',
+		1,
+		1
+	},
+	{
+		"max-pending",
+		"<max_pending>",
+		"Maximum number of pending registrations, up to %d (default: %d)\n"
+		"   Only used by the \"table\" challenge mode",
+		{ MAX_NB_PENDING, DEFAULT_MAX_NB_PENDING },
 		'\0',
 		1,
 		1
@@ -204,6 +341,16 @@ static const cmdlineopt_t cmdline_options [] =
 		1,
 		1
 	},
+	{
+		"overload-shedding",
+		NULL,
+		"When the master is overloaded, answer the server list requests\n"
+		"   from a cache only, or drop them if the overload persists",
+		{ 0, 0 },
+		'\0',
+		0,
+		0
+	},
 	{
 		"port",
 		"<port_num>",
@@ -213,6 +360,47 @@ static const cmdlineopt_t cmdline_options [] =
 		1,
 		1
 	},
+	{
+		"recorder-file",
+		"<file_path>",
+		"Dump the flight recorder events to <file_path> (default: stderr,\n"
+		"   or " DEFAULT_REC_DAEMON_FILE " when running as a daemon)",
+		{ 0, 0 },
+		'\0',
+		1,
+		1
+	},
+	{
+		"recorder-size",
+		"<nb_events>",
+		"Number of events kept by the flight recorder, up to %d (default: %d)\n"
+		"   0 disables the flight recorder",
+		{ MAX_REC_NB_EVENTS, DEFAULT_REC_NB_EVENTS },
+		'\0',
+		1,
+		1
+	},
+	{
+		"reflection-limit",
+		"<max_bytes>",
+		"Maximum size of a getservers response sent to a client which hasn't\n"
+		"   echoed a token, from %d to %d bytes (default: 0, no limit)",
+		{ MIN_REFLECTION_LIMIT, MAX_PACKET_SIZE_OUT },
+		'\0',
+		1,
+		1
+	},
+	{
+		"revalidation",
+		"<period>",
+		"Send a getinfo message to every registered server once per period,\n"
+		"   from %d to %d seconds, and remove those which stop answering\n"
+		"   (default: 0, only heartbeats trigger a getinfo)",
+		{ REV_MIN_PERIOD, REV_MAX_PERIOD },
+		'\0',
+		1,
+		1
+	},
 	{
 		"verbose",
 		"[verbose_lvl]",
@@ -288,6 +476,26 @@ static qboolean UnsecureInit (void)
 	if (! Sys_ResolveListenAddresses ())
 		return false;
 
+	// Start the flight recorder (its file must be opened before chroot)
+	if (! Rec_Init ())
+		return false;
+
+	// Load the ACL file, while its path is still reachable
+	if (! Acl_Init ())
+		return false;
+
+	// Load the GeoIP file, while its path is still reachable
+	if (! Geo_Init ())
+		return false;
+
+	// Generate the secret of the challenges, while /dev/urandom is still reachable
+	if (! Cookie_Init ())
+		return false;
+
+	// Create the admin socket, while its path is still reachable
+	if (! Adm_Init ())
+		return false;
+
 	return true;
 }
 
@@ -328,10 +536,48 @@ static cmdline_status_t Cmdline_Option (const cmdlineopt_t* opt, const char** pa
 	
 	opt_name = opt->long_name;
 
+	// ACL file
+	if (strcmp (opt_name, "acl-file") == 0)
+	{
+		if (! Acl_SetFilePath (params[0]))
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+	}
+
 	// Are servers on loopback interfaces allowed?
-	if (strcmp (opt_name, "allow-loopback") == 0)
+	else if (strcmp (opt_name, "allow-loopback") == 0)
 		allow_loopback = true;
 
+	// Automatic bans
+	else if (strcmp (opt_name, "auto-ban") == 0)
+	{
+		const char* start_ptr;
+		char* end_ptr;
+		unsigned int max_packets, ban_duration, max_prefix_packets;
+
+		start_ptr = params[0];
+		max_packets = (unsigned int)strtol (start_ptr, &end_ptr, 0);
+		if (end_ptr == start_ptr || *end_ptr != '\0')
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+
+		start_ptr = params[1];
+		ban_duration = (unsigned int)strtol (start_ptr, &end_ptr, 0);
+		if (end_ptr == start_ptr || *end_ptr != '\0')
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+
+		if (nb_params == 3)
+		{
+			start_ptr = params[2];
+			max_prefix_packets = (unsigned int)strtol (start_ptr, &end_ptr, 0);
+			if (end_ptr == start_ptr || *end_ptr != '\0')
+				return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+		}
+		else
+			max_prefix_packets = max_packets * 4;
+
+		if (! Hit_SetAutoBan (max_packets, max_prefix_packets, ban_duration))
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+	}
+
 	// Flood protection
 	else if (strcmp (opt_name, "flood-protection") == 0)
 		flood_protection = true;
@@ -348,7 +594,7 @@ static cmdline_status_t Cmdline_Option (const cmdlineopt_t* opt, const char** pa
 		if (end_ptr == start_ptr || *end_ptr != '\0')
 			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
 
-		if (! Cl_SetFPDecayTime (decay_time))
+		if (! Cl_SetFPDecayTime (FP_CLASS_GETSERVERS, decay_time))
 			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
 	}
 
@@ -364,7 +610,45 @@ static cmdline_status_t Cmdline_Option (const cmdlineopt_t* opt, const char** pa
 		if (end_ptr == start_ptr || *end_ptr != '\0')
 			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
 
-		if (! Cl_SetFPThrottle (throttle))
+		if (! Cl_SetFPThrottle (FP_CLASS_GETSERVERS, throttle))
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+	}
+
+	// Flood protection limits of a message class
+	else if (strcmp (opt_name, "fp-limits") == 0)
+	{
+		fp_class_t msg_class;
+		const char* start_ptr;
+		char* end_ptr;
+		unsigned int throttle, decay_time;
+
+		msg_class = Cl_GetFPClassByName (params[0]);
+		if (msg_class == NB_FP_CLASSES)
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+
+		start_ptr = params[1];
+		throttle = (unsigned int)strtol (start_ptr, &end_ptr, 0);
+		if (end_ptr == start_ptr || *end_ptr != '\0')
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+
+		start_ptr = params[2];
+		decay_time = (unsigned int)strtol (start_ptr, &end_ptr, 0);
+		if (end_ptr == start_ptr || *end_ptr != '\0')
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+
+		if (! Cl_SetFPThrottle (msg_class, throttle) ||
+			! Cl_SetFPDecayTime (msg_class, decay_time))
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+	}
+
+	// Challenge mode
+	else if (strcmp (opt_name, "challenge-mode") == 0)
+	{
+		if (strcmp (params[0], "cookie") == 0)
+			challenge_mode = CHALLENGE_MODE_COOKIE;
+		else if (strcmp (params[0], "table") == 0)
+			challenge_mode = CHALLENGE_MODE_TABLE;
+		else
 			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
 	}
 
@@ -384,6 +668,47 @@ static cmdline_status_t Cmdline_Option (const cmdlineopt_t* opt, const char** pa
 			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
 	}
 
+	// Egress limits
+	else if (strcmp (opt_name, "egress-limit") == 0)
+	{
+		const char* start_ptr;
+		char* end_ptr;
+		unsigned int rate, dest_rate;
+
+		start_ptr = params[0];
+		rate = (unsigned int)strtol (start_ptr, &end_ptr, 0);
+		if (end_ptr == start_ptr || *end_ptr != '\0')
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+
+		if (nb_params == 2)
+		{
+			start_ptr = params[1];
+			dest_rate = (unsigned int)strtol (start_ptr, &end_ptr, 0);
+			if (end_ptr == start_ptr || *end_ptr != '\0')
+				return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+		}
+		else
+		{
+			dest_rate = rate / 8;
+			if (dest_rate != 0 && dest_rate < MIN_EGRESS_RATE)
+				dest_rate = MIN_EGRESS_RATE;
+		}
+
+		if (! Egr_SetRates (rate, dest_rate))
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+	}
+
+	// Eviction policy
+	else if (strcmp (opt_name, "eviction-policy") == 0)
+	{
+		if (strcmp (params[0], "none") == 0)
+			eviction_policy = EVICTION_POLICY_NONE;
+		else if (strcmp (params[0], "quota") == 0)
+			eviction_policy = EVICTION_POLICY_QUOTA;
+		else
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+	}
+
 	// Game properties
 	else if (strcmp (opt_name, "game-properties") == 0)
 	{
@@ -399,6 +724,30 @@ static cmdline_status_t Cmdline_Option (const cmdlineopt_t* opt, const char** pa
 	else if (strcmp (opt_name, "game-policy") == 0)
 		return Game_DeclarePolicy (params[0], &params[1], nb_params - 1);
 
+	// GeoIP benchmark
+	else if (strcmp (opt_name, "geoip-benchmark") == 0)
+	{
+		if (nb_params > 0)
+		{
+			const char* start_ptr;
+			char* end_ptr;
+
+			start_ptr = params[0];
+			geoip_benchmark_lookups = (unsigned int)strtol (start_ptr, &end_ptr, 0);
+			if (end_ptr == start_ptr || *end_ptr != '\0' || geoip_benchmark_lookups == 0)
+				return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+		}
+		else
+			geoip_benchmark_lookups = DEFAULT_GEOIP_BENCHMARK_LOOKUPS;
+	}
+
+	// GeoIP file
+	else if (strcmp (opt_name, "geoip-file") == 0)
+	{
+		if (! Geo_SetFilePath (params[0]))
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+	}
+
 	// Help
 	else if (strcmp (opt_name, "help") == 0)
 		return CMDLINE_STATUS_SHOW_HELP;
@@ -423,6 +772,22 @@ static cmdline_status_t Cmdline_Option (const cmdlineopt_t* opt, const char** pa
 			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
 	}
 
+	// Number of sources tracked by the heavy-hitter detection
+	else if (strcmp (opt_name, "heavy-hitters") == 0)
+	{
+		const char* start_ptr;
+		char* end_ptr;
+		unsigned int nb_sources;
+
+		start_ptr = params[0];
+		nb_sources = (unsigned int)strtol (start_ptr, &end_ptr, 0);
+		if (end_ptr == start_ptr || *end_ptr != '\0')
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+
+		if (! Hit_SetNbSources (nb_sources))
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+	}
+
 	// Listen address
 	else if (strcmp (opt_name, "listen") == 0)
 	{
@@ -470,6 +835,22 @@ static cmdline_status_t Cmdline_Option (const cmdlineopt_t* opt, const char** pa
 			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
 	}
 
+	// Maximum number of pending registrations
+	else if (strcmp (opt_name, "max-pending") == 0)
+	{
+		const char* start_ptr;
+		char* end_ptr;
+		unsigned int max_nb_pending;
+
+		start_ptr = params[0];
+		max_nb_pending = (unsigned int)strtol (start_ptr, &end_ptr, 0);
+		if (end_ptr == start_ptr || *end_ptr != '\0')
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+
+		if (! Sv_SetMaxNbPending (max_nb_pending))
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+	}
+
 	// Maximum number of servers
 	else if (strcmp (opt_name, "max-servers") == 0)
 	{
@@ -502,6 +883,10 @@ static cmdline_status_t Cmdline_Option (const cmdlineopt_t* opt, const char** pa
 			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
 	}
 
+	// Load shedding when overloaded
+	else if (strcmp (opt_name, "overload-shedding") == 0)
+		overload_shedding = true;
+
 	// Port number
 	else if (strcmp (opt_name, "port") == 0)
 	{
@@ -517,6 +902,63 @@ static cmdline_status_t Cmdline_Option (const cmdlineopt_t* opt, const char** pa
 		master_port = port_num;
 	}
 
+	// Flight recorder file
+	else if (strcmp (opt_name, "recorder-file") == 0)
+	{
+		if (! Rec_SetDumpFilePath (params[0]))
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+	}
+
+	// Flight recorder size
+	else if (strcmp (opt_name, "recorder-size") == 0)
+	{
+		const char* start_ptr;
+		char* end_ptr;
+		unsigned int nb_events;
+
+		start_ptr = params[0];
+		nb_events = (unsigned int)strtol (start_ptr, &end_ptr, 0);
+		if (end_ptr == start_ptr || *end_ptr != '\0')
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+
+		if (! Rec_SetNbEvents (nb_events))
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+	}
+
+	// Reflection limit
+	else if (strcmp (opt_name, "reflection-limit") == 0)
+	{
+		const char* start_ptr;
+		char* end_ptr;
+		unsigned int max_bytes;
+
+		start_ptr = params[0];
+		max_bytes = (unsigned int)strtol (start_ptr, &end_ptr, 0);
+		if (end_ptr == start_ptr || *end_ptr != '\0')
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+
+		if (max_bytes != 0 &&
+			(max_bytes < MIN_REFLECTION_LIMIT || max_bytes > MAX_PACKET_SIZE_OUT))
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+		reflection_limit = max_bytes;
+	}
+
+	// Revalidation period
+	else if (strcmp (opt_name, "revalidation") == 0)
+	{
+		const char* start_ptr;
+		char* end_ptr;
+		unsigned int period;
+
+		start_ptr = params[0];
+		period = (unsigned int)strtol (start_ptr, &end_ptr, 0);
+		if (end_ptr == start_ptr || *end_ptr != '\0')
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+
+		if (! Rev_SetPeriod (period))
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+	}
+
 	// Verbose level
 	else if (strcmp (opt_name, "verbose") == 0)
 	{
@@ -911,6 +1353,25 @@ static qboolean SecureInit (void)
 		return false;
 	}
 #endif
+#ifdef SIGHUP
+	if (signal (SIGHUP, Com_SignalHandler) == SIG_ERR)
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: can't capture the SIGHUP signal\n");
+		return false;
+	}
+#endif
+#ifdef SIGQUIT
+	if (signal (SIGQUIT, Com_SignalHandler) == SIG_ERR)
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: can't capture the SIGQUIT signal\n");
+		return false;
+	}
+#endif
+	if (signal (SIGABRT, Com_SignalHandler) == SIG_ERR)
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: can't capture the SIGABRT signal\n");
+		return false;
+	}
 
 	if (! Sys_CreateListenSockets ())
 		return false;
@@ -930,10 +1391,194 @@ static qboolean SecureInit (void)
 	if (! Cl_Init ())
 		return false;
 
+	// Initialize the heavy-hitter detection
+	if (! Hit_Init ())
+		return false;
+
+	// Initialize the egress queue
+	if (! Egr_Init ())
+		return false;
+
 	return true;
 }
 
 
+/*
+====================
+SetPeerAddress
+
+Rebuild the peer address string, if we may print something
+====================
+*/
+static void SetPeerAddress (const struct sockaddr_storage* address, socklen_t addrlen)
+{
+	if (max_msg_level > MSG_NOPRINT &&
+		(Com_IsLogEnabled() || daemon_state < DAEMON_STATE_EFFECTIVE))
+	{
+		strncpy (peer_address, Sys_SockaddrToString(address, addrlen),
+				 sizeof (peer_address));
+		peer_address[sizeof (peer_address) - 1] = '\0';
+	}
+}
+
+
+/*
+====================
+ReceivePackets
+
+Read up to "max_nb_packets" packets from a socket, and add the valid ones
+to the batch. Returns the number of packets read, valid or not. The packets
+are checked on their raw address, which is only converted to a string for
+the packets added to the batch (or for printing a warning)
+====================
+*/
+static unsigned int ReceivePackets (socket_t sock, unsigned int max_nb_packets)
+{
+	unsigned int nb_read;
+
+	for (nb_read = 0; nb_read < max_nb_packets; nb_read++)
+	{
+		received_packet_t* packet = &batch[nb_batch_packets];
+		int flags = 0;
+		int nb_bytes;
+
+		// The first read can't block since select() said there's something
+		// to read. Without MSG_DONTWAIT, we can only read one packet per socket
+		if (nb_read > 0)
+		{
+#ifdef MSG_DONTWAIT
+			flags = MSG_DONTWAIT;
+#else
+			break;
+#endif
+		}
+
+		// Get the next message
+		packet->addrlen = sizeof (packet->address);
+		nb_bytes = recvfrom (sock, packet->data, sizeof (packet->data) - 1, flags,
+							 (struct sockaddr*)&packet->address, &packet->addrlen);
+
+		if (nb_bytes <= 0)
+		{
+			if (nb_bytes < 0 && nb_read > 0 && Sys_GetLastNetError () == NETERR_WOULDBLOCK)
+				break;
+			Com_Printf (MSG_WARNING,
+						"> WARNING: \"recvfrom\" returned %d\n", nb_bytes);
+			continue;
+		}
+		PROBE3 (packet__receive, &packet->address, nb_bytes, (int)sock);
+
+		// We print the packet contents if necessary
+		if (max_msg_level >= MSG_DEBUG)
+		{
+			SetPeerAddress (&packet->address, packet->addrlen);
+			Com_Printf (MSG_DEBUG, "> New packet received from %s: ",
+						peer_address);
+			PrintPacket ((qbyte*)packet->data, nb_bytes);
+		}
+
+		// A few sanity checks
+		if (packet->address.ss_family != AF_INET && packet->address.ss_family != AF_INET6)
+		{
+			Com_Printf (MSG_WARNING,
+						"> WARNING: rejected packet (invalid address family: %hd)\n",
+						packet->address.ss_family);
+			Rec_Record (REC_EVENT_PACKET_REJECTED, REC_REASON_ADDRESS_FAMILY, NULL,
+						packet->data, nb_bytes);
+			continue;
+		}
+		if (Acl_IsDenied (&packet->address))
+		{
+			Com_Printf (MSG_DEBUG, "> Packet from %s denied by the ACL\n",
+						peer_address);
+			Rec_Record (REC_EVENT_PACKET_REJECTED, REC_REASON_ACL, &packet->address,
+						packet->data, nb_bytes);
+			continue;
+		}
+		if (Sys_GetSockaddrPort(&packet->address) == 0)
+		{
+			SetPeerAddress (&packet->address, packet->addrlen);
+			Com_Printf (MSG_WARNING,
+						"> WARNING: rejected packet from %s (source port = 0)\n",
+						peer_address);
+			Rec_Record (REC_EVENT_PACKET_REJECTED, REC_REASON_SOURCE_PORT, &packet->address,
+						packet->data, nb_bytes);
+			continue;
+		}
+		if (nb_bytes < MIN_PACKET_SIZE_IN)
+		{
+			SetPeerAddress (&packet->address, packet->addrlen);
+			Com_Printf (MSG_WARNING,
+						"> WARNING: rejected packet from %s (size = %d bytes)\n",
+						peer_address, nb_bytes);
+			Rec_Record (REC_EVENT_PACKET_REJECTED, REC_REASON_SIZE, &packet->address,
+						packet->data, nb_bytes);
+			continue;
+		}
+		if (packet->data[0] != '\xFF' || packet->data[1] != '\xFF' ||
+			packet->data[2] != '\xFF' || packet->data[3] != '\xFF')
+		{
+			SetPeerAddress (&packet->address, packet->addrlen);
+			Com_Printf (MSG_WARNING,
+						"> WARNING: rejected packet from %s (invalid header)\n",
+						peer_address);
+			Rec_Record (REC_EVENT_PACKET_REJECTED, REC_REASON_HEADER, &packet->address,
+						packet->data, nb_bytes);
+			continue;
+		}
+
+		// Append a '\0' to make the parsing easier
+		packet->data[nb_bytes] = '\0';
+
+		// When overloaded, drop the server list requests before even parsing them
+		if (Ovl_GetLevel () == OVERLOAD_DROP && IsGetServersMessage (packet->data + 4))
+		{
+			Com_Printf (MSG_DEBUG, "> getservers request from %s dropped (overload)\n",
+						peer_address);
+			Ovl_RecordShed (OVL_SHED_DROPPED);
+			continue;
+		}
+
+		Rec_Record (REC_EVENT_PACKET_IN, REC_REASON_NONE, &packet->address,
+					packet->data, nb_bytes);
+
+		// Build the address string once and for all, for the handling of the packet
+		if (max_msg_level < MSG_DEBUG)
+			SetPeerAddress (&packet->address, packet->addrlen);
+		memcpy (packet->peer_address, peer_address, sizeof (packet->peer_address));
+
+		packet->length = nb_bytes;
+		packet->socket = sock;
+		nb_batch_packets++;
+	}
+
+	return nb_read;
+}
+
+
+/*
+====================
+RevalidateServers
+
+Send a getinfo message to the servers due for a revalidation
+====================
+*/
+static void RevalidateServers (void)
+{
+	server_t* due_servers [REV_BATCH_SIZE];
+	unsigned int nb_due, ind;
+
+	nb_due = Rev_GetDueServers (due_servers, REV_BATCH_SIZE);
+	for (ind = 0; ind < nb_due; ind++)
+	{
+		server_t* server = due_servers[ind];
+
+		SetPeerAddress (&server->user.address, server->user.addrlen);
+		ProbeServer (server);
+	}
+}
+
+
 /*
 ====================
 main
@@ -982,6 +1627,11 @@ int main (int argc, const char* argv [])
 	crt_time = time (NULL);
 	print_date = true;
 
+	// Benchmark the GeoIP lookups instead of running, if asked to
+	if (geoip_benchmark_lookups > 0)
+		return ((Geo_Init () && Geo_Benchmark (geoip_benchmark_lookups)) ?
+				EXIT_SUCCESS : EXIT_FAILURE);
+
 	// Initializations
 	if (! Sys_UnsecureInit () || ! UnsecureInit () ||
 		! Sys_SecurityInit () ||
@@ -991,12 +1641,18 @@ int main (int argc, const char* argv [])
 	// Until the end of times...
 	for (;;)
 	{
-		fd_set sock_set;
+		fd_set sock_set, write_set;
 		socket_t max_sock;
 		size_t sock_ind;
 		int nb_sock_ready;
+		struct timeval timeout;
+		struct timeval* timeout_ptr = NULL;
+		qu64 flush_delay, revalidation_delay, batch_start;
+		unsigned int nb_read, packet_ind, pass;
+		qboolean batch_full, must_wake_up;
 
 		FD_ZERO(&sock_set);
+		FD_ZERO(&write_set);
 		max_sock = INVALID_SOCKET;
 		for (sock_ind = 0; sock_ind < nb_sockets; sock_ind++)
 		{
@@ -1006,6 +1662,7 @@ int main (int argc, const char* argv [])
 			if (max_sock == INVALID_SOCKET || max_sock < crt_sock)
 				max_sock = crt_sock;
 		}
+		Adm_SetSelectSockets (&sock_set, &write_set, &max_sock);
 
 		// Flush the console and log file
 		if (Com_IsLogEnabled ())
@@ -1013,104 +1670,97 @@ int main (int argc, const char* argv [])
 		if (daemon_state < DAEMON_STATE_EFFECTIVE)
 			fflush (stdout);
 
-		nb_sock_ready = select ((int)(max_sock + 1), &sock_set, NULL, NULL, NULL);
+		// Wake up in time for the packets waiting in the egress queue, if
+		// any, and for the next servers to revalidate
+		must_wake_up = Egr_GetFlushDelay (&flush_delay);
+		if (Rev_GetDelay (&revalidation_delay) &&
+			(! must_wake_up || revalidation_delay < flush_delay))
+		{
+			flush_delay = revalidation_delay;
+			must_wake_up = true;
+		}
+		if (must_wake_up)
+		{
+			timeout.tv_sec = (long)(flush_delay / 1000000);
+			timeout.tv_usec = (long)(flush_delay % 1000000);
+			timeout_ptr = &timeout;
+		}
+
+		nb_sock_ready = select ((int)(max_sock + 1), &sock_set, &write_set, NULL, timeout_ptr);
 
 		// Update the current time
 		crt_time = time (NULL);
 
 		print_date = false;
 		Com_UpdateLogStatus (false);
+		Rec_Update ();
+		Acl_Update ();
+		Geo_Update ();
+		RevalidateServers ();
+		Egr_Flush ();
 
 		// Print the date once per select()
 		print_date = true;
 
 		if (nb_sock_ready <= 0)
 		{
-			if (Sys_GetLastNetError() != NETERR_INTR)
+			if (nb_sock_ready < 0 && Sys_GetLastNetError() != NETERR_INTR)
 				Com_Printf (MSG_WARNING,
 							"> WARNING: \"select\" returned %d\n",
 							nb_sock_ready);
 			continue;
 		}
 
+		// Serve the admin connections first, they don't take long
+		Adm_HandleSelectSockets (&sock_set, &write_set);
+
+		// Read a batch of packets from the sockets
+		batch_start = Sys_GetMonotonicTime ();
+		nb_batch_packets = 0;
+		nb_read = 0;
+		batch_full = false;
 		for (sock_ind = 0;
 			 sock_ind < nb_sockets && nb_sock_ready > 0;
 			 sock_ind++)
 		{
-			struct sockaddr_storage address;
-			socklen_t addrlen;
-			int nb_bytes;
-			char packet [MAX_PACKET_SIZE_IN + 1];  // "+ 1" because we append a '\0'
 			socket_t crt_sock = listen_sockets[sock_ind].socket;
+			unsigned int max_nb_packets = MAX_BATCH_SIZE / nb_sockets;
+			unsigned int nb_sock_read;
 
 			if (! FD_ISSET (crt_sock, &sock_set))
 				continue;
 			nb_sock_ready--;
 
-			// Get the next valid message
-			addrlen = sizeof (address);
-			nb_bytes = recvfrom (crt_sock, packet, sizeof (packet) - 1, 0,
-								 (struct sockaddr*)&address, &addrlen);
+			nb_sock_read = ReceivePackets (crt_sock, max_nb_packets);
+			nb_read += nb_sock_read;
+			if (nb_sock_read >= max_nb_packets)
+				batch_full = true;
+		}
 
-			if (nb_bytes <= 0)
+		// Handle the servers' messages first, so the registrations
+		// can't be delayed by a flood of client queries
+		for (pass = 0; pass < 2; pass++)
+		{
+			for (packet_ind = 0; packet_ind < nb_batch_packets; packet_ind++)
 			{
-				Com_Printf (MSG_WARNING,
-							"> WARNING: \"recvfrom\" returned %d\n", nb_bytes);
-				continue;
-			}
+				received_packet_t* packet = &batch[packet_ind];
+				const char* msg = packet->data + 4;
 
-			// If we may print something, rebuild the peer address string
-			if (max_msg_level > MSG_NOPRINT &&
-				(Com_IsLogEnabled() || daemon_state < DAEMON_STATE_EFFECTIVE))
-			{
-				strncpy (peer_address, Sys_SockaddrToString(&address, addrlen),
-						 sizeof (peer_address));
-				peer_address[sizeof (peer_address) - 1] = '\0';
-			}
+				if (IsServerMessage (msg) != (pass == 0))
+					continue;
 
-			// We print the packet contents if necessary
-			if (max_msg_level >= MSG_DEBUG)
-			{
-				Com_Printf (MSG_DEBUG, "> New packet received from %s: ",
-							peer_address);
-				PrintPacket ((qbyte*)packet, nb_bytes);
-			}
+				memcpy (peer_address, packet->peer_address, sizeof (peer_address));
 
-			// A few sanity checks
-			if (address.ss_family != AF_INET && address.ss_family != AF_INET6)
-			{
-				Com_Printf (MSG_WARNING,
-							"> WARNING: rejected packet from %s (invalid address family: %hd)\n",
-							peer_address, address.ss_family);
-				continue;
-			}
-			if (Sys_GetSockaddrPort(&address) == 0)
-			{
-				Com_Printf (MSG_WARNING,
-							"> WARNING: rejected packet from %s (source port = 0)\n",
-							peer_address);
-				continue;
-			}
-			if (nb_bytes < MIN_PACKET_SIZE_IN)
-			{
-				Com_Printf (MSG_WARNING,
-							"> WARNING: rejected packet from %s (size = %d bytes)\n",
-							peer_address, nb_bytes);
-				continue;
-			}
-			if (packet[0] != '\xFF' || packet[1] != '\xFF' || packet[2] != '\xFF' || packet[3] != '\xFF')
-			{
-				Com_Printf (MSG_WARNING,
-							"> WARNING: rejected packet from %s (invalid header)\n",
-							peer_address);
-				continue;
+				// Call HandleMessage with the remaining contents
+				HandleMessage (msg, packet->length - 4, &packet->address,
+							   packet->addrlen, packet->socket);
 			}
 
-			// Append a '\0' to make the parsing easier
-			packet[nb_bytes] = '\0';
-
-			// Call HandleMessage with the remaining contents
-			HandleMessage (packet + 4, nb_bytes - 4, &address, addrlen, crt_sock);
+			// Challenge the new servers before handling the client requests
+			if (pass == 0)
+				FlushGetInfos ();
 		}
+
+		Ovl_RecordBatch (nb_read, batch_full, Sys_GetMonotonicTime () - batch_start);
 	}
 }
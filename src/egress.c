@@ -0,0 +1,602 @@
+/*
+	egress.c
+
+	Outgoing bandwidth shaping for dpmaster
+
+	Copyright (C) 2011  Mathieu Olivier
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include "common.h"
+#include "system.h"
+#include "egress.h"
+#include "messages.h"
+#include "recorder.h"
+
+
+// ---------- Private constants ---------- //
+
+// Index marking the end of a packet list
+#define NO_PACKET ((unsigned int)-1)
+
+
+// ---------- Private types ---------- //
+
+// A packet waiting in the queue
+typedef struct
+{
+	qu64 release_time;	// when its destination's rate allows it
+	qu64 queue_time;
+	struct sockaddr_storage address;
+	socklen_t addrlen;
+	socket_t socket;
+	unsigned int next;
+	unsigned int length;
+	qbyte data [MAX_PACKET_SIZE_OUT];
+} queued_packet_t;
+
+// The rate of a destination
+typedef struct
+{
+	qu64 key;
+	qu64 tat;
+	int family;
+} dest_t;
+
+// Per-class statistics
+typedef struct
+{
+	qu64 nb_sent;
+	qu64 nb_delayed;
+	qu64 nb_dropped;
+	qu64 nb_bytes;
+	qu64 max_delay;
+} egress_stats_t;
+
+
+// ---------- Private variables ---------- //
+
+static qboolean initialized = false;
+
+// Rates, in bytes per second (0 means no limit)
+static unsigned int egress_rate = 0;
+static unsigned int dest_rate = 0;
+
+// Like the flood protection, the rates are enforced using token buckets
+// stored as "theoretical arrival times" (TAT), in microseconds. Sending a
+// packet moves the TAT forward by the time it takes to send it at the given
+// rate, and the packet is allowed if it doesn't make the TAT go further
+// ahead of the current time than the burst allowance
+static qu64 global_tat = 0;
+static qu64 global_burst = 0;
+static qu64 dest_burst = 0;
+static dest_t* dests = NULL;
+
+// The packet queue: a pool of packets, with a FIFO list per class
+static queued_packet_t* queue = NULL;
+static unsigned int free_head = NO_PACKET;
+static unsigned int nb_free = 0;
+static unsigned int class_heads [NB_EGRESS_CLASSES];
+static unsigned int class_tails [NB_EGRESS_CLASSES];
+
+// Reason of the last failure of Egr_Send (NULL if it's a network error)
+static const char* last_error = NULL;
+
+static egress_stats_t egress_stats [NB_EGRESS_CLASSES];
+static const char* class_names [NB_EGRESS_CLASSES] =
+{
+	"control",
+	"list",
+	"bulk",
+};
+
+
+// ---------- Private functions ---------- //
+
+/*
+====================
+Egr_GetCost
+
+Return how long it takes to send some bytes at a given rate, in microseconds
+====================
+*/
+static qu64 Egr_GetCost (size_t length, unsigned int rate)
+{
+	return (qu64)length * 1000000 / rate;
+}
+
+
+/*
+====================
+Egr_GetGlobalReadyTime
+
+Return the time at which the global rate will allow a packet
+====================
+*/
+static qu64 Egr_GetGlobalReadyTime (size_t length)
+{
+	qu64 cost;
+
+	if (egress_rate == 0)
+		return 0;
+
+	cost = Egr_GetCost (length, egress_rate);
+	if (global_tat + cost <= global_burst)
+		return 0;
+	return global_tat + cost - global_burst;
+}
+
+
+/*
+====================
+Egr_GetDest
+
+Return the rate entry of a destination
+====================
+*/
+static dest_t* Egr_GetDest (const struct sockaddr_storage* addr, qu64* key)
+{
+	unsigned int hash;
+
+	*key = Com_AddressKey (addr);
+	hash = (unsigned int)(((*key + addr->ss_family) * 0x9E3779B97F4A7C15ULL) >> 52);
+	assert (hash < EGRESS_NB_DESTS);
+	return &dests[hash];
+}
+
+
+/*
+====================
+Egr_ScheduleDest
+
+Return the time at which the destination's rate allows a packet to be sent,
+and the destination's TAT once the packet is sent. The TAT itself isn't
+updated, since the packet may still be dropped (see Egr_UpdateDest)
+====================
+*/
+static qu64 Egr_ScheduleDest (const struct sockaddr_storage* addr, size_t length, qu64 now, qu64* new_tat)
+{
+	qu64 key, tat;
+	const dest_t* dest;
+
+	if (dest_rate == 0)
+	{
+		*new_tat = now;
+		return now;
+	}
+
+	// If another destination is using this entry, ours has no history
+	dest = Egr_GetDest (addr, &key);
+	if (dest->key == key && dest->family == addr->ss_family && dest->tat > now)
+		tat = dest->tat;
+	else
+		tat = now;
+	*new_tat = tat + Egr_GetCost (length, dest_rate);
+
+	if (*new_tat - now <= dest_burst)
+		return now;
+	return *new_tat - dest_burst;
+}
+
+
+/*
+====================
+Egr_UpdateDest
+
+Account for a packet sent or queued for a destination
+====================
+*/
+static void Egr_UpdateDest (const struct sockaddr_storage* addr, qu64 new_tat)
+{
+	qu64 key;
+	dest_t* dest;
+
+	if (dest_rate == 0)
+		return;
+
+	// If another destination was using this entry, it's ours now
+	dest = Egr_GetDest (addr, &key);
+	dest->key = key;
+	dest->family = addr->ss_family;
+	dest->tat = new_tat;
+}
+
+
+/*
+====================
+Egr_SendPacket
+
+Send a packet, and account for it
+====================
+*/
+static qboolean Egr_SendPacket (socket_t sock, const void* data, size_t length,
+								const struct sockaddr_storage* addr, socklen_t addrlen,
+								egress_class_t egress_class, qu64 now)
+{
+	if (egress_rate != 0)
+	{
+		qu64 tat = (global_tat > now ? global_tat : now);
+		global_tat = tat + Egr_GetCost (length, egress_rate);
+	}
+
+	if (sendto (sock, data, length, 0, (const struct sockaddr*)addr, addrlen) < 0)
+	{
+		last_error = NULL;
+		return false;
+	}
+
+	egress_stats[egress_class].nb_sent++;
+	egress_stats[egress_class].nb_bytes += length;
+	return true;
+}
+
+
+// ---------- Public functions ---------- //
+
+/*
+====================
+Egr_SetRates
+
+Set the global and per-destination rates, in bytes per second
+====================
+*/
+qboolean Egr_SetRates (unsigned int rate, unsigned int per_dest_rate)
+{
+	if (initialized ||
+		(rate != 0 && rate < MIN_EGRESS_RATE) ||
+		(per_dest_rate != 0 && per_dest_rate < MIN_EGRESS_RATE))
+		return false;
+
+	egress_rate = rate;
+	dest_rate = per_dest_rate;
+	return true;
+}
+
+
+/*
+====================
+Egr_Init
+
+Allocate the packet queue, if the shaping is enabled
+====================
+*/
+qboolean Egr_Init (void)
+{
+	unsigned int ind;
+
+	initialized = true;
+	if (egress_rate == 0 && dest_rate == 0)
+		return true;
+
+	queue = malloc (EGRESS_QUEUE_SIZE * sizeof (queue[0]));
+	if (dest_rate != 0)
+		dests = calloc (EGRESS_NB_DESTS, sizeof (dests[0]));
+	if (queue == NULL || (dest_rate != 0 && dests == NULL))
+	{
+		Com_Printf (MSG_ERROR,
+					"> ERROR: can't allocate the egress queue (%s)\n",
+					strerror (errno));
+		return false;
+	}
+
+	for (ind = 0; ind < EGRESS_QUEUE_SIZE; ind++)
+		queue[ind].next = ind + 1;
+	queue[EGRESS_QUEUE_SIZE - 1].next = NO_PACKET;
+	free_head = 0;
+	nb_free = EGRESS_QUEUE_SIZE;
+	for (ind = 0; ind < NB_EGRESS_CLASSES; ind++)
+	{
+		class_heads[ind] = NO_PACKET;
+		class_tails[ind] = NO_PACKET;
+	}
+
+	// The bursts must at least allow the largest packet, or it would never be sent
+	if (egress_rate != 0)
+	{
+		global_burst = EGRESS_BURST_TIME;
+		if (global_burst < Egr_GetCost (MAX_PACKET_SIZE_OUT, egress_rate))
+			global_burst = Egr_GetCost (MAX_PACKET_SIZE_OUT, egress_rate);
+	}
+	if (dest_rate != 0)
+		dest_burst = Egr_GetCost (EGRESS_DEST_BURST, dest_rate);
+
+	Com_Printf (MSG_NORMAL, "> Egress shaping enabled (%u bytes/s, %u bytes/s per destination, 0 meaning no limit)\n",
+				egress_rate, dest_rate);
+	return true;
+}
+
+
+/*
+====================
+Egr_Send
+
+Send a packet, or queue it if the rates don't allow it yet
+====================
+*/
+qboolean Egr_Send (socket_t sock, const void* data, size_t length,
+				   const struct sockaddr_storage* addr, socklen_t addrlen,
+				   egress_class_t egress_class)
+{
+	qu64 now, release_time, dest_tat;
+	queued_packet_t* packet;
+	unsigned int packet_ind, class_ind;
+	qboolean can_send;
+
+	assert (egress_class < NB_EGRESS_CLASSES);
+	assert (length <= MAX_PACKET_SIZE_OUT);
+
+	// No shaping
+	if (queue == NULL)
+	{
+		if (sendto (sock, data, length, 0, (const struct sockaddr*)addr, addrlen) < 0)
+		{
+			last_error = NULL;
+			return false;
+		}
+		return true;
+	}
+
+	now = Sys_GetMonotonicTime ();
+	release_time = Egr_ScheduleDest (addr, length, now, &dest_tat);
+
+	// A destination which gets more than its rate allows (a flood victim, for
+	// instance) can't hold the queue: past a few seconds, its packets are dropped
+	if (release_time - now > EGRESS_MAX_DEST_DELAY)
+	{
+		egress_stats[egress_class].nb_dropped++;
+		last_error = "destination rate exceeded";
+		return false;
+	}
+
+	// Send it right away if the rates allow it and if no packet
+	// of the same or of a more urgent class is waiting
+	can_send = (release_time <= now && Egr_GetGlobalReadyTime (length) <= now);
+	for (class_ind = 0; can_send && class_ind <= (unsigned int)egress_class; class_ind++)
+		if (class_heads[class_ind] != NO_PACKET)
+			can_send = false;
+	if (can_send)
+	{
+		if (! Egr_SendPacket (sock, data, length, addr, addrlen, egress_class, now))
+			return false;
+		Egr_UpdateDest (addr, dest_tat);
+		return true;
+	}
+
+	// The last free packets are kept for the control messages
+	if (nb_free == 0 ||
+		(egress_class != EGRESS_CLASS_CONTROL && nb_free <= EGRESS_RESERVED_SIZE))
+	{
+		egress_stats[egress_class].nb_dropped++;
+		last_error = "egress queue full";
+		return false;
+	}
+
+	packet_ind = free_head;
+	packet = &queue[packet_ind];
+	free_head = packet->next;
+	nb_free--;
+
+	packet->release_time = release_time;
+	packet->queue_time = now;
+	memcpy (&packet->address, addr, addrlen);
+	packet->addrlen = addrlen;
+	packet->socket = sock;
+	packet->length = (unsigned int)length;
+	memcpy (packet->data, data, length);
+
+	packet->next = NO_PACKET;
+	if (class_tails[egress_class] != NO_PACKET)
+		queue[class_tails[egress_class]].next = packet_ind;
+	else
+		class_heads[egress_class] = packet_ind;
+	class_tails[egress_class] = packet_ind;
+
+	Egr_UpdateDest (addr, dest_tat);
+	egress_stats[egress_class].nb_delayed++;
+	return true;
+}
+
+
+/*
+====================
+Egr_SendBatch
+
+Send or queue several packets through the same socket. Without shaping,
+they are all given to the system at once
+====================
+*/
+unsigned int Egr_SendBatch (socket_t sock, const outgoing_packet_t* packets, unsigned int nb_packets,
+							egress_class_t egress_class)
+{
+	unsigned int nb_sent;
+
+	if (queue == NULL)
+	{
+		nb_sent = Sys_SendPackets (sock, packets, nb_packets);
+		if (nb_sent < nb_packets)
+			last_error = NULL;
+		return nb_sent;
+	}
+
+	for (nb_sent = 0; nb_sent < nb_packets; nb_sent++)
+	{
+		const outgoing_packet_t* packet = &packets[nb_sent];
+
+		if (! Egr_Send (sock, packet->data, packet->length, packet->address,
+						packet->addrlen, egress_class))
+			break;
+	}
+	return nb_sent;
+}
+
+
+/*
+====================
+Egr_GetLastErrorString
+
+Get the reason of the last failure of Egr_Send
+====================
+*/
+const char* Egr_GetLastErrorString (void)
+{
+	if (last_error != NULL)
+		return last_error;
+	return Sys_GetLastNetErrorString ();
+}
+
+
+/*
+====================
+Egr_Flush
+
+Send the queued packets allowed by the rates, most urgent first. The packets
+of a class are sent in order, except those still held back by the rate of
+their destination, which don't block the others
+====================
+*/
+void Egr_Flush (void)
+{
+	unsigned int class_ind;
+	qu64 now;
+
+	if (queue == NULL || nb_free == EGRESS_QUEUE_SIZE)
+		return;
+
+	now = Sys_GetMonotonicTime ();
+	for (class_ind = 0; class_ind < NB_EGRESS_CLASSES; class_ind++)
+	{
+		unsigned int packet_ind = class_heads[class_ind];
+		unsigned int prev_ind = NO_PACKET;
+
+		while (packet_ind != NO_PACKET)
+		{
+			queued_packet_t* packet = &queue[packet_ind];
+			unsigned int next_ind = packet->next;
+			qu64 delay;
+
+			if (packet->release_time > now)
+			{
+				prev_ind = packet_ind;
+				packet_ind = next_ind;
+				continue;
+			}
+
+			// If the uplink is busy, the other packets will have to wait too
+			if (Egr_GetGlobalReadyTime (packet->length) > now)
+				return;
+
+			if (! Egr_SendPacket (packet->socket, packet->data, packet->length,
+								  &packet->address, packet->addrlen, class_ind, now))
+			{
+				Com_Printf (MSG_WARNING, "> WARNING: can't send a delayed %s packet to %s (%s)\n",
+							class_names[class_ind],
+							Sys_SockaddrToString (&packet->address, packet->addrlen),
+							Sys_GetLastNetErrorString ());
+				Rec_Record (REC_EVENT_SEND_FAILED, REC_REASON_NONE, &packet->address,
+							packet->data, packet->length);
+			}
+
+			delay = now - packet->queue_time;
+			if (delay > egress_stats[class_ind].max_delay)
+				egress_stats[class_ind].max_delay = delay;
+
+			// Unlink the packet and free it
+			if (prev_ind != NO_PACKET)
+				queue[prev_ind].next = next_ind;
+			else
+				class_heads[class_ind] = next_ind;
+			if (class_tails[class_ind] == packet_ind)
+				class_tails[class_ind] = prev_ind;
+			packet->next = free_head;
+			free_head = packet_ind;
+			nb_free++;
+
+			packet_ind = next_ind;
+		}
+	}
+}
+
+
+/*
+====================
+Egr_GetFlushDelay
+
+Get how long we can wait before calling Egr_Flush again, in microseconds
+====================
+*/
+qboolean Egr_GetFlushDelay (qu64* delay)
+{
+	unsigned int class_ind;
+	qu64 now, next_time;
+
+	if (queue == NULL || nb_free == EGRESS_QUEUE_SIZE)
+		return false;
+
+	next_time = (qu64)-1;
+	for (class_ind = 0; class_ind < NB_EGRESS_CLASSES; class_ind++)
+	{
+		unsigned int packet_ind;
+
+		for (packet_ind = class_heads[class_ind]; packet_ind != NO_PACKET; packet_ind = queue[packet_ind].next)
+		{
+			const queued_packet_t* packet = &queue[packet_ind];
+			qu64 ready_time = Egr_GetGlobalReadyTime (packet->length);
+
+			if (ready_time < packet->release_time)
+				ready_time = packet->release_time;
+			if (ready_time < next_time)
+				next_time = ready_time;
+		}
+	}
+
+	now = Sys_GetMonotonicTime ();
+	*delay = (next_time > now ? next_time - now : 0);
+	return true;
+}
+
+
+/*
+====================
+Egr_PrintStats
+
+Print the shaping statistics
+====================
+*/
+void Egr_PrintStats (msg_level_t msg_level)
+{
+	unsigned int class_ind;
+
+	if (queue == NULL)
+	{
+		Com_Printf (msg_level, "\n> Egress shaping: disabled\n");
+		return;
+	}
+
+	Com_Printf (msg_level,
+				"\n> Egress shaping (%u bytes/s, %u bytes/s per destination, %u packets queued):\n",
+				egress_rate, dest_rate, EGRESS_QUEUE_SIZE - nb_free);
+	for (class_ind = 0; class_ind < NB_EGRESS_CLASSES; class_ind++)
+	{
+		const egress_stats_t* stats = &egress_stats[class_ind];
+
+		Com_Printf (msg_level,
+					" * %s: %llu packets sent (%llu bytes), %llu delayed (up to %.3f ms), %llu dropped\n",
+					class_names[class_ind], stats->nb_sent, stats->nb_bytes,
+					stats->nb_delayed, (double)stats->max_delay / 1000.0,
+					stats->nb_dropped);
+	}
+}
@@ -0,0 +1,101 @@
+/*
+	egress.h
+
+	Outgoing bandwidth shaping for dpmaster
+
+	Copyright (C) 2011  Mathieu Olivier
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef _EGRESS_H_
+#define _EGRESS_H_
+
+
+// ---------- Constants ---------- //
+
+// Smallest rate accepted, in bytes per second
+#define MIN_EGRESS_RATE 1000
+
+// Number of packets which can wait in the queue, and how many of them
+// are reserved to the control messages
+#define EGRESS_QUEUE_SIZE 512
+#define EGRESS_RESERVED_SIZE 64
+
+// Burst allowances: the whole uplink can send at full speed for
+// EGRESS_BURST_TIME microseconds, and a destination can get
+// EGRESS_DEST_BURST bytes at once, before being paced
+#define EGRESS_BURST_TIME 20000
+#define EGRESS_DEST_BURST 3000
+
+// Longest delay a destination's rate can impose on a packet, in microseconds.
+// The packets which would wait longer are dropped
+#define EGRESS_MAX_DEST_DELAY 2000000
+
+// Number of destinations whose rate is tracked (a direct-mapped table,
+// so different destinations can share an entry)
+#define EGRESS_NB_DESTS 4096
+
+
+// ---------- Types ---------- //
+
+// Priority classes of the outgoing messages, most urgent first
+typedef enum
+{
+	EGRESS_CLASS_CONTROL,	// getinfo, getMyAddrResponse, getserversToken
+	EGRESS_CLASS_LIST,		// getserversResponse, getserversExtResponse, relayRecv
+	EGRESS_CLASS_BULK,		// getserversWithInfoResponse, getinfo probes
+
+	NB_EGRESS_CLASSES
+} egress_class_t;
+
+
+// ---------- Public functions ---------- //
+
+// Set the global and per-destination rates, in bytes per second (0 means
+// no limit). Will simply return "false" if called after Egr_Init
+qboolean Egr_SetRates (unsigned int rate, unsigned int dest_rate);
+
+// Allocate the packet queue, if the shaping is enabled
+qboolean Egr_Init (void);
+
+// Send a packet, or queue it if the rates don't allow it yet. Returns
+// "false" if it can't be sent nor queued (see Egr_GetLastErrorString)
+qboolean Egr_Send (socket_t sock, const void* data, size_t length,
+				   const struct sockaddr_storage* addr, socklen_t addrlen,
+				   egress_class_t egress_class);
+
+// Send or queue several packets through the same socket. Returns the number
+// of packets sent or queued before the first failure (see Egr_GetLastErrorString),
+// or "nb_packets" if there was no failure
+unsigned int Egr_SendBatch (socket_t sock, const outgoing_packet_t* packets, unsigned int nb_packets,
+							egress_class_t egress_class);
+
+// Get the reason of the last failure of Egr_Send or Egr_SendBatch
+const char* Egr_GetLastErrorString (void);
+
+// Send the queued packets allowed by the rates, most urgent first
+void Egr_Flush (void);
+
+// Get how long we can wait before calling Egr_Flush again, in microseconds.
+// Returns "false" if there's nothing waiting in the queue
+qboolean Egr_GetFlushDelay (qu64* delay);
+
+// Print the shaping statistics
+void Egr_PrintStats (msg_level_t msg_level);
+
+
+#endif  // #ifndef _EGRESS_H_
@@ -24,6 +24,8 @@
 #include "common.h"
 #include "system.h"
 #include "games.h"
+#include "revalidation.h"
+#include "servers.h"
 
 
 // ---------- Private variables ---------- //
@@ -116,15 +118,21 @@ cmdline_status_t Game_DeclarePolicy (const char* policy, const char** games, uns
 		if (! Game_Find (game, &index))
 		{
 			const char** new_game_names;
+			char* game_copy;
 			
 			new_game_names = realloc ((void*)game_names, (nb_game_names + 1) * sizeof (game_names[0]));
 			if (new_game_names == NULL)
 				return CMDLINE_STATUS_NOT_ENOUGH_MEMORY;
+			game_names = new_game_names;
+
+			// Keep our own copy, so the name can be removed later
+			game_copy = strdup (game);
+			if (game_copy == NULL)
+				return CMDLINE_STATUS_NOT_ENOUGH_MEMORY;
 			
 			memmove((void*)&new_game_names[index + 1], &new_game_names[index], (nb_game_names - index) * sizeof (new_game_names[0]));
-			new_game_names[index] = game;
+			new_game_names[index] = game_copy;
 
-			game_names = new_game_names;
 			nb_game_names++;
 		}
 	}
@@ -133,6 +141,61 @@ cmdline_status_t Game_DeclarePolicy (const char* policy, const char** games, uns
 }
 
 
+/*
+====================
+Game_RemoveFromPolicy
+
+Remove a game from the list of games of the server policy.
+When the list becomes empty, all games are accepted again
+====================
+*/
+qboolean Game_RemoveFromPolicy (const char* game)
+{
+	unsigned int index;
+
+	if (! Game_Find (game, &index))
+		return false;
+
+	free ((void*)game_names[index]);
+	nb_game_names--;
+	memmove ((void*)&game_names[index], &game_names[index + 1], (nb_game_names - index) * sizeof (game_names[0]));
+
+	// Without any game in the list, go back to the default policy
+	if (nb_game_names == 0)
+	{
+		free ((void*)game_names);
+		game_names = NULL;
+		reject_when_known = true;
+	}
+
+	return true;
+}
+
+
+/*
+====================
+Game_PrintPolicy
+
+Print the game policy
+====================
+*/
+void Game_PrintPolicy (msg_level_t msg_level)
+{
+	unsigned int ind;
+
+	if (game_names == NULL)
+	{
+		Com_Printf (msg_level, "All games are accepted\n");
+		return;
+	}
+
+	Com_Printf (msg_level, "%s:", reject_when_known ? "reject" : "accept");
+	for (ind = 0; ind < nb_game_names; ind++)
+		Com_Printf (msg_level, " %s", game_names[ind]);
+	Com_Printf (msg_level, "\n");
+}
+
+
 /*
 ====================
 Game_IsAccepted
@@ -467,6 +530,19 @@ static cmdline_status_t Game_UpdateProperty (game_properties_t* game_props, cons
 		{
 			Game_RemoveHeartbeat (game_props, HEARTBEAT_TYPE_DEAD);
 		}
+		else if (strcmp (prop_name, "revalidation") == 0)
+		{
+			game_props->revalidation_period = 0;
+		}
+		else if (strcmp (prop_name, "timeout") == 0)
+		{
+			game_props->timeout = 0;
+			game_props->adaptive_timeout = false;
+		}
+		else if (strcmp (prop_name, "quota") == 0)
+		{
+			game_props->quota = 0;
+		}
 		else
 			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
 	}
@@ -509,6 +585,58 @@ static cmdline_status_t Game_UpdateProperty (game_properties_t* game_props, cons
 			if (result != CMDLINE_STATUS_OK)
 				return result;
 		}
+		else if (strcmp (prop_name, "revalidation") == 0)
+		{
+			char* end_ptr;
+			long period;
+
+			// A period is a single value, which can only be assigned
+			if (! reset_property)
+				return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+
+			period = strtol (next_value, &end_ptr, 0);
+			if (end_ptr == next_value || *end_ptr != '\0' ||
+				period < REV_MIN_PERIOD || period > REV_MAX_PERIOD)
+				return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+			game_props->revalidation_period = (unsigned int)period;
+		}
+		else if (strcmp (prop_name, "timeout") == 0)
+		{
+			char* end_ptr;
+			long timeout;
+
+			// The timeout can only be assigned, with a number of seconds,
+			// "adaptive", or both (the fixed value being used until the
+			// heartbeat interval of a server is known)
+			if (! reset_property)
+				return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+
+			if (strcmp (next_value, "adaptive") == 0)
+				game_props->adaptive_timeout = true;
+			else
+			{
+				timeout = strtol (next_value, &end_ptr, 0);
+				if (end_ptr == next_value || *end_ptr != '\0' ||
+					timeout < MIN_SV_TIMEOUT || timeout > MAX_SV_TIMEOUT)
+					return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+				game_props->timeout = (unsigned int)timeout;
+			}
+		}
+		else if (strcmp (prop_name, "quota") == 0)
+		{
+			char* end_ptr;
+			long quota;
+
+			// A quota is a single value, which can only be assigned
+			if (! reset_property)
+				return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+
+			quota = strtol (next_value, &end_ptr, 0);
+			if (end_ptr == next_value || *end_ptr != '\0' ||
+				quota < 1 || quota > INT_MAX)
+				return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+			game_props->quota = (unsigned int)quota;
+		}
 		else
 			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
 
@@ -664,6 +792,23 @@ void Game_PrintProperties (void)
 			Com_Printf (MSG_ERROR, " none");
 		Com_Printf (MSG_ERROR, "\n");
 
+		// Revalidation period
+		if (props->revalidation_period != 0)
+			Com_Printf (MSG_ERROR, "   - revalidation: every %u seconds\n",
+						props->revalidation_period);
+
+		// Timeout
+		if (props->adaptive_timeout)
+			Com_Printf (MSG_ERROR, "   - timeout: %u times the heartbeat interval (%u seconds until it's known)\n",
+						SV_HEARTBEAT_FACTOR,
+						props->timeout != 0 ? props->timeout : DEFAULT_SV_TIMEOUT);
+		else if (props->timeout != 0)
+			Com_Printf (MSG_ERROR, "   - timeout: %u seconds\n", props->timeout);
+
+		// Quota
+		if (props->quota != 0)
+			Com_Printf (MSG_ERROR, "   - quota: %u servers\n", props->quota);
+
 		Com_Printf (MSG_ERROR, "\n");
 		props = props->next;
 	}
@@ -796,6 +941,62 @@ const game_properties_t* Game_GetPropertiesByHeartbeat (const char* heartbeat_ta
 }
 
 
+/*
+====================
+Game_GetPropertiesIndex
+
+Returns the index of some game properties: 0 for the DarkPlaces protocol (no properties),
+then the rank of the properties in the list, starting at 1
+====================
+*/
+unsigned int Game_GetPropertiesIndex (const game_properties_t* game_props)
+{
+	const game_properties_t* props = game_properties_list;
+	unsigned int index = 1;
+
+	if (game_props == NULL)
+		return 0;
+
+	while (props != game_props)
+	{
+		assert (props != NULL);
+		props = props->next;
+		index++;
+	}
+
+	return index;
+}
+
+
+/*
+====================
+Game_GetPropertiesByIndex
+
+Get the game properties corresponding to an index returned by Game_GetPropertiesIndex.
+Returns "false" if the index is invalid
+====================
+*/
+qboolean Game_GetPropertiesByIndex (unsigned int index, const game_properties_t** game_props)
+{
+	const game_properties_t* props = game_properties_list;
+
+	if (index == 0)
+	{
+		*game_props = NULL;
+		return true;
+	}
+
+	while (props != NULL && index > 1)
+	{
+		props = props->next;
+		index--;
+	}
+
+	*game_props = props;
+	return (props != NULL);
+}
+
+
 /*
 ====================
 Game_GetOptions
@@ -812,3 +1013,44 @@ game_options_t Game_GetOptions (const char* game)
 	else
 		return GAME_OPTION_NONE;
 }
+
+
+/*
+====================
+Game_GetRevalidationPeriod
+
+Returns the revalidation period of a game, in seconds (0 if it uses the default period)
+====================
+*/
+unsigned int Game_GetRevalidationPeriod (const char* game)
+{
+	const game_properties_t* props = Game_GetAnonymous (game, false);
+
+	if (props != NULL)
+		return props->revalidation_period;
+	else
+		return 0;
+}
+
+
+/*
+====================
+Game_GetTimeout
+
+Returns the timeout of a game, in seconds (0 if it uses the default timeout),
+and tell if it follows the heartbeat interval of each server when it's known
+====================
+*/
+unsigned int Game_GetTimeout (const char* game, qboolean* adaptive)
+{
+	const game_properties_t* props = Game_GetAnonymous (game, false);
+
+	if (props != NULL)
+	{
+		*adaptive = props->adaptive_timeout;
+		return props->timeout;
+	}
+
+	*adaptive = false;
+	return 0;
+}
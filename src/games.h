@@ -30,9 +30,15 @@
 // Declare the server policy regarding which games are allowed on this master
 cmdline_status_t Game_DeclarePolicy (const char* policy, const char** games, unsigned int nb_games);
 
+// Remove a game from the list of games of the server policy
+qboolean Game_RemoveFromPolicy (const char* game);
+
 // Return true if the game is allowed on this master
 qboolean Game_IsAccepted (const char* game_name);
 
+// Print the game policy
+void Game_PrintPolicy (msg_level_t msg_level);
+
 
 // ---------- Public constants (game properties) ---------- //
 
@@ -66,6 +72,10 @@ typedef struct game_properties_s
 	const char*					name;
 	game_options_t				options;
 	char*						heartbeats [NB_HEARTBEAT_TYPES];	// Heartbeat tags
+	unsigned int				revalidation_period;				// in seconds (0 means the default period)
+	unsigned int				timeout;							// in seconds (0 means the default timeout)
+	qboolean					adaptive_timeout;					// does the timeout follow the heartbeat interval?
+	unsigned int				quota;								// number of servers kept when the list is full (0 means none)
 	struct game_properties_s*	next;
 } game_properties_t;
 
@@ -91,8 +101,21 @@ const char* Game_GetNameByProtocol (int protocol, game_options_t* options);
 // "flatline_heartbeat" will be set to "true" if it's a flatline tag
 const game_properties_t* Game_GetPropertiesByHeartbeat (const char* heartbeat_tag, qboolean* flatline_heartbeat);
 
+// Returns the index of some game properties (0 for the DarkPlaces protocol)
+unsigned int Game_GetPropertiesIndex (const game_properties_t* game_props);
+
+// Get the game properties corresponding to an index. Returns "false" if the index is invalid
+qboolean Game_GetPropertiesByIndex (unsigned int index, const game_properties_t** game_props);
+
 // Returns the options of a game
 game_options_t Game_GetOptions (const char* game);
 
+// Returns the revalidation period of a game, in seconds (0 if it uses the default period)
+unsigned int Game_GetRevalidationPeriod (const char* game);
+
+// Returns the timeout of a game, in seconds (0 if it uses the default timeout),
+// and tell if it follows the heartbeat interval of each server when it's known
+unsigned int Game_GetTimeout (const char* game, qboolean* adaptive);
+
 
 #endif  // #ifndef _GAMES_H_
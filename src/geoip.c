@@ -0,0 +1,948 @@
+/*
+	geoip.c
+
+	Country database for dpmaster
+
+	Copyright (C) 2011  Mathieu Olivier
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <math.h>
+
+#include "common.h"
+#include "system.h"
+#include "geoip.h"
+
+
+// ---------- Private constants ---------- //
+
+// Code index of the address ranges which don't belong to any country
+#define GEOIP_NO_CODE 0xFFFF
+
+// Latitude of the unknown locations
+#define GEOIP_NO_LOCATION SHRT_MIN
+
+// Factor converting hundredths of degrees into radians
+#define GEOIP_LOCATION_TO_RADIANS (3.14159265358979323846 / 18000.0)
+
+// Size of the hash table indexing the codes while loading a file
+#define GEOIP_CODE_HASH_SIZE (GEOIP_MAX_NB_CODES * 2)
+
+// Number of ranges allocated at once while loading a file
+#define GEOIP_RANGE_BLOCK 4096
+
+// Indexes of the IPv4 and IPv6 tables
+#define GEOIP_TABLE_IPV4	0
+#define GEOIP_TABLE_IPV6	1
+
+// Number of different addresses used by the benchmark, for each family
+#define GEOIP_BENCHMARK_NB_ADDRS 4096
+
+
+// ---------- Private types ---------- //
+
+// A 128-bit address. IPv4 addresses only use the 32 least significant bits
+typedef struct
+{
+	qu64 hi;
+	qu64 lo;
+} geo_key_t;
+
+// A location, in hundredths of degrees
+typedef struct
+{
+	short latitude;			// GEOIP_NO_LOCATION if unknown
+	short longitude;
+} geo_location_t;
+
+// A range of addresses, as read from the file
+typedef struct
+{
+	geo_key_t first;
+	geo_key_t last;
+	unsigned short code;
+	geo_location_t location;
+} geo_range_t;
+
+// A complete database. The ranges of each family are stored in 2 flat arrays,
+// sorted by address: the first address of each range, and the index of its
+// code. The holes between the ranges are stored as ranges without any code, so
+// a range ends where the next one starts, and a lookup is a binary search for
+// the last range starting at or before the address. A range can have its
+// own location, or use the location of its country
+typedef struct
+{
+	unsigned int* v4_starts;
+	geo_key_t* v6_starts;
+	unsigned short* codes_by_range [2];
+	geo_location_t* locations_by_range [2];	// NULL if no range has a location
+	unsigned int nb_ranges [2];
+	char (*codes) [GEOIP_CODE_LENGTH + 1];
+	geo_location_t* code_locations;
+	unsigned int nb_codes;
+	unsigned int nb_locations;				// number of ranges and codes with a location
+} geo_database_t;
+
+// The state of a file being loaded
+typedef struct
+{
+	geo_database_t* db;
+	geo_range_t* ranges [2];
+	unsigned int nb_ranges [2];
+	unsigned int max_nb_ranges [2];
+	qboolean range_locations;				// does any range have a location?
+	unsigned short code_hash [GEOIP_CODE_HASH_SIZE];
+} geo_loader_t;
+
+
+// ---------- Private variables ---------- //
+
+static geo_database_t geo = { NULL, NULL, { NULL, NULL }, { NULL, NULL }, { 0, 0 }, NULL, NULL, 0, 0 };
+
+static char geo_filepath [MAX_PATH] = "";
+
+// Incremented each time a database is loaded
+static unsigned int geo_generation = 0;
+
+// Should we reload the GeoIP file?
+static volatile sig_atomic_t must_reload = false;
+
+
+// ---------- Private functions ---------- //
+
+/*
+====================
+Geo_BytesToKey
+
+Convert an address in network byte order into a key
+====================
+*/
+static geo_key_t Geo_BytesToKey (const qbyte* addr_buff, size_t addr_size)
+{
+	geo_key_t key = { 0, 0 };
+	size_t ind;
+
+	for (ind = 0; ind < addr_size; ind++)
+	{
+		key.hi = (key.hi << 8) | (key.lo >> 56);
+		key.lo = (key.lo << 8) | addr_buff[ind];
+	}
+
+	return key;
+}
+
+
+/*
+====================
+Geo_CompareKeys
+
+Compare 2 keys, returning -1, 0 or 1
+====================
+*/
+static int Geo_CompareKeys (const geo_key_t* key1, const geo_key_t* key2)
+{
+	if (key1->hi != key2->hi)
+		return (key1->hi < key2->hi ? -1 : 1);
+	if (key1->lo != key2->lo)
+		return (key1->lo < key2->lo ? -1 : 1);
+	return 0;
+}
+
+
+/*
+====================
+Geo_Random
+
+A simple pseudo-random generator (xorshift), for the benchmark
+====================
+*/
+static unsigned int Geo_Random (unsigned int* state)
+{
+	unsigned int value = *state;
+
+	value ^= value << 13;
+	value ^= value >> 17;
+	value ^= value << 5;
+	*state = value;
+	return value;
+}
+
+
+/*
+====================
+Geo_FreeDatabase
+
+Free the memory used by a database
+====================
+*/
+static void Geo_FreeDatabase (geo_database_t* db)
+{
+	free (db->v4_starts);
+	free (db->v6_starts);
+	free (db->codes_by_range[GEOIP_TABLE_IPV4]);
+	free (db->codes_by_range[GEOIP_TABLE_IPV6]);
+	free (db->locations_by_range[GEOIP_TABLE_IPV4]);
+	free (db->locations_by_range[GEOIP_TABLE_IPV6]);
+	free (db->codes);
+	free (db->code_locations);
+	memset (db, 0, sizeof (*db));
+}
+
+
+/*
+====================
+Geo_GetCodeIndex
+
+Get the index of a country code, adding it to the database if necessary
+====================
+*/
+static unsigned short Geo_GetCodeIndex (geo_loader_t* loader, const char* code)
+{
+	geo_database_t* db = loader->db;
+	unsigned int hash = 0;
+	const char* crt_char;
+
+	for (crt_char = code; *crt_char != '\0'; crt_char++)
+		hash = hash * 31 + (qbyte)*crt_char;
+	hash %= GEOIP_CODE_HASH_SIZE;
+
+	// Linear probing (the table is never more than half full)
+	while (loader->code_hash[hash] != GEOIP_NO_CODE)
+	{
+		unsigned short code_ind = loader->code_hash[hash];
+
+		if (strcmp (db->codes[code_ind], code) == 0)
+			return code_ind;
+		hash = (hash + 1) % GEOIP_CODE_HASH_SIZE;
+	}
+
+	if (db->nb_codes >= GEOIP_MAX_NB_CODES)
+		return GEOIP_NO_CODE;
+
+	strcpy (db->codes[db->nb_codes], code);
+	db->code_locations[db->nb_codes].latitude = GEOIP_NO_LOCATION;
+	db->code_locations[db->nb_codes].longitude = 0;
+	loader->code_hash[hash] = (unsigned short)db->nb_codes;
+	return (unsigned short)db->nb_codes++;
+}
+
+
+/*
+====================
+Geo_IsCode
+
+Return "true" if a field of the GeoIP file looks like a country code
+====================
+*/
+static qboolean Geo_IsCode (const char* field)
+{
+	size_t length = strlen (field);
+	qboolean has_letter = false;
+	size_t ind;
+
+	if (length == 0 || length > GEOIP_CODE_LENGTH)
+		return false;
+
+	for (ind = 0; ind < length; ind++)
+	{
+		if (isalpha ((qbyte)field[ind]))
+			has_letter = true;
+		else if (! isdigit ((qbyte)field[ind]))
+			return false;
+	}
+
+	return has_letter;
+}
+
+
+/*
+====================
+Geo_ParseLocation
+
+Parse a latitude and a longitude, in degrees
+====================
+*/
+static qboolean Geo_ParseLocation (const char* latitude_str, const char* longitude_str,
+								   geo_location_t* location)
+{
+	double latitude, longitude;
+	char* end_ptr;
+
+	if (latitude_str == NULL || longitude_str == NULL)
+		return false;
+
+	latitude = strtod (latitude_str, &end_ptr);
+	if (end_ptr == latitude_str || *end_ptr != '\0' || latitude < -90.0 || latitude > 90.0)
+		return false;
+	longitude = strtod (longitude_str, &end_ptr);
+	if (end_ptr == longitude_str || *end_ptr != '\0' || longitude < -180.0 || longitude > 180.0)
+		return false;
+
+	location->latitude = (short)floor (latitude * 100.0 + 0.5);
+	location->longitude = (short)floor (longitude * 100.0 + 0.5);
+	return true;
+}
+
+
+/*
+====================
+Geo_ParseLine
+
+Parse a line of the GeoIP file and add its range to the loader
+====================
+*/
+static qboolean Geo_ParseLine (geo_loader_t* loader, char* line, unsigned int line_num)
+{
+	static const char* separators = ", \t\r\n\"";
+	const char* first_str;
+	const char* last_str;
+	const char* field;
+	const char* latitude_str;
+	const char* longitude_str;
+	qbyte first_buff [16];
+	qbyte last_buff [16];
+	geo_range_t* range;
+	unsigned short code;
+	unsigned int table;
+	size_t addr_size;
+
+	if (line[0] == '#')
+		return true;
+
+	first_str = strtok (line, separators);
+	if (first_str == NULL)
+		return true;  // empty line
+	last_str = strtok (NULL, separators);
+
+	// If it's the location of a country
+	if (Geo_IsCode (first_str))
+	{
+		geo_location_t location;
+
+		if (! Geo_ParseLocation (last_str, strtok (NULL, separators), &location) ||
+			strtok (NULL, separators) != NULL)
+		{
+			Com_Printf (MSG_ERROR, "> ERROR: invalid country location at line %u of the GeoIP file\n",
+						line_num);
+			return false;
+		}
+
+		code = Geo_GetCodeIndex (loader, first_str);
+		if (code == GEOIP_NO_CODE)
+		{
+			Com_Printf (MSG_ERROR, "> ERROR: too many different country codes in the GeoIP file (max: %u)\n",
+						GEOIP_MAX_NB_CODES);
+			return false;
+		}
+		if (loader->db->code_locations[code].latitude == GEOIP_NO_LOCATION)
+			loader->db->nb_locations++;
+		loader->db->code_locations[code] = location;
+		return true;
+	}
+
+	// The country code is the first field after the addresses which looks
+	// like one, so the numeric fields of some formats are skipped
+	do
+	{
+		field = strtok (NULL, separators);
+	} while (field != NULL && ! Geo_IsCode (field));
+
+	if (last_str == NULL || field == NULL)
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: invalid syntax at line %u of the GeoIP file\n", line_num);
+		return false;
+	}
+
+	if (inet_pton (AF_INET, first_str, first_buff) == 1 &&
+		inet_pton (AF_INET, last_str, last_buff) == 1)
+	{
+		table = GEOIP_TABLE_IPV4;
+		addr_size = 4;
+	}
+	else if (inet_pton (AF_INET6, first_str, first_buff) == 1 &&
+			 inet_pton (AF_INET6, last_str, last_buff) == 1)
+	{
+		table = GEOIP_TABLE_IPV6;
+		addr_size = 16;
+	}
+	else
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: invalid address range at line %u of the GeoIP file\n",
+					line_num);
+		return false;
+	}
+
+	if (loader->nb_ranges[table] >= loader->max_nb_ranges[table])
+	{
+		geo_range_t* new_ranges;
+
+		new_ranges = realloc (loader->ranges[table],
+							  (loader->max_nb_ranges[table] + GEOIP_RANGE_BLOCK) * sizeof (*new_ranges));
+		if (new_ranges == NULL)
+		{
+			Com_Printf (MSG_ERROR, "> ERROR: can't allocate memory for the GeoIP database\n");
+			return false;
+		}
+		loader->ranges[table] = new_ranges;
+		loader->max_nb_ranges[table] += GEOIP_RANGE_BLOCK;
+	}
+
+	code = Geo_GetCodeIndex (loader, field);
+	if (code == GEOIP_NO_CODE)
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: too many different country codes in the GeoIP file (max: %u)\n",
+					GEOIP_MAX_NB_CODES);
+		return false;
+	}
+
+	range = &loader->ranges[table][loader->nb_ranges[table]];
+	range->first = Geo_BytesToKey (first_buff, addr_size);
+	range->last = Geo_BytesToKey (last_buff, addr_size);
+	range->code = code;
+
+	// The code may be followed by the location of the range
+	latitude_str = strtok (NULL, separators);
+	longitude_str = strtok (NULL, separators);
+	if (Geo_ParseLocation (latitude_str, longitude_str, &range->location))
+	{
+		loader->range_locations = true;
+		loader->db->nb_locations++;
+	}
+	else
+	{
+		range->location.latitude = GEOIP_NO_LOCATION;
+		range->location.longitude = 0;
+	}
+
+	if (Geo_CompareKeys (&range->first, &range->last) > 0)
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: invalid address range at line %u of the GeoIP file\n",
+					line_num);
+		return false;
+	}
+
+	loader->nb_ranges[table]++;
+	return true;
+}
+
+
+/*
+====================
+Geo_CompareRanges
+
+Compare 2 ranges, for sorting them by address
+====================
+*/
+static int Geo_CompareRanges (const void* range1, const void* range2)
+{
+	return Geo_CompareKeys (&((const geo_range_t*)range1)->first,
+							&((const geo_range_t*)range2)->first);
+}
+
+
+/*
+====================
+Geo_AddEntry
+
+Add an entry at the end of a lookup table
+====================
+*/
+static void Geo_AddEntry (geo_database_t* db, unsigned int table, const geo_key_t* start,
+						  unsigned short code, const geo_location_t* location)
+{
+	unsigned int entry_ind = db->nb_ranges[table];
+
+	if (table == GEOIP_TABLE_IPV4)
+		db->v4_starts[entry_ind] = (unsigned int)start->lo;
+	else
+		db->v6_starts[entry_ind] = *start;
+	db->codes_by_range[table][entry_ind] = code;
+	if (db->locations_by_range[table] != NULL)
+		db->locations_by_range[table][entry_ind] = *location;
+	db->nb_ranges[table]++;
+}
+
+
+/*
+====================
+Geo_BuildTable
+
+Build a lookup table of the database from the ranges read in the file
+====================
+*/
+static qboolean Geo_BuildTable (geo_loader_t* loader, unsigned int table)
+{
+	geo_database_t* db = loader->db;
+	geo_range_t* ranges = loader->ranges[table];
+	unsigned int nb_ranges = loader->nb_ranges[table];
+	unsigned int max_nb_entries, ind;
+	geo_key_t next_first = { 0, 0 };
+	qboolean wrapped = false;
+	void* starts;
+	geo_location_t no_location = { GEOIP_NO_LOCATION, 0 };
+
+	if (nb_ranges == 0)
+		return true;
+
+	qsort (ranges, nb_ranges, sizeof (ranges[0]), Geo_CompareRanges);
+
+	// Each range may need an additional entry for the hole before it, and
+	// one more entry is needed for the hole at the end of the address space
+	max_nb_entries = nb_ranges * 2 + 1;
+	if (table == GEOIP_TABLE_IPV4)
+		starts = db->v4_starts = malloc (max_nb_entries * sizeof (db->v4_starts[0]));
+	else
+		starts = db->v6_starts = malloc (max_nb_entries * sizeof (db->v6_starts[0]));
+	db->codes_by_range[table] = malloc (max_nb_entries * sizeof (db->codes_by_range[table][0]));
+	if (loader->range_locations)
+		db->locations_by_range[table] = malloc (max_nb_entries * sizeof (db->locations_by_range[table][0]));
+	if (starts == NULL || db->codes_by_range[table] == NULL ||
+		(loader->range_locations && db->locations_by_range[table] == NULL))
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: can't allocate memory for the GeoIP database\n");
+		return false;
+	}
+
+	for (ind = 0; ind < nb_ranges; ind++)
+	{
+		const geo_range_t* range = &ranges[ind];
+		unsigned int last_entry = db->nb_ranges[table] - 1;
+		int cmp;
+
+		cmp = Geo_CompareKeys (&range->first, &next_first);
+		if (wrapped || cmp < 0)
+		{
+			Com_Printf (MSG_ERROR, "> ERROR: overlapping %s address ranges in the GeoIP file\n",
+						table == GEOIP_TABLE_IPV4 ? "IPv4" : "IPv6");
+			return false;
+		}
+
+		// Add the hole before this range, if any
+		if (cmp > 0)
+			Geo_AddEntry (db, table, &next_first, GEOIP_NO_CODE, &no_location);
+
+		// Merge it with the previous range if they are contiguous and have the same properties
+		if (db->nb_ranges[table] == 0 || cmp > 0 ||
+			db->codes_by_range[table][last_entry] != range->code ||
+			(db->locations_by_range[table] != NULL &&
+			 memcmp (&db->locations_by_range[table][last_entry], &range->location, sizeof (range->location)) != 0))
+			Geo_AddEntry (db, table, &range->first, range->code, &range->location);
+
+		// Compute the address following the range
+		next_first = range->last;
+		next_first.lo++;
+		if (next_first.lo == 0)
+			next_first.hi++;
+		if (table == GEOIP_TABLE_IPV4)
+			wrapped = (next_first.lo > 0xFFFFFFFF);
+		else
+			wrapped = (next_first.hi == 0 && next_first.lo == 0);
+	}
+
+	if (! wrapped)
+		Geo_AddEntry (db, table, &next_first, GEOIP_NO_CODE, &no_location);
+
+	return true;
+}
+
+
+/*
+====================
+Geo_Load
+
+Load the GeoIP file into a database
+====================
+*/
+static qboolean Geo_Load (geo_database_t* db)
+{
+	geo_loader_t loader;
+	FILE* file;
+	char line [MAX_GEOIP_LINE_LENGTH];
+	unsigned int line_num = 0;
+	qboolean result = true;
+
+	memset (db, 0, sizeof (*db));
+	db->codes = malloc (GEOIP_MAX_NB_CODES * sizeof (db->codes[0]));
+	db->code_locations = malloc (GEOIP_MAX_NB_CODES * sizeof (db->code_locations[0]));
+	if (db->codes == NULL || db->code_locations == NULL)
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: can't allocate memory for the GeoIP database\n");
+		Geo_FreeDatabase (db);
+		return false;
+	}
+
+	memset (&loader, 0, sizeof (loader));
+	loader.db = db;
+	memset (loader.code_hash, 0xFF, sizeof (loader.code_hash));
+
+	file = fopen (geo_filepath, "r");
+	if (file == NULL)
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: can't open the GeoIP file \"%s\" (%s)\n",
+					geo_filepath, strerror (errno));
+		Geo_FreeDatabase (db);
+		return false;
+	}
+
+	while (fgets (line, sizeof (line), file) != NULL)
+	{
+		line_num++;
+		if (! Geo_ParseLine (&loader, line, line_num))
+		{
+			result = false;
+			break;
+		}
+	}
+
+	fclose (file);
+
+	if (result)
+		result = (Geo_BuildTable (&loader, GEOIP_TABLE_IPV4) &&
+				  Geo_BuildTable (&loader, GEOIP_TABLE_IPV6));
+
+	free (loader.ranges[GEOIP_TABLE_IPV4]);
+	free (loader.ranges[GEOIP_TABLE_IPV6]);
+	if (! result)
+		Geo_FreeDatabase (db);
+	return result;
+}
+
+
+/*
+====================
+Geo_FindRange
+
+Find the range containing an address, and the table it belongs to.
+Returns its index plus one, or 0 if there's none
+====================
+*/
+static unsigned int Geo_FindRange (const struct sockaddr_storage* address, unsigned int* table)
+{
+	unsigned int low, high;
+
+	// Find the last range starting at or before the address
+	low = 0;
+	if (address->ss_family == AF_INET6)
+	{
+		const struct sockaddr_in6* addr6 = (const struct sockaddr_in6*)address;
+		geo_key_t key;
+
+		*table = GEOIP_TABLE_IPV6;
+		key = Geo_BytesToKey ((const qbyte*)&addr6->sin6_addr.s6_addr, 16);
+		high = geo.nb_ranges[GEOIP_TABLE_IPV6];
+		while (low < high)
+		{
+			unsigned int middle = low + (high - low) / 2;
+
+			if (Geo_CompareKeys (&geo.v6_starts[middle], &key) <= 0)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+	}
+	else if (address->ss_family == AF_INET)
+	{
+		const struct sockaddr_in* addr4 = (const struct sockaddr_in*)address;
+		unsigned int addr = ntohl (addr4->sin_addr.s_addr);
+
+		*table = GEOIP_TABLE_IPV4;
+		high = geo.nb_ranges[GEOIP_TABLE_IPV4];
+		while (low < high)
+		{
+			unsigned int middle = low + (high - low) / 2;
+
+			if (geo.v4_starts[middle] <= addr)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+	}
+
+	return low;
+}
+
+
+// ---------- Public functions ---------- //
+
+/*
+====================
+Geo_SetFilePath
+
+Set the path of the GeoIP file
+====================
+*/
+qboolean Geo_SetFilePath (const char* filepath)
+{
+	if (filepath == NULL || filepath[0] == '\0')
+		return false;
+
+	strncpy (geo_filepath, filepath, sizeof (geo_filepath) - 1);
+	geo_filepath[sizeof (geo_filepath) - 1] = '\0';
+
+	return true;
+}
+
+
+/*
+====================
+Geo_Init
+
+Load the GeoIP file, if any (must be called before chroot)
+====================
+*/
+qboolean Geo_Init (void)
+{
+	if (geo_filepath[0] == '\0')
+		return true;
+
+	return Geo_Reload ();
+}
+
+
+/*
+====================
+Geo_RequestReload
+
+Ask for a reload of the GeoIP file (can be called from a signal handler)
+====================
+*/
+void Geo_RequestReload (void)
+{
+	must_reload = true;
+}
+
+
+/*
+====================
+Geo_Update
+
+Reload the GeoIP file if a reload has been requested
+====================
+*/
+void Geo_Update (void)
+{
+	if (must_reload)
+	{
+		must_reload = false;
+		if (geo_filepath[0] != '\0')
+			Geo_Reload ();
+	}
+}
+
+
+/*
+====================
+Geo_Reload
+
+Reload the GeoIP file now. The current database is kept if the new one is invalid
+====================
+*/
+qboolean Geo_Reload (void)
+{
+	geo_database_t new_geo;
+
+	if (geo_filepath[0] == '\0')
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: no GeoIP file has been specified\n");
+		return false;
+	}
+
+	if (! Geo_Load (&new_geo))
+	{
+		if (geo.codes != NULL)
+			Com_Printf (MSG_WARNING,
+						"> WARNING: keeping the previous GeoIP database (%u IPv4 and %u IPv6 ranges)\n",
+						geo.nb_ranges[GEOIP_TABLE_IPV4], geo.nb_ranges[GEOIP_TABLE_IPV6]);
+		return false;
+	}
+
+	Geo_FreeDatabase (&geo);
+	geo = new_geo;
+	geo_generation++;
+
+	Com_Printf (MSG_NORMAL,
+				"> GeoIP database loaded from \"%s\": %u IPv4 and %u IPv6 ranges, %u country codes, %u locations\n",
+				geo_filepath, geo.nb_ranges[GEOIP_TABLE_IPV4], geo.nb_ranges[GEOIP_TABLE_IPV6],
+				geo.nb_codes, geo.nb_locations);
+	return true;
+}
+
+
+/*
+====================
+Geo_GetGeneration
+
+Get the generation of the database, which changes each time it's (re)loaded
+====================
+*/
+unsigned int Geo_GetGeneration (void)
+{
+	return geo_generation;
+}
+
+
+/*
+====================
+Geo_GetCountry
+
+Get the country code of an address, or NULL if it's unknown
+====================
+*/
+const char* Geo_GetCountry (const struct sockaddr_storage* address)
+{
+	unsigned int table, entry;
+	unsigned short code;
+
+	entry = Geo_FindRange (address, &table);
+	if (entry == 0)
+		return NULL;
+
+	code = geo.codes_by_range[table][entry - 1];
+	if (code == GEOIP_NO_CODE)
+		return NULL;
+	return geo.codes[code];
+}
+
+
+/*
+====================
+Geo_GetLocation
+
+Get the location of an address, as a unit vector from the center of the Earth.
+Returns "false" if it's unknown
+====================
+*/
+qboolean Geo_GetLocation (const struct sockaddr_storage* address, float location [3])
+{
+	unsigned int table, entry;
+	const geo_location_t* geo_loc = NULL;
+	double latitude, longitude;
+
+	entry = Geo_FindRange (address, &table);
+	if (entry == 0)
+		return false;
+
+	// Use the location of the range, or else the one of its country
+	if (geo.locations_by_range[table] != NULL &&
+		geo.locations_by_range[table][entry - 1].latitude != GEOIP_NO_LOCATION)
+		geo_loc = &geo.locations_by_range[table][entry - 1];
+	else
+	{
+		unsigned short code = geo.codes_by_range[table][entry - 1];
+
+		if (code != GEOIP_NO_CODE && geo.code_locations[code].latitude != GEOIP_NO_LOCATION)
+			geo_loc = &geo.code_locations[code];
+	}
+	if (geo_loc == NULL)
+		return false;
+
+	latitude = geo_loc->latitude * GEOIP_LOCATION_TO_RADIANS;
+	longitude = geo_loc->longitude * GEOIP_LOCATION_TO_RADIANS;
+	location[0] = (float)(cos (latitude) * cos (longitude));
+	location[1] = (float)(cos (latitude) * sin (longitude));
+	location[2] = (float)sin (latitude);
+	return true;
+}
+
+
+/*
+====================
+Geo_Benchmark
+
+Measure the speed of the lookups, for each address family. The IPv4 addresses
+are picked anywhere, since this address space is densely allocated, while the
+IPv6 ones are picked in the known ranges, with a random interface identifier
+====================
+*/
+qboolean Geo_Benchmark (unsigned int nb_lookups)
+{
+	struct sockaddr_storage* addrs;
+	unsigned int random_state = (unsigned int)time (NULL) | 1;
+	unsigned int table;
+
+	if (geo.codes == NULL)
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: no GeoIP database to benchmark\n");
+		return false;
+	}
+
+	addrs = malloc (GEOIP_BENCHMARK_NB_ADDRS * sizeof (addrs[0]));
+	if (addrs == NULL)
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: can't allocate memory for the GeoIP benchmark\n");
+		return false;
+	}
+
+	Com_Printf (MSG_NORMAL, "> Benchmarking the GeoIP lookups (%u lookups per address family)\n",
+				nb_lookups);
+
+	for (table = GEOIP_TABLE_IPV4; table <= GEOIP_TABLE_IPV6; table++)
+	{
+		const char* family_name = (table == GEOIP_TABLE_IPV4 ? "IPv4" : "IPv6");
+		unsigned int ind, nb_found = 0;
+		qu64 start_time, elapsed_time;
+
+		if (geo.nb_ranges[table] == 0)
+		{
+			Com_Printf (MSG_NORMAL, "  - %s: no ranges\n", family_name);
+			continue;
+		}
+
+		memset (addrs, 0, GEOIP_BENCHMARK_NB_ADDRS * sizeof (addrs[0]));
+		for (ind = 0; ind < GEOIP_BENCHMARK_NB_ADDRS; ind++)
+		{
+			if (table == GEOIP_TABLE_IPV4)
+			{
+				struct sockaddr_in* addr4 = (struct sockaddr_in*)&addrs[ind];
+
+				addr4->sin_family = AF_INET;
+				addr4->sin_addr.s_addr = htonl (Geo_Random (&random_state));
+			}
+			else
+			{
+				struct sockaddr_in6* addr6 = (struct sockaddr_in6*)&addrs[ind];
+				qbyte* addr_buff = (qbyte*)&addr6->sin6_addr.s6_addr;
+				const geo_key_t* start;
+				unsigned int byte_ind;
+
+				start = &geo.v6_starts[Geo_Random (&random_state) % geo.nb_ranges[table]];
+				for (byte_ind = 0; byte_ind < 8; byte_ind++)
+				{
+					addr_buff[byte_ind] = (qbyte)(start->hi >> (56 - byte_ind * 8));
+					addr_buff[byte_ind + 8] = (qbyte)Geo_Random (&random_state);
+				}
+				addr6->sin6_family = AF_INET6;
+			}
+		}
+
+		start_time = Sys_GetMonotonicTime ();
+		for (ind = 0; ind < nb_lookups; ind++)
+			if (Geo_GetCountry (&addrs[ind % GEOIP_BENCHMARK_NB_ADDRS]) != NULL)
+				nb_found++;
+		elapsed_time = Sys_GetMonotonicTime () - start_time;
+
+		Com_Printf (MSG_NORMAL,
+					"  - %s: %u ranges, %.3f ms, %.0f ns per lookup (%.2f millions per second), %.1f%% found\n",
+					family_name, geo.nb_ranges[table], (double)elapsed_time / 1000.0,
+					nb_lookups > 0 ? (double)elapsed_time * 1000.0 / nb_lookups : 0.0,
+					elapsed_time > 0 ? (double)nb_lookups / elapsed_time : 0.0,
+					nb_lookups > 0 ? nb_found * 100.0 / nb_lookups : 0.0);
+	}
+
+	free (addrs);
+	return true;
+}
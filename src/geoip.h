@@ -0,0 +1,73 @@
+/*
+	geoip.h
+
+	Country database for dpmaster
+
+	Copyright (C) 2011  Mathieu Olivier
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef _GEOIP_H_
+#define _GEOIP_H_
+
+
+// ---------- Constants ---------- //
+
+// Maximum length of a line in the GeoIP file
+#define MAX_GEOIP_LINE_LENGTH 256
+
+// Default number of lookups done by Geo_Benchmark, for each address family
+#define DEFAULT_GEOIP_BENCHMARK_LOOKUPS 1000000
+
+// Maximum length of a country code, and maximum number of different codes
+#define GEOIP_CODE_LENGTH 3
+#define GEOIP_MAX_NB_CODES 1024
+
+
+// ---------- Public functions ---------- //
+
+// Set the path of the GeoIP file
+qboolean Geo_SetFilePath (const char* filepath);
+
+// Load the GeoIP file, if any (must be called before chroot)
+qboolean Geo_Init (void);
+
+// Ask for a reload of the GeoIP file (can be called from a signal handler)
+void Geo_RequestReload (void);
+
+// Reload the GeoIP file if a reload has been requested
+void Geo_Update (void);
+
+// Reload the GeoIP file now. The current database is kept if the new one is invalid
+qboolean Geo_Reload (void);
+
+// Get the generation of the database, which changes each time it's (re)loaded.
+// 0 means that no database has been loaded
+unsigned int Geo_GetGeneration (void);
+
+// Get the country code of an address, or NULL if it's unknown
+const char* Geo_GetCountry (const struct sockaddr_storage* address);
+
+// Get the location of an address, as a unit vector from the center of the
+// Earth. Returns "false" if it's unknown
+qboolean Geo_GetLocation (const struct sockaddr_storage* address, float location [3]);
+
+// Measure the speed of the lookups, for each address family
+qboolean Geo_Benchmark (unsigned int nb_lookups);
+
+
+#endif  // #ifndef _GEOIP_H_
@@ -0,0 +1,670 @@
+/*
+	hitters.c
+
+	Heavy-hitter detection and automatic bans for dpmaster
+
+	Copyright (C) 2011  Mathieu Olivier
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include "common.h"
+#include "system.h"
+#include "clients.h"
+#include "hitters.h"
+
+
+// ---------- Private constants ---------- //
+
+// Index used to terminate the hash chains
+#define NO_HITTER ((unsigned int)-1)
+
+
+// ---------- Private types ---------- //
+
+// A tracked source
+typedef struct
+{
+	qu64 key;								// address or prefix (see Com_AddressKey)
+	unsigned int count;						// estimated number of packets (may be overestimated by up to "error")
+	unsigned int error;
+	unsigned int class_counts [NB_FP_CLASSES];	// packets counted since this source is tracked
+	unsigned int hash_next;
+	unsigned int heap_pos;
+	time_t ban_end;							// end of the last ban of this source, if any
+	qbyte family;
+} hitter_t;
+
+// What a sketch counts: the sources, by address or by prefix
+typedef struct
+{
+	const char* name;
+	unsigned int ipv4_prefix_length;
+	unsigned int ipv6_prefix_length;
+} sketch_desc_t;
+
+// A "Space-Saving" sketch: the sources with the highest packet counts are
+// kept in a fixed-size table. When a new source appears and the table is
+// full, it replaces the source with the lowest count, and inherits its count
+// (which thus becomes the maximum error on the new source's count). The
+// sources are organized in a min-heap on their counts, to find this source
+// quickly, and in a hash table to find a source from its address
+typedef struct
+{
+	const sketch_desc_t* desc;
+	unsigned int max_packets;				// auto-ban threshold (0 means no auto-ban)
+
+	hitter_t* hitters;
+	unsigned int* heap;						// hitter indexes
+	unsigned int* hash_heads;
+	unsigned int nb_hitters;
+	unsigned int hash_size;
+} sketch_t;
+
+// A banned source
+typedef struct
+{
+	qu64 key;
+	time_t end_time;
+	qbyte family;
+	qbyte prefix_length;
+} ban_t;
+
+
+// ---------- Private variables ---------- //
+
+// The sources are tracked both by address and by prefix
+static const sketch_desc_t sketch_descs [] =
+{
+	{ "address", 32, 64 },
+	{ "prefix", HIT_IPV4_PREFIX_LENGTH, HIT_IPV6_PREFIX_LENGTH },
+};
+#define NB_SKETCHES (sizeof (sketch_descs) / sizeof (sketch_descs[0]))
+static sketch_t sketches [NB_SKETCHES];
+
+static unsigned int max_nb_hitters = DEFAULT_HIT_NB_SOURCES;
+static qboolean initialized = false;
+static time_t next_decay_time = 0;
+
+// Automatic bans
+static time_t ban_duration = 0;
+static ban_t bans [MAX_HIT_NB_BANS];
+static unsigned int nb_bans = 0;
+
+// Used by Hit_CompareHitters when sorting the sources
+static const hitter_t* sorted_hitters = NULL;
+
+
+// ---------- Private functions ---------- //
+
+/*
+====================
+Hit_GetSourceKey
+
+Compute the key of a source in a sketch
+====================
+*/
+static qu64 Hit_GetSourceKey (qu64 address_key, int family, unsigned int prefix_length)
+{
+	unsigned int nb_host_bits = (family == AF_INET6 ? 64 : 32) - prefix_length;
+
+	if (nb_host_bits == 0)
+		return address_key;
+	return (address_key >> nb_host_bits) << nb_host_bits;
+}
+
+
+/*
+====================
+Hit_SourceToString
+
+Convert a source into a printable string.
+Returns a pointer to its static character buffer (do NOT free it!)
+====================
+*/
+static const char* Hit_SourceToString (qu64 key, int family, unsigned int prefix_length)
+{
+	static char result [INET6_ADDRSTRLEN + 8];
+	char addr_str [INET6_ADDRSTRLEN];
+
+	if (family == AF_INET6)
+	{
+		struct in6_addr addr6;
+		unsigned int ind;
+
+		memset (&addr6, 0, sizeof (addr6));
+		for (ind = 0; ind < 8; ind++)
+			addr6.s6_addr[ind] = (qbyte)(key >> (56 - ind * 8));
+		inet_ntop (AF_INET6, &addr6, addr_str, sizeof (addr_str));
+		snprintf (result, sizeof (result), "%s/%u", addr_str, prefix_length);
+	}
+	else
+	{
+		struct in_addr addr4;
+
+		addr4.s_addr = htonl ((unsigned int)key);
+		inet_ntop (AF_INET, &addr4, addr_str, sizeof (addr_str));
+		if (prefix_length < 32)
+			snprintf (result, sizeof (result), "%s/%u", addr_str, prefix_length);
+		else
+			snprintf (result, sizeof (result), "%s", addr_str);
+	}
+
+	return result;
+}
+
+
+/*
+====================
+Hit_HashKey
+
+Compute the hash value of a source key
+====================
+*/
+static unsigned int Hit_HashKey (const sketch_t* sketch, qu64 key, int family)
+{
+	if (sketch->hash_size == 0)
+		return 0;
+	return (unsigned int)(((key + family) * 0x9E3779B97F4A7C15ULL) >> (64 - sketch->hash_size));
+}
+
+
+/*
+====================
+Hit_HeapSwap
+
+Swap 2 sources in the heap of a sketch
+====================
+*/
+static void Hit_HeapSwap (sketch_t* sketch, unsigned int pos1, unsigned int pos2)
+{
+	unsigned int ind1 = sketch->heap[pos1];
+	unsigned int ind2 = sketch->heap[pos2];
+
+	sketch->heap[pos1] = ind2;
+	sketch->hitters[ind2].heap_pos = pos1;
+	sketch->heap[pos2] = ind1;
+	sketch->hitters[ind1].heap_pos = pos2;
+}
+
+
+/*
+====================
+Hit_HeapSiftUp
+
+Move a source up in the heap until its parent doesn't have a higher count
+====================
+*/
+static void Hit_HeapSiftUp (sketch_t* sketch, unsigned int pos)
+{
+	while (pos > 0)
+	{
+		unsigned int parent = (pos - 1) / 2;
+
+		if (sketch->hitters[sketch->heap[parent]].count <= sketch->hitters[sketch->heap[pos]].count)
+			break;
+
+		Hit_HeapSwap (sketch, parent, pos);
+		pos = parent;
+	}
+}
+
+
+/*
+====================
+Hit_HeapSiftDown
+
+Move a source down in the heap until its children don't have a lower count
+====================
+*/
+static void Hit_HeapSiftDown (sketch_t* sketch, unsigned int pos)
+{
+	for (;;)
+	{
+		unsigned int child = pos * 2 + 1;
+		unsigned int smallest = pos;
+
+		if (child < sketch->nb_hitters &&
+			sketch->hitters[sketch->heap[child]].count < sketch->hitters[sketch->heap[smallest]].count)
+			smallest = child;
+		child++;
+		if (child < sketch->nb_hitters &&
+			sketch->hitters[sketch->heap[child]].count < sketch->hitters[sketch->heap[smallest]].count)
+			smallest = child;
+
+		if (smallest == pos)
+			break;
+
+		Hit_HeapSwap (sketch, pos, smallest);
+		pos = smallest;
+	}
+}
+
+
+/*
+====================
+Hit_Decay
+
+Halve all the packet counters. Since it doesn't change their order, the heaps stay valid
+====================
+*/
+static void Hit_Decay (void)
+{
+	unsigned int sketch_ind;
+
+	for (sketch_ind = 0; sketch_ind < NB_SKETCHES; sketch_ind++)
+	{
+		sketch_t* sketch = &sketches[sketch_ind];
+		unsigned int ind;
+
+		for (ind = 0; ind < sketch->nb_hitters; ind++)
+		{
+			hitter_t* hitter = &sketch->hitters[ind];
+			unsigned int class_ind;
+
+			hitter->count /= 2;
+			hitter->error /= 2;
+			for (class_ind = 0; class_ind < NB_FP_CLASSES; class_ind++)
+				hitter->class_counts[class_ind] /= 2;
+		}
+	}
+}
+
+
+/*
+====================
+Hit_Ban
+
+Ban a source
+====================
+*/
+static void Hit_Ban (const sketch_t* sketch, hitter_t* hitter)
+{
+	unsigned int prefix_length;
+	ban_t* ban;
+
+	prefix_length = (hitter->family == AF_INET6 ? sketch->desc->ipv6_prefix_length : sketch->desc->ipv4_prefix_length);
+
+	// If the list is full, replace the ban which ends first
+	if (nb_bans < MAX_HIT_NB_BANS)
+		ban = &bans[nb_bans++];
+	else
+	{
+		unsigned int ind;
+
+		ban = &bans[0];
+		for (ind = 1; ind < nb_bans; ind++)
+			if (bans[ind].end_time < ban->end_time)
+				ban = &bans[ind];
+	}
+
+	ban->key = hitter->key;
+	ban->family = hitter->family;
+	ban->prefix_length = (qbyte)prefix_length;
+	ban->end_time = crt_time + ban_duration;
+	hitter->ban_end = ban->end_time;
+
+	Com_Printf (MSG_WARNING,
+				"> WARNING: %s banned for %ld seconds (about %u packets recently)\n",
+				Hit_SourceToString (hitter->key, hitter->family, prefix_length),
+				(long)ban_duration, hitter->count);
+}
+
+
+/*
+====================
+Hit_UpdateSketch
+
+Count a packet from a source in a sketch
+====================
+*/
+static void Hit_UpdateSketch (sketch_t* sketch, qu64 address_key, int family, fp_class_t msg_class)
+{
+	qu64 key;
+	unsigned int hash, hitter_ind;
+	hitter_t* hitter;
+
+	key = Hit_GetSourceKey (address_key, family,
+							family == AF_INET6 ? sketch->desc->ipv6_prefix_length : sketch->desc->ipv4_prefix_length);
+	hash = Hit_HashKey (sketch, key, family);
+
+	for (hitter_ind = sketch->hash_heads[hash]; hitter_ind != NO_HITTER; hitter_ind = sketch->hitters[hitter_ind].hash_next)
+	{
+		hitter = &sketch->hitters[hitter_ind];
+		if (hitter->key == key && hitter->family == family)
+			break;
+	}
+
+	// Known source
+	if (hitter_ind != NO_HITTER)
+	{
+		hitter->count++;
+		hitter->class_counts[msg_class]++;
+		Hit_HeapSiftDown (sketch, hitter->heap_pos);
+	}
+
+	// New source, and the sketch isn't full yet
+	else if (sketch->nb_hitters < max_nb_hitters)
+	{
+		hitter_ind = sketch->nb_hitters++;
+		hitter = &sketch->hitters[hitter_ind];
+		memset (hitter, 0, sizeof (*hitter));
+		hitter->key = key;
+		hitter->family = (qbyte)family;
+		hitter->count = 1;
+		hitter->class_counts[msg_class] = 1;
+
+		hitter->hash_next = sketch->hash_heads[hash];
+		sketch->hash_heads[hash] = hitter_ind;
+
+		hitter->heap_pos = hitter_ind;
+		sketch->heap[hitter_ind] = hitter_ind;
+		Hit_HeapSiftUp (sketch, hitter_ind);
+	}
+
+	// New source replacing the one with the lowest count
+	else
+	{
+		unsigned int* link;
+
+		hitter_ind = sketch->heap[0];
+		hitter = &sketch->hitters[hitter_ind];
+
+		link = &sketch->hash_heads[Hit_HashKey (sketch, hitter->key, hitter->family)];
+		while (*link != hitter_ind)
+		{
+			assert (*link != NO_HITTER);
+			link = &sketch->hitters[*link].hash_next;
+		}
+		*link = hitter->hash_next;
+
+		hitter->key = key;
+		hitter->family = (qbyte)family;
+		hitter->error = hitter->count;
+		hitter->count++;
+		memset (hitter->class_counts, 0, sizeof (hitter->class_counts));
+		hitter->class_counts[msg_class] = 1;
+		hitter->ban_end = 0;
+
+		hitter->hash_next = sketch->hash_heads[hash];
+		sketch->hash_heads[hash] = hitter_ind;
+
+		Hit_HeapSiftDown (sketch, 0);
+	}
+
+	// Ban the source if we're sure it has sent too many packets recently
+	if (sketch->max_packets > 0 && hitter->count - hitter->error >= sketch->max_packets &&
+		hitter->ban_end <= crt_time)
+		Hit_Ban (sketch, hitter);
+}
+
+
+/*
+====================
+Hit_IsBanned
+
+Return "true" if an address is currently banned
+====================
+*/
+static qboolean Hit_IsBanned (qu64 address_key, int family)
+{
+	unsigned int ind = 0;
+
+	while (ind < nb_bans)
+	{
+		const ban_t* ban = &bans[ind];
+
+		// Remove the expired bans
+		if (ban->end_time <= crt_time)
+		{
+			nb_bans--;
+			bans[ind] = bans[nb_bans];
+			continue;
+		}
+
+		if (ban->family == family &&
+			Hit_GetSourceKey (address_key, family, ban->prefix_length) == ban->key)
+			return true;
+
+		ind++;
+	}
+
+	return false;
+}
+
+
+/*
+====================
+Hit_CompareHitters
+
+Compare 2 sources by decreasing packet count (for qsort)
+====================
+*/
+static int Hit_CompareHitters (const void* ind1, const void* ind2)
+{
+	unsigned int count1 = sorted_hitters[*(const unsigned int*)ind1].count;
+	unsigned int count2 = sorted_hitters[*(const unsigned int*)ind2].count;
+
+	if (count1 > count2)
+		return -1;
+	if (count1 < count2)
+		return 1;
+	return 0;
+}
+
+
+// ---------- Public functions ---------- //
+
+/*
+====================
+Hit_SetNbSources
+
+Set the number of sources tracked (0 disables the heavy-hitter detection)
+====================
+*/
+qboolean Hit_SetNbSources (unsigned int nb_sources)
+{
+	// Too late? Or too many sources?
+	if (initialized || nb_sources > MAX_HIT_NB_SOURCES)
+		return false;
+
+	max_nb_hitters = nb_sources;
+	return true;
+}
+
+
+/*
+====================
+Hit_SetAutoBan
+
+Set the packet counts above which a source is automatically banned, and for how long
+====================
+*/
+qboolean Hit_SetAutoBan (unsigned int max_packets, unsigned int max_prefix_packets, time_t duration)
+{
+	if (initialized || max_packets == 0 || max_prefix_packets == 0 || duration <= 0)
+		return false;
+
+	sketches[0].max_packets = max_packets;
+	sketches[1].max_packets = max_prefix_packets;
+	ban_duration = duration;
+	return true;
+}
+
+
+/*
+====================
+Hit_Init
+
+Allocate the source counters
+====================
+*/
+qboolean Hit_Init (void)
+{
+	unsigned int sketch_ind;
+
+	initialized = true;
+	if (max_nb_hitters == 0)
+	{
+		if (ban_duration > 0)
+			Com_Printf (MSG_WARNING,
+						"> WARNING: the automatic bans need the heavy-hitter detection\n");
+		return true;
+	}
+
+	for (sketch_ind = 0; sketch_ind < NB_SKETCHES; sketch_ind++)
+	{
+		sketch_t* sketch = &sketches[sketch_ind];
+		unsigned int hash_table_size, ind;
+
+		sketch->desc = &sketch_descs[sketch_ind];
+		sketch->hash_size = 0;
+		while ((1U << sketch->hash_size) < max_nb_hitters)
+			sketch->hash_size++;
+		hash_table_size = 1U << sketch->hash_size;
+
+		sketch->hitters = malloc (max_nb_hitters * sizeof (sketch->hitters[0]));
+		sketch->heap = malloc (max_nb_hitters * sizeof (sketch->heap[0]));
+		sketch->hash_heads = malloc (hash_table_size * sizeof (sketch->hash_heads[0]));
+		if (sketch->hitters == NULL || sketch->heap == NULL || sketch->hash_heads == NULL)
+		{
+			Com_Printf (MSG_ERROR,
+						"> ERROR: can't allocate the heavy-hitter tables (%s)\n",
+						strerror (errno));
+			return false;
+		}
+
+		for (ind = 0; ind < hash_table_size; ind++)
+			sketch->hash_heads[ind] = NO_HITTER;
+		sketch->nb_hitters = 0;
+	}
+
+	next_decay_time = crt_time + HIT_DECAY_PERIOD;
+
+	Com_Printf (MSG_NORMAL, "> Heavy-hitter detection enabled (%u addresses and %u prefixes)\n",
+				max_nb_hitters, max_nb_hitters);
+	if (ban_duration > 0)
+		Com_Printf (MSG_NORMAL,
+					"> Automatic bans enabled (%u packets per address, %u per prefix, for %ld seconds)\n",
+					sketches[0].max_packets, sketches[1].max_packets, (long)ban_duration);
+	return true;
+}
+
+
+/*
+====================
+Hit_RecordMessage
+
+Count a message from this source, and return "true" if the source is banned
+====================
+*/
+qboolean Hit_RecordMessage (const struct sockaddr_storage* addr, fp_class_t msg_class)
+{
+	qu64 address_key;
+	unsigned int sketch_ind;
+
+	if (max_nb_hitters == 0)
+		return false;
+
+	assert (msg_class < NB_FP_CLASSES);
+
+	// Halve the counters periodically, so they reflect the recent traffic
+	if (crt_time >= next_decay_time)
+	{
+		Hit_Decay ();
+		next_decay_time = crt_time + HIT_DECAY_PERIOD;
+	}
+
+	address_key = Com_AddressKey (addr);
+	for (sketch_ind = 0; sketch_ind < NB_SKETCHES; sketch_ind++)
+		Hit_UpdateSketch (&sketches[sketch_ind], address_key, addr->ss_family, msg_class);
+
+	return (nb_bans > 0 && Hit_IsBanned (address_key, addr->ss_family));
+}
+
+
+/*
+====================
+Hit_Print
+
+Print the heaviest sources and the banned ones
+====================
+*/
+void Hit_Print (msg_level_t msg_level, unsigned int nb_sources)
+{
+	unsigned int sketch_ind, ind;
+
+	if (max_nb_hitters == 0)
+	{
+		Com_Printf (msg_level, "\n> Heavy-hitter detection: disabled\n");
+		return;
+	}
+
+	for (sketch_ind = 0; sketch_ind < NB_SKETCHES; sketch_ind++)
+	{
+		const sketch_t* sketch = &sketches[sketch_ind];
+		unsigned int* sorted;
+
+		Com_Printf (msg_level,
+					"\n> Heaviest sources by %s (%u tracked, packet counts halved every %u seconds):\n",
+					sketch->desc->name, sketch->nb_hitters, HIT_DECAY_PERIOD);
+		if (sketch->nb_hitters == 0)
+			continue;
+
+		sorted = malloc (sketch->nb_hitters * sizeof (sorted[0]));
+		if (sorted == NULL)
+			continue;
+		for (ind = 0; ind < sketch->nb_hitters; ind++)
+			sorted[ind] = ind;
+		sorted_hitters = sketch->hitters;
+		qsort (sorted, sketch->nb_hitters, sizeof (sorted[0]), Hit_CompareHitters);
+
+		for (ind = 0; ind < sketch->nb_hitters && ind < nb_sources; ind++)
+		{
+			const hitter_t* hitter = &sketch->hitters[sorted[ind]];
+			char classes [256];
+			size_t length = 0;
+			unsigned int class_ind;
+
+			if (hitter->count == 0)
+				break;
+
+			classes[0] = '\0';
+			for (class_ind = 0; class_ind < NB_FP_CLASSES && length < sizeof (classes); class_ind++)
+				if (hitter->class_counts[class_ind] > 0)
+					length += snprintf (classes + length, sizeof (classes) - length, " %s=%u",
+										Cl_GetFPClassName ((fp_class_t)class_ind),
+										hitter->class_counts[class_ind]);
+
+			Com_Printf (msg_level, " * %s: %u packets (error <= %u)%s\n",
+						Hit_SourceToString (hitter->key, hitter->family,
+											hitter->family == AF_INET6 ? sketch->desc->ipv6_prefix_length : sketch->desc->ipv4_prefix_length),
+						hitter->count, hitter->error, classes);
+		}
+
+		free (sorted);
+	}
+
+	if (ban_duration > 0)
+	{
+		Com_Printf (msg_level, "\n> Banned sources:\n");
+		for (ind = 0; ind < nb_bans; ind++)
+			if (bans[ind].end_time > crt_time)
+				Com_Printf (msg_level, " * %s: %ld seconds left\n",
+							Hit_SourceToString (bans[ind].key, bans[ind].family, bans[ind].prefix_length),
+							(long)(bans[ind].end_time - crt_time));
+	}
+}
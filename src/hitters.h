@@ -0,0 +1,64 @@
+/*
+	hitters.h
+
+	Heavy-hitter detection and automatic bans for dpmaster
+
+	Copyright (C) 2011  Mathieu Olivier
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef _HITTERS_H_
+#define _HITTERS_H_
+
+
+// ---------- Constants ---------- //
+
+// Default and maximum number of sources tracked, for the addresses and for the prefixes
+#define DEFAULT_HIT_NB_SOURCES 256
+#define MAX_HIT_NB_SOURCES 65536
+
+// Length of the prefixes tracked (in bits)
+#define HIT_IPV4_PREFIX_LENGTH 24
+#define HIT_IPV6_PREFIX_LENGTH 48
+
+// The packet counters are halved every HIT_DECAY_PERIOD seconds
+#define HIT_DECAY_PERIOD 10
+
+// Maximum number of sources banned at the same time
+#define MAX_HIT_NB_BANS 64
+
+// Number of sources printed with the statistics
+#define HIT_NB_PRINTED_SOURCES 10
+
+
+// ---------- Public functions ---------- //
+
+// Will simply return "false" if called after Hit_Init
+qboolean Hit_SetNbSources (unsigned int nb_sources);
+qboolean Hit_SetAutoBan (unsigned int max_packets, unsigned int max_prefix_packets, time_t duration);
+
+// Allocate the source counters
+qboolean Hit_Init (void);
+
+// Count a message from this source, and return "true" if the source is banned
+qboolean Hit_RecordMessage (const struct sockaddr_storage* addr, fp_class_t msg_class);
+
+// Print the heaviest sources and the banned ones
+void Hit_Print (msg_level_t msg_level, unsigned int nb_sources);
+
+
+#endif  // #ifndef _HITTERS_H_
@@ -20,31 +20,45 @@
 	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
-#include <GeoIP.h>
 
 #include "common.h"
 #include "system.h"
 
 #include "clients.h"
+#include "cookies.h"
+#include "egress.h"
 #include "games.h"
+#include "geoip.h"
+#include "hitters.h"
 #include "messages.h"
+#include "overload.h"
+#include "probes.h"
+#include "recorder.h"
+#include "revalidation.h"
 #include "servers.h"
+#include "stats.h"
 
 
 // ---------- Constants ---------- //
 
-// Timeout after a valid infoResponse (in secondes)
-#define TIMEOUT_INFORESPONSE (40)
-
-// Period of validity for a challenge string (in secondes)
-#define TIMEOUT_CHALLENGE 2
-
-// Maximum size of a reponse packet
-#define MAX_PACKET_SIZE_OUT 1300
+// Getservers responses cache, used when overloaded: number of entries,
+// maximum length of the requests and number of packets of the responses,
+// and how long a response can be used (in seconds)
+#define RESPONSE_CACHE_SIZE 64
+#define RESPONSE_CACHE_KEY_LENGTH 128
+#define RESPONSE_CACHE_MAX_PACKETS 32
+#define RESPONSE_CACHE_MAX_AGE 30
 
 // Maximum size of data to relay using relaySend/relayRecv messages
 #define MAX_RELAY_DATA_SIZE 512
 
+// Maximum size of a getinfo message
+#define MAX_GETINFO_SIZE 64
+
+// Maximum number of getinfo messages waiting for the end of the current batch
+// of packets. There's at most one per heartbeat, so a batch can't overflow it
+#define GETINFO_QUEUE_SIZE MAX_BATCH_SIZE
+
 // Types of messages (with samples):
 
 // Q3: "heartbeat QuakeArena-1\x0A"
@@ -88,12 +102,71 @@
 // DP "getserversWithInfoResponse\n\\addr6\\xxxx:xxxx:xxxx:xxxx:xxxx:xxxx:xxxx:xxxx port\\(other info ...)\n(next server info)"
 #define M2C_GETSERVERSWITHINFOREPONSE "getserversWithInfoResponse"
 
+// DP & others: "getserversToken A_Token", sent instead of a getservers
+// response larger than the reflection limit, if the client sent a "token" option
+#define M2C_GETSERVERSTOKEN "getserversToken "
+
 // DP "getMyAddrResponse xxx.xxx.xxx.xxx port"
 #define M2C_GETMYADDRRESPONSE "getMyAddrResponse "
 
 // DP: "relayRecv xxx.xxx.xxx.xxx port\ndata..."
 #define M2C_RELAYRECV "relayRecv "
 
+
+// ---------- Private types ---------- //
+
+// A getservers response, stored in the cache
+typedef struct
+{
+	char request [RESPONSE_CACHE_KEY_LENGTH];
+	time_t time;
+	unsigned int nb_packets;
+	size_t size;
+	unsigned short packet_sizes [RESPONSE_CACHE_MAX_PACKETS];
+	qbyte* data;
+} cached_response_t;
+
+// A getinfo message waiting for the end of the current batch of packets
+typedef struct
+{
+	struct sockaddr_storage address;
+	socklen_t addrlen;
+	socket_t socket;
+	size_t length;
+	qboolean flushed;
+	char msg [MAX_GETINFO_SIZE];
+	char peer_address [sizeof (peer_address)];
+} queued_getinfo_t;
+
+
+// ---------- Private variables ---------- //
+
+// The getservers responses cache (direct-mapped), and the response being
+// built. Only used if the load shedding is enabled
+static cached_response_t response_cache [RESPONSE_CACHE_SIZE];
+static qboolean building_response = false;
+static cached_response_t built_response;
+static qbyte built_response_data [RESPONSE_CACHE_MAX_PACKETS * MAX_PACKET_SIZE_OUT];
+
+// The getinfo messages answering the heartbeats of the current batch of
+// packets. They are sent together by FlushGetInfos, once the batch is handled
+static queued_getinfo_t getinfo_queue [GETINFO_QUEUE_SIZE];
+static unsigned int nb_queued_getinfos = 0;
+
+#ifndef DISABLE_LATENCY_STATS
+
+// Time at which we started to handle the current message, in cycles
+static qu64 msg_start_time;
+
+#endif
+
+
+// ---------- Public variables ---------- //
+
+// Maximum size of a getservers response sent without a valid token (0 means no limit)
+unsigned int reflection_limit = 0;
+
+
 // ---------- Private functions ---------- //
 
 /*
@@ -191,89 +264,193 @@ static const char* SearchInfostring (const char* infostring, const char* key)
 
 /*
 ====================
-BuildChallenge
+GetServerCountry
 
-Build a challenge string for a "getinfo" message
+Get the country code of a server, looking it and the server location up only
+if the GeoIP database has changed since the last time. Returns NULL if it's unknown
 ====================
 */
-static const char* BuildChallenge (void)
+static const char* GetServerCountry (server_t* server)
 {
-	static char challenge [CHALLENGE_MAX_LENGTH];
-	size_t ind;
-	size_t length = CHALLENGE_MIN_LENGTH - 1;  // We start at the minimum size
+	unsigned int generation = Geo_GetGeneration ();
 
-	// ... then we add a random number of characters
-	length += rand () % (CHALLENGE_MAX_LENGTH - CHALLENGE_MIN_LENGTH + 1);
-
-	for (ind = 0; ind < length; ind++)
+	if (server->geo_generation != generation)
 	{
-		char c;
-		do
-		{
-			c = 33 + rand () % (126 - 33 + 1);  // -> c = 33..126
-		} while (c == '\\' || c == ';' || c == '"' || c == '%' || c == '/');
+		const char* country = Geo_GetCountry (&server->user.address);
 
-		challenge[ind] = c;
+		if (country != NULL)
+		{
+			strncpy (server->country, country, sizeof (server->country) - 1);
+			server->country[sizeof (server->country) - 1] = '\0';
+		}
+		else
+			server->country[0] = '\0';
+		server->located = Geo_GetLocation (&server->user.address, server->location);
+		server->geo_generation = generation;
 	}
 
-	challenge[length] = '\0';
-	return challenge;
+	return (server->country[0] != '\0' ? server->country : NULL);
 }
 
-/* Find country name from IP address */
-static const char * GetCountryFromAddress(const struct sockaddr_storage *address)
+
+/*
+====================
+GetServerTimeout
+
+Get how long a server stays in the list after a valid infoResponse, in seconds
+====================
+*/
+static unsigned int GetServerTimeout (const server_t* server)
 {
-	static GeoIP *gi = NULL;
-	const struct sockaddr_in* sv_sockaddr = (const struct sockaddr_in *)address;
-	char addr_str[64];
-	
-	if (!gi)
+	unsigned int timeout, heartbeat_interval;
+	qboolean adaptive;
+
+	timeout = Game_GetTimeout (server->gamename, &adaptive);
+	if (timeout == 0)
+		timeout = DEFAULT_SV_TIMEOUT;
+
+	// Follow the pace of the server once we know it. The heartbeats aren't
+	// authenticated, so the fixed timeout is a minimum: spoofed heartbeats
+	// could otherwise shorten the interval until the server drops off the list
+	if (adaptive)
 	{
-		gi = GeoIP_open("/usr/share/GeoIP/GeoIP.dat", GEOIP_MEMORY_CACHE);
-		if (!gi)
+		heartbeat_interval = Sv_GetHeartbeatInterval (server);
+		if (heartbeat_interval != 0 &&
+			heartbeat_interval * SV_HEARTBEAT_FACTOR > timeout)
 		{
-			Com_Printf (MSG_ERROR, "Cannot open GeoIP database at /usr/share/GeoIP/GeoIP.dat! Terminating\n");
-			exit(1);
+			timeout = heartbeat_interval * SV_HEARTBEAT_FACTOR;
+			if (timeout > MAX_SV_TIMEOUT)
+				timeout = MAX_SV_TIMEOUT;
 		}
 	}
-	if (sv_sockaddr->sin_family != AF_INET || !inet_ntop (AF_INET, &sv_sockaddr->sin_addr, addr_str, sizeof(addr_str)))
-		return NULL;
 
-	return GeoIP_country_code3_by_addr(gi, addr_str);
+	return timeout;
+}
+
+
+/*
+====================
+BuildGetInfo
+
+Build a "getinfo" message in a buffer of MAX_GETINFO_SIZE bytes, and return its length
+====================
+*/
+static size_t BuildGetInfo (char* msg, const char* challenge)
+{
+	static const char getinfo_header [] = "\xFF\xFF\xFF\xFF" M2S_GETINFO " ";
+
+	memcpy (msg, getinfo_header, sizeof (getinfo_header) - 1);
+	strncpy (msg + sizeof (getinfo_header) - 1, challenge,
+			 MAX_GETINFO_SIZE - sizeof (getinfo_header));
+	msg[MAX_GETINFO_SIZE - 1] = '\0';
+	return strlen (msg);
+}
+
+
+/*
+====================
+RecordGetInfo
+
+Log and record the outcome of the sending of a "getinfo" message
+====================
+*/
+static void RecordGetInfo (const char* msg, size_t length, const struct sockaddr_storage* addr,
+						   const char* peer, qboolean sent)
+{
+	if (! sent)
+	{
+		Com_Printf (MSG_WARNING, "> WARNING: can't send getinfo (%s)\n",
+						Egr_GetLastErrorString ());
+		Rec_Record (REC_EVENT_SEND_FAILED, REC_REASON_NONE, addr, msg, length);
+		return;
+	}
+
+	Stats_RecordChallenge ();
+	Rec_Record (REC_EVENT_GETINFO_SENT, REC_REASON_NONE, addr, NULL, 0);
+
+	Com_Printf (MSG_NORMAL, "> %s <--- getinfo with challenge \"%s\"\n",
+				peer, msg + strlen ("\xFF\xFF\xFF\xFF" M2S_GETINFO " "));
 }
 
+
 /*
 ====================
 SendGetInfo
 
-Send a "getinfo" message to a server
+Send a "getinfo" message to a server. Returns "false" if it can't be sent
 ====================
 */
-static void SendGetInfo (server_t* server, socket_t recv_socket, qboolean force_new_challenge)
+static qboolean SendGetInfo (const struct sockaddr_storage* addr, socklen_t addrlen, const char* challenge,
+							 socket_t recv_socket, egress_class_t egress_class)
 {
-	char msg [64] = "\xFF\xFF\xFF\xFF" M2S_GETINFO " ";
+	char msg [MAX_GETINFO_SIZE];
 	size_t msglen;
+	qboolean sent;
 
-	if (force_new_challenge || !server->challenge_timeout || server->challenge_timeout < crt_time)
-	{
-		const char* challenge;
+	msglen = BuildGetInfo (msg, challenge);
+	sent = Egr_Send (recv_socket, msg, msglen, addr, addrlen, egress_class);
+	RecordGetInfo (msg, msglen, addr, peer_address, sent);
+	return sent;
+}
 
-		challenge = BuildChallenge ();
-		strncpy (server->challenge, challenge, sizeof (server->challenge) - 1);
-		server->challenge_timeout = crt_time + TIMEOUT_CHALLENGE;
-	}
 
+/*
+====================
+QueueGetInfo
+
+Queue a "getinfo" message, to send it with the other ones answering the
+heartbeats of the current batch of packets (see FlushGetInfos)
+====================
+*/
+static void QueueGetInfo (const struct sockaddr_storage* addr, socklen_t addrlen, const char* challenge,
+						  socket_t recv_socket)
+{
+	queued_getinfo_t* getinfo;
+
+	if (nb_queued_getinfos >= GETINFO_QUEUE_SIZE)
+		FlushGetInfos ();
+
+	getinfo = &getinfo_queue[nb_queued_getinfos++];
+	memcpy (&getinfo->address, addr, addrlen);
+	getinfo->addrlen = addrlen;
+	getinfo->socket = recv_socket;
+	getinfo->length = BuildGetInfo (getinfo->msg, challenge);
+	getinfo->flushed = false;
+	strcpy (getinfo->peer_address, peer_address);
+}
+
+
+/*
+====================
+SendGetServersToken
+
+Send a getservers token to a client, instead of a response too large for
+the reflection limit. Returns the size of the message, or 0 if it failed
+====================
+*/
+static size_t SendGetServersToken (const struct sockaddr_storage* addr, socklen_t addrlen, socket_t recv_socket)
+{
+	char msg [64] = "\xFF\xFF\xFF\xFF" M2C_GETSERVERSTOKEN;
+	const char* token;
+	size_t msglen;
+
+	token = Cookie_BuildToken (addr);
 	msglen = strlen (msg);
-	strncpy (msg + msglen, server->challenge, sizeof (msg) - msglen - 1);
+	strncpy (msg + msglen, token, sizeof (msg) - msglen - 1);
 	msg[sizeof (msg) - 1] = '\0';
-	if (sendto (recv_socket, msg, strlen (msg), 0,
-				(const struct sockaddr*)&server->user.address,
-				server->user.addrlen) < 0)
-		Com_Printf (MSG_WARNING, "> WARNING: can't send getinfo (%s)\n",
-					Sys_GetLastNetErrorString ());
-	else
-		Com_Printf (MSG_NORMAL, "> %s <--- getinfo with challenge \"%s\"\n",
-					peer_address, server->challenge);
+	msglen = strlen (msg);
+	if (! Egr_Send (recv_socket, msg, msglen, addr, addrlen, EGRESS_CLASS_CONTROL))
+	{
+		Com_Printf (MSG_WARNING, "> WARNING: can't send getserversToken (%s)\n",
+						Egr_GetLastErrorString ());
+		Rec_Record (REC_EVENT_SEND_FAILED, REC_REASON_NONE, addr, msg, msglen);
+		return 0;
+	}
+
+	Stats_RecordGetServersToken ();
+	Com_Printf (MSG_NORMAL, "> %s <--- getserversToken \"%s\"\n",
+				peer_address, token);
+	return msglen;
 }
 
 
@@ -288,8 +465,10 @@ static void HandleHeartbeat (const char* msg, const struct sockaddr_storage* add
 {
 	char tag [64];
 	const game_properties_t* game_props;
-	server_t* server;
+	unsigned int game_index;
+	const char* challenge;
 	qboolean flatlineHeartbeat;
+	server_t* server;
 
 	// Extract the tag
 	sscanf (msg, "%63s", tag);
@@ -330,19 +509,231 @@ static void HandleHeartbeat (const char* msg, const struct sockaddr_storage* add
 	else
 		game_props = NULL;
 
-	// Get the server in the list (add it to the list if necessary)
-	server = Sv_GetByAddr (addr, addrlen, true);
-	if (server == NULL)
+	game_index = Game_GetPropertiesIndex (game_props);
+	if (game_index > COOKIE_MAX_GAME_INDEX)
+	{
+		Com_Printf (MSG_WARNING,
+					"> WARNING: Rejecting heartbeat from %s (too many game properties)\n",
+					peer_address);
+		return;
+	}
+
+	// Don't bother challenging a server which would be refused anyway
+	if (! Sv_CanBeAdded (addr, game_props != NULL ? game_props->name : NULL))
+		return;
+
+	// Keep track of the heartbeat intervals of the registered servers
+	server = Sv_GetByAddr (addr, addrlen, false, NULL);
+	if (server != NULL)
+		Sv_RecordHeartbeat (server);
+
+	// Servers often send their heartbeats several times in a row. Until
+	// our challenge expires, sending it again would only waste bandwidth
+	if (Sv_IsChallengePending (addr, game_index))
+	{
+		Com_Printf (MSG_DEBUG, "  - challenge already pending (heartbeat ignored)\n");
+		Stats_RecordDuplicateHeartbeat ();
+		return;
+	}
+
+	// Ask for some infos. The server will only be added to
+	// the list once it has answered with a valid infoResponse.
+	// In the "cookie" mode, the challenge is all we need to check
+	// this infoResponse, so we only remember it to absorb the
+	// duplicate heartbeats
+	if (challenge_mode == CHALLENGE_MODE_TABLE)
+		challenge = Sv_AddPending (addr, game_index);
+	else
+	{
+		challenge = Cookie_BuildChallenge (addr, game_index);
+		Sv_AddRecentChallenge (addr, game_index);
+	}
+	QueueGetInfo (addr, addrlen, challenge, recv_socket);
+
+	// Keep track of the challenges sent to the registered servers
+	if (server != NULL)
+		Sv_RecordChallenge (server);
+}
+
+
+/*
+====================
+GetCachedResponseSlot
+
+Return the cache slot of a getservers request
+====================
+*/
+static cached_response_t* GetCachedResponseSlot (const char* request)
+{
+	unsigned int hash = 2166136261U;
+
+	// FNV-1a
+	while (*request != '\0')
+	{
+		hash ^= (qbyte)*request++;
+		hash *= 16777619U;
+	}
+
+	return &response_cache[(hash ^ (hash >> 16)) % RESPONSE_CACHE_SIZE];
+}
+
+
+/*
+====================
+BuildCacheKey
+
+Build the key of a getservers request in the response cache: the request
+name and its parameters. Returns "false" if the key is too long
+====================
+*/
+static qboolean BuildCacheKey (char* key, size_t key_size, const char* request_name, const char* msg)
+{
+	size_t name_len = strlen (request_name);
+	size_t msg_len = strlen (msg);
+
+	if (name_len + 1 + msg_len >= key_size)
+		return false;
+
+	memcpy (key, request_name, name_len);
+	key[name_len] = ' ';
+	memcpy (&key[name_len + 1], msg, msg_len + 1);
+	return true;
+}
+
+
+/*
+====================
+StartCachedResponse
+
+Start recording a getservers response, to store it in the cache once complete
+====================
+*/
+static void StartCachedResponse (const char* request_name, const char* msg)
+{
+	building_response = BuildCacheKey (built_response.request, sizeof (built_response.request),
+									   request_name, msg);
+	if (! building_response)
+		return;
+
+	built_response.nb_packets = 0;
+	built_response.size = 0;
+}
+
+
+/*
+====================
+CommitCachedResponse
+
+Store the getservers response just sent in the cache
+====================
+*/
+static void CommitCachedResponse (void)
+{
+	cached_response_t* slot;
+	qbyte* data;
+
+	if (! building_response)
+		return;
+	building_response = false;
+
+	slot = GetCachedResponseSlot (built_response.request);
+	data = realloc (slot->data, built_response.size);
+	if (data == NULL)
 		return;
 
-	assert (server->state != sv_state_unused_slot);
+	memcpy (slot->request, built_response.request, sizeof (slot->request));
+	slot->time = crt_time;
+	slot->nb_packets = built_response.nb_packets;
+	slot->size = built_response.size;
+	memcpy (slot->packet_sizes, built_response.packet_sizes, sizeof (slot->packet_sizes));
+	memcpy (data, built_response_data, built_response.size);
+	slot->data = data;
+}
+
+
+/*
+====================
+SendCachedResponse
+
+Answer a getservers request from the cache, if possible
+====================
+*/
+static qboolean SendCachedResponse (const char* request_name, const char* msg,
+									const struct sockaddr_storage* addr, socklen_t addrlen,
+									socket_t recv_socket, egress_class_t egress_class)
+{
+	char request [RESPONSE_CACHE_KEY_LENGTH];
+	const cached_response_t* slot;
+	const qbyte* packet;
+	unsigned int packet_ind;
+
+	if (! BuildCacheKey (request, sizeof (request), request_name, msg))
+		return false;
+
+	// The responses are only stored if they aren't limited by the reflection
+	// limit and if they don't need a token, so any client can get them
+	slot = GetCachedResponseSlot (request);
+	if (slot->data == NULL || strcmp (slot->request, request) != 0 ||
+		crt_time - slot->time > RESPONSE_CACHE_MAX_AGE)
+		return false;
+
+	packet = slot->data;
+	for (packet_ind = 0; packet_ind < slot->nb_packets; packet_ind++)
+	{
+		size_t size = slot->packet_sizes[packet_ind];
+
+		if (! Egr_Send (recv_socket, packet, size, addr, addrlen, egress_class))
+		{
+			Com_Printf (MSG_WARNING, "> WARNING: can't send %s (%s)\n",
+						request_name, Egr_GetLastErrorString ());
+			Rec_Record (REC_EVENT_SEND_FAILED, REC_REASON_NONE, addr, packet, size);
+		}
+		packet += size;
+	}
+
+	Com_Printf (MSG_NORMAL, "> %s <--- %sResponse (from the cache, %ld seconds old)\n",
+				peer_address, request_name, (long)(crt_time - slot->time));
+	return true;
+}
+
 
-	// Ask for some infos.
-	// Force a new challenge if the heartbeat tag has changed
-	SendGetInfo (server, recv_socket, server->hb_properties != game_props);
+/*
+====================
+SendGetServersPacket
+
+Send a packet of a getservers response
+====================
+*/
+static void SendGetServersPacket (const qbyte* packet, size_t size,
+								  const struct sockaddr_storage* addr, socklen_t addrlen,
+								  socket_t recv_socket, egress_class_t egress_class,
+								  const char* request_name, const char* gamename,
+								  unsigned int nb_servers)
+{
+	PROBE4 (getservers__packet, addr, gamename, nb_servers, size);
+	if (! Egr_Send (recv_socket, packet, size, addr, addrlen, egress_class))
+	{
+		Com_Printf (MSG_WARNING, "> WARNING: can't send %s (%s)\n",
+						request_name, Egr_GetLastErrorString ());
+		Rec_Record (REC_EVENT_SEND_FAILED, REC_REASON_NONE, addr, packet, size);
+	}
+	else
+		Com_Printf (MSG_NORMAL, "> %s <--- %sResponse (%u servers)\n",
+					peer_address, request_name, nb_servers);
 
-	// Save the game properties for a future use
-	server->hb_properties = game_props;
+	// Record it for the cache
+	if (building_response)
+	{
+		if (built_response.nb_packets < RESPONSE_CACHE_MAX_PACKETS)
+		{
+			memcpy (&built_response_data[built_response.size], packet, size);
+			built_response.packet_sizes[built_response.nb_packets] = (unsigned short)size;
+			built_response.nb_packets++;
+			built_response.size += size;
+		}
+		else
+			building_response = false;
+	}
 }
 
 
@@ -376,10 +767,19 @@ static void HandleGetServers (const char* msg, const struct sockaddr_storage* ad
 	char* option_ptr;
 	unsigned int nb_servers;
 	const char* request_name;
-	int serverinfo_len = 0;
-
-	if (Cl_BlockedByThrottle (addr, addrlen))
-		return;
+	qboolean opt_token = false;
+	qboolean opt_nearest = false;
+	qboolean opt_liveness = false;
+	unsigned int min_reliability = 0;
+	qboolean limited = (reflection_limit != 0);
+	size_t eot_size = (with_info ? 0 : 7);
+	size_t skipped_size = 0;
+	unsigned int nb_skipped = 0;
+	egress_class_t egress_class;
+
+	// Never record this response under the key of a previous request
+	// which didn't complete its own
+	building_response = false;
 
 	if (with_info)
 	{
@@ -401,6 +801,23 @@ static void HandleGetServers (const char* msg, const struct sockaddr_storage* ad
 		use_dp_protocol = (end_ptr == msg || (*end_ptr != ' ' && *end_ptr != '\0'));
 	}
 
+	// The large responses with infostrings are the least urgent ones
+	egress_class = (with_info ? EGRESS_CLASS_BULK : EGRESS_CLASS_LIST);
+
+	// When overloaded, only the responses we already have are sent
+	if (Ovl_GetLevel () == OVERLOAD_CACHE_ONLY)
+	{
+		if (SendCachedResponse (request_name, msg, addr, addrlen, recv_socket, egress_class))
+			Ovl_RecordShed (OVL_SHED_CACHED);
+		else
+		{
+			Com_Printf (MSG_DEBUG, "> %s ---> %s (dropped, not in the cache)\n",
+						peer_address, request_name);
+			Ovl_RecordShed (OVL_SHED_NOT_CACHED);
+		}
+		return;
+	}
+
 	if (use_dp_protocol)
 	{
 		char *space;
@@ -515,12 +932,41 @@ static void HandleGetServers (const char* msg, const struct sockaddr_storage* ad
 			gametype[sizeof(gametype) - 1] = '\0';
 			opt_gametype = true;
 		}
+		else if (strncmp (option_ptr, "reliability=", 12) == 0)
+		{
+			const char* reliability_string = option_ptr + 12;
+			long reliability = strtol (reliability_string, &end_ptr, 0);
+
+			if (end_ptr != reliability_string && *end_ptr == '\0' && reliability >= 0)
+				min_reliability = (unsigned int)reliability;
+		}
+		else if (strcmp (option_ptr, "token") == 0)
+			opt_token = true;
+		else if (strncmp (option_ptr, "token=", 6) == 0)
+		{
+			opt_token = true;
+			if (limited)
+			{
+				cookie_status_t token_status = Cookie_CheckToken (option_ptr + 6, addr);
+
+				if (token_status == COOKIE_VALID)
+					limited = false;
+				else
+					Com_Printf (MSG_DEBUG, "  - %s token \"%s\"\n",
+								token_status == COOKIE_EXPIRED ? "Obsolete" : "Invalid",
+								option_ptr + 6);
+			}
+		}
 		else if (extended_request)
 		{
 			if (strcmp (option_ptr, "ipv4") == 0)
 				opt_ipv4 = true;
 			else if (strcmp (option_ptr, "ipv6") == 0)
 				opt_ipv6 = true;
+			else if (strcmp (option_ptr, "nearest") == 0)
+				opt_nearest = true;
+			else if (with_info && strcmp (option_ptr, "liveness") == 0)
+				opt_liveness = true;
 		}
 		option_ptr = strtok (NULL, " ");
 	}
@@ -532,6 +978,10 @@ static void HandleGetServers (const char* msg, const struct sockaddr_storage* ad
 		opt_ipv6 = true;
 	}
 
+	// The responses to a token or to a specific location can't be reused
+	if (overload_shedding && ! opt_token && ! opt_nearest)
+		StartCachedResponse (request_name, msg);
+
 	// Initialize the packet contents with the header
 	if (with_info)
 		packetheader = "\xFF\xFF\xFF\xFF" M2C_GETSERVERSWITHINFOREPONSE;
@@ -543,9 +993,26 @@ static void HandleGetServers (const char* msg, const struct sockaddr_storage* ad
 	packetind = headersize;
 	memcpy(packet, packetheader, headersize);
 
+	// Start with the nearest servers if the client wants it and we know where it is
+	sv = NULL;
+	if (opt_nearest)
+	{
+		float client_location [3];
+
+		if (Geo_GetLocation (addr, client_location))
+			sv = Sv_GetFirstNearest (client_location);
+		else
+		{
+			Com_Printf (MSG_DEBUG, "  - Unknown client location, the servers won't be sorted\n");
+			opt_nearest = false;
+		}
+	}
+	if (! opt_nearest)
+		sv = Sv_GetFirst ();
+
 	// Add every relevant server
 	nb_servers = 0;
-	for (sv = Sv_GetFirst (); sv != NULL; sv = Sv_GetNext ())
+	for (; sv != NULL; sv = Sv_GetNext ())
 	{
 		size_t next_sv_size;
 
@@ -578,6 +1045,10 @@ static void HandleGetServers (const char* msg, const struct sockaddr_storage* ad
 				Com_Printf (MSG_DEBUG,
 							"    Reject: gametype \"%s\" != requested \"%s\"\n",
 							sv->gametype, gametype);
+			else if (Sv_GetReliability (sv) < min_reliability)
+				Com_Printf (MSG_DEBUG,
+							"    Reject: reliability %u%% < requested %u%%\n",
+							Sv_GetReliability (sv), min_reliability);
 			else
 			{
 				if (gamename[0] != '\0')
@@ -621,6 +1092,7 @@ static void HandleGetServers (const char* msg, const struct sockaddr_storage* ad
 				Com_Printf (MSG_WARNING,
 							"> WARNING: Rejecting %s from %s (game \"%s\" is not accepted)\n",
 							request_name, peer_address, gamename);
+				building_response = false;
 				return;
 			}
 		}
@@ -631,6 +1103,7 @@ static void HandleGetServers (const char* msg, const struct sockaddr_storage* ad
 			(! opt_ipv4 && sv->user.address.ss_family == AF_INET) ||
 			(! opt_ipv6 && sv->user.address.ss_family == AF_INET6) ||
 			(opt_gametype && strcmp (gametype, sv->gametype) != 0) ||
+			Sv_GetReliability (sv) < min_reliability ||
 			strcmp (gamename, sv->gamename) != 0)
 		{
 			// Skip it
@@ -638,136 +1111,97 @@ static void HandleGetServers (const char* msg, const struct sockaddr_storage* ad
 		}
 
 		// If the packet doesn't have enough free space for this server
-		next_sv_size = (sv->user.address.ss_family == AF_INET ? 4 : 16) + 3;
 		if (with_info)
 		{
-			serverinfo_len = strlen(sv->serverinfo);
-			if (serverinfo_len == 0)
-				continue; // Don't send servers which do did not respond to ping
-			next_sv_size = serverinfo_len + 1;
-			next_sv_size += (sv->user.address.ss_family == AF_INET) ?
-							sizeof("\\addr\\xxx.xxx.xxx.xxx portx") :
-							sizeof("\\addr6\\xxxx:xxxx:xxxx:xxxx:xxxx:xxxx:xxxx:xxxx portx");
+			// Don't send servers which do did not respond to ping
+			if (sv->info_line_len == sv->info_addr_len)
+				continue;
+			next_sv_size = sv->info_line_len;
+			if (opt_liveness)
+				next_sv_size += sizeof("\\rtt\\4294967295\\reliability\\100") - 1;
+		}
+		else
+			next_sv_size = sv->addr_record_len;
+
+		// Without a valid token, the response must fit in the reflection
+		// limit. Since the limit is smaller than a packet, it's the first one
+		if (limited &&
+			(nb_skipped > 0 || packetind + next_sv_size + eot_size > reflection_limit))
+		{
+			skipped_size += next_sv_size;
+			nb_skipped++;
+			continue;
 		}
+
 		if (packetind + next_sv_size > sizeof (packet))
 		{
 			// Send the packet to the client
-			if (sendto (recv_socket, (void*)packet, packetind, 0,
-					(const struct sockaddr*)addr, addrlen) < 0)
-				Com_Printf (MSG_WARNING, "> WARNING: can't send %s (%s)\n",
-							request_name, Sys_GetLastNetErrorString ());
-			else
-				Com_Printf (MSG_NORMAL, "> %s <--- %sResponse (%u servers)\n",
-							peer_address, request_name, nb_servers);
+			SendGetServersPacket (packet, packetind, addr, addrlen, recv_socket, egress_class,
+								  request_name, gamename, nb_servers);
 			
 			// Reset the packet index (no need to change the header)
 			packetind = headersize;
 			nb_servers = 0;
 		}
 
+		// The records of the servers are serialized when they register,
+		// so they only have to be copied
 		if (with_info)
 		{
-			char addr_str [sizeof("\nxxxx:xxxx:xxxx:xxxx:xxxx:xxxx:xxxx:xxxx") + 1];
-			int pridx;
-			if (sv->user.address.ss_family == AF_INET)
-			{
-				const struct sockaddr_in* sv_sockaddr = (const struct sockaddr_in *)&sv->user.address;
-				inet_ntop (sv->user.address.ss_family, &sv_sockaddr->sin_addr, addr_str, sizeof(addr_str));
-				pridx = sprintf ((char *)packet + packetind, "\n\\addr\\%s %u", addr_str, ntohs (sv_sockaddr->sin_port));
-			}
-			else
-			{
-				const struct sockaddr_in6* sv_sockaddr6 = (const struct sockaddr_in6 *)&sv->user.address;
-				inet_ntop (sv->user.address.ss_family, &sv_sockaddr6->sin6_addr, addr_str, sizeof(addr_str));
-				pridx = sprintf ((char *)packet + packetind, "\n\\add6r\\%s %u", addr_str, ntohs (sv_sockaddr6->sin6_port));
-			}
-			packetind += pridx;
-			strncpy ((char *)packet + packetind, sv->serverinfo, serverinfo_len);
-			packetind += serverinfo_len;
+			memcpy (&packet[packetind], sv->info_line, sv->info_line_len);
+			packetind += sv->info_line_len;
+
+			// Add what we know about the liveness of the server, if asked
+			if (opt_liveness)
+				packetind += sprintf ((char *)packet + packetind, "\\rtt\\%u\\reliability\\%u",
+									  Sv_GetRTT (sv), Sv_GetReliability (sv));
 		}
-		else if (sv->user.address.ss_family == AF_INET)
+		else
 		{
-			const struct sockaddr_in* sv_sockaddr;
-			unsigned int sv_addr;
-			unsigned short sv_port;
-
-			sv_sockaddr = (const struct sockaddr_in *)&sv->user.address;
-			sv_addr = ntohl (sv_sockaddr->sin_addr.s_addr);
-			sv_port = ntohs (sv_sockaddr->sin_port);
-
-			// Use the address mapping associated with the server, if any
-			if (sv->addrmap != NULL)
-			{
-				const addrmap_t* addrmap = sv->addrmap;
-
-				sv_addr = ntohl (addrmap->to.sin_addr.s_addr);
-				if (addrmap->to.sin_port != 0)
-					sv_port = ntohs (addrmap->to.sin_port);
-
-				Com_Printf (MSG_DEBUG,
-							"  - Using mapped address %u.%u.%u.%u:%hu\n",
-							sv_addr >> 24, (sv_addr >> 16) & 0xFF,
-							(sv_addr >> 8) & 0xFF, sv_addr & 0xFF,
-							sv_port);
-			}
+			memcpy (&packet[packetind], sv->addr_record, sv->addr_record_len);
 
-			// Heading '\'
-			packet[packetind    ] = '\\';
+			if (sv->addr_record_len == 7)
+				Com_Printf (MSG_DEBUG, "  - Sending server %u.%u.%u.%u:%hu\n",
+							packet[packetind + 1], packet[packetind + 2],
+							packet[packetind + 3], packet[packetind + 4],
+							(packet[packetind + 5] << 8) | packet[packetind + 6]);
 
-			// IP address
-			packet[packetind + 1] =  sv_addr >> 24;
-			packet[packetind + 2] = (sv_addr >> 16) & 0xFF;
-			packet[packetind + 3] = (sv_addr >>  8) & 0xFF;
-			packet[packetind + 4] =  sv_addr        & 0xFF;
+			packetind += sv->addr_record_len;
+		}
 
-			// Port
-			packet[packetind + 5] = sv_port >> 8;
-			packet[packetind + 6] = sv_port & 0xFF;
+		nb_servers++;
+	}
 
-			Com_Printf (MSG_DEBUG, "  - Sending server %u.%u.%u.%u:%hu\n",
-						packet[packetind + 1], packet[packetind + 2],
-						packet[packetind + 3], packet[packetind + 4],
-						sv_port);
+	// If the response has been cut by the reflection limit
+	if (nb_skipped > 0)
+	{
+		size_t full_size = packetind + skipped_size + eot_size;
 
-			packetind += 7;
-		}
-		else
+		// A client which knows about the tokens gets one, rather than a partial list
+		if (opt_token)
 		{
-			const struct sockaddr_in6* sv_sockaddr6;
-			unsigned short sv_port;
+			size_t token_size = SendGetServersToken (addr, addrlen, recv_socket);
 
-			sv_sockaddr6 = (const struct sockaddr_in6 *)&sv->user.address;
+			if (token_size != 0)
+				Stats_RecordLimitedResponse (full_size - token_size);
 
-			// Heading '/'
-			packet[packetind] = '/';
-			packetind += 1;
-
-			// IP address
-			memcpy (&packet[packetind], &sv_sockaddr6->sin6_addr.s6_addr,
-					sizeof(sv_sockaddr6->sin6_addr.s6_addr));
-			packetind += sizeof(sv_sockaddr6->sin6_addr.s6_addr);
-
-			// Port
-			sv_port = ntohs (sv_sockaddr6->sin6_port);
-			packet[packetind    ] = sv_port >> 8;
-			packet[packetind + 1] = sv_port & 0xFF;
-			packetind += 2;
+			LATENCY_RECORD_GAME (gamename, msg_start_time);
+			return;
 		}
 
-		nb_servers++;
+		Com_Printf (MSG_NORMAL,
+					"> %s: %s response limited to its first page (%u servers left out)\n",
+					peer_address, request_name, nb_skipped);
+		building_response = false;
+		Stats_RecordLimitedResponse (skipped_size);
 	}
 
 	// If the packet doesn't have enough free space for the EOT mark
 	if (packetind + 7 > sizeof (packet) && !with_info)
 	{
 		// Send the packet to the client
-		if (sendto (recv_socket, (void*)packet, packetind, 0,
-				(const struct sockaddr*)addr, addrlen) < 0)
-			Com_Printf (MSG_WARNING, "> WARNING: can't send %s (%s)\n",
-						request_name, Sys_GetLastNetErrorString ());
-		else
-			Com_Printf (MSG_NORMAL, "> %s <--- %sResponse (%u servers)\n",
-						peer_address, request_name, nb_servers);
+		SendGetServersPacket (packet, packetind, addr, addrlen, recv_socket, egress_class,
+							  request_name, gamename, nb_servers);
 		
 		// Reset the packet index (no need to change the header)
 		packetind = headersize;
@@ -788,13 +1222,11 @@ static void HandleGetServers (const char* msg, const struct sockaddr_storage* ad
 	}
 
 	// Send the packet to the client
-	if (sendto (recv_socket, (void*)packet, packetind, 0,
-			(const struct sockaddr*)addr, addrlen) < 0)
-		Com_Printf (MSG_WARNING, "> WARNING: can't send %s (%s)\n",
-					request_name, Sys_GetLastNetErrorString ());
-	else
-		Com_Printf (MSG_NORMAL, "> %s <--- %sResponse (%u servers)\n",
-					peer_address, request_name, nb_servers);
+	SendGetServersPacket (packet, packetind, addr, addrlen, recv_socket, egress_class,
+						  request_name, gamename, nb_servers);
+	CommitCachedResponse ();
+
+	LATENCY_RECORD_GAME (gamename, msg_start_time);
 }
 
 
@@ -805,30 +1237,66 @@ HandleInfoResponse
 Parse infoResponse messages
 ====================
 */
-static void HandleInfoResponse (server_t* server, const char* msg)
+static void HandleInfoResponse (const char* msg, const struct sockaddr_storage* addr, socklen_t addrlen, socket_t recv_socket)
 {
 	const char* value;
 	int new_protocol;
 	char new_gametype [GAMETYPE_LENGTH];
 	char* end_ptr;
 	unsigned int new_maxclients, new_clients;
+	server_t* server;
+	const game_properties_t* hb_properties;
+	cookie_status_t cookie_status;
+	unsigned int game_index;
+	qu64 elapsed_time;
+	const char* country;
+	char* serverinfo;
+
+	// Check the challenge. It tells us which game properties the heartbeat used
+	value = SearchInfostring (msg, "challenge");
+	if (value == NULL)
+		cookie_status = COOKIE_INVALID;
+	else if (challenge_mode == CHALLENGE_MODE_TABLE)
+	{
+		qboolean expired;
 
-	// Check the challenge
-	if (!server->challenge_timeout || server->challenge_timeout < crt_time)
+		if (! Sv_CheckPending (value, addr, &game_index, &elapsed_time, &expired))
+			cookie_status = COOKIE_INVALID;
+		else
+			cookie_status = (expired ? COOKIE_EXPIRED : COOKIE_VALID);
+	}
+	else
+		cookie_status = Cookie_CheckChallenge (value, addr, &game_index, &elapsed_time);
+	if (cookie_status == COOKIE_EXPIRED)
 	{
+		Stats_RecordLateInfoResponse ();
+
+		server = Sv_GetByAddr (addr, addrlen, false, NULL);
+		if (server != NULL)
+			Sv_RecordLateAnswer (server);
+
 		Com_Printf (MSG_WARNING,
 					"> WARNING: infoResponse with obsolete challenge from %s\n",
 					peer_address);
+		PROBE2 (inforesponse__reject, addr, "obsolete challenge");
 		return;
 	}
-	value = SearchInfostring (msg, "challenge");
-	if (!value || strcmp (value, server->challenge))
+	if (cookie_status != COOKIE_VALID ||
+		! Game_GetPropertiesByIndex (game_index, &hb_properties))
 	{
 		Com_Printf (MSG_WARNING, "> WARNING: invalid challenge from %s (%s)\n",
 					peer_address, value);
+		Rec_Record (REC_EVENT_PACKET_REJECTED, REC_REASON_BAD_CHALLENGE,
+					addr, msg, strlen (msg));
+		PROBE2 (inforesponse__reject, addr, "invalid challenge");
 		return;
 	}
 
+	// The challenge has been answered, even if the infoResponse turns out to be invalid
+	Stats_RecordGetInfoRTT (Sys_NanosecondsToCycles (elapsed_time * 1000));
+	if (challenge_mode == CHALLENGE_MODE_COOKIE)
+		Sv_RemoveRecentChallenge (addr);
+
 	// Check the value of "protocol"
  	value = SearchInfostring (msg, "protocol");
 	if (value == NULL)
@@ -836,6 +1304,7 @@ static void HandleInfoResponse (server_t* server, const char* msg)
 		Com_Printf (MSG_WARNING,
 					"> WARNING: invalid infoResponse from %s (no protocol value)\n",
 					peer_address);
+		PROBE2 (inforesponse__reject, addr, "no protocol");
 		return;
 	}
 	new_protocol = (int)strtol (value, &end_ptr, 0);
@@ -844,6 +1313,7 @@ static void HandleInfoResponse (server_t* server, const char* msg)
 		Com_Printf (MSG_WARNING,
 					"> WARNING: invalid infoResponse from %s (invalid protocol value: %s)\n",
 					peer_address, value);
+		PROBE2 (inforesponse__reject, addr, "invalid protocol");
 		return;
 	}
 
@@ -856,6 +1326,7 @@ static void HandleInfoResponse (server_t* server, const char* msg)
 			Com_Printf (MSG_WARNING,
 						"> WARNING: invalid infoResponse from %s (game type contains whitespaces)\n",
 						peer_address);
+			PROBE2 (inforesponse__reject, addr, "invalid gametype");
 			return;
 		}
 	}
@@ -875,6 +1346,7 @@ static void HandleInfoResponse (server_t* server, const char* msg)
 		Com_Printf (MSG_WARNING,
 					"> WARNING: invalid infoResponse from %s (sv_maxclients = %d)\n",
 					peer_address, new_maxclients);
+		PROBE2 (inforesponse__reject, addr, "invalid sv_maxclients");
 		return;
 	}
 
@@ -885,6 +1357,7 @@ static void HandleInfoResponse (server_t* server, const char* msg)
 		Com_Printf (MSG_WARNING,
 					"> WARNING: invalid infoResponse from %s (no \"clients\" value)\n",
 					peer_address);
+		PROBE2 (inforesponse__reject, addr, "no clients");
 		return;
 	}
 	new_clients = ((value != NULL) ? atoi (value) : 0);
@@ -894,25 +1367,27 @@ static void HandleInfoResponse (server_t* server, const char* msg)
 	if (value == NULL)
 	{
 		// Games that neither send a known heartbeat nor provide a game name are ignored
-		if (server->hb_properties == NULL)
+		if (hb_properties == NULL)
 		{
 			Com_Printf (MSG_WARNING,
 						"> WARNING: invalid infoResponse from %s (no game name)\n",
 						peer_address);
+			PROBE2 (inforesponse__reject, addr, "no gamename");
 			return;
 		}
 		
-		value = server->hb_properties->name;
+		value = hb_properties->name;
 	}
 	// ... but if it did, it must match the one its heartbeat advertized (if any)
 	else
 	{
-		if (server->hb_properties != NULL &&
-			strcmp (value, server->hb_properties->name) != 0)
+		if (hb_properties != NULL &&
+			strcmp (value, hb_properties->name) != 0)
 		{
 			Com_Printf (MSG_WARNING,
 						"> WARNING: invalid infoResponse from %s (game name is different from the one advertized by the heartbeat)\n",
 						peer_address);
+			PROBE2 (inforesponse__reject, addr, "gamename mismatch");
 			return;
 		}
 	}
@@ -922,6 +1397,7 @@ static void HandleInfoResponse (server_t* server, const char* msg)
 		Com_Printf (MSG_WARNING,
 					"> WARNING: invalid infoResponse from %s (game name is void)\n",
 					peer_address);
+		PROBE2 (inforesponse__reject, addr, "void gamename");
 		return;
 	}
 	else if (strchr (value, ' ') != NULL)
@@ -929,6 +1405,7 @@ static void HandleInfoResponse (server_t* server, const char* msg)
 		Com_Printf (MSG_WARNING,
 					"> WARNING: invalid infoResponse from %s (game name contains whitespaces)\n",
 					peer_address);
+		PROBE2 (inforesponse__reject, addr, "invalid gamename");
 		return;
 	}
 	
@@ -937,14 +1414,30 @@ static void HandleInfoResponse (server_t* server, const char* msg)
 		Com_Printf (MSG_WARNING,
 					"> WARNING: Rejecting infoResponse from %s (game \"%s\" is not accepted)\n",
 					peer_address, value);
+		PROBE2 (inforesponse__reject, addr, "game rejected");
 		return;
 	}
 
+	// Get the server in the list (add it to the list if necessary)
+	server = Sv_GetByAddr (addr, addrlen, true, value);
+	if (server == NULL)
+		return;
+
+	// If the server wasn't visible yet, it is now
+	if (server->state == sv_state_uninitialized)
+		Rec_Record (REC_EVENT_SERVER_REGISTERED, REC_REASON_NONE,
+					&server->user.address, NULL, 0);
+
 	// Save some useful informations in the server entry
+	Sv_RecordAnswer (server, elapsed_time);
+	server->socket = recv_socket;
 	strncpy (server->gamename, value, sizeof (server->gamename) - 1);
 	server->protocol = new_protocol;
-	server->anon_properties = server->hb_properties;
+	server->anon_properties = hb_properties;
 	strncpy (server->gametype, new_gametype, sizeof (server->gametype) - 1);
+	country = GetServerCountry (server);
+	PROBE4 (inforesponse__accept, &server->user.address, server->gamename,
+			new_clients, new_maxclients);
 	if (new_clients == 0)
 		server->state = sv_state_empty;
 	else if (new_clients == new_maxclients)
@@ -952,29 +1445,34 @@ static void HandleInfoResponse (server_t* server, const char* msg)
 	else
 		server->state = sv_state_occupied;
 
-	// Save all server info
+	// Save all server info, right after the address in the getserversWithInfo line
 	// Assume that 'challenge' infostring is the very last string of the msg, and remove it
-	server->serverinfo [0] = '\0';
+	serverinfo = server->info_line + server->info_addr_len;
+	serverinfo [0] = '\0';
 	value = strstr (msg, "\\challenge");
 	if (value == NULL)
 		value = msg + strlen (msg);
-	if (value - msg > 0 && value - msg < sizeof(server->serverinfo) - 1)
+	if (value - msg > 0 && value - msg < SERVERINFO_LENGTH - 1)
 	{
-		strncpy (server->serverinfo, msg, value - msg);
-		server->serverinfo [value - msg] = '\0';
-		if (value - msg < sizeof (server->serverinfo) - sizeof("\\country\\XXX") - 1)
+		strncpy (serverinfo, msg, value - msg);
+		serverinfo [value - msg] = '\0';
+		if (value - msg < SERVERINFO_LENGTH - sizeof("\\country\\XXX") - 1)
 		{
-			const char *country = GetCountryFromAddress (&server->user.address);
-			if (country != NULL && strlen (country) <= 3)
-				sprintf (&server->serverinfo [value - msg], "\\country\\%s", country);
+			if (country != NULL)
+				sprintf (&serverinfo [value - msg], "\\country\\%s", country);
 		}
-		Com_Printf (MSG_NORMAL, "> %s ---> infoResponse serverinfo len %d: %s\n", peer_address, value - msg, server->serverinfo);
+		Com_Printf (MSG_NORMAL, "> %s ---> infoResponse serverinfo len %d: %s\n", peer_address, value - msg, serverinfo);
 	}
 	else
-		Com_Printf (MSG_NORMAL, "> %s ---> infoResponse empty serverinfo, value %p msg %p value - msg %d sizeof(server->serverinfo) %d\n", peer_address, value, msg, value - msg, sizeof(server->serverinfo));
+		Com_Printf (MSG_NORMAL, "> %s ---> infoResponse empty serverinfo, value %p msg %p value - msg %d max size %d\n", peer_address, value, msg, value - msg, SERVERINFO_LENGTH);
+	server->info_line_len = server->info_addr_len + (unsigned int)strlen (serverinfo);
 
 	// Set a new timeout
-	server->timeout = crt_time + TIMEOUT_INFORESPONSE;
+	server->timeout = crt_time + GetServerTimeout (server);
+	Sv_Refresh (server);
+
+	// Check it's still alive from time to time, if its game is revalidated
+	Rev_Schedule (server);
 }
 
 /*
@@ -1006,10 +1504,12 @@ static void HandleGetMyAddr (const struct sockaddr_storage* addr, socklen_t addr
 	packetind += sprintf ((char *)packet + packetind, "%s %u", addr_str, ntohs (sv_sockaddr->sin_port));
 
 	// Send the response back to the client
-	if (sendto (recv_socket, (void*)packet, packetind, 0,
-			(const struct sockaddr*)addr, addrlen) < 0)
+	if (! Egr_Send (recv_socket, packet, packetind, addr, addrlen, EGRESS_CLASS_CONTROL))
+	{
 		Com_Printf (MSG_WARNING, "> WARNING: can't send %s (%s)\n",
-					M2C_GETMYADDRRESPONSE, Sys_GetLastNetErrorString ());
+						M2C_GETMYADDRRESPONSE, Egr_GetLastErrorString ());
+		Rec_Record (REC_EVENT_SEND_FAILED, REC_REASON_NONE, addr, packet, packetind);
+	}
 	else
 		Com_Printf (MSG_NORMAL, "> %s <--- %s %s %u\n",
 					peer_address, M2C_GETMYADDRRESPONSE, addr_str, ntohs (sv_sockaddr->sin_port));
@@ -1084,18 +1584,196 @@ static void HandleRelaySend (const char* msg, const struct sockaddr_storage* add
 	packetind += datalen;
 
 	// Send the response to the target host
-	if (sendto (recv_socket, (void*)packet, packetind, 0,
-			(const struct sockaddr*)&target_sockaddr, sizeof(target_sockaddr)) < 0)
+	if (! Egr_Send (recv_socket, packet, packetind,
+					(const struct sockaddr_storage*)&target_sockaddr, sizeof(target_sockaddr),
+					EGRESS_CLASS_LIST))
+	{
 		Com_Printf (MSG_WARNING, "> WARNING: can't send %s (%s)\n",
-					M2C_RELAYRECV, Sys_GetLastNetErrorString ());
+						M2C_RELAYRECV, Egr_GetLastErrorString ());
+		Rec_Record (REC_EVENT_SEND_FAILED, REC_REASON_NONE,
+					(const struct sockaddr_storage*)&target_sockaddr, packet, packetind);
+	}
 	else
 		Com_Printf (MSG_NORMAL, "> %s <--- %s to %s %u\n",
 					peer_address, M2C_RELAYRECV, addr_str, target_port);
 }
 
+/*
+====================
+IsMessageBlocked
+
+Count the message in the heavy-hitter detection, then check if its
+sender is banned, or if it has exhausted its flood protection budget
+====================
+*/
+static qboolean IsMessageBlocked (fp_class_t msg_class, const char* msg, size_t length,
+								  const struct sockaddr_storage* address)
+{
+	rec_reason_t reason;
+
+	if (Hit_RecordMessage (address, msg_class))
+		reason = REC_REASON_BANNED;
+	else if (Cl_BlockedByThrottle (address, msg_class))
+		reason = REC_REASON_THROTTLED;
+	else
+		return false;
+
+	Rec_Record (REC_EVENT_PACKET_REJECTED, reason, address, msg, length);
+	return true;
+}
+
+
 
 // ---------- Public functions ---------- //
 
+/*
+====================
+IsServerMessage
+
+Return "true" if the message comes from a server (heartbeat or infoResponse)
+====================
+*/
+qboolean IsServerMessage (const char* msg)
+{
+	return (strncmp (S2M_HEARTBEAT, msg, strlen (S2M_HEARTBEAT)) == 0 ||
+			strncmp (S2M_INFORESPONSE, msg, strlen (S2M_INFORESPONSE)) == 0);
+}
+
+
+/*
+====================
+IsGetServersMessage
+
+Return "true" if the message is a request for a server list (any variant)
+====================
+*/
+qboolean IsGetServersMessage (const char* msg)
+{
+	// "getservers" is a prefix of "getserversExt" and "getserversWithInfo" too
+	return (strncmp (C2M_GETSERVERS, msg, strlen (C2M_GETSERVERS) - 1) == 0);
+}
+
+
+/*
+====================
+ProbeServer
+
+Send a getinfo message to a registered server, to check it's still alive.
+A server which has left too many of them unanswered is removed instead
+====================
+*/
+void ProbeServer (server_t* server)
+{
+	unsigned int nb_missed, game_index;
+	const char* challenge;
+	qboolean sent;
+
+	// If it has already timed out, it will be removed soon anyway
+	if (server->timeout < crt_time)
+		return;
+
+	// The last getinfo, if still unanswered, is lost by now
+	nb_missed = server->nb_missed + (server->awaiting_info ? 1 : 0);
+	if (nb_missed >= REV_MAX_MISSED_PROBES)
+	{
+		Rev_RecordRemoval ();
+		Sv_Expire (server, SV_REMOVAL_REVALIDATION);
+		return;
+	}
+
+	game_index = Game_GetPropertiesIndex (server->anon_properties);
+	if (challenge_mode == CHALLENGE_MODE_TABLE)
+		challenge = Sv_AddPending (&server->user.address, game_index);
+	else
+	{
+		challenge = Cookie_BuildChallenge (&server->user.address, game_index);
+		Sv_AddRecentChallenge (&server->user.address, game_index);
+	}
+
+	// The probes are the least urgent messages we send
+	sent = SendGetInfo (&server->user.address, server->user.addrlen, challenge,
+						server->socket, EGRESS_CLASS_BULK);
+	if (sent)
+		Sv_RecordChallenge (server);
+	Rev_RecordProbe (sent);
+}
+
+
+/*
+====================
+FlushGetInfos
+
+Send the getinfo messages queued while handling the current batch of
+packets, all those going through the same socket at once
+====================
+*/
+void FlushGetInfos (void)
+{
+	outgoing_packet_t packets [GETINFO_QUEUE_SIZE];
+	queued_getinfo_t* getinfos [GETINFO_QUEUE_SIZE];
+	unsigned int first_ind, ind;
+
+	for (first_ind = 0; first_ind < nb_queued_getinfos; first_ind++)
+	{
+		socket_t sock = getinfo_queue[first_ind].socket;
+		unsigned int nb_packets = 0, nb_done = 0;
+
+		if (getinfo_queue[first_ind].flushed)
+			continue;
+
+		// Gather the messages going through the same socket
+		for (ind = first_ind; ind < nb_queued_getinfos; ind++)
+		{
+			queued_getinfo_t* getinfo = &getinfo_queue[ind];
+
+			if (getinfo->socket != sock)
+				continue;
+
+			packets[nb_packets].data = getinfo->msg;
+			packets[nb_packets].length = getinfo->length;
+			packets[nb_packets].address = &getinfo->address;
+			packets[nb_packets].addrlen = getinfo->addrlen;
+			getinfos[nb_packets] = getinfo;
+			nb_packets++;
+
+			getinfo->flushed = true;
+		}
+
+		Stats_RecordGetInfoBatch (nb_packets);
+
+		// Skip the messages which can't be sent, and go on with the next ones
+		while (nb_done < nb_packets)
+		{
+			unsigned int nb_sent = Egr_SendBatch (sock, &packets[nb_done], nb_packets - nb_done,
+												  EGRESS_CLASS_CONTROL);
+
+			// Report the failure first, while its error code is still available
+			if (nb_done + nb_sent < nb_packets)
+			{
+				queued_getinfo_t* getinfo = getinfos[nb_done + nb_sent];
+
+				RecordGetInfo (getinfo->msg, getinfo->length, &getinfo->address,
+							   getinfo->peer_address, false);
+			}
+
+			for (ind = nb_done; ind < nb_done + nb_sent; ind++)
+			{
+				queued_getinfo_t* getinfo = getinfos[ind];
+
+				RecordGetInfo (getinfo->msg, getinfo->length, &getinfo->address,
+							   getinfo->peer_address, true);
+			}
+
+			nb_done += nb_sent;
+			if (nb_done < nb_packets)
+				nb_done++;
+		}
+	}
+
+	nb_queued_getinfos = 0;
+}
+
+
 /*
 ====================
 HandleMessage
@@ -1108,62 +1786,87 @@ void HandleMessage (const char* msg, size_t length,
 					socklen_t addrlen,
 					socket_t recv_socket)
 {
+	LATENCY_START (msg_start_time);
+	PROBE3 (message__dispatch, address, msg, length);
+
 	// If it's an heartbeat
 	if (!strncmp (S2M_HEARTBEAT, msg, strlen (S2M_HEARTBEAT)))
 	{
+		if (IsMessageBlocked (FP_CLASS_HEARTBEAT, msg, length, address))
+			return;
+
 		HandleHeartbeat (msg + strlen (S2M_HEARTBEAT), address, addrlen,
 						 recv_socket);
+		LATENCY_RECORD (STATS_MSG_HEARTBEAT, msg_start_time);
 	}
 
 	// If it's an infoResponse message
 	else if (!strncmp (S2M_INFORESPONSE, msg, strlen (S2M_INFORESPONSE)))
 	{
-		server_t* server;
+		if (IsMessageBlocked (FP_CLASS_INFORESPONSE, msg, length, address))
+			return;
 
 		Com_Printf (MSG_NORMAL, "> %s ---> infoResponse\n", peer_address);
-	
-		server = Sv_GetByAddr (address, addrlen, false);
-		if (server == NULL)
-		{
-			Com_Printf (MSG_WARNING,
-						"> WARNING: infoResponse from unknown server %s\n",
-						peer_address);
-			return;
-		}
 
-		HandleInfoResponse (server, msg + strlen (S2M_INFORESPONSE));
+		HandleInfoResponse (msg + strlen (S2M_INFORESPONSE), address, addrlen, recv_socket);
+
+		LATENCY_RECORD (STATS_MSG_INFORESPONSE, msg_start_time);
 	}
 
 	// If it's a getservers request
 	else if (!strncmp (C2M_GETSERVERS, msg, strlen (C2M_GETSERVERS)))
 	{
+		if (IsMessageBlocked (FP_CLASS_GETSERVERS, msg, length, address))
+			return;
+
 		HandleGetServers (msg + strlen (C2M_GETSERVERS), address, addrlen,
 						  recv_socket, false, false);
+		LATENCY_RECORD (STATS_MSG_GETSERVERS, msg_start_time);
 	}
 
 	// If it's a getserversExt request
 	else if (!strncmp (C2M_GETSERVERSEXT, msg, strlen (C2M_GETSERVERSEXT)))
 	{
+		if (IsMessageBlocked (FP_CLASS_GETSERVERS, msg, length, address))
+			return;
+
 		HandleGetServers (msg + strlen (C2M_GETSERVERSEXT), address, addrlen,
 						  recv_socket, true, false);
+		LATENCY_RECORD (STATS_MSG_GETSERVERSEXT, msg_start_time);
 	}
 
 	// If it's a getserversWithInfo request
 	else if (!strncmp (C2M_GETSERVERSWITHINFO, msg, strlen (C2M_GETSERVERSEXT)))
 	{
+		if (IsMessageBlocked (FP_CLASS_GETSERVERS, msg, length, address))
+			return;
+
 		HandleGetServers (msg + strlen (C2M_GETSERVERSWITHINFO), address, addrlen,
 						  recv_socket, true, true);
+		LATENCY_RECORD (STATS_MSG_GETSERVERSWITHINFO, msg_start_time);
 	}
 
 	// The client wants to know it's own public address
 	else if (!strncmp (C2M_GETMYADDR, msg, strlen (C2M_GETMYADDR)))
 	{
+		if (IsMessageBlocked (FP_CLASS_GETMYADDR, msg, length, address))
+			return;
+
 		HandleGetMyAddr (address, addrlen, recv_socket);
+		LATENCY_RECORD (STATS_MSG_GETMYADDR, msg_start_time);
 	}
 
 	// Relay data between two hosts
 	else if (!strncmp (C2M_RELAYSEND, msg, strlen (C2M_RELAYSEND)))
 	{
+		if (IsMessageBlocked (FP_CLASS_RELAYSEND, msg, length, address))
+			return;
+
 		HandleRelaySend (msg + strlen (C2M_RELAYSEND), address, addrlen, recv_socket);
+		LATENCY_RECORD (STATS_MSG_RELAYSEND, msg_start_time);
 	}
+
+	else if (! IsMessageBlocked (FP_CLASS_OTHER, msg, length, address))
+		Rec_Record (REC_EVENT_PACKET_REJECTED, REC_REASON_UNKNOWN_MESSAGE,
+					address, msg, length);
 }
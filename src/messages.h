@@ -25,8 +25,39 @@
 #define _MESSAGES_H_
 
 
+// ---------- Constants ---------- //
+
+// Maximum size of a reponse packet
+#define MAX_PACKET_SIZE_OUT 1300
+
+// Smallest limit accepted for the getservers responses sent without a token
+#define MIN_REFLECTION_LIMIT 128
+
+
+// ---------- Public variables ---------- //
+
+// Maximum size of a getservers response sent to a client which hasn't
+// echoed a valid token (0 means no limit). Can't exceed MAX_PACKET_SIZE_OUT
+extern unsigned int reflection_limit;
+
+
 // ---------- Public functions ---------- //
 
+// Return "true" if the message comes from a server (heartbeat or infoResponse)
+qboolean IsServerMessage (const char* msg);
+
+// Return "true" if the message is a request for a server list (any variant)
+qboolean IsGetServersMessage (const char* msg);
+
+// Send a getinfo message to a registered server, to check it's still alive.
+// A server which has left too many of them unanswered is removed instead
+struct server_s;	// Defined in servers.h
+void ProbeServer (struct server_s* server);
+
+// Send the getinfo messages queued while handling the current batch of
+// packets, all those going through the same socket at once
+void FlushGetInfos (void);
+
 // Parse a packet to figure out what to do with it
 void HandleMessage (const char* msg, size_t length,
 					const struct sockaddr_storage* address,
@@ -0,0 +1,271 @@
+/*
+	overload.c
+
+	Overload detection and load shedding for dpmaster
+
+	Copyright (C) 2011  Mathieu Olivier
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include "common.h"
+#include "system.h"
+#include "overload.h"
+
+
+// ---------- Private variables ---------- //
+
+// The overload level, computed even if the shedding is disabled. An overload
+// "episode" starts with the first batch showing a sign of overload, and ends
+// when no batch has shown any for OVERLOAD_BURST_DELAY microseconds, or
+// OVERLOAD_RECOVERY_DELAY microseconds if the level has already been raised
+static overload_level_t crt_level = OVERLOAD_NONE;
+static qu64 overload_start = 0;  // 0 if we aren't overloaded
+static qu64 last_overload = 0;
+
+// Kernel drop counters of the listening sockets, at the previous check
+static unsigned int prev_nb_drops [MAX_LISTEN_SOCKETS];
+static qboolean prev_nb_drops_known [MAX_LISTEN_SOCKETS];
+static qu64 last_probe = 0;
+
+// Statistics
+static qu64 nb_batches = 0;
+static qu64 nb_packets_total = 0;
+static qu64 total_batch_time = 0;
+static qu64 max_batch_time = 0;
+static qu64 nb_full_batches = 0;
+static qu64 nb_slow_batches = 0;
+static qu64 nb_queue_alerts = 0;
+static qu64 nb_drop_alerts = 0;
+static qu64 nb_episodes = 0;
+static qu64 total_overload_time = 0;
+static qu64 nb_shed [NB_OVL_SHED_DECISIONS];
+
+static const char* level_names [] =
+{
+	"normal",
+	"cache only",
+	"drop",
+};
+
+
+// ---------- Public variables ---------- //
+
+// Shed the getservers requests when overloaded
+qboolean overload_shedding = false;
+
+
+// ---------- Private functions ---------- //
+
+/*
+====================
+Ovl_UpdateLevel
+
+Compute the overload level, ending the current episode if it's over
+====================
+*/
+static void Ovl_UpdateLevel (qu64 now)
+{
+	overload_level_t new_level;
+	qu64 recovery_delay = (crt_level == OVERLOAD_NONE ? OVERLOAD_BURST_DELAY : OVERLOAD_RECOVERY_DELAY);
+
+	if (overload_start != 0 && now - last_overload >= recovery_delay)
+	{
+		total_overload_time += last_overload - overload_start;
+		overload_start = 0;
+	}
+
+	if (overload_start == 0)
+		new_level = OVERLOAD_NONE;
+	else if (now - overload_start >= OVERLOAD_DROP_DELAY)
+		new_level = OVERLOAD_DROP;
+	else if (now - overload_start >= OVERLOAD_CACHE_DELAY)
+		new_level = OVERLOAD_CACHE_ONLY;
+	else
+		new_level = OVERLOAD_NONE;
+
+	if (new_level != crt_level)
+	{
+		if (new_level == OVERLOAD_NONE)
+			Com_Printf (MSG_WARNING, "> WARNING: overload over\n");
+		else if (overload_shedding)
+			Com_Printf (MSG_WARNING,
+						"> WARNING: overloaded for %.1f seconds, getservers requests are now %s\n",
+						(double)(now - overload_start) / 1000000.0,
+						new_level == OVERLOAD_DROP ? "dropped" : "answered from the cache only");
+		else if (new_level == OVERLOAD_CACHE_ONLY)
+			Com_Printf (MSG_WARNING, "> WARNING: overloaded for %.1f seconds\n",
+						(double)(now - overload_start) / 1000000.0);
+		crt_level = new_level;
+	}
+}
+
+
+/*
+====================
+Ovl_ProbeSocket
+
+Check if the receive queue of a listening socket is filling up or overflowing
+====================
+*/
+static qboolean Ovl_ProbeSocket (unsigned int sock_ind)
+{
+	unsigned int queued_bytes, buffer_size, nb_drops;
+	qboolean overloaded = false;
+
+	if (! Sys_GetSocketLoad (listen_sockets[sock_ind].socket, &queued_bytes,
+							 &buffer_size, &nb_drops))
+		return false;
+
+	if (buffer_size > 0 &&
+		(qu64)queued_bytes * 100 >= (qu64)buffer_size * OVERLOAD_QUEUE_PERCENT)
+	{
+		nb_queue_alerts++;
+		overloaded = true;
+	}
+
+	if (prev_nb_drops_known[sock_ind] && nb_drops != prev_nb_drops[sock_ind])
+	{
+		nb_drop_alerts++;
+		overloaded = true;
+	}
+	prev_nb_drops[sock_ind] = nb_drops;
+	prev_nb_drops_known[sock_ind] = true;
+
+	return overloaded;
+}
+
+
+// ---------- Public functions ---------- //
+
+/*
+====================
+Ovl_RecordBatch
+
+Update the overload state after a batch of packets has been handled. We're
+overloaded if the batch filled up, if it took too long to handle, or if a
+receive queue is filling up or overflowing
+====================
+*/
+void Ovl_RecordBatch (unsigned int nb_packets, qboolean batch_full, qu64 batch_time)
+{
+	qboolean overloaded = false;
+	unsigned int sock_ind;
+	qu64 now = Sys_GetMonotonicTime ();
+
+	nb_batches++;
+	nb_packets_total += nb_packets;
+	total_batch_time += batch_time;
+	if (batch_time > max_batch_time)
+		max_batch_time = batch_time;
+
+	if (batch_full)
+	{
+		nb_full_batches++;
+		overloaded = true;
+	}
+	if (batch_time >= OVERLOAD_BATCH_TIME)
+	{
+		nb_slow_batches++;
+		overloaded = true;
+	}
+
+	// Check the receive queues from time to time, if we may have to shed some load
+	if (overload_shedding && now - last_probe >= OVERLOAD_PROBE_PERIOD)
+	{
+		last_probe = now;
+		for (sock_ind = 0; sock_ind < nb_sockets; sock_ind++)
+			if (Ovl_ProbeSocket (sock_ind))
+				overloaded = true;
+	}
+
+	if (overloaded)
+	{
+		if (overload_start == 0)
+		{
+			overload_start = now;
+			nb_episodes++;
+		}
+		last_overload = now;
+	}
+
+	Ovl_UpdateLevel (now);
+}
+
+
+/*
+====================
+Ovl_GetLevel
+
+Get the current overload level
+====================
+*/
+overload_level_t Ovl_GetLevel (void)
+{
+	if (! overload_shedding || overload_start == 0)
+		return OVERLOAD_NONE;
+
+	// The episode may have ended while we were waiting for packets
+	Ovl_UpdateLevel (Sys_GetMonotonicTime ());
+	return crt_level;
+}
+
+
+/*
+====================
+Ovl_RecordShed
+
+Count a load shedding decision
+====================
+*/
+void Ovl_RecordShed (ovl_shed_t decision)
+{
+	assert (decision < NB_OVL_SHED_DECISIONS);
+	nb_shed[decision]++;
+}
+
+
+/*
+====================
+Ovl_PrintStats
+
+Print the overload statistics
+====================
+*/
+void Ovl_PrintStats (msg_level_t msg_level)
+{
+	qu64 overload_time = total_overload_time;
+
+	if (overload_start != 0)
+		overload_time += last_overload - overload_start;
+
+	Com_Printf (msg_level,
+				"\n> Overload detection (load shedding: %s, current level: %s):\n"
+				" * batches: %llu (%llu packets, %.3f ms on average, %.3f ms at most)\n"
+				" * signs of overload: %llu full batches, %llu slow batches, %llu receive queues filling up, %llu receive queues overflowing\n"
+				" * overloaded %llu times, for %.1f seconds in total\n",
+				overload_shedding ? "on" : "off", level_names[crt_level],
+				nb_batches, nb_packets_total,
+				nb_batches > 0 ? (double)total_batch_time / nb_batches / 1000.0 : 0.0,
+				(double)max_batch_time / 1000.0,
+				nb_full_batches, nb_slow_batches, nb_queue_alerts, nb_drop_alerts,
+				nb_episodes, (double)overload_time / 1000000.0);
+	if (overload_shedding)
+		Com_Printf (msg_level,
+					" * getservers requests shed: %llu answered from the cache, %llu dropped (not cached), %llu dropped before parsing\n",
+					nb_shed[OVL_SHED_CACHED], nb_shed[OVL_SHED_NOT_CACHED],
+					nb_shed[OVL_SHED_DROPPED]);
+}
@@ -0,0 +1,96 @@
+/*
+	overload.h
+
+	Overload detection and load shedding for dpmaster
+
+	Copyright (C) 2011  Mathieu Olivier
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef _OVERLOAD_H_
+#define _OVERLOAD_H_
+
+
+// ---------- Constants ---------- //
+
+// Maximum number of packets received before handling them
+#define MAX_BATCH_SIZE 64
+
+// A batch taking longer than this to handle means we're overloaded (in microseconds)
+#define OVERLOAD_BATCH_TIME 50000
+
+// A receive queue filled above this percentage means we're overloaded
+#define OVERLOAD_QUEUE_PERCENT 50
+
+// Minimum delay between 2 checks of the receive queues, which cost a system
+// call per listening socket, and are only done if the shedding is enabled
+#define OVERLOAD_PROBE_PERIOD 100000
+
+// How long the overload must last before shedding the getservers
+// requests not in the cache, then all of them (in microseconds)
+#define OVERLOAD_CACHE_DELAY 500000
+#define OVERLOAD_DROP_DELAY 2000000
+
+// How long without any sign of overload before going back to normal (in
+// microseconds). Isolated bursts end their overload episode much sooner
+// than the ones which have already triggered the load shedding
+#define OVERLOAD_BURST_DELAY 100000
+#define OVERLOAD_RECOVERY_DELAY 1000000
+
+
+// ---------- Types ---------- //
+
+typedef enum
+{
+	OVERLOAD_NONE,
+	OVERLOAD_CACHE_ONLY,	// getservers requests are only answered from the cache
+	OVERLOAD_DROP,			// getservers requests are dropped before being parsed
+} overload_level_t;
+
+// Load shedding decisions
+typedef enum
+{
+	OVL_SHED_CACHED,		// a getservers request answered from the cache
+	OVL_SHED_NOT_CACHED,	// a getservers request dropped since it wasn't in the cache
+	OVL_SHED_DROPPED,		// a getservers request dropped before being parsed
+
+	NB_OVL_SHED_DECISIONS
+} ovl_shed_t;
+
+
+// ---------- Public variables ---------- //
+
+// Shed the getservers requests when overloaded
+extern qboolean overload_shedding;
+
+
+// ---------- Public functions ---------- //
+
+// Update the overload state after a batch of packets has been handled
+void Ovl_RecordBatch (unsigned int nb_packets, qboolean batch_full, qu64 batch_time);
+
+// Get the current overload level (always OVERLOAD_NONE if the shedding is disabled)
+overload_level_t Ovl_GetLevel (void);
+
+// Count a load shedding decision
+void Ovl_RecordShed (ovl_shed_t decision);
+
+// Print the overload statistics
+void Ovl_PrintStats (msg_level_t msg_level);
+
+
+#endif  // #ifndef _OVERLOAD_H_
@@ -0,0 +1,57 @@
+/*
+	probes.h
+
+	Static tracepoints (USDT probes) for dpmaster
+
+	Copyright (C) 2011  Mathieu Olivier
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+
+// The probes are only available when <sys/sdt.h> (from SystemTap) can be
+// found. They are compiled as a single "nop" instruction, until a tracer
+// (bpftrace, perf, SystemTap, ...) attaches itself to them. Define
+// DISABLE_PROBES at compile time to remove them completely
+#if !defined (DISABLE_PROBES) && defined (__has_include)
+#	if __has_include (<sys/sdt.h>)
+#		include <sys/sdt.h>
+#		define HAVE_PROBES
+#	endif
+#endif
+
+
+// ---------- Probe macros ---------- //
+
+// All probes belong to the "dpmaster" provider. Their names use "__" which
+// the tracers turn into "-" (ex: "packet__receive" => "packet-receive")
+#ifdef HAVE_PROBES
+#	define PROBE1(name, a1)						DTRACE_PROBE1 (dpmaster, name, a1)
+#	define PROBE2(name, a1, a2)					DTRACE_PROBE2 (dpmaster, name, a1, a2)
+#	define PROBE3(name, a1, a2, a3)				DTRACE_PROBE3 (dpmaster, name, a1, a2, a3)
+#	define PROBE4(name, a1, a2, a3, a4)			DTRACE_PROBE4 (dpmaster, name, a1, a2, a3, a4)
+#else
+#	define PROBE1(name, a1)
+#	define PROBE2(name, a1, a2)
+#	define PROBE3(name, a1, a2, a3)
+#	define PROBE4(name, a1, a2, a3, a4)
+#endif
+
+
+#endif  // #ifndef _PROBES_H_
@@ -0,0 +1,409 @@
+/*
+	recorder.c
+
+	Flight recorder for dpmaster
+
+	Copyright (C) 2011  Mathieu Olivier
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include "common.h"
+#include "system.h"
+#include "recorder.h"
+
+#ifdef WIN32
+#	include <io.h>
+#endif
+
+
+// ---------- Private types ---------- //
+
+// A recorded event (64 bytes)
+typedef struct
+{
+	qu64 time;						// monotonic time, in microseconds
+	qbyte event;					// rec_event_t
+	qbyte reason;					// rec_reason_t
+	qbyte family;					// AF_INET, AF_INET6, or 0 if there's no address
+	qbyte data_size;				// number of valid bytes in "data"
+	unsigned short port;			// in host byte order
+	unsigned short packet_size;		// real size of the packet (may be truncated in "data")
+	qbyte address [16];
+	qbyte data [REC_DATA_SIZE];
+} rec_record_t;
+
+
+// ---------- Private variables ---------- //
+
+// Names of the events and rejection reasons, for the dumps
+static const char* event_names [NB_REC_EVENTS] =
+{
+	"(none)",
+	"packet in",
+	"packet rejected",
+	"send failed",
+	"getinfo sent",
+	"server added",
+	"server registered",
+	"server removed",
+};
+static const char* reason_names [NB_REC_REASONS] =
+{
+	"",
+	"invalid address family",
+	"source port = 0",
+	"invalid size",
+	"invalid header",
+	"unknown message",
+	"throttled",
+	"bad challenge",
+	"server list full",
+	"banned",
+	"denied by the ACL",
+};
+
+// The event ring
+static rec_record_t* records = NULL;
+static unsigned int nb_records = DEFAULT_REC_NB_EVENTS;
+static unsigned int next_record = 0;
+
+// Where the events are dumped. If no file is specified, we use stderr,
+// or DEFAULT_REC_DAEMON_FILE if we run as a daemon
+static char dump_filepath [MAX_PATH] = "";
+static int dump_fd = -1;
+
+// Should we dump the events?
+static volatile sig_atomic_t must_dump = false;
+
+
+// ---------- Private functions ---------- //
+
+/*
+====================
+Rec_WriteString
+
+Write a string to the dump file descriptor
+====================
+*/
+static void Rec_WriteString (const char* string)
+{
+	size_t length = strlen (string);
+
+	while (length > 0)
+	{
+		int nb_written = (int)write (dump_fd, string, (unsigned int)length);
+
+		if (nb_written <= 0)
+			break;
+		string += nb_written;
+		length -= nb_written;
+	}
+}
+
+
+/*
+====================
+Rec_FormatRecord
+
+Convert a recorded event into a text line
+====================
+*/
+static void Rec_FormatRecord (const rec_record_t* record, qu64 now, char* buffer, size_t size)
+{
+	size_t length;
+	unsigned int ind;
+
+	length = snprintf (buffer, size, "%+.6f %s", -(double)(now - record->time) / 1000000.0,
+					   event_names[record->event]);
+	if (record->reason != REC_REASON_NONE && record->reason < NB_REC_REASONS &&
+		length < size)
+		length += snprintf (buffer + length, size - length, " (%s)",
+							reason_names[record->reason]);
+
+	if (record->family != 0 && length < size)
+	{
+		struct sockaddr_storage address;
+		socklen_t addrlen;
+
+		memset (&address, 0, sizeof (address));
+		if (record->family == AF_INET6)
+		{
+			struct sockaddr_in6* addr_v6 = (struct sockaddr_in6*)&address;
+
+			addr_v6->sin6_family = AF_INET6;
+			addr_v6->sin6_port = htons (record->port);
+			memcpy (&addr_v6->sin6_addr, record->address, sizeof (addr_v6->sin6_addr));
+			addrlen = sizeof (*addr_v6);
+		}
+		else
+		{
+			struct sockaddr_in* addr_v4 = (struct sockaddr_in*)&address;
+
+			addr_v4->sin_family = AF_INET;
+			addr_v4->sin_port = htons (record->port);
+			memcpy (&addr_v4->sin_addr, record->address, sizeof (addr_v4->sin_addr));
+			addrlen = sizeof (*addr_v4);
+		}
+
+		length += snprintf (buffer + length, size - length, " %s",
+							Sys_SockaddrToString (&address, addrlen));
+	}
+
+	if (record->packet_size != 0 && length < size)
+	{
+		length += snprintf (buffer + length, size - length, " (%u bytes) \"",
+							record->packet_size);
+
+		for (ind = 0; ind < record->data_size && length < size; ind++)
+		{
+			qbyte c = record->data[ind];
+
+			if (c >= 32 && c < 127 && c != '\\' && c != '\"')
+				length += snprintf (buffer + length, size - length, "%c", c);
+			else
+				length += snprintf (buffer + length, size - length, "\\x%02X", c);
+		}
+
+		if (length < size)
+			length += snprintf (buffer + length, size - length, "\"%s",
+								record->data_size < record->packet_size ? "..." : "");
+	}
+
+	if (length >= size - 1)
+		length = size - 2;
+	buffer[length] = '\n';
+	buffer[length + 1] = '\0';
+}
+
+
+// ---------- Public functions ---------- //
+
+/*
+====================
+Rec_SetNbEvents
+
+Set the number of events kept in memory (0 disables the recorder)
+====================
+*/
+qboolean Rec_SetNbEvents (unsigned int nb_events)
+{
+	// Too late? Or too many events?
+	if (records != NULL || nb_events > MAX_REC_NB_EVENTS)
+		return false;
+
+	nb_records = nb_events;
+	return true;
+}
+
+
+/*
+====================
+Rec_SetDumpFilePath
+
+Set the path of the file where the events are dumped
+====================
+*/
+qboolean Rec_SetDumpFilePath (const char* filepath)
+{
+	if (records != NULL || filepath == NULL || filepath[0] == '\0')
+		return false;
+
+	strncpy (dump_filepath, filepath, sizeof (dump_filepath) - 1);
+	dump_filepath[sizeof (dump_filepath) - 1] = '\0';
+
+	return true;
+}
+
+
+/*
+====================
+Rec_Init
+
+Allocate the event ring and open the dump file (must be called before chroot)
+====================
+*/
+qboolean Rec_Init (void)
+{
+	if (nb_records == 0)
+	{
+		Com_Printf (MSG_NORMAL, "> Flight recorder disabled\n");
+		return true;
+	}
+
+	records = calloc (nb_records, sizeof (records[0]));
+	if (records == NULL)
+	{
+		Com_Printf (MSG_ERROR,
+					"> ERROR: can't allocate the flight recorder (%u events)\n",
+					nb_records);
+		return false;
+	}
+
+	if (dump_filepath[0] != '\0')
+	{
+		dump_fd = open (dump_filepath, O_WRONLY | O_CREAT | O_APPEND, 0640);
+		if (dump_fd == -1)
+		{
+			Com_Printf (MSG_ERROR,
+						"> ERROR: can't open the flight recorder file \"%s\" (%s)\n",
+						dump_filepath, strerror (errno));
+			return false;
+		}
+	}
+
+	// A daemon loses its standard error output, so it needs a file by default.
+	// If it can't be opened, the daemon can still run, without the dumps
+	else if (daemon_state == DAEMON_STATE_REQUEST)
+	{
+		dump_fd = open (DEFAULT_REC_DAEMON_FILE, O_WRONLY | O_CREAT | O_APPEND, 0640);
+		if (dump_fd != -1)
+			strcpy (dump_filepath, DEFAULT_REC_DAEMON_FILE);
+		else
+		{
+			Com_Printf (MSG_WARNING,
+						"> WARNING: can't open the flight recorder file \"%s\" (%s), the events won't be dumped\n",
+						DEFAULT_REC_DAEMON_FILE, strerror (errno));
+			dump_fd = 2;
+		}
+	}
+	else
+		dump_fd = 2;
+
+	Com_Printf (MSG_NORMAL,
+				"> Flight recorder enabled (%u events, dumped to %s)\n",
+				nb_records, dump_filepath[0] != '\0' ? dump_filepath : "stderr");
+	return true;
+}
+
+
+/*
+====================
+Rec_Record
+
+Record an event, with the beginning of the packet which triggered it, if any
+====================
+*/
+void Rec_Record (rec_event_t event, rec_reason_t reason,
+				 const struct sockaddr_storage* address,
+				 const void* data, size_t data_size)
+{
+	rec_record_t* record;
+
+	if (records == NULL)
+		return;
+
+	record = &records[next_record];
+	next_record = (next_record + 1) % nb_records;
+
+	record->time = Sys_GetMonotonicTime ();
+	record->event = (qbyte)event;
+	record->reason = (qbyte)reason;
+
+	if (address != NULL && address->ss_family == AF_INET6)
+	{
+		const struct sockaddr_in6* addr_v6 = (const struct sockaddr_in6*)address;
+
+		record->family = AF_INET6;
+		record->port = ntohs (addr_v6->sin6_port);
+		memcpy (record->address, &addr_v6->sin6_addr, sizeof (addr_v6->sin6_addr));
+	}
+	else if (address != NULL && address->ss_family == AF_INET)
+	{
+		const struct sockaddr_in* addr_v4 = (const struct sockaddr_in*)address;
+
+		record->family = AF_INET;
+		record->port = ntohs (addr_v4->sin_port);
+		memcpy (record->address, &addr_v4->sin_addr, sizeof (addr_v4->sin_addr));
+	}
+	else
+		record->family = 0;
+
+	record->packet_size = (unsigned short)(data_size < USHRT_MAX ? data_size : USHRT_MAX);
+	record->data_size = (qbyte)(data_size < REC_DATA_SIZE ? data_size : REC_DATA_SIZE);
+	if (data != NULL)
+		memcpy (record->data, data, record->data_size);
+}
+
+
+/*
+====================
+Rec_RequestDump
+
+Ask for a dump of the recorded events (can be called from a signal handler)
+====================
+*/
+void Rec_RequestDump (void)
+{
+	must_dump = true;
+}
+
+
+/*
+====================
+Rec_Update
+
+Dump the recorded events if a dump has been requested
+====================
+*/
+void Rec_Update (void)
+{
+	if (must_dump)
+	{
+		must_dump = false;
+		Rec_Dump ("signal");
+	}
+}
+
+
+/*
+====================
+Rec_Dump
+
+Dump the recorded events immediately (used when crashing).
+The events are formatted one by one, and written directly to the file
+descriptor, so we don't need any memory allocation nor stdio buffer
+====================
+*/
+void Rec_Dump (const char* cause)
+{
+	char line [REC_DATA_SIZE * 4 + 256];
+	qu64 now;
+	unsigned int ind;
+
+	if (records == NULL || dump_fd == -1)
+		return;
+
+	now = Sys_GetMonotonicTime ();
+	snprintf (line, sizeof (line),
+			  "> Flight recorder dump (cause: %s, time: %lu, %u events max)\n",
+			  cause, (unsigned long)time (NULL), nb_records);
+	Rec_WriteString (line);
+
+	// From the oldest event to the most recent one
+	for (ind = 0; ind < nb_records; ind++)
+	{
+		const rec_record_t* record = &records[(next_record + ind) % nb_records];
+
+		if (record->event == REC_EVENT_NONE || record->event >= NB_REC_EVENTS)
+			continue;
+
+		Rec_FormatRecord (record, now, line, sizeof (line));
+		Rec_WriteString (line);
+	}
+
+	Rec_WriteString ("> End of flight recorder dump\n");
+}
@@ -0,0 +1,105 @@
+/*
+	recorder.h
+
+	Flight recorder for dpmaster
+
+	Copyright (C) 2011  Mathieu Olivier
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef _RECORDER_H_
+#define _RECORDER_H_
+
+
+// ---------- Constants ---------- //
+
+// Default number of events kept in memory
+#define DEFAULT_REC_NB_EVENTS 1024
+
+// Maximum number of events kept in memory
+#define MAX_REC_NB_EVENTS (1024 * 1024)
+
+// Number of packet bytes saved with each event
+#define REC_DATA_SIZE 32
+
+// Default dump file of a daemon, whose standard error output goes to /dev/null
+#define DEFAULT_REC_DAEMON_FILE "/var/log/dpmaster-recorder.log"
+
+
+// ---------- Types ---------- //
+
+// Recorded events
+typedef enum
+{
+	REC_EVENT_NONE,				// unused event slot
+
+	REC_EVENT_PACKET_IN,		// packet accepted by the main loop
+	REC_EVENT_PACKET_REJECTED,	// packet rejected (see rec_reason_t)
+	REC_EVENT_SEND_FAILED,		// a "sendto" call failed
+	REC_EVENT_GETINFO_SENT,		// challenge sent to a server
+	REC_EVENT_SERVER_ADDED,		// new server slot allocated
+	REC_EVENT_SERVER_REGISTERED,// valid infoResponse received
+	REC_EVENT_SERVER_REMOVED,	// server timed out
+
+	NB_REC_EVENTS
+} rec_event_t;
+
+// Why a packet has been rejected
+typedef enum
+{
+	REC_REASON_NONE,
+
+	REC_REASON_ADDRESS_FAMILY,
+	REC_REASON_SOURCE_PORT,
+	REC_REASON_SIZE,
+	REC_REASON_HEADER,
+	REC_REASON_UNKNOWN_MESSAGE,
+	REC_REASON_THROTTLED,
+	REC_REASON_BAD_CHALLENGE,
+	REC_REASON_SERVER_LIST_FULL,
+	REC_REASON_BANNED,
+	REC_REASON_ACL,
+
+	NB_REC_REASONS
+} rec_reason_t;
+
+
+// ---------- Public functions ---------- //
+
+// Will simply return "false" if called after Rec_Init
+qboolean Rec_SetNbEvents (unsigned int nb_events);
+qboolean Rec_SetDumpFilePath (const char* filepath);
+
+// Allocate the event ring and open the dump file (must be called before chroot)
+qboolean Rec_Init (void);
+
+// Record an event, with the beginning of the packet which triggered it, if any
+void Rec_Record (rec_event_t event, rec_reason_t reason,
+				 const struct sockaddr_storage* address,
+				 const void* data, size_t data_size);
+
+// Ask for a dump of the recorded events (can be called from a signal handler)
+void Rec_RequestDump (void);
+
+// Dump the recorded events if a dump has been requested
+void Rec_Update (void);
+
+// Dump the recorded events immediately (used when crashing)
+void Rec_Dump (const char* cause);
+
+
+#endif  // #ifndef _RECORDER_H_
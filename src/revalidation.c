@@ -0,0 +1,297 @@
+/*
+	revalidation.c
+
+	Periodic revalidation of the registered servers for dpmaster
+
+	Copyright (C) 2011  Mathieu Olivier
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include "common.h"
+#include "system.h"
+#include "games.h"
+#include "revalidation.h"
+#include "servers.h"
+
+
+// ---------- Private variables ---------- //
+
+// Default revalidation period, in seconds (0 means disabled)
+static unsigned int default_period = 0;
+
+// The timer wheel: each slot is a doubly linked list of the servers
+// to probe during the corresponding tick. "crt_tick" is the last tick
+// whose slot has been emptied (or is being emptied)
+static server_t* wheel [REV_NB_SLOTS];
+static qu64 crt_tick = 0;
+static unsigned int nb_scheduled = 0;
+
+// Statistics
+static qu64 nb_probes_sent = 0;
+static qu64 nb_probes_failed = 0;
+static qu64 nb_removals = 0;
+
+
+// ---------- Private functions ---------- //
+
+/*
+====================
+Rev_GetPeriodTicks
+
+Get the revalidation period of a server, in ticks (0 if it isn't revalidated)
+====================
+*/
+static unsigned int Rev_GetPeriodTicks (const server_t* server)
+{
+	unsigned int period = Game_GetRevalidationPeriod (server->gamename);
+
+	if (period == 0)
+		period = default_period;
+	if (period > REV_MAX_PERIOD)
+		period = REV_MAX_PERIOD;
+
+	return period * (1000000 / REV_SLOT_DURATION);
+}
+
+
+/*
+====================
+Rev_Insert
+
+Insert a server in the slot of a given tick
+====================
+*/
+static void Rev_Insert (server_t* server, qu64 tick)
+{
+	unsigned int slot = (unsigned int)(tick % REV_NB_SLOTS);
+	server_t* head = wheel[slot];
+
+	server->rev_prev = NULL;
+	server->rev_next = head;
+	if (head != NULL)
+		head->rev_prev = server;
+	wheel[slot] = server;
+
+	server->rev_slot = slot;
+	server->rev_scheduled = true;
+	nb_scheduled++;
+}
+
+
+// ---------- Public functions ---------- //
+
+/*
+====================
+Rev_SetPeriod
+
+Set the default revalidation period, in seconds (0 disables it, except for
+the games having their own period). Returns "false" if the period is invalid
+====================
+*/
+qboolean Rev_SetPeriod (unsigned int period)
+{
+	if (period != 0 && (period < REV_MIN_PERIOD || period > REV_MAX_PERIOD))
+		return false;
+
+	default_period = period;
+	return true;
+}
+
+
+/*
+====================
+Rev_Schedule
+
+Schedule the probes of a newly registered server, if its game is revalidated
+====================
+*/
+void Rev_Schedule (server_t* server)
+{
+	unsigned int period_ticks;
+
+	if (server->rev_scheduled)
+		return;
+
+	period_ticks = Rev_GetPeriodTicks (server);
+	if (period_ticks == 0)
+		return;
+
+	// Don't let an idle wheel lag behind
+	if (nb_scheduled == 0)
+		crt_tick = Sys_GetMonotonicTime () / REV_SLOT_DURATION;
+
+	// The first probe happens at a random time during the first period,
+	// so the probes of servers registering together are spread evenly
+	Rev_Insert (server, crt_tick + 1 + (unsigned int)rand () % period_ticks);
+}
+
+
+/*
+====================
+Rev_Unschedule
+
+Stop probing a server (must be called before its slot is reused)
+====================
+*/
+void Rev_Unschedule (server_t* server)
+{
+	if (! server->rev_scheduled)
+		return;
+
+	if (server->rev_prev != NULL)
+		server->rev_prev->rev_next = server->rev_next;
+	else
+	{
+		assert (wheel[server->rev_slot] == server);
+		wheel[server->rev_slot] = server->rev_next;
+	}
+	if (server->rev_next != NULL)
+		server->rev_next->rev_prev = server->rev_prev;
+
+	server->rev_prev = NULL;
+	server->rev_next = NULL;
+	server->rev_scheduled = false;
+
+	assert (nb_scheduled > 0);
+	nb_scheduled--;
+}
+
+
+/*
+====================
+Rev_GetDueServers
+
+Get at most "max_nb_servers" servers which must be probed now. Their next
+probes are scheduled one period later
+====================
+*/
+unsigned int Rev_GetDueServers (server_t** servers, unsigned int max_nb_servers)
+{
+	qu64 now_tick;
+	unsigned int nb_due = 0;
+
+	if (nb_scheduled == 0)
+		return 0;
+
+	now_tick = Sys_GetMonotonicTime () / REV_SLOT_DURATION;
+	while (nb_due < max_nb_servers)
+	{
+		server_t* server = wheel[crt_tick % REV_NB_SLOTS];
+		unsigned int period_ticks;
+
+		// Move to the next tick once the current slot is empty
+		if (server == NULL)
+		{
+			if (crt_tick >= now_tick)
+				break;
+			crt_tick++;
+			continue;
+		}
+
+		Rev_Unschedule (server);
+		servers[nb_due++] = server;
+
+		// The period can't be longer than a turn of the wheel, so
+		// the server can't be put back in the slot we're emptying
+		period_ticks = Rev_GetPeriodTicks (server);
+		if (period_ticks != 0)
+			Rev_Insert (server, crt_tick + period_ticks);
+	}
+
+	return nb_due;
+}
+
+
+/*
+====================
+Rev_GetDelay
+
+Get how long we can wait before calling Rev_GetDueServers again, in
+microseconds. Returns "false" if no server is scheduled
+====================
+*/
+qboolean Rev_GetDelay (qu64* delay)
+{
+	qu64 now, tick;
+
+	if (nb_scheduled == 0)
+		return false;
+
+	// Look for the next slot which isn't empty
+	tick = crt_tick;
+	while (wheel[tick % REV_NB_SLOTS] == NULL)
+		tick++;
+
+	now = Sys_GetMonotonicTime ();
+	if (tick * REV_SLOT_DURATION <= now)
+		*delay = 0;
+	else
+		*delay = tick * REV_SLOT_DURATION - now;
+	return true;
+}
+
+
+/*
+====================
+Rev_RecordProbe
+
+Count a probe, sent or not
+====================
+*/
+void Rev_RecordProbe (qboolean sent)
+{
+	if (sent)
+		nb_probes_sent++;
+	else
+		nb_probes_failed++;
+}
+
+
+/*
+====================
+Rev_RecordRemoval
+
+Count a server removed for not answering its probes
+====================
+*/
+void Rev_RecordRemoval (void)
+{
+	nb_removals++;
+}
+
+
+/*
+====================
+Rev_PrintStats
+
+Print the revalidation statistics
+====================
+*/
+void Rev_PrintStats (msg_level_t msg_level)
+{
+	if (default_period != 0)
+		Com_Printf (msg_level, "\n> Revalidation (every %u seconds by default):\n",
+					default_period);
+	else
+		Com_Printf (msg_level, "\n> Revalidation (only for the games having their own period):\n");
+	Com_Printf (msg_level,
+				" * servers scheduled: %u\n"
+				" * probes: %llu sent, %llu failed\n"
+				" * servers removed after %u unanswered probes: %llu\n",
+				nb_scheduled, nb_probes_sent, nb_probes_failed,
+				REV_MAX_MISSED_PROBES, nb_removals);
+}
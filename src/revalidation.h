@@ -0,0 +1,77 @@
+/*
+	revalidation.h
+
+	Periodic revalidation of the registered servers for dpmaster
+
+	Copyright (C) 2011  Mathieu Olivier
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef _REVALIDATION_H_
+#define _REVALIDATION_H_
+
+
+// ---------- Constants ---------- //
+
+// The probes are scheduled on a timer wheel of REV_NB_SLOTS slots,
+// each of them lasting REV_SLOT_DURATION microseconds
+#define REV_SLOT_DURATION 100000
+#define REV_NB_SLOTS 4096
+
+// Shortest and longest revalidation periods, in seconds. A period
+// can't be longer than a turn of the wheel
+#define REV_MIN_PERIOD 1
+#define REV_MAX_PERIOD ((REV_NB_SLOTS - 1) / (1000000 / REV_SLOT_DURATION))
+
+// Number of probes in a row a server can leave unanswered before being removed
+#define REV_MAX_MISSED_PROBES 2
+
+// Maximum number of probes sent per iteration of the main loop
+#define REV_BATCH_SIZE 64
+
+
+// ---------- Public functions ---------- //
+
+struct server_s;	// Defined in servers.h
+
+// Set the default revalidation period, in seconds (0 disables it, except for
+// the games having their own period). Returns "false" if the period is invalid
+qboolean Rev_SetPeriod (unsigned int period);
+
+// Schedule the probes of a newly registered server, if its game is revalidated
+void Rev_Schedule (struct server_s* server);
+
+// Stop probing a server (must be called before its slot is reused)
+void Rev_Unschedule (struct server_s* server);
+
+// Get at most "max_nb_servers" servers which must be probed now. Their next
+// probes are scheduled one period later
+unsigned int Rev_GetDueServers (struct server_s** servers, unsigned int max_nb_servers);
+
+// Get how long we can wait before calling Rev_GetDueServers again, in
+// microseconds. Returns "false" if no server is scheduled
+qboolean Rev_GetDelay (qu64* delay);
+
+// Count the outcome of a probe
+void Rev_RecordProbe (qboolean sent);
+void Rev_RecordRemoval (void);
+
+// Print the revalidation statistics
+void Rev_PrintStats (msg_level_t msg_level);
+
+
+#endif  // #ifndef _REVALIDATION_H_
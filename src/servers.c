@@ -23,7 +23,13 @@
 
 #include "common.h"
 #include "system.h"
+#include "cookies.h"
+#include "games.h"
+#include "probes.h"
+#include "recorder.h"
+#include "revalidation.h"
 #include "servers.h"
+#include "stats.h"
 
 
 // ---------- Constants ---------- //
@@ -31,6 +37,83 @@
 // Timeout for a newly added server (in seconds)
 #define TIMEOUT_HEARTBEAT	2
 
+// Period of validity of a challenge stored in the pending registrations table (in seconds)
+#define TIMEOUT_CHALLENGE	2
+
+// Index used to mark the end of a pending registration hash chain
+#define NO_PENDING ((unsigned int)-1)
+
+// Index used to mark the end of an address counter hash chain
+#define NO_ADDR_COUNTER ((unsigned int)-1)
+
+// Size of the table of recent challenges, in bits (in the "cookie" challenge mode)
+#define RECENT_CHALLENGES_HASH_SIZE 12
+
+// Number of servers sorted by distance for a "nearest" request. The farther
+// ones follow in no particular order, so a request costs a linear time only
+#define NB_SORTED_NEAREST 256
+
+// The first 2 quota groups, for the uninitialized servers and for
+// the games without a quota. The games with a quota follow
+#define QUOTA_GROUP_UNINITIALIZED 0
+#define QUOTA_GROUP_OTHERS 1
+
+
+// ---------- Private types ---------- //
+
+// A server which has been challenged, but hasn't answered yet (48 bytes)
+typedef struct
+{
+	qbyte address [16];		// IPv4 addresses only use the first 4 bytes
+	qu64 expiry;			// when the challenge expires (monotonic time, in microseconds)
+	unsigned int hash_next;	// next pending registration with the same hash
+	char challenge [COOKIE_CHALLENGE_LENGTH + 1];
+	unsigned short port;	// in network byte order
+	unsigned short game_index;
+	qbyte family;			// 0 for an unused entry
+} pending_t;
+
+// A challenge sent recently, in the "cookie" challenge mode (32 bytes)
+typedef struct
+{
+	qbyte address [16];		// IPv4 addresses only use the first 4 bytes
+	qu64 expiry;			// when the challenge expires (monotonic time, in microseconds)
+	unsigned short port;	// in network byte order
+	unsigned short game_index;
+	qbyte family;			// 0 for an unused entry
+} recent_challenge_t;
+
+// A quota group: the servers of a game with a quota, or those of all the
+// games without one, or the uninitialized servers. The servers are kept in
+// a binary min-heap ordered by timeout, so the oldest one is at the top
+typedef struct
+{
+	const char* gamename;	// NULL for the first 2 groups
+	unsigned int quota;		// 0 for the first 2 groups
+	unsigned int nb_servers;
+	server_t** heap;
+} quota_group_t;
+
+// The number of servers registered from a public address (an IPv4 address or
+// an IPv6 /64 subnet, see Com_AddressKey), and the list of these servers
+typedef struct
+{
+	qu64 key;				// public part of the address
+	server_t* first_server;	// linked by their "addr_next" fields
+	unsigned int nb_servers;
+	unsigned int hash_next;	// next counter with the same hash, or next free counter
+	int family;
+} addr_counter_t;
+
+// A server, and how close it is to a client (the cosine of the angle between
+// their locations, or -2 if the server location is unknown)
+typedef struct
+{
+	float closeness;
+	unsigned int order;		// rotated index, to break the ties at random
+	unsigned int index;
+} nearest_server_t;
+
 
 // ---------- Private variables ---------- //
 
@@ -49,22 +132,326 @@ static unsigned int max_per_address = DEFAULT_MAX_NB_SERVERS_PER_ADDRESS;
 static int last_used_slot = -1;  // -1 = no used slot
 static int first_free_slot = 0;  // -1 = no more room
 
+// When the timeouts have last been checked. Since they have a 1-second
+// resolution, checking them more often wouldn't remove anything
+static time_t last_timeouts_check = 0;
+
 // Variables for Sv_GetFirst, Sv_GetNext and Sv_Remove
 static int crt_server_ind = -1;
 static int last_server_ind = -1;
 
+// Variables for Sv_GetFirstNearest. The servers are sorted by closeness
+// to the client in "nearest_servers", allocated the first time it's needed
+static nearest_server_t* nearest_servers = NULL;
+static unsigned int nb_nearest_servers = 0;
+static unsigned int crt_nearest_ind = 0;
+static qboolean iterating_nearest = false;
+
 // List of address mappings. They are sorted by "from" field (IP, then port)
 static addrmap_t* addrmaps = NULL;
 
+// The pending registrations (in the "table" challenge mode) are stored in a
+// ring buffer. Since all challenges have the same lifetime, the next entry
+// to be overwritten is always the oldest one, expired or not
+static pending_t* pendings = NULL;
+static unsigned int max_nb_pending = DEFAULT_MAX_NB_PENDING;
+static unsigned int next_pending = 0;
+static unsigned int* pending_hash_table = NULL;
+static unsigned int pending_hash_size = 0;  // in bits
+
+// In the "cookie" challenge mode, the challenges aren't needed to check the
+// infoResponses, but we remember the recent ones in a direct-mapped table, to
+// absorb the duplicate heartbeats. Colliding addresses simply overwrite each other
+static recent_challenge_t* recent_challenges = NULL;
+
+// The address counters. There's at most one per server, so they are allocated
+// in one block, the unused ones being linked in a free list
+static addr_counter_t* addr_counters = NULL;
+static unsigned int first_free_addr_counter = NO_ADDR_COUNTER;
+static unsigned int* addr_counter_hash_table = NULL;
+static unsigned int addr_counter_hash_size = 0;  // in bits
+
+// The quota groups, only used by the "quota" eviction policy
+static quota_group_t* quota_groups = NULL;
+static unsigned int nb_quota_groups = 0;
+
 
 // ---------- Public variables ---------- //
 
 // Are servers talking from a loopback interface allowed?
 qboolean allow_loopback = false;
 
+// How the challenges sent to the servers are checked
+challenge_mode_t challenge_mode = CHALLENGE_MODE_COOKIE;
+
+// What happens to a new server when the list is full
+eviction_policy_t eviction_policy = EVICTION_POLICY_NONE;
+
 
 // ---------- Private functions ---------- //
 
+/*
+====================
+Sv_HeapPlace
+
+Put a server at a given position in the heap of its quota group
+====================
+*/
+static void Sv_HeapPlace (quota_group_t* group, server_t* sv, unsigned int pos)
+{
+	group->heap[pos] = sv;
+	sv->heap_pos = pos;
+}
+
+
+/*
+====================
+Sv_HeapSiftUp
+
+Move a server up in the heap of its quota group, until its parent times out first
+====================
+*/
+static void Sv_HeapSiftUp (quota_group_t* group, unsigned int pos)
+{
+	server_t* sv = group->heap[pos];
+
+	while (pos > 0)
+	{
+		unsigned int parent = (pos - 1) / 2;
+
+		if (group->heap[parent]->timeout <= sv->timeout)
+			break;
+		Sv_HeapPlace (group, group->heap[parent], pos);
+		pos = parent;
+	}
+
+	Sv_HeapPlace (group, sv, pos);
+}
+
+
+/*
+====================
+Sv_HeapSiftDown
+
+Move a server down in the heap of its quota group, until its children time out after it
+====================
+*/
+static void Sv_HeapSiftDown (quota_group_t* group, unsigned int pos)
+{
+	server_t* sv = group->heap[pos];
+
+	for (;;)
+	{
+		unsigned int child = pos * 2 + 1;
+
+		if (child >= group->nb_servers)
+			break;
+		if (child + 1 < group->nb_servers &&
+			group->heap[child + 1]->timeout < group->heap[child]->timeout)
+			child++;
+		if (sv->timeout <= group->heap[child]->timeout)
+			break;
+
+		Sv_HeapPlace (group, group->heap[child], pos);
+		pos = child;
+	}
+
+	Sv_HeapPlace (group, sv, pos);
+}
+
+
+/*
+====================
+Sv_AddToQuotaGroup
+
+Add a server to a quota group
+====================
+*/
+static void Sv_AddToQuotaGroup (server_t* sv, unsigned int group_ind)
+{
+	quota_group_t* group = &quota_groups[group_ind];
+
+	assert (group->nb_servers < max_nb_servers);
+
+	sv->quota_group = group_ind;
+	Sv_HeapPlace (group, sv, group->nb_servers);
+	group->nb_servers++;
+	Sv_HeapSiftUp (group, sv->heap_pos);
+}
+
+
+/*
+====================
+Sv_RemoveFromQuotaGroup
+
+Remove a server from its quota group
+====================
+*/
+static void Sv_RemoveFromQuotaGroup (server_t* sv)
+{
+	quota_group_t* group = &quota_groups[sv->quota_group];
+	server_t* last;
+
+	assert (group->nb_servers > 0);
+	assert (group->heap[sv->heap_pos] == sv);
+
+	// Fill the hole with the last server of the heap, and put it back in order
+	group->nb_servers--;
+	last = group->heap[group->nb_servers];
+	if (last == sv)
+		return;
+
+	Sv_HeapPlace (group, last, sv->heap_pos);
+	Sv_HeapSiftUp (group, last->heap_pos);
+	Sv_HeapSiftDown (group, last->heap_pos);
+}
+
+
+/*
+====================
+Sv_GetQuotaGroup
+
+Get the quota group of a game
+====================
+*/
+static unsigned int Sv_GetQuotaGroup (const char* gamename)
+{
+	unsigned int group_ind;
+
+	// There's one group per game with a quota, so they are few
+	for (group_ind = QUOTA_GROUP_OTHERS + 1; group_ind < nb_quota_groups; group_ind++)
+		if (strcmp (quota_groups[group_ind].gamename, gamename) == 0)
+			return group_ind;
+
+	return QUOTA_GROUP_OTHERS;
+}
+
+
+/*
+====================
+Sv_AddrCounterHash
+
+Compute the hash of the public part of an address
+====================
+*/
+static unsigned int Sv_AddrCounterHash (qu64 key)
+{
+	return (unsigned int)((key * 0x9E3779B97F4A7C15ULL) >> (64 - addr_counter_hash_size));
+}
+
+
+/*
+====================
+Sv_FindAddrCounter
+
+Get the counter of the public part of an address, or NO_ADDR_COUNTER if no server uses it
+====================
+*/
+static unsigned int Sv_FindAddrCounter (const struct sockaddr_storage* address)
+{
+	qu64 key = Com_AddressKey (address);
+	unsigned int ind;
+
+	ind = addr_counter_hash_table[Sv_AddrCounterHash (key)];
+	while (ind != NO_ADDR_COUNTER)
+	{
+		const addr_counter_t* counter = &addr_counters[ind];
+
+		if (counter->key == key && counter->family == address->ss_family)
+			break;
+		ind = counter->hash_next;
+	}
+
+	return ind;
+}
+
+
+/*
+====================
+Sv_AddToAddrCounter
+
+Count a new server in the counter of its public address, creating it if necessary
+====================
+*/
+static void Sv_AddToAddrCounter (server_t* sv)
+{
+	const struct sockaddr_storage* address = &sv->user.address;
+	unsigned int ind = Sv_FindAddrCounter (address);
+	addr_counter_t* counter;
+
+	if (ind == NO_ADDR_COUNTER)
+	{
+		unsigned int hash;
+		qu64 key = Com_AddressKey (address);
+
+		// There's at most one counter per server, so we can't run out of them
+		ind = first_free_addr_counter;
+		assert (ind != NO_ADDR_COUNTER);
+		counter = &addr_counters[ind];
+		first_free_addr_counter = counter->hash_next;
+
+		hash = Sv_AddrCounterHash (key);
+		counter->key = key;
+		counter->family = address->ss_family;
+		counter->first_server = NULL;
+		counter->nb_servers = 0;
+		counter->hash_next = addr_counter_hash_table[hash];
+		addr_counter_hash_table[hash] = ind;
+	}
+	else
+		counter = &addr_counters[ind];
+
+	sv->addr_counter = ind;
+	sv->addr_prev = NULL;
+	sv->addr_next = counter->first_server;
+	if (counter->first_server != NULL)
+		counter->first_server->addr_prev = sv;
+	counter->first_server = sv;
+	counter->nb_servers++;
+}
+
+
+/*
+====================
+Sv_RemoveFromAddrCounter
+
+Stop counting a server in the counter of its public address, freeing it if it was the last one
+====================
+*/
+static void Sv_RemoveFromAddrCounter (server_t* sv)
+{
+	addr_counter_t* counter = &addr_counters[sv->addr_counter];
+	unsigned int* link;
+
+	if (sv->addr_prev != NULL)
+		sv->addr_prev->addr_next = sv->addr_next;
+	else
+	{
+		assert (counter->first_server == sv);
+		counter->first_server = sv->addr_next;
+	}
+	if (sv->addr_next != NULL)
+		sv->addr_next->addr_prev = sv->addr_prev;
+
+	assert (counter->nb_servers > 0);
+	counter->nb_servers--;
+	if (counter->nb_servers > 0)
+		return;
+
+	// Unlink the counter from its hash chain, and put it in the free list
+	link = &addr_counter_hash_table[Sv_AddrCounterHash (counter->key)];
+	while (*link != sv->addr_counter)
+	{
+		assert (*link != NO_ADDR_COUNTER);
+		link = &addr_counters[*link].hash_next;
+	}
+	*link = counter->hash_next;
+
+	counter->hash_next = first_free_addr_counter;
+	first_free_addr_counter = sv->addr_counter;
+}
+
+
 /*
 ====================
 Sv_Remove
@@ -72,11 +459,26 @@ Sv_Remove
 Remove a server from the lists
 ====================
 */
-static void Sv_Remove (server_t* sv)
+static void Sv_Remove (server_t* sv, sv_removal_t reason)
 {
+	static const char* removal_names [NB_SV_REMOVALS] =
+	{
+		"timed out",
+		"evicted",
+		"removed (getinfo messages left unanswered)",
+	};
 	int sv_ind;
 
+	assert (reason < NB_SV_REMOVALS);
+
 	Com_UserHashTable_Remove (&sv->user);
+	Sv_RemoveFromAddrCounter (sv);
+	Rev_Unschedule (sv);
+	if (quota_groups != NULL)
+		Sv_RemoveFromQuotaGroup (sv);
+
+	Rec_Record (REC_EVENT_SERVER_REMOVED, REC_REASON_NONE, &sv->user.address,
+				NULL, 0);
 
 	// Mark this structure as "free"
 	sv->state = sv_state_unused_slot;
@@ -104,9 +506,11 @@ static void Sv_Remove (server_t* sv)
 		crt_server_ind = last_used_slot;
 
 	nb_servers--;
+	PROBE2 (server__remove, &sv->user.address, nb_servers);
 	Com_Printf (MSG_NORMAL,
-				"> %s timed out; %u server(s) currently registered\n",
-				Sys_SockaddrToString(&sv->user.address, sv->user.addrlen), nb_servers);
+				"> %s %s; %u server(s) currently registered\n",
+				Sys_SockaddrToString(&sv->user.address, sv->user.addrlen),
+				removal_names[reason], nb_servers);
 
 	assert (last_used_slot >= (int)nb_servers - 1);
 }
@@ -135,7 +539,7 @@ static qboolean Sv_IsActive (unsigned int sv_ind)
 	// If the server has timed out
 	if (sv->timeout < crt_time)
 	{
-		Sv_Remove (sv);
+		Sv_Remove (sv, SV_REMOVAL_TIMEOUT);
 		return false;
 	}
 
@@ -143,6 +547,40 @@ static qboolean Sv_IsActive (unsigned int sv_ind)
 }
 
 
+/*
+====================
+Sv_CountSameAddress
+
+Get the number of servers registered from the public part of an address.
+The servers which have timed out are only removed when the maximum is
+reached, so it takes constant time for all the other addresses
+====================
+*/
+static unsigned int Sv_CountSameAddress (const struct sockaddr_storage* address)
+{
+	unsigned int ind = Sv_FindAddrCounter (address);
+	server_t* sv;
+
+	if (ind == NO_ADDR_COUNTER)
+		return 0;
+	if (addr_counters[ind].nb_servers < max_per_address || max_per_address == 0)
+		return addr_counters[ind].nb_servers;
+
+	// The counter is freed if all its servers have timed out
+	sv = addr_counters[ind].first_server;
+	while (sv != NULL)
+	{
+		server_t* next_sv = sv->addr_next;
+
+		Sv_IsActive ((unsigned int)(sv - servers));
+		sv = next_sv;
+	}
+
+	ind = Sv_FindAddrCounter (address);
+	return (ind == NO_ADDR_COUNTER ? 0 : addr_counters[ind].nb_servers);
+}
+
+
 /*
 ====================
 Sv_GetByAddr_Internal
@@ -150,7 +588,7 @@ Sv_GetByAddr_Internal
 Search for a particular server in the list
 ====================
 */
-static server_t* Sv_GetByAddr_Internal (const struct sockaddr_storage* address, unsigned int* same_address_found)
+static server_t* Sv_GetByAddr_Internal (const struct sockaddr_storage* address)
 {
 	unsigned int hash = Com_AddressHash (address, sv_hash_size);
 	server_t* sv;
@@ -165,7 +603,6 @@ static server_t* Sv_GetByAddr_Internal (const struct sockaddr_storage* address,
 	}
 	sv = (server_t*)hash_table.entries[hash];
 
-	*same_address_found = 0;
 	while (sv != NULL)
 	{
 		server_t* next_sv = (server_t*)sv->user.next;
@@ -178,13 +615,8 @@ static server_t* Sv_GetByAddr_Internal (const struct sockaddr_storage* address,
 			{
 				// Same address?
 				qboolean same_public_address;
-				qboolean same_address;
 
-				same_public_address = false;
-				same_address = IsSameAddress (sv_address, address, &same_public_address);
-				if (same_public_address)
-					*same_address_found += 1;
-				if (same_address)
+				if (IsSameAddress (sv_address, address, &same_public_address))
 				{
 					// Move it on top of the list (it's useful because heartbeats
 					// are almost always followed by infoResponses)
@@ -213,12 +645,97 @@ Browse the server list and remove all the servers that have timed out
 static void Sv_CheckTimeouts (void)
 {
 	int ind;
-	
+
+	if (last_timeouts_check == crt_time)
+		return;
+	last_timeouts_check = crt_time;
+
 	for (ind = 0; ind <= last_used_slot; ind++)
 		Sv_IsActive (ind);
 }
 
 
+/*
+====================
+Sv_FindVictim
+
+Find the server to remove from the full list to make room for a new server
+of a given game (NULL if its game isn't known yet), according to the "quota"
+eviction policy. The servers which have timed out are removed right away,
+and if it makes room, there's no need for a victim. Returns "false" if no
+room can be made. The uninitialized servers go first, then the oldest server
+of a game over its quota, but only if the game of the new server is under
+its quota
+====================
+*/
+static qboolean Sv_FindVictim (const char* gamename, server_t** victim_ptr)
+{
+	unsigned int group_ind;
+	server_t* victim = NULL;
+
+	assert (quota_groups != NULL);
+
+	*victim_ptr = NULL;
+	for (group_ind = 0; group_ind < nb_quota_groups; group_ind++)
+	{
+		quota_group_t* group = &quota_groups[group_ind];
+
+		while (group->nb_servers > 0 && group->heap[0]->timeout < crt_time)
+			Sv_Remove (group->heap[0], SV_REMOVAL_TIMEOUT);
+	}
+	if (nb_servers < max_nb_servers)
+		return true;
+
+	if (quota_groups[QUOTA_GROUP_UNINITIALIZED].nb_servers > 0)
+		victim = quota_groups[QUOTA_GROUP_UNINITIALIZED].heap[0];
+	else
+	{
+		if (gamename != NULL)
+		{
+			const quota_group_t* new_group = &quota_groups[Sv_GetQuotaGroup (gamename)];
+
+			if (new_group->nb_servers >= new_group->quota)
+				return false;
+		}
+
+		for (group_ind = QUOTA_GROUP_OTHERS; group_ind < nb_quota_groups; group_ind++)
+		{
+			const quota_group_t* group = &quota_groups[group_ind];
+
+			if (group->nb_servers > group->quota &&
+				(victim == NULL || group->heap[0]->timeout < victim->timeout))
+				victim = group->heap[0];
+		}
+		if (victim == NULL)
+			return false;
+	}
+
+	*victim_ptr = victim;
+	return true;
+}
+
+
+/*
+====================
+Sv_MakeRoom
+
+Remove a server from the full list to make room for a new server of a
+given game, if the "quota" eviction policy allows it (see Sv_FindVictim)
+====================
+*/
+static void Sv_MakeRoom (const char* gamename)
+{
+	server_t* victim;
+
+	if (! Sv_FindVictim (gamename, &victim) || victim == NULL)
+		return;
+
+	Com_Printf (MSG_NORMAL, "> Making room for a server of game \"%s\"\n", gamename);
+	Stats_RecordServerEviction ();
+	Sv_Remove (victim, SV_REMOVAL_EVICTION);
+}
+
+
 /*
 ====================
 Sv_ResolveIPv4Addr
@@ -420,29 +937,351 @@ static qboolean Sv_ResolveAddrmap (addrmap_t* addrmap)
 }
 
 
-// ---------- Public functions (servers) ---------- //
-
 /*
 ====================
-Sv_SetHashSize
+Sv_CheckAdmission
 
-Set a new hash size value
+Check if a server which isn't in the list yet is allowed in it.
+Whether the list has room for it or not isn't checked here
 ====================
 */
-qboolean Sv_SetHashSize (unsigned int size)
+static qboolean Sv_CheckAdmission (const struct sockaddr_storage* address, unsigned int nb_same_address,
+								   const addrmap_t** addrmap_ptr)
 {
-	// Too late? Or too big?
-	if (servers != NULL || size > MAX_HASH_SIZE)
+	*addrmap_ptr = NULL;
+
+	assert (nb_same_address <= max_per_address || max_per_address == 0);
+	if (nb_same_address >= max_per_address && max_per_address != 0)
+	{
+		Com_Printf (MSG_WARNING,
+					"> WARNING: server %s isn't allowed (max number of servers reached for this address)\n",
+					peer_address);
 		return false;
+	}
 
-	sv_hash_size = size;
-	return true;
-}
+	if (! allow_loopback)
+	{
+		// IPv4 servers on a loopback address are allowed if a mapping is defined for them
+		if (address->ss_family == AF_INET)
+		{
+			const struct sockaddr_in* addr_in = (const struct sockaddr_in*)address;
+			*addrmap_ptr = Sv_GetAddrmap (addr_in);
+			if ((ntohl (addr_in->sin_addr.s_addr) >> 24) == 127 &&
+				*addrmap_ptr == NULL)
+			{
+				Com_Printf (MSG_WARNING,
+							"> WARNING: server %s isn't allowed (loopback address without address mapping)\n",
+							peer_address);
+				return false;
+			}
+		}
+		else
+		{
+			const struct sockaddr_in6 *addr_in6;
 
+			assert (address->ss_family == AF_INET6);
+			addr_in6 = (const struct sockaddr_in6*)address;
 
-/*
-====================
-Sv_SetMaxNbServers
+			if (memcmp (&addr_in6->sin6_addr.s6_addr, &in6addr_loopback.s6_addr,
+						sizeof(addr_in6->sin6_addr.s6_addr)) == 0)
+			{
+				Com_Printf (MSG_WARNING,
+							"> WARNING: server %s isn't allowed (IPv6 loopback address)\n",
+							peer_address);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+
+/*
+====================
+Sv_BuildAddrRecords
+
+Serialize the address of a new server once and for all, as it appears in the
+getservers responses and in the getserversWithInfo ones. Only the former use
+its address mapping, if any
+====================
+*/
+static void Sv_BuildAddrRecords (server_t* sv)
+{
+	char addr_str [INET6_ADDRSTRLEN];
+	int length;
+
+	if (sv->user.address.ss_family == AF_INET)
+	{
+		const struct sockaddr_in* sv_sockaddr = (const struct sockaddr_in*)&sv->user.address;
+		const struct sockaddr_in* mapped_sockaddr = sv_sockaddr;
+		unsigned short port = sv_sockaddr->sin_port;
+
+		// Use the address mapping associated with the server, if any
+		if (sv->addrmap != NULL)
+		{
+			mapped_sockaddr = &sv->addrmap->to;
+			if (mapped_sockaddr->sin_port != 0)
+				port = mapped_sockaddr->sin_port;
+		}
+
+		// Heading '\', IP address and port, all in network byte order
+		sv->addr_record[0] = '\\';
+		memcpy (&sv->addr_record[1], &mapped_sockaddr->sin_addr.s_addr, 4);
+		memcpy (&sv->addr_record[5], &port, 2);
+		sv->addr_record_len = 7;
+
+		if (sv->addrmap != NULL)
+			Com_Printf (MSG_DEBUG,
+						"  - Using mapped address %u.%u.%u.%u:%hu\n",
+						sv->addr_record[1], sv->addr_record[2],
+						sv->addr_record[3], sv->addr_record[4], ntohs (port));
+
+		inet_ntop (AF_INET, &sv_sockaddr->sin_addr, addr_str, sizeof (addr_str));
+		length = snprintf (sv->info_line, SV_INFO_ADDR_LENGTH, "\n\\addr\\%s %u",
+						   addr_str, ntohs (sv_sockaddr->sin_port));
+	}
+	else
+	{
+		const struct sockaddr_in6* sv_sockaddr6 = (const struct sockaddr_in6*)&sv->user.address;
+
+		assert (sv->user.address.ss_family == AF_INET6);
+
+		// Heading '/', IP address and port, all in network byte order
+		sv->addr_record[0] = '/';
+		memcpy (&sv->addr_record[1], &sv_sockaddr6->sin6_addr.s6_addr, 16);
+		memcpy (&sv->addr_record[17], &sv_sockaddr6->sin6_port, 2);
+		sv->addr_record_len = 19;
+
+		inet_ntop (AF_INET6, &sv_sockaddr6->sin6_addr, addr_str, sizeof (addr_str));
+		length = snprintf (sv->info_line, SV_INFO_ADDR_LENGTH, "\n\\addr6\\%s %u",
+						   addr_str, ntohs (sv_sockaddr6->sin6_port));
+	}
+
+	assert (length > 0 && length < SV_INFO_ADDR_LENGTH);
+	sv->info_addr_len = (unsigned int)length;
+	sv->info_line_len = sv->info_addr_len;
+}
+
+
+/*
+====================
+Sv_GetPendingKey
+
+Extract the fields identifying a pending registration from an address
+====================
+*/
+static void Sv_GetPendingKey (const struct sockaddr_storage* address, qbyte* addr_bytes, unsigned short* port)
+{
+	memset (addr_bytes, 0, sizeof (((pending_t*)NULL)->address));
+
+	if (address->ss_family == AF_INET6)
+	{
+		const struct sockaddr_in6* addr6 = (const struct sockaddr_in6*)address;
+
+		memcpy (addr_bytes, &addr6->sin6_addr.s6_addr, sizeof (addr6->sin6_addr.s6_addr));
+		*port = addr6->sin6_port;
+	}
+	else
+	{
+		const struct sockaddr_in* addr4 = (const struct sockaddr_in*)address;
+
+		assert (address->ss_family == AF_INET);
+		memcpy (addr_bytes, &addr4->sin_addr.s_addr, sizeof (addr4->sin_addr.s_addr));
+		*port = addr4->sin_port;
+	}
+}
+
+
+/*
+====================
+Sv_PendingHash
+
+Compute the hash of a pending registration, using a multiplicative hash
+of its full address, port included. "hash_size" is in bits
+====================
+*/
+static unsigned int Sv_PendingHash (const qbyte* addr_bytes, unsigned short port, unsigned int hash_size)
+{
+	qu64 key = port;
+	unsigned int ind;
+
+	for (ind = 0; ind < sizeof (((pending_t*)NULL)->address); ind++)
+		key = ((key << 8) | (key >> 56)) ^ addr_bytes[ind];
+
+	return (unsigned int)((key * 0x9E3779B97F4A7C15ULL) >> (64 - hash_size));
+}
+
+
+/*
+====================
+Sv_FindPending
+
+Find the pending registration of an address, or return NO_PENDING
+====================
+*/
+static unsigned int Sv_FindPending (const struct sockaddr_storage* address)
+{
+	qbyte addr_bytes [sizeof (((pending_t*)NULL)->address)];
+	unsigned short port;
+	unsigned int ind;
+
+	Sv_GetPendingKey (address, addr_bytes, &port);
+
+	ind = pending_hash_table[Sv_PendingHash (addr_bytes, port, pending_hash_size)];
+	while (ind != NO_PENDING)
+	{
+		const pending_t* pending = &pendings[ind];
+
+		if (pending->port == port && pending->family == address->ss_family &&
+			memcmp (pending->address, addr_bytes, sizeof (addr_bytes)) == 0)
+			break;
+
+		ind = pending->hash_next;
+	}
+
+	return ind;
+}
+
+
+/*
+====================
+Sv_RemovePending
+
+Remove a pending registration from its hash chain, and mark it as unused
+====================
+*/
+static void Sv_RemovePending (unsigned int pending_ind)
+{
+	pending_t* pending = &pendings[pending_ind];
+	unsigned int* link;
+
+	assert (pending->family != 0);
+
+	link = &pending_hash_table[Sv_PendingHash (pending->address, pending->port,
+											   pending_hash_size)];
+	while (*link != pending_ind)
+	{
+		assert (*link != NO_PENDING);
+		link = &pendings[*link].hash_next;
+	}
+	*link = pending->hash_next;
+
+	pending->family = 0;
+}
+
+
+/*
+====================
+Sv_GetRecentChallenge
+
+Get the entry of the table of recent challenges where an address goes, and
+tell if it's already the one of this address
+====================
+*/
+static recent_challenge_t* Sv_GetRecentChallenge (const struct sockaddr_storage* address,
+												  qbyte* addr_bytes, unsigned short* port,
+												  qboolean* found)
+{
+	recent_challenge_t* recent;
+
+	Sv_GetPendingKey (address, addr_bytes, port);
+	recent = &recent_challenges[Sv_PendingHash (addr_bytes, *port, RECENT_CHALLENGES_HASH_SIZE)];
+	*found = (recent->port == *port && recent->family == address->ss_family &&
+			  memcmp (recent->address, addr_bytes, sizeof (recent->address)) == 0);
+
+	return recent;
+}
+
+
+/*
+====================
+Sv_CompareNearest
+
+Compare 2 servers by closeness, the nearest first
+====================
+*/
+static int Sv_CompareNearest (const void* server1, const void* server2)
+{
+	const nearest_server_t* sv1 = (const nearest_server_t*)server1;
+	const nearest_server_t* sv2 = (const nearest_server_t*)server2;
+
+	if (sv1->closeness != sv2->closeness)
+		return (sv1->closeness > sv2->closeness ? -1 : 1);
+	return (sv1->order < sv2->order ? -1 : 1);
+}
+
+
+/*
+====================
+Sv_SelectNearest
+
+Partially sort the servers so that the "nb_selected" nearest ones come first,
+in any order (quickselect, in linear time on average)
+====================
+*/
+static void Sv_SelectNearest (nearest_server_t* nearest, unsigned int nb_nearest, unsigned int nb_selected)
+{
+	unsigned int left = 0;
+	unsigned int right = nb_nearest - 1;
+
+	while (left < right)
+	{
+		nearest_server_t pivot, tmp;
+		unsigned int pivot_ind, ind, store_ind;
+
+		// Move a random pivot to the right end, then partition around it
+		pivot_ind = left + (unsigned int)rand () % (right - left + 1);
+		pivot = nearest[pivot_ind];
+		nearest[pivot_ind] = nearest[right];
+		nearest[right] = pivot;
+
+		store_ind = left;
+		for (ind = left; ind < right; ind++)
+			if (Sv_CompareNearest (&nearest[ind], &pivot) < 0)
+			{
+				tmp = nearest[ind];
+				nearest[ind] = nearest[store_ind];
+				nearest[store_ind] = tmp;
+				store_ind++;
+			}
+		nearest[right] = nearest[store_ind];
+		nearest[store_ind] = pivot;
+
+		// The pivot is now at its final rank
+		if (store_ind == nb_selected)
+			return;
+		if (store_ind < nb_selected)
+			left = store_ind + 1;
+		else
+			right = store_ind - 1;
+	}
+}
+
+
+// ---------- Public functions (servers) ---------- //
+
+/*
+====================
+Sv_SetHashSize
+
+Set a new hash size value
+====================
+*/
+qboolean Sv_SetHashSize (unsigned int size)
+{
+	// Too late? Or too big?
+	if (servers != NULL || size > MAX_HASH_SIZE)
+		return false;
+
+	sv_hash_size = size;
+	return true;
+}
+
+
+/*
+====================
+Sv_SetMaxNbServers
 
 Set a new maximum number of servers
 ====================
@@ -476,6 +1315,24 @@ qboolean Sv_SetMaxNbServersPerAddress (unsigned int nb)
 }
 
 
+/*
+====================
+Sv_SetMaxNbPending
+
+Set a new maximum number of pending registrations
+====================
+*/
+qboolean Sv_SetMaxNbPending (unsigned int nb)
+{
+	// Too late? Or too small? Or too big?
+	if (servers != NULL || nb <= 0 || nb > MAX_NB_PENDING)
+		return false;
+
+	max_nb_pending = nb;
+	return true;
+}
+
+
 /*
 ====================
 Sv_Init
@@ -486,6 +1343,7 @@ Initialize the server list and hash tables
 qboolean Sv_Init (void)
 {
 	size_t array_size;
+	unsigned int ind;
 
 	// Allocate "servers" and clean it
 	array_size = max_nb_servers * sizeof (servers[0]);
@@ -509,6 +1367,109 @@ qboolean Sv_Init (void)
 	if (! Com_UserHashTable_Init (&hash_table, sv_hash_size, "server"))
 		return false;
 
+	// Allocate the address counters, with roughly one hash chain per counter
+	addr_counter_hash_size = 1;
+	while ((1U << addr_counter_hash_size) < max_nb_servers)
+		addr_counter_hash_size++;
+	addr_counters = malloc (max_nb_servers * sizeof (addr_counters[0]));
+	addr_counter_hash_table = malloc ((1 << addr_counter_hash_size) * sizeof (addr_counter_hash_table[0]));
+	if ((addr_counters == NULL && max_nb_servers != 0) || addr_counter_hash_table == NULL)
+	{
+		Com_Printf (MSG_ERROR,
+					"> ERROR: can't allocate the address counters (%s)\n",
+					strerror (errno));
+		return false;
+	}
+	for (ind = 0; ind < (1U << addr_counter_hash_size); ind++)
+		addr_counter_hash_table[ind] = NO_ADDR_COUNTER;
+	for (ind = 0; ind < max_nb_servers; ind++)
+		addr_counters[ind].hash_next = (ind + 1 < max_nb_servers ? ind + 1 : NO_ADDR_COUNTER);
+	first_free_addr_counter = (max_nb_servers != 0 ? 0 : NO_ADDR_COUNTER);
+
+	// Allocate the pending registrations table, if we need it
+	if (challenge_mode == CHALLENGE_MODE_TABLE)
+	{
+		pendings = calloc (max_nb_pending, sizeof (pendings[0]));
+
+		// Roughly one hash chain per entry
+		pending_hash_size = 1;
+		while ((1U << pending_hash_size) < max_nb_pending)
+			pending_hash_size++;
+		pending_hash_table = malloc ((1 << pending_hash_size) * sizeof (pending_hash_table[0]));
+
+		if (pendings == NULL || pending_hash_table == NULL)
+		{
+			Com_Printf (MSG_ERROR,
+						"> ERROR: can't allocate the pending registrations table (%s)\n",
+						strerror (errno));
+			return false;
+		}
+		for (ind = 0; ind < (1U << pending_hash_size); ind++)
+			pending_hash_table[ind] = NO_PENDING;
+
+		Com_Printf (MSG_NORMAL,
+					"> %u pending registration records allocated (%u bytes each)\n",
+					max_nb_pending, (unsigned int)sizeof (pendings[0]));
+	}
+	else
+	{
+		recent_challenges = calloc (1 << RECENT_CHALLENGES_HASH_SIZE, sizeof (recent_challenges[0]));
+		if (recent_challenges == NULL)
+		{
+			Com_Printf (MSG_ERROR,
+						"> ERROR: can't allocate the table of recent challenges (%s)\n",
+						strerror (errno));
+			return false;
+		}
+	}
+
+	// Allocate the quota groups, if we need them
+	if (eviction_policy == EVICTION_POLICY_QUOTA)
+	{
+		const game_properties_t* props;
+		unsigned int props_ind, group_ind;
+
+		nb_quota_groups = QUOTA_GROUP_OTHERS + 1;
+		for (props_ind = 1; Game_GetPropertiesByIndex (props_ind, &props); props_ind++)
+			if (props->quota != 0)
+				nb_quota_groups++;
+
+		quota_groups = calloc (nb_quota_groups, sizeof (quota_groups[0]));
+		if (quota_groups == NULL)
+		{
+			Com_Printf (MSG_ERROR,
+						"> ERROR: can't allocate the quota groups (%s)\n",
+						strerror (errno));
+			return false;
+		}
+
+		group_ind = QUOTA_GROUP_OTHERS + 1;
+		for (props_ind = 1; Game_GetPropertiesByIndex (props_ind, &props); props_ind++)
+			if (props->quota != 0)
+			{
+				quota_groups[group_ind].gamename = props->name;
+				quota_groups[group_ind].quota = props->quota;
+				group_ind++;
+			}
+
+		// Each heap must be able to hold the whole list
+		for (group_ind = 0; group_ind < nb_quota_groups; group_ind++)
+		{
+			quota_groups[group_ind].heap = malloc (max_nb_servers * sizeof (quota_groups[group_ind].heap[0]));
+			if (quota_groups[group_ind].heap == NULL && max_nb_servers != 0)
+			{
+				Com_Printf (MSG_ERROR,
+							"> ERROR: can't allocate the quota groups (%s)\n",
+							strerror (errno));
+				return false;
+			}
+		}
+
+		Com_Printf (MSG_NORMAL,
+					"> Eviction policy \"quota\" enabled (%u games with a quota)\n",
+					nb_quota_groups - (QUOTA_GROUP_OTHERS + 1));
+	}
+
 	return true;
 }
 
@@ -520,15 +1481,15 @@ Sv_GetByAddr
 Search for a particular server in the list; add it if necessary
 ====================
 */
-server_t* Sv_GetByAddr (const struct sockaddr_storage* address, socklen_t addrlen, qboolean add_it)
+server_t* Sv_GetByAddr (const struct sockaddr_storage* address, socklen_t addrlen, qboolean add_it,
+						const char* gamename)
 {
-	unsigned int nb_same_address = 0;
 	server_t *sv;
 	const addrmap_t* addrmap = NULL;
 	unsigned int hash;
 	unsigned int ind;
 
-	sv = Sv_GetByAddr_Internal (address, &nb_same_address);
+	sv = Sv_GetByAddr_Internal (address);
 	if (sv != NULL)
 	{
 		assert (addrlen == sv->user.addrlen);
@@ -538,49 +1499,8 @@ server_t* Sv_GetByAddr (const struct sockaddr_storage* address, socklen_t addrle
 	if (! add_it)
 		return NULL;
 
-	assert (nb_same_address <= max_per_address || max_per_address == 0);
-	if (nb_same_address >= max_per_address && max_per_address != 0)
-	{
-		Com_Printf (MSG_WARNING,
-					"> WARNING: server %s isn't allowed (max number of servers reached for this address)\n",
-					peer_address);
+	if (! Sv_CheckAdmission (address, Sv_CountSameAddress (address), &addrmap))
 		return NULL;
-	}
-
-	if (! allow_loopback)
-	{
-		// IPv4 servers on a loopback address are allowed if a mapping is defined for them
-		if (address->ss_family == AF_INET)
-		{
-			const struct sockaddr_in* addr_in = (const struct sockaddr_in*)address;
-			addrmap = Sv_GetAddrmap (addr_in);
-			if ((ntohl (addr_in->sin_addr.s_addr) >> 24) == 127 &&
-				addrmap == NULL)
-			{
-				Com_Printf (MSG_WARNING,
-							"> WARNING: server %s isn't allowed (loopback address without address mapping)\n",
-							peer_address);
-				return NULL;
-			}
-		}
-		else
-		{
-			const struct sockaddr_in6 *addr_in6;
-
-			assert (address->ss_family == AF_INET6);
-			addr_in6 = (const struct sockaddr_in6*)address;
-
-			if (memcmp (&addr_in6->sin6_addr.s6_addr, &in6addr_loopback.s6_addr,
-						sizeof(addr_in6->sin6_addr.s6_addr)) == 0)
-			{
-				Com_Printf (MSG_WARNING,
-							"> WARNING: server %s isn't allowed (IPv6 loopback address)\n",
-							peer_address);
-				return NULL;
-			}
-		}
-	}
-
 
 	// If the list is full, check the entries to see if we can free a slot
 	if (nb_servers == max_nb_servers)
@@ -588,12 +1508,17 @@ server_t* Sv_GetByAddr (const struct sockaddr_storage* address, socklen_t addrle
 		assert (last_used_slot == (int)max_nb_servers - 1);
 		assert (first_free_slot == -1);
 
-		Sv_CheckTimeouts ();
+		if (quota_groups != NULL)
+			Sv_MakeRoom (gamename);
+		else
+			Sv_CheckTimeouts ();
 		if (nb_servers == max_nb_servers)
 		{
 			Com_Printf (MSG_WARNING,
 						"> WARNING: can't add server %s (server list is full)\n",
 						peer_address);
+			Rec_Record (REC_EVENT_PACKET_REJECTED, REC_REASON_SERVER_LIST_FULL,
+						address, NULL, 0);
 			return NULL;
 		}
 	}
@@ -625,19 +1550,25 @@ server_t* Sv_GetByAddr (const struct sockaddr_storage* address, socklen_t addrle
 	memcpy (&sv->user.address, address, sizeof (sv->user.address));
 	sv->user.addrlen = addrlen;
 	sv->addrmap = addrmap;
+	Sv_BuildAddrRecords (sv);
 
 	// Add it to the list it belongs to
 	hash = Com_AddressHash (address, sv_hash_size);
 	Com_UserHashTable_Add (&hash_table, &sv->user, hash);
+	Sv_AddToAddrCounter (sv);
 
 	sv->state = sv_state_uninitialized;
 	sv->timeout = crt_time + TIMEOUT_HEARTBEAT;
+	if (quota_groups != NULL)
+		Sv_AddToQuotaGroup (sv, QUOTA_GROUP_UNINITIALIZED);
 
 	nb_servers++;
+	Rec_Record (REC_EVENT_SERVER_ADDED, REC_REASON_NONE, address, NULL, 0);
+	PROBE2 (server__add, address, nb_servers);
 
 	Com_Printf (MSG_NORMAL,
 				"> New server added: %s. %u server(s) now registered, including %u for this address quota\n",
-				peer_address, nb_servers, nb_same_address + 1);
+				peer_address, nb_servers, addr_counters[sv->addr_counter].nb_servers);
 	Com_Printf (MSG_DEBUG,
 				"  - index: %u\n"
 				"  - hash: 0x%04X\n",
@@ -649,17 +1580,119 @@ server_t* Sv_GetByAddr (const struct sockaddr_storage* address, socklen_t addrle
 
 /*
 ====================
-Sv_GetFirst
+Sv_Refresh
 
-Get the first server in the list
+Update the eviction order after the state, game or timeout of a server have changed
 ====================
 */
-server_t* Sv_GetFirst (void)
+void Sv_Refresh (server_t* server)
 {
-	if (nb_servers <= 0)
-		return NULL;
+	unsigned int group_ind;
 
-	// Pick the start of the iteration at random
+	if (quota_groups == NULL)
+		return;
+
+	if (server->state == sv_state_uninitialized)
+		group_ind = QUOTA_GROUP_UNINITIALIZED;
+	else
+		group_ind = Sv_GetQuotaGroup (server->gamename);
+
+	if (group_ind != server->quota_group)
+	{
+		Sv_RemoveFromQuotaGroup (server);
+		Sv_AddToQuotaGroup (server, group_ind);
+	}
+	else
+	{
+		quota_group_t* group = &quota_groups[group_ind];
+
+		Sv_HeapSiftUp (group, server->heap_pos);
+		Sv_HeapSiftDown (group, server->heap_pos);
+	}
+}
+
+
+/*
+====================
+Sv_CanBeAdded
+
+Check if a server is in the list, or is allowed in it and would find some
+room, without adding it. "gamename" is the game of the server, or NULL if it
+isn't known yet. It browses the whole list at most once per second (when it's
+full, without the "quota" eviction policy), so it can be called for each heartbeat
+====================
+*/
+qboolean Sv_CanBeAdded (const struct sockaddr_storage* address, const char* gamename)
+{
+	const addrmap_t* addrmap;
+
+	if (Sv_GetByAddr_Internal (address) != NULL)
+		return true;
+
+	if (! Sv_CheckAdmission (address, Sv_CountSameAddress (address), &addrmap))
+		return false;
+
+	// If the list is full, check if we could free a slot
+	if (nb_servers == max_nb_servers)
+	{
+		qboolean has_room;
+
+		if (quota_groups != NULL)
+		{
+			server_t* victim;
+
+			has_room = Sv_FindVictim (gamename, &victim);
+		}
+		else
+		{
+			Sv_CheckTimeouts ();
+			has_room = (nb_servers < max_nb_servers);
+		}
+
+		if (! has_room)
+		{
+			Com_Printf (MSG_WARNING,
+						"> WARNING: server %s isn't allowed (server list is full)\n",
+						peer_address);
+			Rec_Record (REC_EVENT_PACKET_REJECTED, REC_REASON_SERVER_LIST_FULL,
+						address, NULL, 0);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+====================
+Sv_Expire
+
+Remove a server from the list right away
+====================
+*/
+void Sv_Expire (server_t* server, sv_removal_t reason)
+{
+	assert (server->state != sv_state_unused_slot);
+
+	Sv_Remove (server, reason);
+}
+
+
+/*
+====================
+Sv_GetFirst
+
+Get the first server in the list
+====================
+*/
+server_t* Sv_GetFirst (void)
+{
+	iterating_nearest = false;
+	if (nb_servers <= 0)
+		return NULL;
+
+	// Pick the start of the iteration at random
 	crt_server_ind = rand () % (last_used_slot + 1);
 
 	// Set the end of the iteration 
@@ -689,6 +1722,19 @@ server_t* Sv_GetNext (void)
 	assert(last_used_slot >= -1);
 	assert(last_used_slot < (int)max_nb_servers);
 
+	if (iterating_nearest)
+	{
+		while (crt_nearest_ind < nb_nearest_servers)
+		{
+			server_t* sv = &servers[nearest_servers[crt_nearest_ind++].index];
+
+			// The list may have changed since the iteration has started
+			if (sv->state > sv_state_unused_slot)
+				return sv;
+		}
+		return NULL;
+	}
+
 	while (crt_server_ind != last_server_ind)
 	{
 		crt_server_ind = (crt_server_ind + 1) % (last_used_slot + 1);
@@ -700,6 +1746,218 @@ server_t* Sv_GetNext (void)
 }
 
 
+/*
+====================
+Sv_GetFirstNearest
+
+Get the first server in the list, iterating from the nearest server to the
+farthest one (the servers without a location come last). Only the
+NB_SORTED_NEAREST nearest servers are sorted, the others follow in no
+particular order
+====================
+*/
+server_t* Sv_GetFirstNearest (const float location [3])
+{
+	unsigned int start_ind, nb_sorted;
+	int ind;
+
+	if (nb_servers <= 0)
+		return Sv_GetFirst ();
+
+	if (nearest_servers == NULL)
+	{
+		nearest_servers = malloc (max_nb_servers * sizeof (nearest_servers[0]));
+		if (nearest_servers == NULL)
+		{
+			Com_Printf (MSG_WARNING, "> WARNING: can't allocate the sorted server list\n");
+			return Sv_GetFirst ();
+		}
+	}
+
+	// Servers at the same distance are sent in a random order
+	start_ind = (unsigned int)(rand () % (last_used_slot + 1));
+
+	nb_nearest_servers = 0;
+	for (ind = 0; ind <= last_used_slot; ind++)
+		if (Sv_IsActive (ind))
+		{
+			const server_t* sv = &servers[ind];
+			nearest_server_t* nearest = &nearest_servers[nb_nearest_servers++];
+
+			if (sv->located)
+				nearest->closeness = location[0] * sv->location[0] +
+									 location[1] * sv->location[1] +
+									 location[2] * sv->location[2];
+			else
+				nearest->closeness = -2.0f;
+			nearest->order = ((unsigned int)ind + max_nb_servers - start_ind) % max_nb_servers;
+			nearest->index = (unsigned int)ind;
+		}
+
+	// Only sort the nearest servers, no full sort of the list for each request
+	nb_sorted = nb_nearest_servers;
+	if (nb_sorted > NB_SORTED_NEAREST)
+	{
+		nb_sorted = NB_SORTED_NEAREST;
+		Sv_SelectNearest (nearest_servers, nb_nearest_servers, nb_sorted);
+	}
+	qsort (nearest_servers, nb_sorted, sizeof (nearest_servers[0]), Sv_CompareNearest);
+
+	crt_nearest_ind = 0;
+	iterating_nearest = true;
+	return Sv_GetNext ();
+}
+
+
+/*
+====================
+Sv_RecordChallenge
+
+Record that a server has been sent a getinfo message. If the previous
+one is still unanswered, it's considered lost
+====================
+*/
+void Sv_RecordChallenge (server_t* server)
+{
+	if (server->awaiting_info)
+	{
+		server->reliability -= server->reliability >> SV_LIVENESS_SHIFT;
+		server->nb_missed++;
+	}
+	server->awaiting_info = true;
+}
+
+
+/*
+====================
+Sv_RecordAnswer
+
+Record the answer of a server to its last getinfo message
+====================
+*/
+void Sv_RecordAnswer (server_t* server, qu64 rtt)
+{
+	unsigned int sample = (rtt < UINT_MAX ? (unsigned int)rtt : UINT_MAX);
+
+	// A new server gets its first sample as it is
+	if (server->state == sv_state_uninitialized)
+	{
+		server->rtt = sample;
+		server->reliability = SV_MAX_RELIABILITY;
+
+		// Its getinfo answered a heartbeat, so its first heartbeat interval starts here
+		server->last_heartbeat = Sys_GetMonotonicTime () - rtt;
+	}
+	else
+	{
+		if (sample >= server->rtt)
+			server->rtt += (sample - server->rtt) >> SV_LIVENESS_SHIFT;
+		else
+			server->rtt -= (server->rtt - sample) >> SV_LIVENESS_SHIFT;
+
+		server->reliability += (SV_MAX_RELIABILITY - server->reliability) >> SV_LIVENESS_SHIFT;
+	}
+
+	server->awaiting_info = false;
+	server->nb_missed = 0;
+}
+
+
+/*
+====================
+Sv_RecordLateAnswer
+
+Record the fact that a server has answered its last getinfo message too late
+====================
+*/
+void Sv_RecordLateAnswer (server_t* server)
+{
+	if (server->awaiting_info)
+	{
+		server->reliability -= server->reliability >> SV_LIVENESS_SHIFT;
+		server->awaiting_info = false;
+		server->nb_missed++;
+	}
+}
+
+
+/*
+====================
+Sv_RecordHeartbeat
+
+Record a heartbeat from a registered server, to estimate its heartbeat interval
+====================
+*/
+void Sv_RecordHeartbeat (server_t* server)
+{
+	qu64 now = Sys_GetMonotonicTime ();
+	unsigned int sample;
+
+	if (server->last_heartbeat != 0)
+	{
+		qu64 interval = (now - server->last_heartbeat) / 1000;
+
+		// Servers often send several heartbeats in a row, when they change
+		// their map for instance. Only the first one starts a new interval
+		if (interval < SV_MIN_HEARTBEAT_INTERVAL * 1000)
+			return;
+
+		if (interval > MAX_SV_TIMEOUT * 1000)
+			interval = MAX_SV_TIMEOUT * 1000;
+		sample = (unsigned int)interval;
+
+		// The first interval is taken as it is
+		if (server->heartbeat_interval == 0)
+			server->heartbeat_interval = sample;
+		else if (sample >= server->heartbeat_interval)
+			server->heartbeat_interval += (sample - server->heartbeat_interval) >> SV_LIVENESS_SHIFT;
+		else
+			server->heartbeat_interval -= (server->heartbeat_interval - sample) >> SV_LIVENESS_SHIFT;
+	}
+
+	server->last_heartbeat = now;
+}
+
+
+/*
+====================
+Sv_GetHeartbeatInterval
+
+Get the smoothed heartbeat interval of a server, in seconds (0 if unknown)
+====================
+*/
+unsigned int Sv_GetHeartbeatInterval (const server_t* server)
+{
+	return (server->heartbeat_interval + 500) / 1000;
+}
+
+
+/*
+====================
+Sv_GetRTT
+
+Get the smoothed round-trip time of a server, in milliseconds
+====================
+*/
+unsigned int Sv_GetRTT (const server_t* server)
+{
+	return (server->rtt + 500) / 1000;
+}
+
+
+/*
+====================
+Sv_GetReliability
+
+Get the reliability of a server, in percents
+====================
+*/
+unsigned int Sv_GetReliability (const server_t* server)
+{
+	return server->reliability * 100 / SV_MAX_RELIABILITY;
+}
+
+
 /*
 ====================
 Sv_PrintServerList
@@ -753,16 +2011,235 @@ void Sv_PrintServerList (msg_level_t msg_level)
 			Com_Printf (msg_level,
 						" (timeout: %lu)\n"
 						"\tgame: \"%s\" (protocol: %d, gametype: %s)\n"
-						"\tstate: %s\n"
-						"\tchallenge: \"%s\" (timeout: %lu)\n",
+						"\tstate: %s\n",
 						(unsigned long)sv->timeout,
 						sv->gamename, sv->protocol, sv->gametype,
-						state_string,
-						sv->challenge, (unsigned long)sv->challenge_timeout);
+						state_string);
+		}
+}
+
+
+/*
+====================
+Sv_DumpServerList
+
+Print the list of servers to the output, in a machine-readable form:
+one line per server, made of "key=value" pairs separated by spaces
+====================
+*/
+void Sv_DumpServerList (msg_level_t msg_level)
+{
+	static const char* state_names [] =
+	{
+		"unused",
+		"uninitialized",
+		"empty",
+		"occupied",
+		"full",
+	};
+	int ind;
+
+	for (ind = 0; ind <= last_used_slot; ind++)
+		if (Sv_IsActive(ind))
+		{
+			const server_t* sv = &servers[ind];
+
+			assert(sv->state > sv_state_unused_slot);
+			assert(sv->state <= sv_state_full);
+
+			Com_Printf (msg_level, "addr=%s",
+						Sys_SockaddrToString (&sv->user.address, sv->user.addrlen));
+			if (sv->addrmap != NULL)
+				Com_Printf (msg_level, " mapped=%s", sv->addrmap->to_string);
+			if (sv->country[0] != '\0')
+				Com_Printf (msg_level, " country=%s", sv->country);
+			Com_Printf (msg_level,
+						" game=%s protocol=%d gametype=%s state=%s timeout=%ld rtt=%u reliability=%u\n",
+						sv->gamename, sv->protocol, sv->gametype,
+						state_names[sv->state], (long)(sv->timeout - crt_time),
+						Sv_GetRTT (sv), Sv_GetReliability (sv));
 		}
 }
 
 
+// ---------- Public functions (pending registrations) ---------- //
+
+/*
+====================
+Sv_AddPending
+
+Record a server which must answer a challenge before being added to
+the list, and return the challenge to send to it
+====================
+*/
+const char* Sv_AddPending (const struct sockaddr_storage* address, unsigned int game_index)
+{
+	pending_t* pending;
+	unsigned int pending_ind, hash;
+	qu64 now = Sys_GetMonotonicTime ();
+
+	assert (challenge_mode == CHALLENGE_MODE_TABLE);
+	assert (game_index <= COOKIE_MAX_GAME_INDEX);
+
+	pending_ind = Sv_FindPending (address);
+	if (pending_ind != NO_PENDING)
+	{
+		pending = &pendings[pending_ind];
+
+		// Further heartbeats can't prolong a challenge, unless they change the game
+		if (pending->expiry > now && pending->game_index == game_index)
+			return pending->challenge;
+
+		Sv_RemovePending (pending_ind);
+	}
+
+	// Overwrite the oldest entry
+	pending_ind = next_pending;
+	next_pending = (next_pending + 1) % max_nb_pending;
+	pending = &pendings[pending_ind];
+	if (pending->family != 0)
+	{
+		if (pending->expiry > now)
+			Stats_RecordPendingEviction ();
+		Sv_RemovePending (pending_ind);
+	}
+
+	Sv_GetPendingKey (address, pending->address, &pending->port);
+	pending->family = (qbyte)address->ss_family;
+	pending->game_index = (unsigned short)game_index;
+	pending->expiry = now + TIMEOUT_CHALLENGE * 1000000;
+
+	// The cookie is unpredictable, so it makes a good challenge
+	strncpy (pending->challenge, Cookie_BuildChallenge (address, game_index),
+			 sizeof (pending->challenge) - 1);
+	pending->challenge[sizeof (pending->challenge) - 1] = '\0';
+
+	hash = Sv_PendingHash (pending->address, pending->port, pending_hash_size);
+	pending->hash_next = pending_hash_table[hash];
+	pending_hash_table[hash] = pending_ind;
+
+	return pending->challenge;
+}
+
+
+/*
+====================
+Sv_CheckPending
+
+Check the challenge echoed by a pending server, and forget this server
+====================
+*/
+qboolean Sv_CheckPending (const char* challenge, const struct sockaddr_storage* address,
+						  unsigned int* game_index, qu64* elapsed_time, qboolean* expired)
+{
+	pending_t* pending;
+	unsigned int pending_ind;
+	qu64 now;
+
+	assert (challenge_mode == CHALLENGE_MODE_TABLE);
+
+	pending_ind = Sv_FindPending (address);
+	if (pending_ind == NO_PENDING)
+		return false;
+
+	// A wrong challenge doesn't cancel the right one
+	pending = &pendings[pending_ind];
+	if (strcmp (challenge, pending->challenge) != 0)
+		return false;
+
+	now = Sys_GetMonotonicTime ();
+	*game_index = pending->game_index;
+	*elapsed_time = now + TIMEOUT_CHALLENGE * 1000000 - pending->expiry;
+	*expired = (now >= pending->expiry);
+
+	Sv_RemovePending (pending_ind);
+	return true;
+}
+
+
+/*
+====================
+Sv_IsChallengePending
+
+Return "true" if a challenge sent to an address for a game has neither
+expired nor been answered yet
+====================
+*/
+qboolean Sv_IsChallengePending (const struct sockaddr_storage* address, unsigned int game_index)
+{
+	qu64 now = Sys_GetMonotonicTime ();
+
+	if (challenge_mode == CHALLENGE_MODE_TABLE)
+	{
+		unsigned int pending_ind = Sv_FindPending (address);
+		const pending_t* pending;
+
+		if (pending_ind == NO_PENDING)
+			return false;
+		pending = &pendings[pending_ind];
+		return (pending->expiry > now && pending->game_index == game_index);
+	}
+	else
+	{
+		qbyte addr_bytes [sizeof (((recent_challenge_t*)NULL)->address)];
+		unsigned short port;
+		const recent_challenge_t* recent;
+		qboolean found;
+
+		recent = Sv_GetRecentChallenge (address, addr_bytes, &port, &found);
+		return (found && recent->expiry > now && recent->game_index == game_index);
+	}
+}
+
+
+/*
+====================
+Sv_AddRecentChallenge
+
+Remember that a cookie challenge has been sent to an address, in
+the "cookie" challenge mode (see Sv_IsChallengePending)
+====================
+*/
+void Sv_AddRecentChallenge (const struct sockaddr_storage* address, unsigned int game_index)
+{
+	recent_challenge_t* recent;
+	qbyte addr_bytes [sizeof (((recent_challenge_t*)NULL)->address)];
+	unsigned short port;
+	qboolean found;
+
+	assert (challenge_mode == CHALLENGE_MODE_COOKIE);
+
+	recent = Sv_GetRecentChallenge (address, addr_bytes, &port, &found);
+	memcpy (recent->address, addr_bytes, sizeof (recent->address));
+	recent->port = port;
+	recent->family = (qbyte)address->ss_family;
+	recent->game_index = (unsigned short)game_index;
+	recent->expiry = Sys_GetMonotonicTime () + TIMEOUT_CHALLENGE * 1000000;
+}
+
+
+/*
+====================
+Sv_RemoveRecentChallenge
+
+Forget the cookie challenge sent to an address, once it has been answered
+====================
+*/
+void Sv_RemoveRecentChallenge (const struct sockaddr_storage* address)
+{
+	recent_challenge_t* recent;
+	qbyte addr_bytes [sizeof (((recent_challenge_t*)NULL)->address)];
+	unsigned short port;
+	qboolean found;
+
+	assert (challenge_mode == CHALLENGE_MODE_COOKIE);
+
+	recent = Sv_GetRecentChallenge (address, addr_bytes, &port, &found);
+	if (found)
+		recent->family = 0;
+}
+
+
 // ---------- Public functions (address mappings) ---------- //
 
 /*
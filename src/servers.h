@@ -36,9 +36,9 @@
 // Address hash size in bits for servers (between 0 and MAX_HASH_SIZE)
 #define DEFAULT_SV_HASH_SIZE 10
 
-// Number of characters in a challenge, including the '\0'
-#define CHALLENGE_MIN_LENGTH 9
-#define CHALLENGE_MAX_LENGTH 12
+// Default and maximum number of pending registrations, in the "table" challenge mode
+#define DEFAULT_MAX_NB_PENDING 1024
+#define MAX_NB_PENDING (1 << 20)
 
 // Max number of characters for a gamename, including the '\0'
 #define GAMENAME_LENGTH 64
@@ -49,9 +49,61 @@
 // Max size of a server info string, including the '\0'
 #define SERVERINFO_LENGTH 512
 
+// Max size of the binary record of a server in the getservers responses
+// ('/', IPv6 address and port), and of the address part of its line in
+// the getserversWithInfo responses ("\n\\addr6\\<IPv6 address> <port>")
+#define SV_ADDR_RECORD_LENGTH 19
+#define SV_INFO_ADDR_LENGTH 64
+
+// Max number of characters for a country code, including the '\0'
+#define COUNTRY_LENGTH 4
+
+// Liveness of the servers: the getinfo round-trip times and the proportion of
+// answered challenges are smoothed by exponentially weighted moving averages,
+// giving a weight of 1/(2^SV_LIVENESS_SHIFT) to each new sample
+#define SV_LIVENESS_SHIFT 3
+#define SV_MAX_RELIABILITY 1000
+
+// Default, minimum and maximum time a server stays in the list after its
+// last valid infoResponse, in seconds (see the "timeout" game property)
+#define DEFAULT_SV_TIMEOUT 40
+#define MIN_SV_TIMEOUT 5
+#define MAX_SV_TIMEOUT 86400
+
+// Adaptive timeouts: a server stays in the list SV_HEARTBEAT_FACTOR times its
+// smoothed heartbeat interval. The heartbeats following the previous one by
+// less than SV_MIN_HEARTBEAT_INTERVAL seconds aren't part of the regular ones
+#define SV_HEARTBEAT_FACTOR 3
+#define SV_MIN_HEARTBEAT_INTERVAL 5
+
 
 // ---------- Types ---------- //
 
+// How the challenges sent to the servers are checked
+typedef enum
+{
+	CHALLENGE_MODE_COOKIE,	// stateless: the challenge is a MAC of the server address
+	CHALLENGE_MODE_TABLE,	// the challenge is stored in the pending registrations table
+} challenge_mode_t;
+
+// What happens to a new server when the list is full
+typedef enum
+{
+	EVICTION_POLICY_NONE,	// it's refused
+	EVICTION_POLICY_QUOTA,	// it replaces an uninitialized server, or the oldest server of
+							// a game over its quota, if its own game is under its quota
+} eviction_policy_t;
+
+// Why a server is removed from the list
+typedef enum
+{
+	SV_REMOVAL_TIMEOUT,			// it hasn't sent a heartbeat for too long
+	SV_REMOVAL_EVICTION,		// it made room for a new server (see eviction_policy_t)
+	SV_REMOVAL_REVALIDATION,	// it left several getinfo messages unanswered
+
+	NB_SV_REMOVALS
+} sv_removal_t;
+
 // Address mapping
 typedef struct addrmap_s
 {
@@ -79,15 +131,36 @@ typedef struct server_s
 	user_t user;										// WARNING: MUST be the 1st member, for compatibility with the user hash tables
 	const struct addrmap_s* addrmap;
 	const struct game_properties_s* anon_properties;	// game properties, for an anonymous game
-	const struct game_properties_s* hb_properties;		// future "anon_properties", not yet validated by an infoResponse
 	time_t timeout;
-	time_t challenge_timeout;
 	int protocol;
 	server_state_t state;
-	char challenge [CHALLENGE_MAX_LENGTH];
 	char gametype [GAMETYPE_LENGTH];
 	char gamename [GAMENAME_LENGTH];
-	char serverinfo [SERVERINFO_LENGTH];
+	qbyte addr_record [SV_ADDR_RECORD_LENGTH];			// record in the getservers responses, ready to be copied
+	unsigned int addr_record_len;
+	char info_line [SV_INFO_ADDR_LENGTH + SERVERINFO_LENGTH];	// line in the getserversWithInfo responses: address part, then serverinfo
+	unsigned int info_addr_len;
+	unsigned int info_line_len;							// equal to "info_addr_len" while the serverinfo is unknown
+	char country [COUNTRY_LENGTH];						// empty if unknown
+	float location [3];									// unit vector from the center of the Earth
+	qboolean located;									// is "location" known?
+	unsigned int geo_generation;						// GeoIP database generation of "country" and "location"
+	unsigned int rtt;									// smoothed getinfo round-trip time, in microseconds
+	unsigned int reliability;							// smoothed proportion of answered challenges, up to SV_MAX_RELIABILITY
+	qboolean awaiting_info;								// has a getinfo been sent since the last infoResponse?
+	unsigned int nb_missed;								// number of getinfo messages left unanswered in a row
+	qu64 last_heartbeat;								// monotonic time of the last regular heartbeat, in microseconds (0 if none)
+	unsigned int heartbeat_interval;					// smoothed interval between the heartbeats, in milliseconds (0 if unknown)
+	socket_t socket;									// socket the server has registered on
+	struct server_s* rev_prev;							// previous and next servers in the revalidation wheel slot
+	struct server_s* rev_next;
+	unsigned int rev_slot;
+	qboolean rev_scheduled;
+	unsigned int quota_group;							// quota group and position in its heap (see Sv_Refresh)
+	unsigned int heap_pos;
+	unsigned int addr_counter;							// counter of its public address, and previous and next servers counted in it
+	struct server_s* addr_prev;
+	struct server_s* addr_next;
 } server_t;
 
 
@@ -96,6 +169,12 @@ typedef struct server_s
 // Are servers talking from a loopback interface allowed?
 extern qboolean allow_loopback;
 
+// How the challenges sent to the servers are checked (can't be changed after Sv_Init)
+extern challenge_mode_t challenge_mode;
+
+// What happens to a new server when the list is full (can't be changed after Sv_Init)
+extern eviction_policy_t eviction_policy;
+
 
 // ---------- Public functions (servers) ---------- //
 
@@ -103,13 +182,26 @@ extern qboolean allow_loopback;
 qboolean Sv_SetHashSize (unsigned int size);
 qboolean Sv_SetMaxNbServers (unsigned int nb);
 qboolean Sv_SetMaxNbServersPerAddress (unsigned int nb);
+qboolean Sv_SetMaxNbPending (unsigned int nb);
 
 // Initialize the server list and hash tables
 qboolean Sv_Init (void);
 
-// Search for a particular server in the list; add it if necessary
+// Search for a particular server in the list; add it if necessary. "gamename"
+// is the game of the server to add, or NULL if "add_it" is false
 // NOTE: doesn't change the current position for "Sv_GetNext"
-server_t* Sv_GetByAddr (const struct sockaddr_storage* address, socklen_t addrlen, qboolean add_it);
+server_t* Sv_GetByAddr (const struct sockaddr_storage* address, socklen_t addrlen, qboolean add_it,
+						const char* gamename);
+
+// Update the eviction order after the state, game or timeout of a server have changed
+void Sv_Refresh (server_t* server);
+
+// Check if a server is in the list, or is allowed in it and would find some room,
+// without adding it. "gamename" is the game of the server, or NULL if it isn't known yet
+qboolean Sv_CanBeAdded (const struct sockaddr_storage* address, const char* gamename);
+
+// Remove a server from the list right away
+void Sv_Expire (server_t* server, sv_removal_t reason);
 
 // Get the first server in the list
 server_t* Sv_GetFirst (void);
@@ -117,9 +209,59 @@ server_t* Sv_GetFirst (void);
 // Get the next server in the list
 server_t* Sv_GetNext (void);
 
+// Get the first server in the list, iterating from the nearest server to the
+// farthest one (the servers without a location come last). Only the nearest
+// servers are sorted, the farther ones follow in no particular order
+server_t* Sv_GetFirstNearest (const float location [3]);
+
+// Record that a server has been sent a getinfo message. If the previous
+// one is still unanswered, it's considered lost
+void Sv_RecordChallenge (server_t* server);
+
+// Record the answer of a server to its last getinfo message, or the fact
+// that it answered too late
+void Sv_RecordAnswer (server_t* server, qu64 rtt);
+void Sv_RecordLateAnswer (server_t* server);
+
+// Record a heartbeat from a registered server, to estimate its heartbeat interval
+void Sv_RecordHeartbeat (server_t* server);
+
+// Get the smoothed heartbeat interval of a server, in seconds (0 if unknown)
+unsigned int Sv_GetHeartbeatInterval (const server_t* server);
+
+// Get the liveness of a server: its smoothed round-trip time, in milliseconds,
+// and its reliability, in percents
+unsigned int Sv_GetRTT (const server_t* server);
+unsigned int Sv_GetReliability (const server_t* server);
+
 // Print the list of servers to the output
 void Sv_PrintServerList (msg_level_t msg_level);
 
+// Print the list of servers to the output, in a machine-readable form
+void Sv_DumpServerList (msg_level_t msg_level);
+
+
+// ---------- Public functions (pending registrations) ---------- //
+
+// Record a server which must answer a challenge before being added to the list,
+// and return the challenge to send to it. Only used in the "table" challenge mode
+const char* Sv_AddPending (const struct sockaddr_storage* address, unsigned int game_index);
+
+// Check the challenge echoed by a pending server, and forget this server. If the
+// challenge is the expected one, get back the game index and the time elapsed since
+// it has been sent (in microseconds), and tell if it has expired
+qboolean Sv_CheckPending (const char* challenge, const struct sockaddr_storage* address,
+						  unsigned int* game_index, qu64* elapsed_time, qboolean* expired);
+
+// Return "true" if a challenge sent to an address for a game has neither
+// expired nor been answered yet
+qboolean Sv_IsChallengePending (const struct sockaddr_storage* address, unsigned int game_index);
+
+// Remember that a cookie challenge has been sent to an address, or forget it
+// once it has been answered. Only used in the "cookie" challenge mode
+void Sv_AddRecentChallenge (const struct sockaddr_storage* address, unsigned int game_index);
+void Sv_RemoveRecentChallenge (const struct sockaddr_storage* address);
+
 
 // ---------- Public functions (address mappings) ---------- //
 
@@ -0,0 +1,469 @@
+/*
+	stats.c
+
+	Statistics for dpmaster
+
+	Copyright (C) 2011  Mathieu Olivier
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include "common.h"
+#include "system.h"
+#include "clients.h"
+#include "egress.h"
+#include "hitters.h"
+#include "messages.h"
+#include "overload.h"
+#include "revalidation.h"
+#include "servers.h"
+#include "stats.h"
+
+
+// ---------- Private types ---------- //
+
+typedef struct
+{
+	char name [GAMENAME_LENGTH];
+	histogram_t* histogram;
+} game_stats_t;
+
+
+// ---------- Private variables ---------- //
+
+#ifndef DISABLE_LATENCY_STATS
+
+// Names of the message types, for printing
+static const char* msg_type_names [NB_STATS_MSG_TYPES] =
+{
+	"heartbeat",
+	"infoResponse",
+	"getservers",
+	"getserversExt",
+	"getserversWithInfo",
+	"getMyAddr",
+	"relaySend",
+};
+
+#endif
+
+// Latency of each type of message, in cycles
+static histogram_t msg_latencies [NB_STATS_MSG_TYPES];
+
+// Latency of the getservers requests, per game, in cycles. Games
+// which don't fit in the array are recorded in "other_games_latency"
+static game_stats_t game_latencies [MAX_STATS_GAMES];
+static unsigned int nb_game_latencies = 0;
+static histogram_t other_games_latency;
+
+// Server registration statistics
+static histogram_t getinfo_rtt;			// getinfo -> infoResponse, in cycles
+static qu64 nb_challenges_sent = 0;
+static qu64 nb_late_inforesponses = 0;
+static qu64 nb_pending_evictions = 0;
+static qu64 nb_duplicate_heartbeats = 0;
+static qu64 nb_getinfo_batches = 0;
+static qu64 nb_batched_getinfos = 0;
+static qu64 nb_server_evictions = 0;
+
+// Anti-reflection statistics
+static qu64 nb_getservers_tokens = 0;
+static qu64 nb_limited_responses = 0;
+static qu64 nb_reflection_bytes_saved = 0;
+
+
+// ---------- Private functions (histograms) ---------- //
+
+/*
+====================
+Histogram_GetBucket
+
+Return the index of the bucket a value belongs to
+====================
+*/
+static unsigned int Histogram_GetBucket (qu64 value)
+{
+	unsigned int exponent, shift;
+
+	// Small values have a bucket of their own
+	if (value < (1 << HISTOGRAM_SUB_BITS))
+		return (unsigned int)value;
+
+	if (value >= ((qu64)1 << HISTOGRAM_MAX_BITS))
+		return HISTOGRAM_NB_BUCKETS - 1;
+
+	// Find the position of the highest bit set
+#ifdef __GNUC__
+	exponent = 63 - __builtin_clzll (value);
+#else
+	exponent = HISTOGRAM_SUB_BITS;
+	while ((value >> (exponent + 1)) != 0)
+		exponent++;
+#endif
+
+	// Each power of 2 is split in (1 << HISTOGRAM_SUB_BITS) linear buckets
+	shift = exponent - HISTOGRAM_SUB_BITS;
+	return ((shift + 1) << HISTOGRAM_SUB_BITS) +
+		   (unsigned int)(value >> shift) - (1 << HISTOGRAM_SUB_BITS);
+}
+
+
+/*
+====================
+Histogram_GetBucketValue
+
+Return the highest value a bucket can contain
+====================
+*/
+static qu64 Histogram_GetBucketValue (unsigned int bucket)
+{
+	unsigned int shift;
+	qu64 mantissa;
+
+	if (bucket < (1 << HISTOGRAM_SUB_BITS))
+		return bucket;
+
+	shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+	mantissa = (bucket & ((1 << HISTOGRAM_SUB_BITS) - 1)) + (1 << HISTOGRAM_SUB_BITS);
+	return ((mantissa + 1) << shift) - 1;
+}
+
+
+// ---------- Private functions (statistics) ---------- //
+
+/*
+====================
+Stats_PrintHistogram
+
+Print the main percentiles of a latency histogram
+====================
+*/
+static void Stats_PrintHistogram (msg_level_t msg_level, const char* name, const histogram_t* histogram)
+{
+	const double percentiles [] = { 50.0, 90.0, 99.0, 99.9 };
+	unsigned int ind;
+	qu64 max_ns;
+
+	// The conversion ratio slightly changes over time, so the percentiles
+	// are clamped to the converted maximum value to stay consistent
+	max_ns = Sys_CyclesToNanoseconds (histogram->max_value);
+
+	Com_Printf (msg_level, " * %s: %llu samples,", name, histogram->nb_values);
+	for (ind = 0; ind < sizeof (percentiles) / sizeof (percentiles[0]); ind++)
+	{
+		qu64 value = Histogram_GetPercentile (histogram, percentiles[ind]);
+		qu64 value_ns = Sys_CyclesToNanoseconds (value);
+
+		Com_Printf (msg_level, " p%g: %.1f us,", percentiles[ind],
+					(value_ns < max_ns ? value_ns : max_ns) / 1000.0);
+	}
+	Com_Printf (msg_level, " max: %.1f us\n", max_ns / 1000.0);
+}
+
+
+// ---------- Public functions (histograms) ---------- //
+
+/*
+====================
+Histogram_Record
+
+Add a value to a histogram
+====================
+*/
+void Histogram_Record (histogram_t* histogram, qu64 value)
+{
+	histogram->counts[Histogram_GetBucket (value)]++;
+	histogram->nb_values++;
+	if (value > histogram->max_value)
+		histogram->max_value = value;
+}
+
+
+/*
+====================
+Histogram_GetPercentile
+
+Get the value at a given percentile (between 0 and 100) of a histogram
+====================
+*/
+qu64 Histogram_GetPercentile (const histogram_t* histogram, double percentile)
+{
+	qu64 rank, count;
+	unsigned int bucket;
+
+	if (histogram->nb_values == 0)
+		return 0;
+
+	rank = (qu64)(histogram->nb_values * percentile / 100.0 + 0.5);
+	if (rank == 0)
+		rank = 1;
+
+	count = 0;
+	for (bucket = 0; bucket < HISTOGRAM_NB_BUCKETS; bucket++)
+	{
+		count += histogram->counts[bucket];
+		if (count >= rank)
+		{
+			qu64 value = Histogram_GetBucketValue (bucket);
+
+			return (value < histogram->max_value ? value : histogram->max_value);
+		}
+	}
+
+	return histogram->max_value;
+}
+
+
+// ---------- Public functions (statistics) ---------- //
+
+/*
+====================
+Stats_RecordLatency
+
+Record the time (in cycles) spent handling a message
+====================
+*/
+void Stats_RecordLatency (stats_msg_type_t msg_type, qu64 cycles)
+{
+	assert (msg_type < NB_STATS_MSG_TYPES);
+	Histogram_Record (&msg_latencies[msg_type], cycles);
+}
+
+
+/*
+====================
+Stats_RecordGameLatency
+
+Record the time (in cycles) spent answering a getservers request for a game
+====================
+*/
+void Stats_RecordGameLatency (const char* game, qu64 cycles)
+{
+	unsigned int ind;
+	histogram_t* histogram = &other_games_latency;
+
+	for (ind = 0; ind < nb_game_latencies; ind++)
+		if (strcmp (game_latencies[ind].name, game) == 0)
+		{
+			histogram = game_latencies[ind].histogram;
+			break;
+		}
+
+	// If it's a new game and we still have some room for it
+	if (ind == nb_game_latencies && nb_game_latencies < MAX_STATS_GAMES)
+	{
+		histogram_t* new_histogram = malloc (sizeof (*new_histogram));
+
+		if (new_histogram != NULL)
+		{
+			game_stats_t* game_stats = &game_latencies[nb_game_latencies];
+
+			memset (new_histogram, 0, sizeof (*new_histogram));
+			strncpy (game_stats->name, game, sizeof (game_stats->name) - 1);
+			game_stats->name[sizeof (game_stats->name) - 1] = '\0';
+			game_stats->histogram = new_histogram;
+			nb_game_latencies++;
+
+			histogram = new_histogram;
+		}
+	}
+
+	Histogram_Record (histogram, cycles);
+}
+
+
+// ---------- Public functions (server registrations) ---------- //
+
+/*
+====================
+Stats_RecordChallenge
+
+Record that a getinfo challenge has been sent
+====================
+*/
+void Stats_RecordChallenge (void)
+{
+	nb_challenges_sent++;
+}
+
+
+/*
+====================
+Stats_RecordGetInfoRTT
+
+Record the round-trip time (in cycles) between a getinfo and its infoResponse
+====================
+*/
+void Stats_RecordGetInfoRTT (qu64 cycles)
+{
+	Histogram_Record (&getinfo_rtt, cycles);
+}
+
+
+/*
+====================
+Stats_RecordLateInfoResponse
+
+Record that an infoResponse has been received after its challenge expired
+====================
+*/
+void Stats_RecordLateInfoResponse (void)
+{
+	nb_late_inforesponses++;
+}
+
+
+/*
+====================
+Stats_RecordPendingEviction
+
+Record that a pending registration has been overwritten before its challenge expired
+====================
+*/
+void Stats_RecordPendingEviction (void)
+{
+	nb_pending_evictions++;
+}
+
+
+/*
+====================
+Stats_RecordDuplicateHeartbeat
+
+Record that a heartbeat has been ignored because a challenge was already pending
+====================
+*/
+void Stats_RecordDuplicateHeartbeat (void)
+{
+	nb_duplicate_heartbeats++;
+}
+
+
+/*
+====================
+Stats_RecordServerEviction
+
+Record that a server has been removed from the full list to make room for another one
+====================
+*/
+void Stats_RecordServerEviction (void)
+{
+	nb_server_evictions++;
+}
+
+
+/*
+====================
+Stats_RecordGetInfoBatch
+
+Record that a batch of getinfo messages has been sent at once
+====================
+*/
+void Stats_RecordGetInfoBatch (unsigned int nb_getinfos)
+{
+	nb_getinfo_batches++;
+	nb_batched_getinfos += nb_getinfos;
+}
+
+
+// ---------- Public functions (anti-reflection) ---------- //
+
+/*
+====================
+Stats_RecordGetServersToken
+
+Record that a getservers token has been sent
+====================
+*/
+void Stats_RecordGetServersToken (void)
+{
+	nb_getservers_tokens++;
+}
+
+
+/*
+====================
+Stats_RecordLimitedResponse
+
+Record that a getservers response has been cut or replaced by a token
+====================
+*/
+void Stats_RecordLimitedResponse (qu64 bytes_saved)
+{
+	nb_limited_responses++;
+	nb_reflection_bytes_saved += bytes_saved;
+}
+
+
+// ---------- Public functions (misc) ---------- //
+
+/*
+====================
+Stats_Print
+
+Print the statistics to the output
+====================
+*/
+void Stats_Print (msg_level_t msg_level)
+{
+#ifndef DISABLE_LATENCY_STATS
+	unsigned int ind;
+
+	Com_Printf (msg_level, "\n> Message handling latencies (time: %lu):\n",
+				(unsigned long)crt_time);
+	for (ind = 0; ind < NB_STATS_MSG_TYPES; ind++)
+		if (msg_latencies[ind].nb_values > 0)
+			Stats_PrintHistogram (msg_level, msg_type_names[ind], &msg_latencies[ind]);
+
+	Com_Printf (msg_level, "\n> getservers latencies per game:\n");
+	for (ind = 0; ind < nb_game_latencies; ind++)
+		Stats_PrintHistogram (msg_level, game_latencies[ind].name,
+							  game_latencies[ind].histogram);
+	if (other_games_latency.nb_values > 0)
+		Stats_PrintHistogram (msg_level, "(other games)", &other_games_latency);
+#endif
+
+	Com_Printf (msg_level,
+				"\n> Server registrations:\n"
+				" * challenges: %llu sent, %llu answered, %llu answered too late\n"
+				" * duplicate heartbeats absorbed: %llu\n"
+				" * getinfo batches: %llu (%llu messages)\n",
+				nb_challenges_sent, getinfo_rtt.nb_values, nb_late_inforesponses,
+				nb_duplicate_heartbeats, nb_getinfo_batches, nb_batched_getinfos);
+	if (challenge_mode == CHALLENGE_MODE_TABLE)
+		Com_Printf (msg_level, " * pending registrations evicted before expiring: %llu\n",
+					nb_pending_evictions);
+	if (eviction_policy == EVICTION_POLICY_QUOTA)
+		Com_Printf (msg_level, " * servers evicted from the full list: %llu\n",
+					nb_server_evictions);
+	if (getinfo_rtt.nb_values > 0)
+		Stats_PrintHistogram (msg_level, "getinfo round-trip time", &getinfo_rtt);
+
+	if (reflection_limit != 0)
+		Com_Printf (msg_level,
+					"\n> Anti-reflection (limit: %u bytes):\n"
+					" * getservers responses limited: %llu (%llu bytes saved)\n"
+					" * tokens sent: %llu\n",
+					reflection_limit, nb_limited_responses,
+					nb_reflection_bytes_saved, nb_getservers_tokens);
+
+	Cl_PrintStats (msg_level);
+	Hit_Print (msg_level, HIT_NB_PRINTED_SOURCES);
+	Egr_PrintStats (msg_level);
+	Ovl_PrintStats (msg_level);
+	Rev_PrintStats (msg_level);
+	Sys_PrintSocketStats (msg_level);
+}
@@ -0,0 +1,141 @@
+/*
+	stats.h
+
+	Statistics for dpmaster
+
+	Copyright (C) 2011  Mathieu Olivier
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+
+// ---------- Constants ---------- //
+
+// Number of linear sub-buckets per power of 2 in a histogram (in bits).
+// 4 bits means each value is recorded with a precision of about 6%
+#define HISTOGRAM_SUB_BITS 4
+
+// Values above 2^HISTOGRAM_MAX_BITS are recorded in the last bucket
+#define HISTOGRAM_MAX_BITS 48
+
+// Total number of buckets in a histogram
+#define HISTOGRAM_NB_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+// Maximum number of games with their own getservers latency histogram
+#define MAX_STATS_GAMES 32
+
+
+// ---------- Types ---------- //
+
+// Log-linear histogram, in the spirit of HdrHistogram
+typedef struct
+{
+	unsigned int counts [HISTOGRAM_NB_BUCKETS];
+	qu64 nb_values;
+	qu64 max_value;
+} histogram_t;
+
+// Types of timed messages
+typedef enum
+{
+	STATS_MSG_HEARTBEAT,
+	STATS_MSG_INFORESPONSE,
+	STATS_MSG_GETSERVERS,
+	STATS_MSG_GETSERVERSEXT,
+	STATS_MSG_GETSERVERSWITHINFO,
+	STATS_MSG_GETMYADDR,
+	STATS_MSG_RELAYSEND,
+
+	NB_STATS_MSG_TYPES
+} stats_msg_type_t;
+
+
+// ---------- Latency measurement macros ---------- //
+
+// Define DISABLE_LATENCY_STATS at compile time to remove the instrumentation
+#ifndef DISABLE_LATENCY_STATS
+#	define LATENCY_START(start_var)				((start_var) = Sys_GetCycles ())
+#	define LATENCY_RECORD(msg_type, start_var)	Stats_RecordLatency ((msg_type), Sys_GetCycles () - (start_var))
+#	define LATENCY_RECORD_GAME(game, start_var)	Stats_RecordGameLatency ((game), Sys_GetCycles () - (start_var))
+#else
+#	define LATENCY_START(start_var)
+#	define LATENCY_RECORD(msg_type, start_var)
+#	define LATENCY_RECORD_GAME(game, start_var)
+#endif
+
+
+// ---------- Public functions (histograms) ---------- //
+
+// Add a value to a histogram
+void Histogram_Record (histogram_t* histogram, qu64 value);
+
+// Get the value at a given percentile (between 0 and 100) of a histogram
+qu64 Histogram_GetPercentile (const histogram_t* histogram, double percentile);
+
+
+// ---------- Public functions (statistics) ---------- //
+
+// Record the time (in cycles) spent handling a message
+void Stats_RecordLatency (stats_msg_type_t msg_type, qu64 cycles);
+
+// Record the time (in cycles) spent answering a getservers request for a game
+void Stats_RecordGameLatency (const char* game, qu64 cycles);
+
+
+// ---------- Public functions (server registrations) ---------- //
+
+// Record that a getinfo challenge has been sent
+void Stats_RecordChallenge (void);
+
+// Record the round-trip time (in cycles) between a getinfo and its infoResponse
+void Stats_RecordGetInfoRTT (qu64 cycles);
+
+// Record that an infoResponse has been received after its challenge expired
+void Stats_RecordLateInfoResponse (void);
+
+// Record that a pending registration has been overwritten before its challenge expired
+void Stats_RecordPendingEviction (void);
+
+// Record that a heartbeat has been ignored because a challenge was already pending
+void Stats_RecordDuplicateHeartbeat (void);
+
+// Record that a server has been removed from the full list to make room for another one
+void Stats_RecordServerEviction (void);
+
+// Record that a batch of getinfo messages has been sent at once
+void Stats_RecordGetInfoBatch (unsigned int nb_getinfos);
+
+
+// ---------- Public functions (anti-reflection) ---------- //
+
+// Record that a getservers token has been sent
+void Stats_RecordGetServersToken (void);
+
+// Record that a getservers response has been cut or replaced by a token
+// because of the reflection limit, and how many bytes it saved
+void Stats_RecordLimitedResponse (qu64 bytes_saved);
+
+
+// ---------- Public functions (misc) ---------- //
+
+// Print the statistics to the output
+void Stats_Print (msg_level_t msg_level);
+
+
+#endif  // #ifndef _STATS_H_
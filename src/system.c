@@ -21,8 +21,23 @@
 */
 
 
+// sendmmsg() is a GNU extension
+#if defined (__linux__) && ! defined (_GNU_SOURCE)
+#	define _GNU_SOURCE
+#endif
+
 #include "common.h"
 #include "system.h"
+#include "admin.h"
+
+#ifdef _MSC_VER
+#	include <intrin.h>
+#endif
+
+#ifdef __linux__
+#	include <linux/filter.h>
+#	include <linux/sock_diag.h>
+#endif
 
 
 // ---------- Constants ---------- //
@@ -37,6 +52,25 @@
 
 #endif
 
+#ifdef __linux__
+
+// First 4 characters of the messages handled by dpmaster, as loaded by
+// the socket filter (in network byte order). Must be kept in sync with
+// the messages recognized by HandleMessage (messages.c)
+# define SF_PREFIX_HEARTBEAT	0x68656172  // "hear" (heartbeat)
+# define SF_PREFIX_INFORESPONSE	0x696E666F  // "info" (infoResponse)
+# define SF_PREFIX_GETSERVERS	0x67657473  // "gets" (getservers, getserversExt, getserversWithInfo)
+# define SF_PREFIX_GETMYADDR	0x6765744D  // "getM" (getMyAddr)
+# define SF_PREFIX_RELAYSEND	0x72656C61  // "rela" (relaySend)
+
+// Size of the UDP header, which precedes the payload in the socket filter's view
+# define SF_UDP_HEADER_SIZE 8
+
+// Maximum number of packets given to sendmmsg() at once
+# define SEND_BATCH_SIZE 64
+
+#endif
+
 
 // ---------- Private variables ---------- //
 
@@ -53,6 +87,37 @@ static int null_device = -1;
 
 #endif
 
+#ifdef __linux__
+
+// Should we attach a socket filter to the listening sockets?
+static qboolean socket_filter = false;
+
+// The socket filter, dropping in the kernel the packets main() would reject:
+// source port 0, packets too short, invalid headers and unknown messages
+static struct sock_filter socket_filter_code [] =
+{
+	BPF_STMT (BPF_LD | BPF_H | BPF_ABS, 0),  // UDP source port
+	BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, 0, 10, 0),
+	BPF_STMT (BPF_LD | BPF_W | BPF_LEN, 0),
+	BPF_JUMP (BPF_JMP | BPF_JGE | BPF_K, SF_UDP_HEADER_SIZE + MIN_PACKET_SIZE_IN, 0, 8),
+	BPF_STMT (BPF_LD | BPF_W | BPF_ABS, SF_UDP_HEADER_SIZE),  // Header
+	BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, 0xFFFFFFFF, 0, 6),
+	BPF_STMT (BPF_LD | BPF_W | BPF_ABS, SF_UDP_HEADER_SIZE + 4),  // Message prefix
+	BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, SF_PREFIX_HEARTBEAT, 5, 0),
+	BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, SF_PREFIX_INFORESPONSE, 4, 0),
+	BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, SF_PREFIX_GETSERVERS, 3, 0),
+	BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, SF_PREFIX_GETMYADDR, 2, 0),
+	BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, SF_PREFIX_RELAYSEND, 1, 0),
+	BPF_STMT (BPF_RET | BPF_K, 0),  // Drop the packet
+	BPF_STMT (BPF_RET | BPF_K, 0xFFFFFFFF),  // Accept the whole packet
+};
+
+#endif
+
+// Reference points used for converting cycles into nanoseconds
+static qu64 cycles_origin = 0;
+static qu64 time_origin = 0;
+
 
 // ---------- Public variables ---------- //
 
@@ -67,6 +132,15 @@ unsigned short master_port = DEFAULT_MASTER_PORT;
 const cmdlineopt_t sys_cmdline_options [] =
 {
 #ifndef WIN32
+	{
+		"admin-socket",
+		"<socket_path>",
+		"Accept admin commands on the UNIX socket <socket_path>",
+		{ 0, 0 },
+		'\0',
+		1,
+		1
+	},
 	{
 		"daemon",
 		NULL,
@@ -86,6 +160,17 @@ const cmdlineopt_t sys_cmdline_options [] =
 		1,
 		1
 	},
+#ifdef __linux__
+	{
+		"socket-filter",
+		NULL,
+		"Drop the invalid packets in the kernel, using a socket filter",
+		{ 0, 0 },
+		'\0',
+		0,
+		0
+	},
+#endif
 	{
 		"user",
 		"<user>",
@@ -131,6 +216,36 @@ static void Sys_CloseSocket (socket_t sock)
 }
 
 
+#ifdef __linux__
+
+/*
+====================
+Sys_AttachSocketFilter
+
+Attach the socket filter to a socket
+====================
+*/
+static qboolean Sys_AttachSocketFilter (socket_t sock)
+{
+	struct sock_fprog program;
+
+	program.len = sizeof (socket_filter_code) / sizeof (socket_filter_code[0]);
+	program.filter = socket_filter_code;
+
+	if (setsockopt (sock, SOL_SOCKET, SO_ATTACH_FILTER,
+					(const void *)&program, sizeof (program)) != 0)
+	{
+		Com_Printf (MSG_ERROR, "> ERROR: setsockopt(SO_ATTACH_FILTER) failed (%s)\n",
+					Sys_GetLastNetErrorString ());
+		return false;
+	}
+
+	return true;
+}
+
+#endif
+
+
 /*
 ====================
 Sys_CloseAllSockets
@@ -442,6 +557,16 @@ qboolean Sys_CreateListenSockets (void)
 #endif
 		}
 
+#ifdef __linux__
+		// Attach the filter before binding the socket, so no packet escapes it
+		if (socket_filter && ! Sys_AttachSocketFilter (crt_sock))
+		{
+			Sys_CloseSocket (crt_sock);
+			Sys_CloseAllSockets ();
+			return false;
+		}
+#endif
+
 		if (listen_sock->local_addr_name != NULL)
 		{
 			const char* addr_str;
@@ -490,14 +615,27 @@ cmdline_status_t Sys_Cmdline_Option (const cmdlineopt_t* opt, const char** param
 	
 	opt_name = opt->long_name;
 
+	// Admin socket
+	if (strcmp (opt_name, "admin-socket") == 0)
+	{
+		if (! Adm_SetSocketPath (params[0]))
+			return CMDLINE_STATUS_INVALID_OPT_PARAMS;
+	}
+
 	// Daemon mode
-	if (strcmp (opt_name, "daemon") == 0)
+	else if (strcmp (opt_name, "daemon") == 0)
 		daemon_state = DAEMON_STATE_REQUEST;
 
 	// Jail path
 	else if (strcmp (opt_name, "jail-path") == 0)
 		jail_path = params[0];
 
+#ifdef __linux__
+	// Socket filter
+	else if (strcmp (opt_name, "socket-filter") == 0)
+		socket_filter = true;
+#endif
+
 	// Low privileges user
 	else if (strcmp (opt_name, "user") == 0)
 		low_priv_user = params[0];
@@ -524,7 +662,13 @@ qboolean Sys_UnsecureInit (void)
 {
 #ifdef WIN32
 	WSADATA winsockdata;
+#endif
+
+	// Start the calibration of the cycle counter
+	time_origin = Sys_GetMonotonicTime ();
+	cycles_origin = Sys_GetCycles ();
 
+#ifdef WIN32
 	if (WSAStartup (MAKEWORD (1, 1), &winsockdata))
 	{
 		Com_Printf (MSG_ERROR, "> ERROR: can't initialize winsocks\n");
@@ -771,3 +915,268 @@ const char* Sys_GetLastNetErrorString (void)
 	}
 #endif
 }
+
+
+/*
+====================
+Sys_GetMonotonicTime
+
+Get a monotonic timestamp, in microseconds
+====================
+*/
+qu64 Sys_GetMonotonicTime (void)
+{
+#ifdef WIN32
+	static LARGE_INTEGER frequency = { 0 };
+	LARGE_INTEGER counter;
+
+	if (frequency.QuadPart == 0)
+		QueryPerformanceFrequency (&frequency);
+	QueryPerformanceCounter (&counter);
+
+	return (qu64)(counter.QuadPart / frequency.QuadPart) * 1000000 +
+		   (qu64)(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#else
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (qu64)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+
+/*
+====================
+Sys_GetCycles
+
+Read the CPU cycle counter, or the best substitute available
+====================
+*/
+qu64 Sys_GetCycles (void)
+{
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+	return __rdtsc ();
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+	unsigned int low, high;
+
+	__asm__ __volatile__ ("rdtsc" : "=a" (low), "=d" (high));
+	return ((qu64)high << 32) | low;
+#elif defined(WIN32)
+	LARGE_INTEGER counter;
+
+	QueryPerformanceCounter (&counter);
+	return counter.QuadPart;
+#else
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (qu64)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+
+/*
+====================
+Sys_CyclesToNanoseconds
+
+Convert a number of cycles into nanoseconds.
+The cycle counter frequency is estimated using the time elapsed since the
+initialization, so the conversion gets more accurate as the program runs.
+====================
+*/
+qu64 Sys_CyclesToNanoseconds (qu64 cycles)
+{
+	qu64 elapsed_time = Sys_GetMonotonicTime () - time_origin;
+	qu64 elapsed_cycles = Sys_GetCycles () - cycles_origin;
+
+	// Not enough data yet, assume a 1 GHz counter
+	if (elapsed_time == 0 || elapsed_cycles == 0)
+		return cycles;
+
+	return (qu64)((double)cycles * (double)elapsed_time * 1000.0 / (double)elapsed_cycles);
+}
+
+
+/*
+====================
+Sys_NanosecondsToCycles
+
+Convert a number of nanoseconds into cycles
+====================
+*/
+qu64 Sys_NanosecondsToCycles (qu64 nanoseconds)
+{
+	qu64 elapsed_time = Sys_GetMonotonicTime () - time_origin;
+	qu64 elapsed_cycles = Sys_GetCycles () - cycles_origin;
+
+	// Not enough data yet, assume a 1 GHz counter
+	if (elapsed_time == 0 || elapsed_cycles == 0)
+		return nanoseconds;
+
+	return (qu64)((double)nanoseconds * (double)elapsed_cycles / ((double)elapsed_time * 1000.0));
+}
+
+
+/*
+====================
+Sys_GetRandomBytes
+
+Fill a buffer with random bytes from the system, if it provides
+them. Must be called before chrooting
+====================
+*/
+qboolean Sys_GetRandomBytes (void* buffer, size_t size)
+{
+#ifndef WIN32
+	int rnd_device;
+	ssize_t nb_read;
+
+	rnd_device = open ("/dev/urandom", O_RDONLY, 0);
+	if (rnd_device == -1)
+		return false;
+
+	nb_read = read (rnd_device, buffer, size);
+	close (rnd_device);
+
+	return (nb_read == (ssize_t)size);
+#else
+	return false;
+#endif
+}
+
+
+/*
+====================
+Sys_PrintSocketStats
+
+Print the statistics the kernel keeps about the listening sockets
+====================
+*/
+void Sys_PrintSocketStats (msg_level_t msg_level)
+{
+#if defined (__linux__) && defined (SO_MEMINFO)
+	unsigned int sock_ind;
+
+	Com_Printf (msg_level, "\n> Listening sockets (socket filter: %s):\n",
+				socket_filter ? "on" : "off");
+	for (sock_ind = 0; sock_ind < nb_sockets; sock_ind++)
+	{
+		const listen_socket_t* listen_sock = &listen_sockets[sock_ind];
+		unsigned int meminfo [SK_MEMINFO_VARS];
+		socklen_t meminfo_len = sizeof (meminfo);
+		const char* addr_str;
+
+		addr_str = Sys_SockaddrToString (&listen_sock->local_addr,
+										 listen_sock->local_addr_len);
+		if (getsockopt (listen_sock->socket, SOL_SOCKET, SO_MEMINFO,
+						meminfo, &meminfo_len) != 0 ||
+			meminfo_len < (SK_MEMINFO_DROPS + 1) * sizeof (meminfo[0]))
+		{
+			Com_Printf (msg_level, " * %s: no kernel statistics available\n",
+						addr_str);
+			continue;
+		}
+
+		// The kernel counts the packets rejected by the socket filter
+		// together with the ones lost because the receive queue was full
+		Com_Printf (msg_level,
+					" * %s: %u packets dropped by the kernel, %u bytes queued\n",
+					addr_str, meminfo[SK_MEMINFO_DROPS],
+					meminfo[SK_MEMINFO_RMEM_ALLOC]);
+	}
+#endif
+}
+
+
+/*
+====================
+Sys_GetSocketLoad
+
+Get the number of bytes waiting in the receive queue of a socket, the
+size of this queue, and the number of packets lost because it was full
+====================
+*/
+qboolean Sys_GetSocketLoad (socket_t sock, unsigned int* queued_bytes,
+							unsigned int* buffer_size, unsigned int* nb_overflows)
+{
+#if defined (__linux__) && defined (SO_MEMINFO)
+	unsigned int meminfo [SK_MEMINFO_VARS];
+	socklen_t meminfo_len = sizeof (meminfo);
+
+	if (getsockopt (sock, SOL_SOCKET, SO_MEMINFO, meminfo, &meminfo_len) != 0 ||
+		meminfo_len < (SK_MEMINFO_DROPS + 1) * sizeof (meminfo[0]))
+		return false;
+
+	*queued_bytes = meminfo[SK_MEMINFO_RMEM_ALLOC];
+	*buffer_size = meminfo[SK_MEMINFO_RCVBUF];
+
+	// The drop counter also includes the packets rejected by
+	// the socket filter, which have nothing to do with the load
+	*nb_overflows = (socket_filter ? 0 : meminfo[SK_MEMINFO_DROPS]);
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+/*
+====================
+Sys_SendPackets
+
+Send several packets through the same socket, with as few system calls as
+possible. Returns the number of packets sent before the first failure (see
+Sys_GetLastNetErrorString), or "nb_packets" if they have all been sent
+====================
+*/
+unsigned int Sys_SendPackets (socket_t sock, const outgoing_packet_t* packets, unsigned int nb_packets)
+{
+	unsigned int nb_sent = 0;
+
+#ifdef __linux__
+	struct mmsghdr msgs [SEND_BATCH_SIZE];
+	struct iovec iovecs [SEND_BATCH_SIZE];
+
+	while (nb_sent < nb_packets)
+	{
+		unsigned int nb_msgs = nb_packets - nb_sent;
+		unsigned int ind;
+		int result;
+
+		if (nb_msgs > SEND_BATCH_SIZE)
+			nb_msgs = SEND_BATCH_SIZE;
+
+		memset (msgs, 0, nb_msgs * sizeof (msgs[0]));
+		for (ind = 0; ind < nb_msgs; ind++)
+		{
+			const outgoing_packet_t* packet = &packets[nb_sent + ind];
+
+			iovecs[ind].iov_base = (void*)packet->data;
+			iovecs[ind].iov_len = packet->length;
+			msgs[ind].msg_hdr.msg_name = (void*)packet->address;
+			msgs[ind].msg_hdr.msg_namelen = packet->addrlen;
+			msgs[ind].msg_hdr.msg_iov = &iovecs[ind];
+			msgs[ind].msg_hdr.msg_iovlen = 1;
+		}
+
+		// sendmmsg() only reports an error if the first packet fails. If another
+		// one does, the next call will start with it, and report its error
+		result = sendmmsg (sock, msgs, nb_msgs, 0);
+		if (result <= 0)
+			break;
+		nb_sent += (unsigned int)result;
+	}
+#else
+	while (nb_sent < nb_packets)
+	{
+		const outgoing_packet_t* packet = &packets[nb_sent];
+
+		if (sendto (sock, packet->data, packet->length, 0,
+					(const struct sockaddr*)packet->address, packet->addrlen) < 0)
+			break;
+		nb_sent++;
+	}
+#endif
+
+	return nb_sent;
+}
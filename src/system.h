@@ -45,10 +45,12 @@
 #	define NETERR_AFNOSUPPORT	WSAEAFNOSUPPORT
 #	define NETERR_NOPROTOOPT	WSAENOPROTOOPT
 #	define NETERR_INTR			WSAEINTR
+#	define NETERR_WOULDBLOCK	WSAEWOULDBLOCK
 #else
 #	define NETERR_AFNOSUPPORT	EAFNOSUPPORT
 #	define NETERR_NOPROTOOPT	ENOPROTOOPT
 #	define NETERR_INTR			EINTR
+#	define NETERR_WOULDBLOCK	EWOULDBLOCK
 #endif
 
 // Windows' CRT wants an explicit buffer size for its setvbuf() calls
@@ -86,6 +88,15 @@ typedef struct
 	qboolean optional;
 } listen_socket_t;
 
+// A packet to send with Sys_SendPackets
+typedef struct
+{
+	const void* data;
+	size_t length;
+	const struct sockaddr_storage* address;
+	socklen_t addrlen;
+} outgoing_packet_t;
+
 // The steps for running as a daemon (no console output)
 typedef enum
 {
@@ -128,6 +139,7 @@ qboolean Sys_CreateListenSockets (void);
 // Win32 uses a different name for some standard functions
 #ifdef WIN32
 # define snprintf _snprintf
+# define vsnprintf _vsnprintf
 # define strdup _strdup
 #endif
 
@@ -156,5 +168,34 @@ int Sys_GetLastNetError (void);
 // Get the last network error string
 const char* Sys_GetLastNetErrorString (void);
 
+// Get a monotonic timestamp, in microseconds
+qu64 Sys_GetMonotonicTime (void);
+
+// Read the CPU cycle counter, or the best substitute available
+qu64 Sys_GetCycles (void);
+
+// Convert a number of cycles into nanoseconds
+qu64 Sys_CyclesToNanoseconds (qu64 cycles);
+
+// Convert a number of nanoseconds into cycles
+qu64 Sys_NanosecondsToCycles (qu64 nanoseconds);
+
+// Fill a buffer with random bytes from the system (must be called before chrooting)
+qboolean Sys_GetRandomBytes (void* buffer, size_t size);
+
+// Print the statistics the kernel keeps about the listening sockets (Linux only)
+void Sys_PrintSocketStats (msg_level_t msg_level);
+
+// Get the number of bytes waiting in the receive queue of a socket, the size
+// of this queue, and the number of packets lost because it was full. Returns
+// "false" if the system doesn't provide this information (Linux only)
+qboolean Sys_GetSocketLoad (socket_t sock, unsigned int* queued_bytes,
+							unsigned int* buffer_size, unsigned int* nb_overflows);
+
+// Send several packets through the same socket, with as few system calls as
+// possible. Returns the number of packets sent before the first failure (see
+// Sys_GetLastNetErrorString), or "nb_packets" if they have all been sent
+unsigned int Sys_SendPackets (socket_t sock, const outgoing_packet_t* packets, unsigned int nb_packets);
+
 
 #endif  // #ifndef _SYSTEM_H_
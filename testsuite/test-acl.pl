@@ -0,0 +1,31 @@
+#!/usr/bin/perl -w
+
+use strict;
+use testlib;
+
+
+my $aclFile = Test_GetTempFilePath ("acl.txt");
+
+sub WriteAclFile {
+	open (ACL_FILE, ">", $aclFile) or die "Can't create $aclFile: $!";
+	print ACL_FILE @_;
+	close (ACL_FILE);
+}
+
+Master_SetProperty ("extraOptions", [ "--acl-file", $aclFile ]);
+
+my $serverRef = Server_New ();
+my $clientRef = Client_New ();
+
+# The longest matching prefix wins
+WriteAclFile ("# Deny the loopback network, except 127.0.0.1\n",
+			  "deny 127.0.0.0/8\n",
+			  "allow 127.0.0.1\n");
+Test_Run ("ACL allowing the loopback address");
+
+WriteAclFile ("deny 127.0.0.1/32\n");
+Server_SetProperty ($serverRef, "cannotBeAnswered", 1);
+Client_SetProperty ($clientRef, "cannotBeAnswered", 1);
+Test_Run ("ACL denying the loopback address");
+
+unlink ($aclFile);
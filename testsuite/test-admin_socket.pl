@@ -0,0 +1,39 @@
+#!/usr/bin/perl -w
+
+use strict;
+use testlib;
+
+
+my $serverRef = Server_New ();
+my $clientRef = Client_New ();
+
+my @adminCommands = (
+	{
+		time => 1,
+		command => "servers",
+		expectedAnswer => qr/^addr=127\.0\.0\.1:\d+ game=DpmasterTest protocol=5 gametype=0 state=\w+ timeout=\d+ rtt=\d+ reliability=\d+\nOK\n$/,
+	},
+	{
+		time => 1,
+		command => "stats",
+		expectedAnswer => qr/Server registrations.*\nOK\n$/s,
+	},
+	{
+		time => 1,
+		command => "game-policy reject SomeOtherGame",
+		expectedAnswer => qr/^reject: SomeOtherGame\nOK\n$/,
+	},
+	{
+		time => 1,
+		command => "fp-throttle 0",
+		expectedAnswer => qr/^ERROR/,
+	},
+	{
+		time => 1,
+		command => "no-such-command",
+		expectedAnswer => qr/^ERROR/,
+	},
+);
+Master_SetProperty ("adminSocket", Test_GetTempFilePath ("admin.sock"));
+Master_SetProperty ("adminCommands", \@adminCommands);
+Test_Run ("Admin socket commands");
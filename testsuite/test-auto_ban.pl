@@ -0,0 +1,18 @@
+#!/usr/bin/perl -w
+
+use strict;
+use testlib;
+
+
+# Ban any address as soon as it has sent 2 packets
+Master_SetProperty ("extraOptions", [ "--auto-ban", "2", "60" ]);
+Master_SetProperty ("hashPorts", 0);
+
+my $client1Ref = Client_New ();
+my $client2Ref = Client_New ();
+my $client3Ref = Client_New ();
+
+# The 2nd request triggers the ban, so only the 1st one should be answered
+Client_SetProperty ($client2Ref, "cannotBeAnswered", 1);
+Client_SetProperty ($client3Ref, "cannotBeAnswered", 1);
+Test_Run ("Automatic ban");
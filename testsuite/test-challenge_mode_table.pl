@@ -0,0 +1,22 @@
+#!/usr/bin/perl -w
+
+use strict;
+use testlib;
+
+
+Master_SetProperty ("extraOptions", [ "--challenge-mode", "table" ]);
+
+my $server1Ref = Server_New ();
+my $server2Ref = Server_New (GAME_FAMILY_QUAKE3ARENA);
+
+my $client1Ref = Client_New ();
+my $client2Ref = Client_New (GAME_FAMILY_QUAKE3ARENA);
+
+Test_Run ("Challenges stored in the pending registrations table");
+
+
+# With only one pending registration, the 2nd heartbeat evicts the 1st one
+Master_SetProperty ("extraOptions", [ "--challenge-mode", "table", "--max-pending", "1" ]);
+Server_SetProperty ($server1Ref, "cannotBeRegistered", 1);
+
+Test_Run ("Pending registration evicted by a newer one");
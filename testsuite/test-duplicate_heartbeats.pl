@@ -0,0 +1,25 @@
+#!/usr/bin/perl -w
+
+use strict;
+use testlib;
+
+
+# The 2 heartbeats repeating the first one are absorbed, since
+# the challenge it triggered is still pending
+my $serverRef = Server_New ();
+Server_SetProperty ($serverRef, "nbHeartbeats", 3);
+my $clientRef = Client_New ();
+
+my @adminCommands = (
+	{
+		time => 1,
+		command => "stats",
+		expectedAnswer => qr/challenges: 1 sent, 1 answered, 0 answered too late\n \* duplicate heartbeats absorbed: 2\n \* getinfo batches: 1 \(1 messages\)\n.*OK\n$/s,
+	},
+);
+Master_SetProperty ("adminSocket", Test_GetTempFilePath ("admin.sock"));
+Master_SetProperty ("adminCommands", \@adminCommands);
+Test_Run ("Duplicate heartbeats absorbed (cookie challenges)", 2);
+
+Master_SetProperty ("extraOptions", [ "--challenge-mode", "table" ]);
+Test_Run ("Duplicate heartbeats absorbed (challenges table)", 2);
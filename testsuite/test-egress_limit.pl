@@ -0,0 +1,20 @@
+#!/usr/bin/perl -w
+
+use strict;
+use testlib;
+
+
+# All the servers and clients share the same address, so the getinfo
+# messages and the 2-packet server lists all go through the same
+# destination bucket, and some of them have to be paced
+Master_SetProperty ("extraOptions", [ "--egress-limit", "100000", "5000" ]);
+
+for (my $i = 0; $i < 200; $i++) {
+	Server_New ();
+}
+
+my $clientRef = Client_New ();
+my $clientExtRef = Client_New ();
+Client_SetProperty ($clientExtRef, "alwaysUseExtendedQuery", 1);
+
+Test_Run ("Egress shaping");
@@ -0,0 +1,39 @@
+#!/usr/bin/perl -w
+
+use strict;
+use testlib;
+
+
+Master_SetProperty ("maxNbServers", 1);
+Master_SetProperty ("extraOptions", [ "--eviction-policy", "quota", "-g", "OtherGame", "quota=1" ]);
+
+# The 1st server fills the list, but its game has no quota, so it's
+# evicted when a server of a game under its quota shows up
+my $server1Ref = Server_New ();
+Server_SetProperty ($server1Ref, "cannotBeRegistered", 1);
+my $client1Ref = Client_New ();
+
+my $server2Ref = Server_New ();
+Server_SetGameProperty ($server2Ref, "gamename", "OtherGame");
+Server_SetProperty ($server2Ref, "heartbeatDelay", 0.5);
+my $client2Ref = Client_New ();
+Client_SetGameProperty ($client2Ref, "gamename", "OtherGame");
+
+my @adminCommands = (
+	{
+		time => 2,
+		command => "stats",
+		expectedAnswer => qr/servers evicted from the full list: 1\n.*OK\n$/s,
+	},
+);
+Master_SetProperty ("adminSocket", Test_GetTempFilePath ("admin.sock"));
+Master_SetProperty ("adminCommands", \@adminCommands);
+Test_Run ("Server evicted for a game under its quota");
+
+# A server of a game over its quota can't evict anything, so it isn't even challenged
+Server_SetProperty ($server1Ref, "cannotBeRegistered", 0);
+Server_SetProperty ($server2Ref, "cannotBeAnswered", 1);
+Master_SetProperty ("extraOptions", [ "--eviction-policy", "quota", "-g", "OtherGame", "quota=1",
+									  "-g", "DpmasterTest", "quota=1" ]);
+$adminCommands[0]->{expectedAnswer} = qr/servers evicted from the full list: 0\n.*OK\n$/s;
+Test_Run ("No eviction when the list is shared according to the quotas");
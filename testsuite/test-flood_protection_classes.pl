@@ -0,0 +1,20 @@
+#!/usr/bin/perl -w
+
+use strict;
+use testlib;
+
+
+# Only 2 heartbeats in a row per address, but the default limits for the other classes
+Master_SetProperty ("extraOptions", [ "-f", "--fp-limits", "heartbeat", "3", "60" ]);
+Master_SetProperty ("hashPorts", 0);
+
+my $server1Ref = Server_New ();
+my $server2Ref = Server_New ();
+my $server3Ref = Server_New ();
+
+my $client1Ref = Client_New ();
+my $client2Ref = Client_New ();
+
+# The 3rd heartbeat should be ignored, without affecting the getservers requests
+Server_SetProperty ($server3Ref, "cannotBeAnswered", 1);
+Test_Run ("Flood protection of the heartbeats");
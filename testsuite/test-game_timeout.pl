@@ -0,0 +1,26 @@
+#!/usr/bin/perl -w
+
+use strict;
+use testlib;
+
+
+my $serverRef = Server_New ();
+my $clientRef = Client_New ();
+
+my @adminCommands = (
+	{
+		time => 1,
+		command => "servers",
+		expectedAnswer => qr/^addr=127\.0\.0\.1:\d+ game=DpmasterTest .* timeout=(599|600) /,
+	},
+);
+Master_SetProperty ("extraOptions", [ "-g", "DpmasterTest", "timeout=600" ]);
+Master_SetProperty ("adminSocket", Test_GetTempFilePath ("admin.sock"));
+Master_SetProperty ("adminCommands", \@adminCommands);
+Test_Run ("Timeout set by a game property", 2);
+
+# The heartbeat interval of the server isn't known yet, so
+# the adaptive timeout falls back to the fixed value
+Master_SetProperty ("extraOptions", [ "-g", "DpmasterTest", "timeout=300,adaptive" ]);
+$adminCommands[0]->{expectedAnswer} = qr/^addr=127\.0\.0\.1:\d+ game=DpmasterTest .* timeout=(299|300) /;
+Test_Run ("Adaptive timeout, heartbeat interval unknown", 2);
@@ -0,0 +1,41 @@
+#!/usr/bin/perl -w
+
+use strict;
+use testlib;
+
+
+my $geoipFile = Test_GetTempFilePath ("geoip.csv");
+
+open (GEOIP_FILE, ">", $geoipFile) or die "Can't create $geoipFile: $!";
+print GEOIP_FILE "# Both the simple and the legacy CSV formats are accepted\n",
+				 "1.0.0.0,1.0.0.255,AU\n",
+				 "\"127.0.0.0\",\"127.0.0.255\",\"2130706432\",\"2130706687\",\"LOC\",\"Loopback\"\n",
+				 "LOC,48.85,2.35\n",
+				 "::1,::1,LO6,40.71,-74.01\n",
+				 "2001:db8::,2001:db8:ffff:ffff:ffff:ffff:ffff:ffff,ZZ\n";
+close (GEOIP_FILE);
+
+Master_SetProperty ("extraOptions", [ "--geoip-file", $geoipFile ]);
+
+my $serverRef = Server_New ();
+my $serverIPv6Ref = Server_New ();
+Server_SetProperty ($serverIPv6Ref, "useIPv6", 1);
+my $clientRef = Client_New ();
+
+# The clients can ask for the nearest servers first
+my $nearestClientRef = Client_New ();
+Client_SetProperty ($nearestClientRef, "alwaysUseExtendedQuery", 1);
+Client_SetProperty ($nearestClientRef, "queryFilters", "empty full ipv4 nearest");
+
+my @adminCommands = (
+	{
+		time => 1,
+		command => "servers",
+		expectedAnswer => qr/^(addr=127\.0\.0\.1:\d+ country=LOC game=DpmasterTest .*\n|addr=\[::1\]:\d+ country=LO6 game=DpmasterTest .*\n){2}OK\n$/,
+	},
+);
+Master_SetProperty ("adminSocket", Test_GetTempFilePath ("admin.sock"));
+Master_SetProperty ("adminCommands", \@adminCommands);
+Test_Run ("Country of a server");
+
+unlink ($geoipFile);
@@ -10,9 +10,10 @@ Master_SetProperty ("maxNbServersPerAddr", 2);
 my $server1Ref = Server_New ();
 my $server2Ref = Server_New ();
 
-# The 3rd one should be refused
+# The 3rd one should be refused. It waits for the 2 first ones to be registered
 my $server3Ref = Server_New ();
 Server_SetProperty ($server3Ref, "cannotBeAnswered", 1);
+Server_SetProperty ($server3Ref, "heartbeatDelay", 0.5);
 
 my $clientRef = Client_New ();
 
@@ -0,0 +1,19 @@
+#!/usr/bin/perl -w
+
+use strict;
+use testlib;
+
+
+# Without any overload, enabling the load shedding must not change
+# anything, even for multi-packet responses (which are cached)
+Master_SetProperty ("extraOptions", [ "--overload-shedding" ]);
+
+for (my $i = 0; $i < 200; $i++) {
+	Server_New ();
+}
+
+Client_New ();
+my $clientExtRef = Client_New ();
+Client_SetProperty ($clientExtRef, "alwaysUseExtendedQuery", 1);
+
+Test_Run ("Load shedding enabled, no overload");
@@ -0,0 +1,27 @@
+#!/usr/bin/perl -w
+
+use strict;
+use testlib;
+
+
+# 20 servers don't fit in 128 bytes, so the client must echo a token
+Master_SetProperty ("extraOptions", [ "--reflection-limit", "128" ]);
+
+for (my $i = 0; $i < 20; $i++) {
+	Server_New ();
+}
+
+my $clientRef = Client_New ();
+Client_SetProperty ($clientRef, "useGetServersTokens", 1);
+my $clientExtRef = Client_New ();
+Client_SetProperty ($clientExtRef, "useGetServersTokens", 1);
+Client_SetProperty ($clientExtRef, "alwaysUseExtendedQuery", 1);
+
+Test_Run ("Large response sent after a token has been echoed");
+
+
+# A response which fits in the limit doesn't need any token
+Master_SetProperty ("extraOptions", [ "--reflection-limit", "1300" ]);
+my $legacyClientRef = Client_New ();
+
+Test_Run ("Small response sent to any client");
@@ -0,0 +1,30 @@
+#!/usr/bin/perl -w
+
+use strict;
+use testlib;
+
+
+Master_SetProperty ("extraOptions", [ "--revalidation", "1" ]);
+
+# The 1st server answers its probes, so it stays in the list. The
+# 2nd one doesn't, so it's removed after its 2nd unanswered probe
+my $serverRef = Server_New ();
+my $silentServerRef = Server_New ();
+Server_SetProperty ($silentServerRef, "ignoreLaterGetInfos", 1);
+my $clientRef = Client_New ();
+
+my @adminCommands = (
+	{
+		time => 4,
+		command => "stats",
+		expectedAnswer => qr/probes: [1-9]\d* sent, 0 failed\n.*removed after \d+ unanswered probes: 1\n.*OK\n$/s,
+	},
+	{
+		time => 4,
+		command => "servers",
+		expectedAnswer => qr/^addr=127\.0\.0\.1:$serverRef->{port} game=DpmasterTest .* reliability=100\nOK\n$/,
+	},
+);
+Master_SetProperty ("adminSocket", Test_GetTempFilePath ("admin.sock"));
+Master_SetProperty ("adminCommands", \@adminCommands);
+Test_Run ("Revalidation of the registered servers", 5);
@@ -0,0 +1,23 @@
+#!/usr/bin/perl -w
+
+use strict;
+use testlib;
+
+
+my $serverRef = Server_New ();
+
+# The server has answered its only challenge, so it's fully reliable
+my $clientRef = Client_New ();
+Client_SetProperty ($clientRef, "alwaysUseExtendedQuery", 1);
+Client_SetProperty ($clientRef, "queryFilters", "empty full reliability=100");
+
+my @adminCommands = (
+	{
+		time => 1,
+		command => "servers",
+		expectedAnswer => qr/^addr=127\.0\.0\.1:\d+ game=DpmasterTest .* rtt=\d+ reliability=100\nOK\n$/,
+	},
+);
+Master_SetProperty ("adminSocket", Test_GetTempFilePath ("admin.sock"));
+Master_SetProperty ("adminCommands", \@adminCommands);
+Test_Run ("Liveness of a server");
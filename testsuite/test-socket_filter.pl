@@ -0,0 +1,39 @@
+#!/usr/bin/perl -w
+
+use strict;
+use testlib;
+
+
+# The socket filter is only available on Linux
+if ($^O ne "linux") {
+	exit 0;
+}
+
+my $serverRef = Server_New ();
+my $clientRef = Client_New ();
+my $clientExtRef = Client_New ();
+Client_SetProperty ($clientExtRef, "alwaysUseExtendedQuery", 1);
+
+# Some junk: no header, an unknown message, and a packet too short
+my @rawPackets = (
+	{ time => 0, data => "getservers DpmasterTest 5" },
+	{ time => 0, data => "\xFF\xFF\xFF\xFFunknownMessage" },
+	{ time => 0, data => "\xFF\xFF" },
+);
+Master_SetProperty ("rawPackets", \@rawPackets);
+
+# The junk is dropped by the kernel, before dpmaster sees it: the valid
+# messages are the only ones counted by the heavy-hitter detection
+my @adminCommands = (
+	{
+		time => 2,
+		command => "stats",
+		expectedAnswer => qr/\* 127\.0\.0\.1: 4 packets .*\* 0\.0\.0\.0:\d+: 3 packets dropped by the kernel/s,
+	},
+);
+Master_SetProperty ("adminSocket", Test_GetTempFilePath ("admin.sock"));
+Master_SetProperty ("adminCommands", \@adminCommands);
+
+# The valid messages must still go through the socket filter
+Master_SetProperty ("extraOptions", [ "--socket-filter" ]);
+Test_Run ("Socket filter");
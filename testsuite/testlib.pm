@@ -5,10 +5,12 @@ use warnings;
 
 # Libraries
 use Fcntl;
+use File::Temp qw(tempdir);
 use Getopt::Long;
 use POSIX qw(:sys_wait_h :stdlib_h);
 use Socket;
 use Socket6;
+use IO::Socket::UNIX;
 use Time::HiRes qw(time sleep);
 
 
@@ -31,6 +33,7 @@ use constant WOET_PROTOCOL => 84;
 # Constants - misc
 use constant DEFAULT_SERVER_PORT => 5678;
 use constant DEFAULT_CLIENT_PORT => 4321;
+use constant RAW_PACKETS_PORT => 4000;
 use constant {
 	GAME_FAMILY_DARKPLACES => 0,
 	GAME_FAMILY_QUAKE3ARENA => 1,
@@ -41,11 +44,22 @@ use constant {
 
 # Global variables - dpmaster
 my $dpmasterPid = undef;
+my $rawPacketsSocket = undef;
+my $nextRawPacket = 0;
 my %dpmasterProperties = (
 	exitvalue => undef,
 	remoteAddress => undef,
 
+	# Admin commands, sent during the test: list of hashes containing
+	# "time" (in seconds), "command", and "expectedAnswer" (a regexp)
+	adminCommands => [],
+
+	# Raw packets, sent to the master during the test, in this order: list
+	# of hashes containing "time" (in seconds) and "data" (the whole packet)
+	rawPackets => [],
+
 	# Command line options
+	adminSocket => undef,
 	allowLoopback => 1,
 	floodProtectionThrottle => undef,
 	gamePolicy => undef,
@@ -72,6 +86,8 @@ my $testStartTime = undef;
 my $mustExit = 0;
 my $testNumber = 0;
 my @failureDiagnostic = ();
+my $tempDir = undef;
+my $adminCommandsFailed = 0;
 
 # Command-line options
 my $optVerbose = 0;
@@ -101,6 +117,7 @@ BEGIN {
 		&Server_SetGameProperty
 		&Server_SetProperty
 
+		&Test_GetTempFilePath
 		&Test_Run
 
 		GAME_FAMILY_DARKPLACES
@@ -271,7 +288,8 @@ sub Client_CheckServerList {
 		}
 
 		# Skip this server if it shouldn't be registered
-		next if ($serverRef->{cannotBeAnswered} or $serverRef->{cannotBeRegistered});
+		next if ($serverRef->{cannotBeAnswered} or $serverRef->{cannotBeRegistered} or
+				 $serverRef->{invalidInfoResponse});
 
 		my $fullAddress = ($svUseIPv6 ? "[" . IPV6_LOOPBACK_ADDRESS . "]" : IPV4_LOOPBACK_ADDRESS);
 		$fullAddress .= ":" . $serverRef->{port};
@@ -411,6 +429,8 @@ sub Client_New {
 		queryFilters => $queryFilters,
 		ignoreEOTMarks => 0,
 		retryDelay => undef,
+		useGetServersTokens => 0,
+		getserversToken => undef,
 
 		gameProperties => {
 			gamename => $gamename,
@@ -462,6 +482,14 @@ sub Client_Run {
 					Common_VerbosePrint ("No EOT mark found. Waiting for the next packet\n");
 				}
 			}
+			# If the master wants us to echo a token, ask again with it
+			elsif ($clientRef->{useGetServersTokens} and
+				   $recvPacket =~ /^\xFF\xFF\xFF\xFFgetserversToken ([^ ]+)$/ and
+				   not defined $clientRef->{getserversToken}) {
+				Common_VerbosePrint ("Client received a getserversToken\n");
+				$clientRef->{getserversToken} = $1;
+				Client_SendGetServers ($clientRef);
+			}
 			else {
 				# FIXME: report the error correctly instead of just dying
 				die "Invalid message received while waiting for the server list";
@@ -549,6 +577,15 @@ sub Client_SendGetServers {
 		$getservers .= " $gametypeFilter";
 	}
 
+	if ($clientRef->{useGetServersTokens}) {
+		if (defined $clientRef->{getserversToken}) {
+			$getservers .= " token=$clientRef->{getserversToken}";
+		}
+		else {
+			$getservers .= " token";
+		}
+	}
+
 	send ($clientRef->{socket}, $getservers, 0) or die "Can't send packet: $!";
 	$clientRef->{lastRequestTime} = $currentTime;
 
@@ -612,6 +649,7 @@ sub Client_Stop {
 	# Clean the server list
 	$clientRef->{serverList} = {};
 	$clientRef->{serverListCount} = 0;
+	$clientRef->{getserversToken} = undef;
 	
 	$clientRef->{cannotBeAnswered} = undef;
 }
@@ -684,6 +722,63 @@ sub Master_IsGameAccepted {
 }
 
 	
+#***************************************************************************
+# Master_RunAdminCommands
+#***************************************************************************
+sub Master_RunAdminCommands {
+	my $adminCommandsRef = $dpmasterProperties{adminCommands};
+
+	foreach my $adminCommand (@{$adminCommandsRef}) {
+		next if ($adminCommand->{done} or
+				 $currentTime < $testStartTime + $adminCommand->{time});
+		$adminCommand->{done} = 1;
+
+		my $command = $adminCommand->{command};
+		Common_VerbosePrint ("Sending admin command \"$command\"\n");
+
+		my $socket = IO::Socket::UNIX->new (Peer => $dpmasterProperties{adminSocket},
+											Type => SOCK_STREAM,
+											Timeout => 2);
+		if (not defined $socket) {
+			push @failureDiagnostic, "Can't connect to the admin socket: $!";
+			$adminCommandsFailed = 1;
+			next;
+		}
+
+		# Read the answer, up to its "OK" or "ERROR" line
+		print $socket "$command\n";
+		my $answer = "";
+		while (my $line = <$socket>) {
+			$answer .= $line;
+			last if ($line =~ /^(OK|ERROR)/);
+		}
+		close ($socket);
+
+		if ($answer !~ $adminCommand->{expectedAnswer}) {
+			push @failureDiagnostic, "Unexpected answer to admin command \"$command\": \"$answer\"";
+			$adminCommandsFailed = 1;
+		}
+	}
+}
+
+
+#***************************************************************************
+# Master_SendRawPackets
+#***************************************************************************
+sub Master_SendRawPackets {
+	my $rawPacketsRef = $dpmasterProperties{rawPackets};
+
+	while ($nextRawPacket < scalar @{$rawPacketsRef}) {
+		my $rawPacket = $rawPacketsRef->[$nextRawPacket];
+		last if ($currentTime < $testStartTime + $rawPacket->{time});
+		$nextRawPacket++;
+
+		Common_VerbosePrint ("Sending a raw packet (" . length ($rawPacket->{data}) . " bytes)\n");
+		send ($rawPacketsSocket, $rawPacket->{data}, 0);
+	}
+}
+
+
 #***************************************************************************
 # Master_Run
 #***************************************************************************
@@ -693,6 +788,14 @@ sub Master_Run {
 		return;
 	}
 
+	if (defined $dpmasterProperties{adminSocket}) {
+		Master_RunAdminCommands ();
+	}
+
+	if (defined $rawPacketsSocket) {
+		Master_SendRawPackets ();
+	}
+
 	# Print the master server output
 	while (<DPMASTER_PROCESS>) {
 		if ($optDpmasterOutput) {
@@ -758,13 +861,14 @@ sub Master_Start {
 		$dpmasterCmdLine .= " -f --fp-throttle $dpmasterProperties{floodProtectionThrottle}";
 	}
 	
-	# "--hash-ports" and "-N" are mutually incompatible options
+	# All the test servers share the same address, so the maximum number
+	# of servers per address is lifted along with "--hash-ports"
 	if (defined $dpmasterProperties{maxNbServersPerAddr}) {
 		$dpmasterCmdLine .= " -N $dpmasterProperties{maxNbServersPerAddr}";
 	}
 	else {
 		if ($dpmasterProperties{hashPorts}) {
-			$dpmasterCmdLine .= " --hash-ports";
+			$dpmasterCmdLine .= " --hash-ports -N 0";
 		}
 	}
 	
@@ -772,6 +876,10 @@ sub Master_Start {
 		$dpmasterCmdLine .= " --allow-loopback";
 	}
 	
+	if (defined $dpmasterProperties{adminSocket}) {
+		$dpmasterCmdLine .= " --admin-socket $dpmasterProperties{adminSocket}";
+	}
+	
 	my $gamePolicyRef = $dpmasterProperties{gamePolicy};
 	if (defined $gamePolicyRef) {
 		$dpmasterCmdLine .= " --game-policy $gamePolicyRef->{policy}";
@@ -799,6 +907,15 @@ sub Master_Start {
 	# Wait for the master to be ready
 	# TODO: find a better way to do this
 	sleep (0.5);
+
+	# The admin commands and the raw packets are sent again at each test
+	foreach my $adminCommand (@{$dpmasterProperties{adminCommands}}) {
+		$adminCommand->{done} = 0;
+	}
+	$nextRawPacket = 0;
+	if (scalar @{$dpmasterProperties{rawPackets}} > 0) {
+		$rawPacketsSocket = Common_CreateSocket (RAW_PACKETS_PORT, 0);
+	}
 }
 
 
@@ -813,10 +930,19 @@ sub Master_Stop {
 
 	# Kill dpmaster if it's still running
 	if (defined ($dpmasterPid)) {
-		kill ("HUP", $dpmasterPid);
+		kill ("TERM", $dpmasterPid);
 		$dpmasterPid = undef;
 	}
 
+	if (defined ($rawPacketsSocket)) {
+		close ($rawPacketsSocket);
+		$rawPacketsSocket = undef;
+	}
+
+	if (defined ($dpmasterProperties{adminSocket})) {
+		unlink ($dpmasterProperties{adminSocket});
+	}
+
 	# Close the pipe
 	close (DPMASTER_PROCESS);
 }
@@ -884,7 +1010,11 @@ sub Server_New {
 		masterProtocol => $masterProtocol,
 		socket => undef,
 		cannotBeRegistered => 0,
+		invalidInfoResponse => 0,
 		cannotBeAnswered => 0,
+		ignoreLaterGetInfos => 0,
+		nbHeartbeats => 1,
+		heartbeatDelay => 0,
 		useIPv6 => 0,
 		
 		gameProperties => {
@@ -912,7 +1042,9 @@ sub Server_Run {
 	if ($state eq "Init") {
 		# If it's time to send an heartbeat
 		if ($currentTime >= $serverRef->{heartbeatTime}) {
-			Server_SendHeartbeat ($serverRef);
+			for (my $ind = 0; $ind < $serverRef->{nbHeartbeats}; $ind++) {
+				Server_SendHeartbeat ($serverRef);
+			}
 
 			$serverRef->{heartbeatTime} = undef;
 			$serverRef->{state} = "WaitingGetInfos";
@@ -945,7 +1077,22 @@ sub Server_Run {
 
 	# "Done" state
 	elsif ($state eq "Done") {
-		# Nothing to do
+		# Answer the later getinfo messages (sent to revalidate the server), if any
+		my $recvPacket;
+		if (recv ($serverRef->{socket}, $recvPacket, 1500, 0)) {
+			if ($recvPacket =~ /^\xFF\xFF\xFF\xFFgetinfo +(\S+)$/) {
+				my $challenge = $1;
+				Common_VerbosePrint ("Server $serverRef->{id} received a later getinfo with challenge \"$challenge\"\n");
+
+				if (not $serverRef->{ignoreLaterGetInfos}) {
+					Server_SendInfoResponse ($serverRef, $challenge);
+				}
+			}
+			else {
+				# FIXME: report the error correctly instead of just dying
+				die "Invalid message received after the registration";
+			}
+		}
 	}
 
 	# Invalid state
@@ -993,7 +1140,7 @@ sub Server_SendInfoResponse {
 		}
 	}
 	
-	$serverRef->{cannotBeRegistered} = not (Server_ValidateInfoResponse ($infoResponse) and Master_IsGameAccepted ($serverRef->{gameProperties}{gamename}));
+	$serverRef->{invalidInfoResponse} = not (Server_ValidateInfoResponse ($infoResponse) and Master_IsGameAccepted ($serverRef->{gameProperties}{gamename}));
 
 	send ($serverRef->{socket}, $infoResponse, 0) or die "Can't send packet: $!";
 }
@@ -1034,7 +1181,7 @@ sub Server_Start {
 
 	$serverRef->{socket} = Common_CreateSocket($serverRef->{port}, $serverRef->{useIPv6});
 	$serverRef->{state} = "Init";
-	$serverRef->{heartbeatTime} = $currentTime;
+	$serverRef->{heartbeatTime} = $currentTime + $serverRef->{heartbeatDelay};
 }
 
 	
@@ -1050,7 +1197,7 @@ sub Server_Stop {
 		$serverRef->{socket} = undef;
 	}
 
-	$serverRef->{cannotBeRegistered} = 0;
+	$serverRef->{invalidInfoResponse} = 0;
 }
 
 	
@@ -1139,10 +1286,12 @@ sub Test_SignalHandler {
 # Test_StartAll
 #***************************************************************************
 sub Test_StartAll {
-	$testStartTime = $currentTime;
-
 	Master_Start ();
 
+	# Starting the master takes some time, which mustn't count in the test timings
+	$currentTime = time;
+	$testStartTime = $currentTime;
+
 	foreach my $server (@serverList) {
 		Server_Start ($server);
 	}
@@ -1169,6 +1318,22 @@ sub Test_StopAll {
 }
 
 
+#***************************************************************************
+# Test_GetTempFilePath
+#***************************************************************************
+sub Test_GetTempFilePath {
+	my $filename = shift;
+
+	# Each run gets its own directory, removed when it ends, so concurrent
+	# or interrupted runs can't collide
+	if (not defined $tempDir) {
+		$tempDir = tempdir ("dpmaster-test-XXXXXX", TMPDIR => 1, CLEANUP => 1);
+	}
+
+	return "$tempDir/$filename";
+}
+
+
 #***************************************************************************
 # Test_Run
 #***************************************************************************
@@ -1184,6 +1349,7 @@ sub Test_Run {
 	print ("    * " . $testTitle . "\n");
 
 	@failureDiagnostic = ();
+	$adminCommandsFailed = 0;
 	$currentTime = time();
 
 	Test_StartAll ();
@@ -1239,6 +1405,11 @@ sub Test_Run {
 		}
 	}
 
+	# Check the answers to the admin commands
+	if ($adminCommandsFailed) {
+		$Result = EXIT_FAILURE;
+	}
+
 	# Check that the server lists we got are valid
 	unless ($skipServerListCheck) {
 		if ($Result == EXIT_SUCCESS) {